@@ -0,0 +1,178 @@
+/*
+ * Compare bandwidth and CPU time per delivered chat message with and
+ * without compression: every message on its own, a stream that keeps its
+ * context across messages, and a stream primed with the chat dictionary.
+ *
+ * Messages are v2 chat messages of made-up chat lines. Bytes are on the
+ * wire, header included, over all messages and over the first few of a
+ * connection, before the context has much to go on. CPU time is process
+ * time to compress or to decompress one message.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../chat.h"
+#include "../compression.h"
+#include "../network.h"
+
+#define NUM_MESSAGES                    20000
+#define NUM_FIRST_MESSAGES              16
+
+struct mode {
+    const char *name;
+    bool compress;
+    bool dictionary;
+    bool reset;                         /* Start over for every message. */
+};
+
+static const struct mode modes[] = {
+    { "none", false, false, false },
+    { "per-message", true, false, true },
+    { "stream", true, false, false },
+    { "stream+dict", true, true, false },
+};
+
+static const char *const senders[] = {
+    "Billy", "alice", "bob_the_builder", "Joe", "mårten", "xXgamerXx",
+};
+
+static const char *const words[] = {
+    "the", "I", "you", "it", "is", "a", "to", "and", "that", "what", "do",
+    "think", "know", "just", "like", "no", "yes", "ok", "lol", "haha", "so",
+    "this", "not", "have", "we", "can", "but", "was", "for", "on", "with",
+    "server", "works", "now", "again", "today", "tomorrow", "thanks", "build",
+    "broken", "fixed", "meeting", "lunch", "coffee", "deploy", "review",
+    "anyone", "here", "there", "really", "maybe", "probably", "please", ":)",
+};
+
+static double cpu_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int init_compression(struct compression *comp, const struct mode *mode)
+{
+    return mode->dictionary ? chat_compression_init(comp) :
+        compression_init(comp, NULL, 0);
+}
+
+static struct net_message *make_message(void)
+{
+    char text[CHAT_MESSAGE_MAX_LEN + 1];
+    unsigned num_words = 1 + rand() % 16;
+    size_t len = 0;
+
+    text[0] = '\0';
+    for (unsigned i = 0; i < num_words; ++i) {
+        const char *word = words[rand() % (sizeof(words) / sizeof(*words))];
+
+        len += snprintf(text + len, sizeof(text) - len, "%s%s", i ? " " : "", word);
+    }
+
+    return chat_message_build(CHAT_PROTOCOL_V2,
+            senders[rand() % (sizeof(senders) / sizeof(*senders))], text);
+}
+
+static void bench(const struct mode *mode, struct net_message **msgs)
+{
+    static struct net_message *packed[NUM_MESSAGES];
+    struct compression sender, receiver;
+    unsigned long long bytes = 0, first_bytes = 0;
+    double start, deflate_ns = 0, inflate_ns = 0;
+
+    if (!mode->compress) {
+        for (unsigned i = 0; i < NUM_MESSAGES; ++i) {
+            bytes += NET_MSG_HEADER_LEN + net_message_body_length(msgs[i]);
+            if (i + 1 == NUM_FIRST_MESSAGES) {
+                first_bytes = bytes;
+            }
+        }
+        printf("%-12s %10.1f %10.1f %12s %12s\n", mode->name,
+                (double)bytes / NUM_MESSAGES,
+                (double)first_bytes / NUM_FIRST_MESSAGES, "-", "-");
+        return;
+    }
+
+    if (init_compression(&sender, mode) == -1 ||
+            init_compression(&receiver, mode) == -1) {
+        fprintf(stderr, "Unable to initialise compression\n");
+        exit(1);
+    }
+
+    start = cpu_ns();
+    for (unsigned i = 0; i < NUM_MESSAGES; ++i) {
+        if (mode->reset) {
+            deflateReset(&sender.deflate);
+        }
+        packed[i] = chat_compress(&sender, msgs[i]);
+        if (!packed[i]) {
+            fprintf(stderr, "Compression failed\n");
+            exit(1);
+        }
+        bytes += NET_MSG_HEADER_LEN + net_message_body_length(packed[i]);
+        if (i + 1 == NUM_FIRST_MESSAGES) {
+            first_bytes = bytes;
+        }
+    }
+    deflate_ns = cpu_ns() - start;
+
+    start = cpu_ns();
+    for (unsigned i = 0; i < NUM_MESSAGES; ++i) {
+        struct net_message *msg;
+
+        if (mode->reset) {
+            inflateReset(&receiver.inflate);
+        }
+        msg = chat_decompress(&receiver, net_message_body(packed[i]),
+                net_message_body_length(packed[i]));
+        if (!msg || net_message_body_length(msg) != net_message_body_length(msgs[i])) {
+            fprintf(stderr, "Decompression failed\n");
+            exit(1);
+        }
+        net_message_unref(msg);
+    }
+    inflate_ns = cpu_ns() - start;
+
+    for (unsigned i = 0; i < NUM_MESSAGES; ++i) {
+        net_message_unref(packed[i]);
+    }
+    compression_deinit(&sender);
+    compression_deinit(&receiver);
+
+    printf("%-12s %10.1f %10.1f %12.0f %12.0f\n", mode->name,
+            (double)bytes / NUM_MESSAGES,
+            (double)first_bytes / NUM_FIRST_MESSAGES,
+            deflate_ns / NUM_MESSAGES, inflate_ns / NUM_MESSAGES);
+}
+
+int main(int argc, char *argv[])
+{
+    static struct net_message *msgs[NUM_MESSAGES];
+
+    srand(1);
+    for (unsigned i = 0; i < NUM_MESSAGES; ++i) {
+        msgs[i] = make_message();
+        if (!msgs[i]) {
+            fprintf(stderr, "Unable to build messages\n");
+            return 1;
+        }
+    }
+
+    printf("%-12s %10s %10s %12s %12s\n", "compression", "bytes/msg",
+            "first 16", "deflate ns", "inflate ns");
+
+    for (unsigned i = 0; i < sizeof(modes) / sizeof(*modes); ++i) {
+        bench(&modes[i], msgs);
+    }
+
+    for (unsigned i = 0; i < NUM_MESSAGES; ++i) {
+        net_message_unref(msgs[i]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,304 @@
+/*
+ * Compare the system call cost of the epoll and io_uring backends for the
+ * server's hot path: receive messages and broadcast them to every
+ * connection. A burst of several messages per round models clients that
+ * have fallen behind, whose send queues are flushed with vectored sends.
+ *
+ * Connections are socket pairs. The bench owns one end of each pair through a
+ * network endpoint and plays all the clients on the other ends.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include "../network.h"
+#include "../reactor.h"
+
+#define NUM_ROUNDS                      5000
+#define MAX_BURST                       64
+#define DRAIN_INTERVAL                  8
+#define BODY_LEN                        64
+
+struct conn {
+    struct net_endpoint *endpoint;
+    int peer_fd;
+    bool sending;
+};
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int open_conn(struct reactor *reactor, struct conn *conn)
+{
+    struct uring *ring = reactor_uring(reactor);
+    int fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+        return -1;
+    }
+
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    conn->peer_fd = fds[1];
+    conn->endpoint = net_endpoint_new(fds[0]);
+    if (!conn->endpoint) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    if (ring) {
+        return net_endpoint_attach_uring(conn->endpoint, ring, conn);
+    }
+
+    return reactor_add(reactor, fds[0], REACTOR_IN, conn);
+}
+
+static void close_conn(struct conn *conn)
+{
+    int fd = conn->endpoint->fd;
+
+    net_endpoint_destroy(conn->endpoint);
+    close(fd);
+    close(conn->peer_fd);
+}
+
+static void drain_peers(struct conn *conns, unsigned num_conns)
+{
+    char buf[16384];
+
+    for (unsigned i = 0; i < num_conns; ++i) {
+        while (read(conns[i].peer_fd, buf, sizeof(buf)) > 0) {
+        }
+    }
+}
+
+/**
+ * @brief Wait until conn has received num_msgs messages.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int receive_from(struct reactor *reactor, struct conn *conn,
+        struct net_message **msgs, unsigned num_msgs)
+{
+    struct reactor_event events[64];
+    bool readable = conn->endpoint->uring != NULL;
+    unsigned count = 0;
+    int n;
+
+    for (;;) {
+        /* io_uring may already hold the data; sockets need a wakeup first. */
+        while (readable && count < num_msgs) {
+            n = net_receive_batch(conn->endpoint, msgs + count, num_msgs - count);
+            if (n > 0) {
+                count += n;
+            }
+            else if (n == 0 || errno != EAGAIN) {
+                goto err;
+            }
+            else {
+                break;
+            }
+        }
+
+        if (count == num_msgs) {
+            return 0;
+        }
+
+        if (reactor_wait(reactor, events, 64, -1) == -1) {
+            goto err;
+        }
+        readable = true;
+    }
+
+err:
+    while (count-- > 0) {
+        net_message_unref(msgs[count]);
+    }
+    return -1;
+}
+
+/**
+ * @brief Queue msgs to every connection and wait until all of it is sent.
+ */
+static int broadcast(struct reactor *reactor, struct conn *conns,
+        unsigned num_conns, struct net_message **msgs, unsigned num_msgs)
+{
+    struct reactor_event events[64];
+    unsigned pending = 0;
+    int n, rc;
+
+    for (unsigned i = 0; i < num_conns; ++i) {
+        for (unsigned j = 0; j < num_msgs; ++j) {
+            net_enqueue_message(conns[i].endpoint, msgs[j]);
+        }
+
+        rc = net_process_send(conns[i].endpoint);
+        if (rc < 0) {
+            return -1;
+        }
+
+        conns[i].sending = rc > 0;
+        pending += rc > 0;
+    }
+
+    while (pending > 0) {
+        n = reactor_wait(reactor, events, 64, -1);
+        if (n == -1) {
+            return -1;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            struct conn *conn = events[i].data;
+
+            if (!(events[i].events & REACTOR_OUT) || !conn->sending) {
+                continue;
+            }
+
+            rc = net_process_send(conn->endpoint);
+            if (rc < 0) {
+                return -1;
+            }
+            else if (rc == 0) {
+                conn->sending = false;
+                pending--;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Run the broadcast rounds with a backend.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int bench_backend(enum reactor_backend backend, unsigned num_conns,
+        unsigned burst, double *syscalls_per_msg, double *ns_per_msg)
+{
+    unsigned char frame[NET_MSG_HEADER_LEN + BODY_LEN] = {0};
+    unsigned char frames[MAX_BURST * sizeof(frame)];
+    struct net_message *msgs[MAX_BURST];
+    struct net_stats before, after;
+    unsigned long long reactor_before;
+    struct reactor *reactor;
+    struct conn *conns;
+    double start;
+    unsigned i = 0;
+    int rc = -1;
+
+    frame[0] = (sizeof(frame) >> 8) & 0xff;
+    frame[1] = sizeof(frame) & 0xff;
+    for (unsigned j = 0; j < burst; ++j) {
+        memcpy(frames + j * sizeof(frame), frame, sizeof(frame));
+    }
+
+    conns = calloc(num_conns, sizeof(*conns));
+    reactor = reactor_new(backend);
+    if (!conns || !reactor) {
+        fprintf(stderr, "%s: %s\n", reactor_backend_name(backend),
+                strerror(errno));
+        goto out;
+    }
+
+    for (i = 0; i < num_conns; ++i) {
+        if (open_conn(reactor, &conns[i]) == -1) {
+            fprintf(stderr, "open_conn: %s\n", strerror(errno));
+            goto out;
+        }
+    }
+
+    net_get_stats(&before);
+    reactor_before = reactor_num_syscalls(reactor);
+    start = now_ns();
+
+    for (unsigned round = 0; round < NUM_ROUNDS; ++round) {
+        struct conn *sender = &conns[round % num_conns];
+        bool failed;
+
+        if (write(sender->peer_fd, frames, burst * sizeof(frame)) !=
+                burst * sizeof(frame)) {
+            goto out;
+        }
+
+        if (receive_from(reactor, sender, msgs, burst) == -1) {
+            fprintf(stderr, "receive: %s\n", strerror(errno));
+            goto out;
+        }
+
+        failed = broadcast(reactor, conns, num_conns, msgs, burst) == -1;
+
+        for (unsigned j = 0; j < burst; ++j) {
+            net_message_unref(msgs[j]);
+        }
+
+        if (failed) {
+            fprintf(stderr, "broadcast: %s\n", strerror(errno));
+            goto out;
+        }
+
+        if (round % DRAIN_INTERVAL == DRAIN_INTERVAL - 1) {
+            drain_peers(conns, num_conns);
+        }
+    }
+
+    net_get_stats(&after);
+    *ns_per_msg = (now_ns() - start) / ((double)NUM_ROUNDS * num_conns * burst);
+    *syscalls_per_msg = (after.num_syscalls - before.num_syscalls +
+            reactor_num_syscalls(reactor) - reactor_before) /
+        ((double)NUM_ROUNDS * num_conns * burst);
+    rc = 0;
+
+out:
+    while (i-- > 0) {
+        close_conn(&conns[i]);
+    }
+
+    if (reactor) {
+        reactor_destroy(reactor);
+    }
+
+    free(conns);
+
+    return rc;
+}
+
+int main(int argc, char *argv[])
+{
+    static const unsigned conn_counts[] = { 1, 16, 256 };
+    static const unsigned bursts[] = { 1, 16 };
+    static const enum reactor_backend backends[] = {
+        REACTOR_BACKEND_EPOLL, REACTOR_BACKEND_URING
+    };
+
+    printf("%-12s %-6s %-10s %18s %14s\n", "connections", "burst", "backend",
+            "syscalls/delivery", "ns/delivery");
+
+    for (unsigned i = 0; i < sizeof(conn_counts) / sizeof(*conn_counts); ++i) {
+        for (unsigned k = 0; k < sizeof(bursts) / sizeof(*bursts); ++k) {
+            for (unsigned j = 0; j < sizeof(backends) / sizeof(*backends); ++j) {
+                double syscalls, ns;
+
+                if (bench_backend(backends[j], conn_counts[i], bursts[k],
+                            &syscalls, &ns) == 0) {
+                    printf("%-12u %-6u %-10s %18.3f %14.0f\n", conn_counts[i],
+                            bursts[k], reactor_backend_name(backends[j]),
+                            syscalls, ns);
+                }
+            }
+        }
+    }
+
+    return 0;
+}
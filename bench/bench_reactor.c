@@ -0,0 +1,130 @@
+/*
+ * Compare the cost of one wakeup of the poll and epoll reactor backends when
+ * a single descriptor out of many is active.
+ *
+ * Every connection is modelled by an eventfd so that 10k connections fit in
+ * a modest descriptor limit.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+
+#include "../reactor.h"
+
+#define NUM_ITERATIONS                  20000
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void raise_fd_limit(void)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+/**
+ * @brief Measure the average wakeup latency of a backend.
+ *
+ * @return Nanoseconds per wakeup or a negative value on error.
+ */
+static double bench_backend(enum reactor_backend backend, unsigned num_conns)
+{
+    struct reactor_event events[64];
+    struct reactor *reactor;
+    uint64_t value = 1;
+    unsigned seed = 1;
+    double start, elapsed = -1.0;
+    int *fds;
+    unsigned i = 0;
+
+    fds = calloc(num_conns, sizeof(*fds));
+    reactor = reactor_new(backend);
+    if (!fds || !reactor) {
+        goto out;
+    }
+
+    for (i = 0; i < num_conns; ++i) {
+        fds[i] = eventfd(0, EFD_NONBLOCK);
+        if (fds[i] == -1) {
+            fprintf(stderr, "eventfd: %s (%u connections)\n",
+                    strerror(errno), i);
+            goto out;
+        }
+
+        if (reactor_add(reactor, fds[i], REACTOR_IN, &fds[i]) == -1) {
+            fprintf(stderr, "reactor_add: %s\n", strerror(errno));
+            i++;
+            goto out;
+        }
+    }
+
+    start = now_ns();
+
+    for (unsigned iter = 0; iter < NUM_ITERATIONS; ++iter) {
+        int *active = &fds[rand_r(&seed) % num_conns];
+        int n;
+
+        if (write(*active, &value, sizeof(value)) != sizeof(value)) {
+            goto out;
+        }
+
+        n = reactor_wait(reactor, events, 64, -1);
+        if (n != 1 || events[0].data != active) {
+            fprintf(stderr, "Unexpected wakeup\n");
+            goto out;
+        }
+
+        if (read(*active, &value, sizeof(value)) != sizeof(value)) {
+            goto out;
+        }
+        value = 1;
+    }
+
+    elapsed = (now_ns() - start) / NUM_ITERATIONS;
+
+out:
+    while (i-- > 0) {
+        close(fds[i]);
+    }
+
+    if (reactor) {
+        reactor_destroy(reactor);
+    }
+
+    free(fds);
+
+    return elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+    static const unsigned conn_counts[] = { 16, 1000, 10000 };
+
+    raise_fd_limit();
+
+    printf("%-12s %14s %14s\n", "connections", "poll ns/wake", "epoll ns/wake");
+
+    for (unsigned i = 0; i < sizeof(conn_counts) / sizeof(*conn_counts); ++i) {
+        double poll_ns = bench_backend(REACTOR_BACKEND_POLL, conn_counts[i]);
+        double epoll_ns = bench_backend(REACTOR_BACKEND_EPOLL, conn_counts[i]);
+
+        printf("%-12u %14.0f %14.0f\n", conn_counts[i], poll_ns, epoll_ns);
+    }
+
+    return 0;
+}
@@ -0,0 +1,106 @@
+/*
+ * Compare the cost of finding the fields of a v1 chat message body: the old
+ * path, a memchr per field without validation, against utf8_scan with each
+ * implementation, which validates UTF-8 in the same pass.
+ *
+ * Cycles are time stamp counter cycles, which tick at a constant rate that
+ * may differ from the core clock.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include <x86intrin.h>
+
+#include "../utf8.h"
+
+#define NUM_ROUNDS                      200000
+#define SENDER                          "Billy"
+
+/* A body of sender and text fields; text has len bytes. */
+static size_t make_body(unsigned char *body, size_t len, bool ascii)
+{
+    static const char ascii_text[] = "The quick brown fox jumps over the lazy dog. ";
+    static const char mixed_text[] = "Fünf Bücher, 五本の本, пять книг. ";
+    const char *text = ascii ? ascii_text : mixed_text;
+    size_t text_len = strlen(text);
+    size_t n = sizeof(SENDER);
+
+    memcpy(body, SENDER, sizeof(SENDER));
+    while (n <= sizeof(SENDER) + len) {
+        body[n] = text[(n - sizeof(SENDER)) % text_len];
+        n++;
+    }
+    body[n] = '\0';
+
+    /* Do not end inside a multibyte sequence. */
+    n = sizeof(SENDER) + utf8_truncate((char *)body + sizeof(SENDER), len);
+    body[n++] = '\0';
+
+    return n;
+}
+
+static int scan_memchr(const unsigned char *data, size_t len, size_t *nuls)
+{
+    const unsigned char *p = memchr(data, 0, len);
+
+    if (!p) {
+        return -1;
+    }
+    nuls[0] = p - data;
+
+    p = memchr(p + 1, 0, len - nuls[0] - 1);
+    if (!p) {
+        return -1;
+    }
+    nuls[1] = p - data;
+
+    return 2;
+}
+
+static double bench(int impl, const unsigned char *body, size_t len)
+{
+    unsigned long long start, cycles;
+    volatile size_t sink = 0;
+    size_t nuls[2];
+
+    start = __rdtsc();
+    for (unsigned i = 0; i < NUM_ROUNDS; ++i) {
+        int rc = impl < 0 ? scan_memchr(body, len, nuls) :
+            utf8_scan_impl(impl, body, len, nuls, 2);
+
+        if (rc != 2) {
+            fprintf(stderr, "Scan failed\n");
+            return 0;
+        }
+        sink += nuls[1];
+    }
+    cycles = __rdtsc() - start;
+
+    return (double)len * NUM_ROUNDS / cycles;
+}
+
+int main(int argc, char *argv[])
+{
+    static const size_t text_lens[] = { 16, 64, 256, 512 };
+    unsigned char body[1024];
+
+    printf("%-6s %-6s %-14s %12s\n", "text", "bytes", "scan", "bytes/cycle");
+
+    for (int ascii = 1; ascii >= 0; --ascii) {
+        for (size_t i = 0; i < sizeof(text_lens) / sizeof(*text_lens); ++i) {
+            size_t len = make_body(body, text_lens[i], ascii);
+
+            printf("%-6s %-6zu %-14s %12.2f\n", ascii ? "ascii" : "mixed", len,
+                    "memchr", bench(-1, body, len));
+
+            for (unsigned impl = 0; impl < UTF8_NUM_IMPLS; ++impl) {
+                if (utf8_impl_supported(impl)) {
+                    printf("%-6s %-6zu %-14s %12.2f\n", ascii ? "ascii" : "mixed",
+                            len, utf8_impl_name(impl), bench(impl, body, len));
+                }
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,288 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "channel.h"
+
+#define CHANNEL_TABLE_INITIAL_SLOTS     16u
+#define CHANNEL_INITIAL_MEMBERS         4u
+
+/* FNV-1a. */
+static uint32_t channel_hash(const char *name, unsigned len)
+{
+    uint32_t hash = 2166136261u;
+
+    for (unsigned i = 0; i < len; ++i) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static bool channel_is(const struct channel *channel, uint32_t hash,
+        const char *name, unsigned len)
+{
+    return channel->hash == hash && channel->name_len == len &&
+        memcmp(channel->name, name, len) == 0;
+}
+
+int channel_table_init(struct channel_table *table)
+{
+    table->slots = calloc(CHANNEL_TABLE_INITIAL_SLOTS, sizeof(*table->slots));
+    if (!table->slots) {
+        return -1;
+    }
+
+    table->num_slots = CHANNEL_TABLE_INITIAL_SLOTS;
+    table->count = 0;
+    return 0;
+}
+
+void channel_table_deinit(struct channel_table *table)
+{
+    for (unsigned i = 0; i < table->num_slots; ++i) {
+        if (table->slots[i]) {
+            free(table->slots[i]->members);
+            free(table->slots[i]);
+        }
+    }
+
+    free(table->slots);
+    table->slots = NULL;
+    table->num_slots = 0;
+    table->count = 0;
+}
+
+/**
+ * @brief Find the slot of a channel, or the free slot where it would go.
+ */
+static unsigned channel_table_probe(const struct channel_table *table,
+        uint32_t hash, const char *name, unsigned len)
+{
+    unsigned mask = table->num_slots - 1;
+    unsigned i = hash & mask;
+
+    while (table->slots[i] && !channel_is(table->slots[i], hash, name, len)) {
+        i = (i + 1) & mask;
+    }
+
+    return i;
+}
+
+/**
+ * @brief Double the number of slots, keeping the table at most half full.
+ *
+ * @return 0 on success, -1 on memory allocation error.
+ */
+static int channel_table_grow(struct channel_table *table)
+{
+    struct channel **old = table->slots;
+    unsigned old_num = table->num_slots;
+
+    table->slots = calloc(2 * old_num, sizeof(*table->slots));
+    if (!table->slots) {
+        table->slots = old;
+        return -1;
+    }
+    table->num_slots = 2 * old_num;
+
+    for (unsigned i = 0; i < old_num; ++i) {
+        if (old[i]) {
+            table->slots[channel_table_probe(table, old[i]->hash, old[i]->name,
+                    old[i]->name_len)] = old[i];
+        }
+    }
+
+    free(old);
+    return 0;
+}
+
+/**
+ * @brief Free a slot without tombstones: later channels of the same probe
+ *        run are shifted back into the hole.
+ */
+static void channel_table_remove(struct channel_table *table, unsigned hole)
+{
+    unsigned mask = table->num_slots - 1;
+    unsigned i = hole;
+
+    table->slots[hole] = NULL;
+    table->count--;
+
+    for (;;) {
+        unsigned home;
+
+        i = (i + 1) & mask;
+        if (!table->slots[i]) {
+            break;
+        }
+
+        /* Move the channel unless its home lies cyclically in (hole, i]. */
+        home = table->slots[i]->hash & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            table->slots[hole] = table->slots[i];
+            table->slots[i] = NULL;
+            hole = i;
+        }
+    }
+}
+
+struct channel *channel_table_find(const struct channel_table *table,
+        const char *name, unsigned len)
+{
+    return table->slots[channel_table_probe(table, channel_hash(name, len),
+            name, len)];
+}
+
+struct channel *channel_member_find(const struct channel_member *member,
+        const char *name, unsigned len)
+{
+    for (unsigned i = 0; i < member->num_channels; ++i) {
+        struct channel *channel = member->channels[i].channel;
+
+        if (channel->name_len == len && memcmp(channel->name, name, len) == 0) {
+            return channel;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Find or create a channel.
+ */
+static struct channel *channel_get(struct channel_table *table,
+        const char *name, unsigned len)
+{
+    uint32_t hash = channel_hash(name, len);
+    struct channel *channel;
+    unsigned slot = channel_table_probe(table, hash, name, len);
+
+    if (table->slots[slot]) {
+        return table->slots[slot];
+    }
+
+    if (2 * (table->count + 1) > table->num_slots) {
+        if (channel_table_grow(table) == -1) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        slot = channel_table_probe(table, hash, name, len);
+    }
+
+    channel = calloc(1, sizeof(*channel));
+    if (!channel) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    memcpy(channel->name, name, len);
+    channel->name[len] = '\0';
+    channel->name_len = len;
+    channel->hash = hash;
+
+    table->slots[slot] = channel;
+    table->count++;
+    return channel;
+}
+
+/**
+ * @brief Remove a channel without members from the table and free it.
+ */
+static void channel_destroy(struct channel_table *table, struct channel *channel)
+{
+    channel_table_remove(table, channel_table_probe(table, channel->hash,
+                channel->name, channel->name_len));
+    free(channel->members);
+    free(channel);
+}
+
+struct channel *channel_join(struct channel_table *table,
+        struct channel_member *member, const char *name, unsigned len)
+{
+    struct channel *channel;
+
+    if (len == 0 || len > CHAT_CHANNEL_NAME_MAX_LEN) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (channel_member_find(member, name, len)) {
+        errno = EEXIST;
+        return NULL;
+    }
+
+    if (member->num_channels == CHANNEL_MAX_PER_MEMBER) {
+        errno = ENOSPC;
+        return NULL;
+    }
+
+    channel = channel_get(table, name, len);
+    if (!channel) {
+        return NULL;
+    }
+
+    if (channel->count == channel->capacity) {
+        unsigned capacity = channel->capacity ? 2 * channel->capacity :
+            CHANNEL_INITIAL_MEMBERS;
+        struct channel_member **members = realloc(channel->members,
+                capacity * sizeof(*members));
+
+        if (!members) {
+            if (channel->count == 0) {
+                channel_destroy(table, channel);
+            }
+            errno = ENOMEM;
+            return NULL;
+        }
+        channel->members = members;
+        channel->capacity = capacity;
+    }
+
+    member->channels[member->num_channels].channel = channel;
+    member->channels[member->num_channels].index = channel->count;
+    member->num_channels++;
+    channel->members[channel->count++] = member;
+
+    return channel;
+}
+
+/**
+ * @brief Find the membership of a member in a channel.
+ */
+static struct channel_membership *channel_membership_of(
+        struct channel_member *member, const struct channel *channel)
+{
+    for (unsigned i = 0; i < member->num_channels; ++i) {
+        if (member->channels[i].channel == channel) {
+            return &member->channels[i];
+        }
+    }
+
+    return NULL;
+}
+
+void channel_leave(struct channel_table *table, struct channel_member *member,
+        struct channel *channel)
+{
+    struct channel_membership *membership = channel_membership_of(member, channel);
+    struct channel_member *last;
+
+    if (!membership) {
+        return;
+    }
+
+    /* Swap-remove from the members, then from the channels of the member. */
+    last = channel->members[--channel->count];
+    if (last != member) {
+        channel->members[membership->index] = last;
+        channel_membership_of(last, channel)->index = membership->index;
+    }
+
+    *membership = member->channels[--member->num_channels];
+
+    if (channel->count == 0) {
+        channel_destroy(table, channel);
+    }
+}
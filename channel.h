@@ -0,0 +1,97 @@
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <stdint.h>
+
+#include "chat.h"
+
+/*
+ * Channel table: named sets of members, looked up by name in an open
+ * addressing hash table with linear probing. The members of a channel are
+ * kept in a dense array so that a message to it visits its members and
+ * nobody else. Every member records where it is in each of its channels,
+ * so that leaving takes constant time. A channel exists while it has
+ * members.
+ */
+
+#define CHANNEL_MAX_PER_MEMBER          16
+
+struct channel_member;
+
+struct channel {
+    char name[CHAT_CHANNEL_NAME_MAX_LEN + 1];
+    unsigned name_len;
+    uint32_t hash;
+    struct channel_member **members;
+    unsigned count;
+    unsigned capacity;
+};
+
+struct channel_membership {
+    struct channel *channel;
+    unsigned index;                     /* In the members of the channel. */
+};
+
+/* Embedded in whatever joins channels. */
+struct channel_member {
+    void *value;
+    struct channel_membership channels[CHANNEL_MAX_PER_MEMBER];
+    unsigned num_channels;
+};
+
+struct channel_table {
+    struct channel **slots;             /* NULL if free. */
+    unsigned num_slots;                 /* Power of two. */
+    unsigned count;
+};
+
+/**
+ * @brief Initialise an empty channel table.
+ *
+ * @return 0 on success, -1 on memory allocation error.
+ */
+int channel_table_init(struct channel_table *table);
+
+/**
+ * @brief Free the table and its channels. Members are left as they are.
+ */
+void channel_table_deinit(struct channel_table *table);
+
+/**
+ * @brief Look up a channel by name.
+ *
+ * @return Channel or NULL if it has no members.
+ */
+struct channel *channel_table_find(const struct channel_table *table,
+        const char *name, unsigned len);
+
+/**
+ * @brief Add a member to a channel, creating the channel if needed.
+ *
+ * @param name Name, at most CHAT_CHANNEL_NAME_MAX_LEN bytes.
+ *
+ * @return Channel joined or NULL on error (check errno: EEXIST if already a
+ *         member, ENOSPC if in CHANNEL_MAX_PER_MEMBER channels already,
+ *         EINVAL if the name is empty or too long, ENOMEM).
+ */
+struct channel *channel_join(struct channel_table *table,
+        struct channel_member *member, const char *name, unsigned len);
+
+/**
+ * @brief Remove a member from a channel, and the channel if it was the
+ *        last member.
+ *
+ * @param channel A channel of member.
+ */
+void channel_leave(struct channel_table *table, struct channel_member *member,
+        struct channel *channel);
+
+/**
+ * @brief Look up a channel of a member by name.
+ *
+ * @return Channel or NULL if member is not in it.
+ */
+struct channel *channel_member_find(const struct channel_member *member,
+        const char *name, unsigned len);
+
+#endif /* CHANNEL_H */
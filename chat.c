@@ -1,9 +1,13 @@
 #define _GNU_SOURCE
 #include <string.h>
+#include <stdint.h>
+#include <errno.h>
 
 #include "network.h"
 #include "chat.h"
+#include "compression.h"
 #include "log.h"
+#include "utf8.h"
 
 static int length_of_null_terminated(const char *buf, size_t len)
 {
@@ -121,6 +125,714 @@ int network_to_chat_member_leave(struct chat_member_leave *msg, const unsigned c
     return save_buf_len - buf_len;
 }
 
+size_t chat_varint_encode(unsigned char *buffer, uint32_t value)
+{
+    size_t n = 0;
+
+    while (value >= 0x80) {
+        buffer[n++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    buffer[n++] = value;
+
+    return n;
+}
+
+int chat_varint_decode(uint32_t *value, const unsigned char **data, size_t *len)
+{
+    uint32_t result = 0;
+
+    for (size_t i = 0; i < CHAT_VARINT_MAX_LEN && i < *len; ++i) {
+        unsigned char byte = (*data)[i];
+
+        /* The fifth byte only has room for the top 4 bits. */
+        if (i == CHAT_VARINT_MAX_LEN - 1 && byte > 0x0f) {
+            return -1;
+        }
+
+        result |= (uint32_t)(byte & 0x7f) << (7 * i);
+        if (!(byte & 0x80)) {
+            *value = result;
+            *data += i + 1;
+            *len -= i + 1;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static size_t chat_varint_size(uint32_t value)
+{
+    size_t n = 1;
+
+    while (value >= 0x80) {
+        value >>= 7;
+        n++;
+    }
+
+    return n;
+}
+
+/**
+ * @brief Get the size of a field of len bytes in the network format.
+ */
+static size_t chat_field_size(unsigned version, size_t len)
+{
+    if (version == CHAT_PROTOCOL_V1) {
+        return len + 1;
+    }
+
+    return 1 + chat_varint_size(len) + len;
+}
+
+static void chat_field_put(struct net_builder *builder, unsigned version,
+        enum chat_field_tag tag, const char *data, size_t len)
+{
+    unsigned char head[1 + CHAT_VARINT_MAX_LEN];
+    size_t head_len;
+
+    if (version == CHAT_PROTOCOL_V1) {
+        net_builder_put(builder, data, len);
+        net_builder_put(builder, "", 1);
+        return;
+    }
+
+    head[0] = tag;
+    head_len = 1 + chat_varint_encode(head + 1, len);
+    net_builder_put(builder, head, head_len);
+    net_builder_put(builder, data, len);
+}
+
+static void chat_number_put(struct net_builder *builder,
+        enum chat_field_tag tag, uint32_t value)
+{
+    unsigned char buffer[CHAT_VARINT_MAX_LEN];
+
+    chat_field_put(builder, CHAT_PROTOCOL_V2, tag, (const char *)buffer,
+            chat_varint_encode(buffer, value));
+}
+
+/**
+ * @brief Build a chat object of a sender and, for chat messages, a text.
+ *
+ * @param sender Sender, or NULL data to only give the sender id.
+ * @param sender_id Id of the sender, or 0 for none. Only v2 has ids.
+ * @param place Where the object goes: the recipient of a direct message,
+ *        else the channel, empty for the lobby. Only v2 has places.
+ * @param text Text, or NULL data for objects without.
+ */
+static struct net_message *chat_object_build_fields(unsigned version,
+        enum chat_object_type type, struct chat_field sender,
+        uint32_t sender_id, struct chat_field place, struct chat_field text)
+{
+    enum chat_field_tag place_tag = type == CHAT_DIRECT_MESSAGE ?
+        CHAT_FIELD_RECIPIENT : CHAT_FIELD_CHANNEL;
+    struct net_builder builder;
+    unsigned char head[] = { 0, type };     /* v2 flags, type. */
+    size_t head_len = version == CHAT_PROTOCOL_V1 ? 1 : 2;
+    size_t len;
+
+    /* Objects after CHAT_HELLO are v2 only, like places and ids. */
+    if (version == CHAT_PROTOCOL_V1 && (place.len || sender_id ||
+                !sender.data || type > CHAT_HELLO)) {
+        errno = EPROTONOSUPPORT;
+        return NULL;
+    }
+
+    len = head_len;
+    if (sender.data) {
+        len += chat_field_size(version, sender.len);
+    }
+    if (sender_id) {
+        len += chat_field_size(version, chat_varint_size(sender_id));
+    }
+    if (place.len) {
+        len += chat_field_size(version, place.len);
+    }
+    if (text.data) {
+        len += chat_field_size(version, text.len);
+    }
+
+    if (len > NET_MSG_DATA_SIZE) {
+        errno = EMSGSIZE;
+        return NULL;
+    }
+
+    if (net_builder_init(&builder, len) == -1) {
+        return NULL;
+    }
+
+    net_builder_put(&builder, head + 2 - head_len, head_len);
+    if (sender.data) {
+        chat_field_put(&builder, version, CHAT_FIELD_SENDER, sender.data,
+                sender.len);
+    }
+    if (sender_id) {
+        chat_number_put(&builder, CHAT_FIELD_SENDER_ID, sender_id);
+    }
+    if (place.len) {
+        chat_field_put(&builder, version, place_tag, place.data, place.len);
+    }
+    if (text.data) {
+        chat_field_put(&builder, version, CHAT_FIELD_TEXT, text.data, text.len);
+    }
+
+    return net_builder_finish(&builder);
+}
+
+static struct chat_field chat_field_of(const char *str)
+{
+    return (struct chat_field){ str, str ? strlen(str) : 0 };
+}
+
+static struct net_message *chat_object_build(unsigned version,
+        enum chat_object_type type, const char *place, const char *sender,
+        const char *text)
+{
+    return chat_object_build_fields(version, type, chat_field_of(sender), 0,
+            chat_field_of(place), chat_field_of(text));
+}
+
+struct net_message *chat_message_build(unsigned version, const char *sender,
+        const char *message)
+{
+    return chat_object_build(version, CHAT_MESSAGE, "", sender, message);
+}
+
+struct net_message *chat_member_join_build(unsigned version, const char *sender)
+{
+    return chat_object_build(version, CHAT_MEMBER_JOIN, "", sender, NULL);
+}
+
+struct net_message *chat_member_leave_build(unsigned version, const char *sender)
+{
+    return chat_object_build(version, CHAT_MEMBER_LEAVE, "", sender, NULL);
+}
+
+struct net_message *chat_member_build(unsigned version,
+        enum chat_object_type type, const char *sender, uint32_t id)
+{
+    return chat_object_build_fields(version, type, chat_field_of(sender), id,
+            chat_field_of(""), chat_field_of(NULL));
+}
+
+struct net_message *chat_channel_message_build(unsigned version,
+        const char *channel, const char *sender, const char *message)
+{
+    return chat_object_build(version, CHAT_MESSAGE, channel, sender, message);
+}
+
+struct net_message *chat_channel_join_build(unsigned version,
+        const char *channel, const char *sender)
+{
+    return chat_object_build(version, CHAT_CHANNEL_JOIN, channel, sender, NULL);
+}
+
+struct net_message *chat_channel_part_build(unsigned version,
+        const char *channel, const char *sender)
+{
+    return chat_object_build(version, CHAT_CHANNEL_PART, channel, sender, NULL);
+}
+
+struct net_message *chat_direct_message_build(unsigned version,
+        const char *recipient, const char *sender, const char *message)
+{
+    return chat_object_build(version, CHAT_DIRECT_MESSAGE, recipient, sender,
+            message);
+}
+
+struct net_message *chat_message_relay(unsigned version,
+        const struct chat_view *view, const char *sender)
+{
+    bool direct = view->type == CHAT_DIRECT_MESSAGE;
+
+    return chat_object_build_fields(version, view->type, chat_field_of(sender),
+            0, direct ? view->recipient : view->channel, view->message);
+}
+
+struct net_message *chat_message_relay_compact(unsigned version,
+        const struct chat_view *view, uint32_t sender_id)
+{
+    bool direct = view->type == CHAT_DIRECT_MESSAGE;
+
+    return chat_object_build_fields(version, view->type, chat_field_of(NULL),
+            sender_id, direct ? view->recipient : view->channel, view->message);
+}
+
+struct net_message *chat_chunk_build(unsigned version, const char *sender,
+        const struct chat_chunk *chunk)
+{
+    const unsigned char head[] = { 0, CHAT_CHUNK };
+    struct net_builder builder;
+    size_t sender_len = strlen(sender);
+    size_t len;
+
+    if (version < CHAT_PROTOCOL_V2) {
+        errno = EPROTONOSUPPORT;
+        return NULL;
+    }
+
+    len = sizeof(head) + chat_field_size(version, sender_len) +
+        chat_field_size(version, chat_varint_size(chunk->transfer)) +
+        chat_field_size(version, chat_varint_size(chunk->offset)) +
+        chat_field_size(version, chat_varint_size(chunk->size)) +
+        chat_field_size(version, chunk->name.len) +
+        chat_field_size(version, chunk->data.len);
+
+    if (len > NET_MSG_DATA_SIZE) {
+        errno = EMSGSIZE;
+        return NULL;
+    }
+
+    if (net_builder_init(&builder, len) == -1) {
+        return NULL;
+    }
+
+    net_builder_put(&builder, head, sizeof(head));
+    chat_field_put(&builder, version, CHAT_FIELD_SENDER, sender, sender_len);
+    chat_number_put(&builder, CHAT_FIELD_TRANSFER, chunk->transfer);
+    chat_number_put(&builder, CHAT_FIELD_OFFSET, chunk->offset);
+    chat_number_put(&builder, CHAT_FIELD_SIZE, chunk->size);
+    chat_field_put(&builder, version, CHAT_FIELD_NAME, chunk->name.data,
+            chunk->name.len);
+    chat_field_put(&builder, version, CHAT_FIELD_DATA, chunk->data.data,
+            chunk->data.len);
+
+    return net_builder_finish(&builder);
+}
+
+/**
+ * @brief Build a v2-only object of text fields and numbers.
+ *
+ * @param fields Text fields, those of NULL data left out.
+ * @param numbers Number fields, those of tag 0 left out.
+ */
+static struct net_message *chat_object_build_v2(unsigned version,
+        enum chat_object_type type, const struct chat_field *fields,
+        const enum chat_field_tag *field_tags, unsigned num_fields,
+        const uint32_t *numbers, const enum chat_field_tag *number_tags,
+        unsigned num_numbers)
+{
+    const unsigned char head[] = { 0, type };
+    struct net_builder builder;
+    size_t len = sizeof(head);
+
+    if (version < CHAT_PROTOCOL_V2) {
+        errno = EPROTONOSUPPORT;
+        return NULL;
+    }
+
+    for (unsigned i = 0; i < num_fields; ++i) {
+        if (fields[i].data) {
+            len += chat_field_size(version, fields[i].len);
+        }
+    }
+    for (unsigned i = 0; i < num_numbers; ++i) {
+        if (number_tags[i]) {
+            len += chat_field_size(version, chat_varint_size(numbers[i]));
+        }
+    }
+
+    if (len > NET_MSG_DATA_SIZE) {
+        errno = EMSGSIZE;
+        return NULL;
+    }
+
+    if (net_builder_init(&builder, len) == -1) {
+        return NULL;
+    }
+
+    net_builder_put(&builder, head, sizeof(head));
+    for (unsigned i = 0; i < num_fields; ++i) {
+        if (fields[i].data) {
+            chat_field_put(&builder, version, field_tags[i], fields[i].data,
+                    fields[i].len);
+        }
+    }
+    for (unsigned i = 0; i < num_numbers; ++i) {
+        if (number_tags[i]) {
+            chat_number_put(&builder, number_tags[i], numbers[i]);
+        }
+    }
+
+    return net_builder_finish(&builder);
+}
+
+struct net_message *chat_search_build(unsigned version, const char *query,
+        uint32_t count)
+{
+    const struct chat_field fields[] = { chat_field_of(query) };
+    const enum chat_field_tag field_tags[] = { CHAT_FIELD_TEXT };
+    const enum chat_field_tag number_tags[] = { count ? CHAT_FIELD_SIZE : 0 };
+
+    return chat_object_build_v2(version, CHAT_SEARCH, fields, field_tags, 1,
+            &count, number_tags, 1);
+}
+
+struct net_message *chat_history_entry_build(unsigned version,
+        const struct chat_view *message, uint32_t message_id, uint32_t time)
+{
+    const struct chat_field fields[] = {
+        message->sender, message->channel.len ? message->channel :
+            chat_field_of(NULL), message->message
+    };
+    const enum chat_field_tag field_tags[] = {
+        CHAT_FIELD_SENDER, CHAT_FIELD_CHANNEL, CHAT_FIELD_TEXT
+    };
+    const uint32_t numbers[] = { message_id, time };
+    const enum chat_field_tag number_tags[] = {
+        CHAT_FIELD_MESSAGE_ID, CHAT_FIELD_TIME
+    };
+
+    return chat_object_build_v2(version, CHAT_HISTORY_ENTRY, fields,
+            field_tags, 3, numbers, number_tags, 2);
+}
+
+struct net_message *chat_history_end_build(unsigned version, uint32_t count)
+{
+    const enum chat_field_tag number_tags[] = { CHAT_FIELD_SIZE };
+
+    return chat_object_build_v2(version, CHAT_HISTORY_END, NULL, NULL, 0,
+            &count, number_tags, 1);
+}
+
+struct net_message *chat_history_request_build(unsigned version,
+        const struct chat_history *range)
+{
+    const uint32_t numbers[] = {
+        range->message_id, range->time, range->until, range->count
+    };
+    const enum chat_field_tag number_tags[] = {
+        range->message_id ? CHAT_FIELD_MESSAGE_ID : 0,
+        range->time ? CHAT_FIELD_TIME : 0,
+        range->until ? CHAT_FIELD_UNTIL : 0,
+        range->count ? CHAT_FIELD_SIZE : 0
+    };
+
+    return chat_object_build_v2(version, CHAT_HISTORY_REQUEST, NULL, NULL, 0,
+            numbers, number_tags, 4);
+}
+
+struct net_message *chat_hello_build(unsigned version, uint32_t features)
+{
+    unsigned char data[2 + CHAT_VARINT_MAX_LEN] = { CHAT_HELLO, version };
+    struct net_builder builder;
+    size_t len;
+
+    len = 2 + chat_varint_encode(data + 2, features);
+    if (net_builder_init(&builder, len) == -1) {
+        return NULL;
+    }
+
+    net_builder_put(&builder, data, len);
+    return net_builder_finish(&builder);
+}
+
+/**
+ * @brief Point view fields at the next null-terminated strings of data,
+ *        finding the terminators and validating UTF-8 in one pass.
+ *
+ * @param fields Fields, at most two.
+ * @param max_lens Maximum length of each field.
+ *
+ * @return 0 on success, -1 if a terminator is missing, a field is too long
+ *         or not valid UTF-8.
+ */
+static int chat_fields_decode(struct chat_field *const *fields,
+        const size_t *max_lens, unsigned num_fields,
+        const unsigned char **data, size_t *len)
+{
+    size_t nuls[2];
+    size_t start = 0;
+
+    if (utf8_scan(*data, *len, nuls, num_fields) != (int)num_fields) {
+        return -1;
+    }
+
+    for (unsigned i = 0; i < num_fields; ++i) {
+        if (nuls[i] - start > max_lens[i]) {
+            return -1;
+        }
+
+        fields[i]->data = (const char *)*data + start;
+        fields[i]->len = nuls[i] - start;
+        start = nuls[i] + 1;
+    }
+
+    *data += start;
+    *len -= start;
+    return 0;
+}
+
+static int chat_hello_decode(struct chat_view *view,
+        const unsigned char **data, size_t *len)
+{
+    if (*len < 1) {
+        return -1;
+    }
+
+    view->version = (*data)[0];
+    *data += 1;
+    *len -= 1;
+
+    return chat_varint_decode(&view->features, data, len);
+}
+
+static int chat_view_decode_v1(struct chat_view *view,
+        const unsigned char *data, size_t length)
+{
+    size_t save_length = length;
+    int rc;
+
+    if (length < 1) {
+        return -1;
+    }
+
+    view->type = data[0];
+    view->flags = 0;
+    view->sender_id = 0;
+    view->channel = (struct chat_field){ "", 0 };
+    view->recipient = view->channel;
+    data++;
+    length--;
+
+    switch (view->type) {
+    case CHAT_MESSAGE:
+        rc = chat_fields_decode(
+                (struct chat_field *[]){ &view->sender, &view->message },
+                (size_t[]){ CHAT_MEMBER_NAME_MAX_LEN, CHAT_MESSAGE_MAX_LEN },
+                2, &data, &length);
+        break;
+    case CHAT_MEMBER_JOIN:
+    case CHAT_MEMBER_LEAVE:
+        rc = chat_fields_decode((struct chat_field *[]){ &view->sender },
+                (size_t[]){ CHAT_MEMBER_NAME_MAX_LEN }, 1, &data, &length);
+        break;
+    case CHAT_HELLO:
+        rc = chat_hello_decode(view, &data, &length);
+        break;
+    default:
+        log_debug("Corrupt object: invalid type (%d)\n", view->type);
+        return -1;
+    }
+
+    if (rc < 0) {
+        log_debug("Failed to decode chat object from network format.\n");
+        return -1;
+    }
+
+    view->len = save_length - length;
+    return view->type;
+}
+
+static int chat_view_decode_v2(struct chat_view *view,
+        const unsigned char *data, size_t length)
+{
+    struct chat_field empty = { "", 0 };
+    size_t skipped = 0;
+    size_t save_length = length;
+    unsigned seen = 0;
+
+    if (length < 2) {
+        return -1;
+    }
+
+    view->flags = data[0];
+    view->type = data[1];
+    view->sender = empty;
+    view->sender_id = 0;
+    view->channel = empty;
+    view->recipient = empty;
+    view->message = empty;
+    memset(&view->chunk, 0, sizeof(view->chunk));
+    view->chunk.name = empty;
+    view->chunk.data = empty;
+    memset(&view->history, 0, sizeof(view->history));
+    data += 2;
+    length -= 2;
+
+    if (view->flags & ~CHAT_KNOWN_FLAGS) {
+        log_debug("Corrupt object: unknown flags (%#x)\n", view->flags);
+        return -1;
+    }
+
+    if (view->type != CHAT_MESSAGE && view->type != CHAT_MEMBER_JOIN &&
+            view->type != CHAT_MEMBER_LEAVE && view->type != CHAT_CHUNK &&
+            view->type != CHAT_CHANNEL_JOIN && view->type != CHAT_CHANNEL_PART &&
+            view->type != CHAT_DIRECT_MESSAGE && view->type != CHAT_MEMBER_INFO &&
+            view->type != CHAT_SEARCH && view->type != CHAT_HISTORY_ENTRY &&
+            view->type != CHAT_HISTORY_END && view->type != CHAT_HISTORY_REQUEST) {
+        log_debug("Corrupt object: invalid type (%d)\n", view->type);
+        return -1;
+    }
+
+    while (length > 0) {
+        const unsigned char *field_start = data;
+        struct chat_field *field = NULL;
+        uint32_t *number = NULL;
+        size_t max_len = 0;
+        bool text = true;
+        unsigned tag = data[0];
+        uint32_t field_len;
+        size_t nul;
+
+        data++;
+        length--;
+
+        if (chat_varint_decode(&field_len, &data, &length) == -1 ||
+                field_len > length) {
+            log_debug("Corrupt object: truncated field %u\n", tag);
+            return -1;
+        }
+
+        if (tag == CHAT_FIELD_SENDER) {
+            field = &view->sender;
+            max_len = CHAT_MEMBER_NAME_MAX_LEN;
+        }
+        else if (tag == CHAT_FIELD_SENDER_ID && view->type != CHAT_CHUNK &&
+                view->type != CHAT_CHANNEL_JOIN &&
+                view->type != CHAT_CHANNEL_PART) {
+            number = &view->sender_id;
+        }
+        else if (tag == CHAT_FIELD_TEXT && (view->type == CHAT_MESSAGE ||
+                    view->type == CHAT_DIRECT_MESSAGE ||
+                    view->type == CHAT_SEARCH ||
+                    view->type == CHAT_HISTORY_ENTRY)) {
+            field = &view->message;
+            max_len = CHAT_MESSAGE_MAX_LEN;
+        }
+        else if (tag == CHAT_FIELD_CHANNEL && (view->type == CHAT_MESSAGE ||
+                    view->type == CHAT_CHANNEL_JOIN ||
+                    view->type == CHAT_CHANNEL_PART ||
+                    view->type == CHAT_HISTORY_ENTRY)) {
+            field = &view->channel;
+            max_len = CHAT_CHANNEL_NAME_MAX_LEN;
+        }
+        else if (tag == CHAT_FIELD_RECIPIENT && view->type == CHAT_DIRECT_MESSAGE) {
+            field = &view->recipient;
+            max_len = CHAT_MEMBER_NAME_MAX_LEN;
+        }
+        else if ((tag == CHAT_FIELD_MESSAGE_ID || tag == CHAT_FIELD_TIME) &&
+                (view->type == CHAT_HISTORY_ENTRY ||
+                 view->type == CHAT_HISTORY_REQUEST)) {
+            number = tag == CHAT_FIELD_TIME ? &view->history.time :
+                &view->history.message_id;
+        }
+        else if (tag == CHAT_FIELD_UNTIL && view->type == CHAT_HISTORY_REQUEST) {
+            number = &view->history.until;
+        }
+        else if (tag == CHAT_FIELD_SIZE && (view->type == CHAT_SEARCH ||
+                    view->type == CHAT_HISTORY_END ||
+                    view->type == CHAT_HISTORY_REQUEST)) {
+            number = &view->history.count;
+        }
+        else if (view->type == CHAT_CHUNK) {
+            switch (tag) {
+            case CHAT_FIELD_TRANSFER:
+                number = &view->chunk.transfer;
+                break;
+            case CHAT_FIELD_OFFSET:
+                number = &view->chunk.offset;
+                break;
+            case CHAT_FIELD_SIZE:
+                number = &view->chunk.size;
+                break;
+            case CHAT_FIELD_NAME:
+                field = &view->chunk.name;
+                max_len = CHAT_FILE_NAME_MAX_LEN;
+                break;
+            case CHAT_FIELD_DATA:
+                field = &view->chunk.data;
+                max_len = CHAT_CHUNK_MAX_LEN;
+                text = false;
+                break;
+            }
+        }
+
+        data += field_len;
+        length -= field_len;
+
+        if (!field && !number) {
+            skipped += data - field_start;
+            continue;
+        }
+
+        if (seen & (1u << tag)) {
+            log_debug("Corrupt object: duplicate field %u\n", tag);
+            return -1;
+        }
+        seen |= 1u << tag;
+
+        if (number) {
+            const unsigned char *value = data - field_len;
+            size_t value_len = field_len;
+
+            if (chat_varint_decode(number, &value, &value_len) == -1 || value_len) {
+                log_debug("Corrupt object: invalid number in field %u\n", tag);
+                return -1;
+            }
+            continue;
+        }
+
+        /* Text fields are UTF-8 without null bytes. */
+        if (field_len > max_len ||
+                (text && utf8_scan(data - field_len, field_len, &nul, 1) != 0)) {
+            log_debug("Corrupt object: invalid field %u\n", tag);
+            return -1;
+        }
+
+        field->data = (const char *)data - field_len;
+        field->len = field_len;
+    }
+
+    if (view->type == CHAT_CHUNK && (view->chunk.size > CHAT_TRANSFER_MAX_LEN ||
+                view->chunk.offset > view->chunk.size ||
+                view->chunk.data.len > view->chunk.size - view->chunk.offset)) {
+        log_debug("Corrupt object: chunk outside of its transfer\n");
+        return -1;
+    }
+
+    if ((view->type == CHAT_CHANNEL_JOIN || view->type == CHAT_CHANNEL_PART) &&
+            view->channel.len == 0) {
+        log_debug("Corrupt object: no channel\n");
+        return -1;
+    }
+
+    if (view->type == CHAT_DIRECT_MESSAGE && view->recipient.len == 0) {
+        log_debug("Corrupt object: no recipient\n");
+        return -1;
+    }
+
+    if (view->type == CHAT_SEARCH && view->message.len == 0) {
+        log_debug("Corrupt object: empty search\n");
+        return -1;
+    }
+
+    if (view->type == CHAT_MEMBER_INFO && (view->sender.len == 0 ||
+                view->sender_id == 0)) {
+        log_debug("Corrupt object: member info without sender or id\n");
+        return -1;
+    }
+
+    view->len = save_length - skipped;
+    return view->type;
+}
+
+int chat_view_decode(struct chat_view *view, unsigned version,
+        const unsigned char *data, size_t length)
+{
+    switch (version) {
+    case CHAT_PROTOCOL_V1:
+        return chat_view_decode_v1(view, data, length);
+    case CHAT_PROTOCOL_V2:
+        return chat_view_decode_v2(view, data, length);
+    default:
+        log_debug("Unknown protocol version %u\n", version);
+        return -1;
+    }
+}
+
 int network_to_chat_object(union chat_object *obj, const unsigned char *data, size_t length)
 {
     int conv, obj_type;
@@ -155,3 +867,74 @@ int network_to_chat_object(union chat_object *obj, const unsigned char *data, si
 
     return obj_type;
 }
+
+/*
+ * Dictionary the compression contexts of every connection are primed with:
+ * the framing of v2 objects and words and phrases common in chat. Strings
+ * near the end are the cheapest to refer to, so the most frequent go last.
+ */
+static const char chat_dictionary[] =
+    "You missed message(s) because you were not keeping up. "
+    "Thanks, thank you! No problem. Sorry, I don't know. What do you think? "
+    "I think so too. Let me check. Does anyone know how to fix this? "
+    "Have a nice day. See you tomorrow. Good night! Good morning everyone. "
+    "I'm not sure about that, but it should work now. Can you try again? "
+    "It works for me. Did you see the new one? Where are you from? "
+    "What are you doing? Nothing much, just working. How about you? "
+    "joined left lol haha :) :D ;) :( ok okay yes yeah nope sure cool nice "
+    "great awesome please maybe really actually anyway probably because "
+    "something anything everything someone people time today work home "
+    "would could should about there their they them when what where which "
+    "with that this have from just like know been were will your you're "
+    "and the for not are but can all was one out get got how now new "
+    "\x00\x01\x01\x00\x02\x01\x00\x00\x01hello hi hey everyone, how are you? "
+    "I'm fine, thanks. \x02";
+
+int chat_compression_init(struct compression *comp)
+{
+    return compression_init(comp, chat_dictionary, sizeof(chat_dictionary) - 1);
+}
+
+struct net_message *chat_compress(struct compression *comp,
+        struct net_message *msg)
+{
+    unsigned char packed[NET_MSG_DATA_SIZE + COMPRESSION_MAX_OVERHEAD];
+    int len;
+
+    packed[0] = CHAT_FLAG_COMPRESSED;
+    len = compression_deflate(comp, net_message_body(msg),
+            net_message_body_length(msg), packed + 1, sizeof(packed) - 1);
+    if (len == -1) {
+        return NULL;
+    }
+
+    return net_message_new_with_body(packed, 1 + len);
+}
+
+bool chat_is_compressed(unsigned version, const unsigned char *data, size_t len)
+{
+    return version >= CHAT_PROTOCOL_V2 && len > 0 &&
+        (data[0] & CHAT_FLAG_COMPRESSED);
+}
+
+struct net_message *chat_decompress(struct compression *comp,
+        const unsigned char *data, size_t len)
+{
+    /* One more byte than fits in a message, to tell when it does not. */
+    unsigned char body[NET_MSG_DATA_SIZE + 1];
+    int body_len;
+
+    /* The compressed frame carries no other flags. */
+    if (len < 2 || data[0] != CHAT_FLAG_COMPRESSED) {
+        errno = EPROTO;
+        return NULL;
+    }
+
+    body_len = compression_inflate(comp, data + 1, len - 1, body, sizeof(body));
+    if (body_len == -1) {
+        log_debug("Corrupt compressed object: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    return net_message_new_with_body(body, body_len);
+}
@@ -1,13 +1,122 @@
 #ifndef CHAT_H
 #define CHAT_H
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+struct net_message;
+struct compression;
+
 #define CHAT_MEMBER_NAME_MAX_LEN        36
 #define CHAT_MESSAGE_MAX_LEN            512
+#define CHAT_FILE_NAME_MAX_LEN          255
+#define CHAT_CHANNEL_NAME_MAX_LEN       32
+
+/*
+ * Payloads too large for a chat message, such as files, are sent in
+ * CHAT_CHUNKs of at most CHAT_CHUNK_MAX_LEN bytes each.
+ */
+#define CHAT_CHUNK_MAX_LEN              1024
+#define CHAT_TRANSFER_MAX_LEN           (1u << 30)
+
+/*
+ * Protocol versions.
+ *
+ * v1: a type byte followed by the null-terminated fields of the object, in
+ *     a fixed order.
+ * v2: a flags byte and a type byte followed by fields in any order, each a
+ *     tag byte, a varint length and that many bytes with no terminator.
+ *     Fields with unknown tags are skipped and absent fields are empty, so
+ *     new fields can be added without a new version.
+ *
+ * Every connection starts in v1. A client that wants more sends a
+ * CHAT_HELLO as its first object; the server answers with a CHAT_HELLO
+ * holding the version and features both sides support, and from then on
+ * both sides use that version. HELLOs are always in the v1 format.
+ *
+ * A transfer is a payload sent as CHAT_CHUNKs, v2 only, in order of offset.
+ * Every chunk carries the transfer id, chosen by the sender, and the size
+ * and name of the whole payload, so that chunks can be relayed one by one
+ * without the payload ever being put together in the server.
+ *
+ * Every member is in the lobby, the channel without a name, which is all
+ * v1 has. In v2 members also join and part named channels with
+ * CHAT_CHANNEL_JOIN and CHAT_CHANNEL_PART, which the server passes on to
+ * the members of the channel, the sender included. A CHAT_MESSAGE with a
+ * channel field goes to the members of that channel only.
+ *
+ * A CHAT_DIRECT_MESSAGE, v2 only, goes to its recipient only, found by
+ * name. Names are unique: a CHAT_MEMBER_JOIN with a name in use is turned
+ * down.
+ *
+ * With CHAT_FEATURE_SENDER_IDS, the server gives every member a numeric id
+ * in the CHAT_MEMBER_JOIN and CHAT_MEMBER_LEAVE it broadcasts, and tells
+ * a joining client the ids of the members already there with
+ * CHAT_MEMBER_INFOs. Chat messages and direct messages to the client then
+ * carry the sender id instead of the sender name. Ids are never reused.
+ *
+ * A server that keeps a history answers a CHAT_SEARCH, v2 only, with the
+ * messages of the history that hold every word of its text and that the
+ * client may see, as CHAT_HISTORY_ENTRYs oldest first, followed by a
+ * CHAT_HISTORY_END with their number. It answers a CHAT_HISTORY_REQUEST,
+ * v2 only, the same way with the messages from a message id or a time on,
+ * oldest first, a batch at a time.
+ */
+#define CHAT_PROTOCOL_V1                1u
+#define CHAT_PROTOCOL_V2                2u
+#define CHAT_PROTOCOL_LATEST            CHAT_PROTOCOL_V2
+#define CHAT_NUM_PROTOCOLS              2u
+
+/* Optional features negotiated by CHAT_HELLO, a bit mask. */
+#define CHAT_FEATURE_COMPRESSION        0x1u    /* See chat_compress. */
+#define CHAT_FEATURE_SENDER_IDS         0x2u    /* v2 only. */
+#define CHAT_SUPPORTED_FEATURES         (CHAT_FEATURE_COMPRESSION | \
+                                         CHAT_FEATURE_SENDER_IDS)
+
+/* v2 frame flags. A flag may only be set if its feature was negotiated. */
+#define CHAT_FLAG_COMPRESSED            0x1u
+
+/*
+ * Flags chat_view_decode accepts. Compressed objects are decompressed
+ * before they are decoded.
+ */
+#define CHAT_KNOWN_FLAGS                0u
+
+/* Longest varint, enough for 32 bits. */
+#define CHAT_VARINT_MAX_LEN             5u
 
 enum chat_object_type {
     CHAT_MESSAGE,
     CHAT_MEMBER_JOIN,
-    CHAT_MEMBER_LEAVE
+    CHAT_MEMBER_LEAVE,
+    CHAT_HELLO,
+    CHAT_CHUNK,
+    CHAT_CHANNEL_JOIN,
+    CHAT_CHANNEL_PART,
+    CHAT_DIRECT_MESSAGE,
+    CHAT_MEMBER_INFO,
+    CHAT_SEARCH,
+    CHAT_HISTORY_ENTRY,
+    CHAT_HISTORY_END,
+    CHAT_HISTORY_REQUEST
+};
+
+/* Tags of v2 fields. */
+enum chat_field_tag {
+    CHAT_FIELD_SENDER = 1,
+    CHAT_FIELD_TEXT = 2,
+    CHAT_FIELD_TRANSFER = 3,            /* Varint. */
+    CHAT_FIELD_OFFSET = 4,              /* Varint. */
+    CHAT_FIELD_SIZE = 5,                /* Varint. */
+    CHAT_FIELD_NAME = 6,
+    CHAT_FIELD_DATA = 7,                /* Any bytes, not text. */
+    CHAT_FIELD_CHANNEL = 8,             /* Empty or absent for the lobby. */
+    CHAT_FIELD_RECIPIENT = 9,
+    CHAT_FIELD_SENDER_ID = 10,          /* Varint, not 0. */
+    CHAT_FIELD_MESSAGE_ID = 11,         /* Varint, in the history. */
+    CHAT_FIELD_TIME = 12,               /* Varint, seconds since the epoch. */
+    CHAT_FIELD_UNTIL = 13               /* Varint, seconds since the epoch. */
 };
 
 struct chat_message {
@@ -29,6 +138,62 @@ union chat_object {
     struct chat_member_leave leave;
 };
 
+/*
+ * A field inside the network format of a chat object. Only v1 fields are
+ * null-terminated, so data must be used with len.
+ */
+struct chat_field {
+    const char *data;
+    unsigned len;                       /* Not counting any terminator. */
+};
+
+/* A piece of a transfer. */
+struct chat_chunk {
+    uint32_t transfer;                  /* Id among the sender's transfers. */
+    uint32_t offset;                    /* Of data in the payload. */
+    uint32_t size;                      /* Of the whole payload. */
+    struct chat_field name;             /* File name or empty. */
+    struct chat_field data;
+};
+
+/* Of the history objects. */
+struct chat_history {
+    uint32_t message_id;                /* Of a CHAT_HISTORY_ENTRY, or to
+                                           start from, 0 for none. */
+    uint32_t time;                      /* Of a CHAT_HISTORY_ENTRY, or to
+                                           start from if there is no
+                                           message id. */
+    uint32_t until;                     /* Time to stop after, 0 for none,
+                                           CHAT_HISTORY_REQUEST only. */
+    uint32_t count;                     /* Most entries wanted for
+                                           CHAT_SEARCH and
+                                           CHAT_HISTORY_REQUEST, 0 for the
+                                           server's choice; entries sent
+                                           for CHAT_HISTORY_END. */
+};
+
+/*
+ * A decoded chat object that points into its network format instead of
+ * copying it, see chat_view_decode.
+ */
+struct chat_view {
+    enum chat_object_type type;
+    unsigned flags;                     /* v2 frame flags. */
+    struct chat_field sender;           /* Empty if only sender_id is given. */
+    uint32_t sender_id;                 /* 0 if none. */
+    struct chat_field channel;          /* Empty for the lobby. */
+    struct chat_field recipient;        /* CHAT_DIRECT_MESSAGE only. */
+    struct chat_field message;          /* CHAT_MESSAGE, CHAT_DIRECT_MESSAGE,
+                                           CHAT_HISTORY_ENTRY and the query
+                                           of CHAT_SEARCH only. */
+    struct chat_chunk chunk;            /* CHAT_CHUNK only. */
+    struct chat_history history;
+    unsigned version;                   /* CHAT_HELLO only. */
+    uint32_t features;                  /* CHAT_HELLO only. */
+    unsigned len;                       /* Bytes of network format decoded,
+                                           not counting skipped fields. */
+};
+
 /*
  * These functions convert network formatted data to messages or vice versa.
  * On success, they return the number of bytes read or written to the buffer.
@@ -43,6 +208,113 @@ int network_to_chat_member_join(struct chat_member_join *msg, const unsigned cha
 int chat_member_leave_to_network(const struct chat_member_leave *msg, unsigned char *buffer, size_t len);
 int network_to_chat_member_leave(struct chat_member_leave *msg, const unsigned char *buffer, size_t len);
 
+/*
+ * These functions write the network format of a chat object in a protocol
+ * version, type byte included, straight into a new network message of ref
+ * count 1. On failure, they return NULL (check errno).
+ */
+struct net_message *chat_message_build(unsigned version, const char *sender,
+        const char *message);
+struct net_message *chat_member_join_build(unsigned version, const char *sender);
+struct net_message *chat_member_leave_build(unsigned version, const char *sender);
+
+/*
+ * These functions build the objects of a named channel, which only exist
+ * in v2: they fail with EPROTONOSUPPORT for v1, except for a chat message
+ * to the lobby, an empty channel.
+ */
+struct net_message *chat_channel_message_build(unsigned version,
+        const char *channel, const char *sender, const char *message);
+struct net_message *chat_channel_join_build(unsigned version,
+        const char *channel, const char *sender);
+struct net_message *chat_channel_part_build(unsigned version,
+        const char *channel, const char *sender);
+
+/**
+ * @brief Build a CHAT_MEMBER_JOIN, CHAT_MEMBER_LEAVE or CHAT_MEMBER_INFO
+ *        with the id of the member, see CHAT_FEATURE_SENDER_IDS.
+ *
+ * @param id Id of the member, or 0 for none. v1 has no ids and no
+ *        CHAT_MEMBER_INFO.
+ *
+ * @return Network message of ref count 1 or NULL on error (check errno).
+ */
+struct net_message *chat_member_build(unsigned version,
+        enum chat_object_type type, const char *sender, uint32_t id);
+
+/**
+ * @brief Build a CHAT_DIRECT_MESSAGE, which only exists in v2.
+ *
+ * @return Network message of ref count 1 or NULL on error (check errno,
+ *         EPROTONOSUPPORT for v1).
+ */
+struct net_message *chat_direct_message_build(unsigned version,
+        const char *recipient, const char *sender, const char *message);
+
+/**
+ * @brief Build a CHAT_CHUNK, which only exists in v2.
+ *
+ * @return Network message of ref count 1 or NULL on error (check errno,
+ *         EPROTONOSUPPORT for v1).
+ */
+struct net_message *chat_chunk_build(unsigned version, const char *sender,
+        const struct chat_chunk *chunk);
+
+/**
+ * @brief Build a CHAT_SEARCH, which only exists in v2.
+ *
+ * @param count Most messages wanted, 0 for the server's choice.
+ *
+ * @return Network message of ref count 1 or NULL on error (check errno,
+ *         EPROTONOSUPPORT for v1).
+ */
+struct net_message *chat_search_build(unsigned version, const char *query,
+        uint32_t count);
+
+/**
+ * @brief Build a CHAT_HISTORY_ENTRY, which only exists in v2, of a chat
+ *        message of the history.
+ *
+ * @param message Decoded CHAT_MESSAGE with a sender name.
+ *
+ * @return Network message of ref count 1 or NULL on error (check errno,
+ *         EPROTONOSUPPORT for v1).
+ */
+struct net_message *chat_history_entry_build(unsigned version,
+        const struct chat_view *message, uint32_t message_id, uint32_t time);
+
+/**
+ * @brief Build a CHAT_HISTORY_END, which only exists in v2.
+ *
+ * @return Network message of ref count 1 or NULL on error (check errno,
+ *         EPROTONOSUPPORT for v1).
+ */
+struct net_message *chat_history_end_build(unsigned version, uint32_t count);
+
+/**
+ * @brief Build a CHAT_HISTORY_REQUEST, which only exists in v2.
+ *
+ * @param range Message id or time to start from, time to stop after and
+ *        most messages wanted, each 0 for none.
+ *
+ * @return Network message of ref count 1 or NULL on error (check errno,
+ *         EPROTONOSUPPORT for v1).
+ */
+struct net_message *chat_history_request_build(unsigned version,
+        const struct chat_history *range);
+
+/**
+ * @brief Build a CHAT_HELLO, which is always in the v1 format.
+ *
+ * @param version Highest protocol version the sender supports, or the
+ *        version chosen in a reply.
+ * @param features Features the sender supports, or the ones chosen in a
+ *        reply.
+ *
+ * @return Network message of ref count 1 or NULL on error (check errno).
+ */
+struct net_message *chat_hello_build(unsigned version, uint32_t features);
+
 /**
  * @brief Convert to a chat message object from network format.
  *
@@ -54,4 +326,109 @@ int network_to_chat_member_leave(struct chat_member_leave *msg, const unsigned c
  */
 int network_to_chat_object(union chat_object *cm, const unsigned char *data, size_t len);
 
+/**
+ * @brief Decode a chat object from network format without copying it.
+ *
+ * @description The fields of view point into data, which must outlive the
+ *              view. Text fields must be valid UTF-8 within the limits of
+ *              network_to_chat_object; v2 text fields must not contain
+ *              null bytes. v1 data may hold bytes after the object. v2
+ *              objects take the whole of data and must not set unknown
+ *              flags. A CHAT_HELLO is only accepted in the v1 format and
+ *              a CHAT_CHUNK only in v2, with its data within its size.
+ *              CHAT_CHANNEL_JOIN and CHAT_CHANNEL_PART are v2 only and
+ *              need a channel, CHAT_DIRECT_MESSAGE is v2 only and needs a
+ *              recipient, CHAT_MEMBER_INFO is v2 only and needs both a
+ *              sender and a sender id. CHAT_SEARCH, which needs a query,
+ *              CHAT_HISTORY_REQUEST and the history objects are v2 only.
+ *
+ * @param view Chat object view.
+ * @param version Protocol version of data.
+ * @param data Chat object network format data.
+ * @param len Length of data.
+ *
+ * @return Chat object type or -1 on conversion error.
+ */
+int chat_view_decode(struct chat_view *view, unsigned version,
+        const unsigned char *data, size_t len);
+
+/**
+ * @brief Build a chat message or direct message with the text and channel
+ *        or recipient of a decoded one and another sender, without
+ *        decoding it into a struct chat_message first.
+ *
+ * @param version Protocol version to build in, not necessarily the one the
+ *        view was decoded from.
+ *
+ * @return Network message of ref count 1 or NULL on error (check errno,
+ *         EPROTONOSUPPORT if the object cannot be held in version).
+ */
+struct net_message *chat_message_relay(unsigned version,
+        const struct chat_view *view, const char *sender);
+
+/**
+ * @brief Build a chat message or direct message like chat_message_relay,
+ *        with the id of the sender instead of its name, which only exists
+ *        in v2.
+ *
+ * @return Network message of ref count 1 or NULL on error (check errno).
+ */
+struct net_message *chat_message_relay_compact(unsigned version,
+        const struct chat_view *view, uint32_t sender_id);
+
+/**
+ * @brief Write value as a varint: 7 bits per byte, least significant
+ *        first, the top bit set on all but the last byte.
+ *
+ * @param buffer At least CHAT_VARINT_MAX_LEN bytes.
+ *
+ * @return Number of bytes written.
+ */
+size_t chat_varint_encode(unsigned char *buffer, uint32_t value);
+
+/**
+ * @brief Read a varint and advance data and len past it.
+ *
+ * @return 0 on success, -1 if it is truncated or does not fit in 32 bits.
+ */
+int chat_varint_decode(uint32_t *value, const unsigned char **data, size_t *len);
+
+/**
+ * @brief Initialise the compression contexts of a connection, primed with
+ *        a dictionary of chat text.
+ *
+ * @return 0 on success, -1 on error (check errno).
+ */
+int chat_compression_init(struct compression *comp);
+
+/**
+ * @brief Compress a v2 chat object as the next one of a connection.
+ *
+ * @description The result is a v2 frame with the CHAT_FLAG_COMPRESSED flag
+ *              followed by the deflated network format of the object, see
+ *              compression.h. It must be sent, and in order.
+ *
+ * @param msg Network message of a v2 chat object.
+ *
+ * @return Network message of ref count 1 or NULL on error (check errno),
+ *         after which comp is unusable.
+ */
+struct net_message *chat_compress(struct compression *comp,
+        struct net_message *msg);
+
+/**
+ * @brief Check whether a chat object has to be decompressed with
+ *        chat_decompress before it can be decoded.
+ */
+bool chat_is_compressed(unsigned version, const unsigned char *data, size_t len);
+
+/**
+ * @brief Decompress a chat object compressed by chat_compress.
+ *
+ * @return Network message of ref count 1 holding the original object, or
+ *         NULL if data is corrupt (check errno).
+ */
+struct net_message *chat_decompress(struct compression *comp,
+        const unsigned char *data, size_t len);
+
 #endif /* CHAT_H */
@@ -5,9 +5,13 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <time.h>
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netdb.h>
@@ -16,28 +20,74 @@
 #include "log.h"
 #include "network.h"
 #include "chat.h"
+#include "compression.h"
+#include "transfer.h"
+#include "utf8.h"
+#include "names.h"
 
 #define eprintf(fmt, ...) fprintf(stderr, fmt, ##__VA_ARGS__)
 
+#define SEND_COMMAND                    "/send "
+#define JOIN_COMMAND                    "/join "
+#define PART_COMMAND                    "/part"
+#define MSG_COMMAND                     "/msg "
+#define SEARCH_COMMAND                  "/search "
+#define SINCE_COMMAND                   "/since "
+
+/*
+ * Most unsent bytes the socket holds while a file is being sent, so that
+ * chat messages typed meanwhile do not wait behind much of the file.
+ */
+#define UPLOAD_NOTSENT_LOWAT            (16 * 1024)
+
 struct prog_args {
     const char *addr;
     const char *port;
     const char *username;
+    unsigned protocol;
 } pargs;
 
 static bool should_exit;
 static char username[CHAT_MEMBER_NAME_MAX_LEN + 1];
+static unsigned protocol = CHAT_PROTOCOL_V1;   /* In use on the connection. */
+static bool joined;
+static char channel[CHAT_CHANNEL_NAME_MAX_LEN + 1]; /* Talked in, or the lobby. */
+static struct compression compression;
+static bool compressed;                         /* Negotiated compression. */
+static struct upload upload = { .fd = -1 };
+static uint32_t num_uploads;
+static struct downloads downloads;
+static struct id_table senders;                 /* See CHAT_FEATURE_SENDER_IDS. */
+
+static bool is_utf8(const char *str)
+{
+    size_t nul;
+
+    return utf8_scan((const unsigned char *)str, strlen(str), &nul, 1) == 0;
+}
 
 int scan_arguments(struct prog_args *pargs, int argc, char *argv[])
 {
     if (argc < 4) {
-        eprintf("usage: %s server_addr server_port username\n", argv[0]);
+        eprintf("usage: %s server_addr server_port username [protocol]\n",
+                argv[0]);
         return -1;
     }
 
     pargs->addr      = argv[1];
     pargs->port      = argv[2];
     pargs->username  = argv[3];
+    pargs->protocol  = CHAT_PROTOCOL_LATEST;
+
+    if (argc > 4) {
+        pargs->protocol = atoi(argv[4]);
+        if (pargs->protocol < CHAT_PROTOCOL_V1 ||
+                pargs->protocol > CHAT_PROTOCOL_LATEST) {
+            eprintf("Protocol version must be from %u to %u.\n",
+                    CHAT_PROTOCOL_V1, CHAT_PROTOCOL_LATEST);
+            return -1;
+        }
+    }
 
     if (strlen(pargs->username) > CHAT_MEMBER_NAME_MAX_LEN) {
         eprintf("Username %s is too long (max %d chars).\n",
@@ -45,6 +95,11 @@ int scan_arguments(struct prog_args *pargs, int argc, char *argv[])
         return -1;
     }
 
+    if (!is_utf8(pargs->username)) {
+        eprintf("Username must be valid UTF-8.\n");
+        return -1;
+    }
+
     return 0;
 }
 
@@ -66,7 +121,7 @@ static struct net_endpoint *connect_server(const char *addr, const char *port)
         return NULL;
     }
 
-    for (addrinfo = res; addrinfo != NULL; addrinfo = res->ai_next) {
+    for (addrinfo = res; addrinfo != NULL; addrinfo = addrinfo->ai_next) {
         sockfd = err = socket(addrinfo->ai_family, addrinfo->ai_socktype,
                 addrinfo->ai_protocol);
         if (err == -1) {
@@ -91,6 +146,13 @@ static struct net_endpoint *connect_server(const char *addr, const char *port)
         return NULL;
     }
 
+    /* Connect blocks, but all further I/O must not. */
+    if (fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        close(sockfd);
+        return NULL;
+    }
+
     server = net_endpoint_new(sockfd);
     if (!server) {
         close(sockfd);
@@ -104,30 +166,41 @@ static void disconnect_server(struct net_endpoint *server)
 {
     close(server->fd);
     net_endpoint_destroy(server);
+
+    if (compressed) {
+        compression_deinit(&compression);
+        compressed = false;
+    }
 }
 
-static int send_chat_message(struct net_endpoint *server, const struct chat_message *chat_msg)
+/**
+ * @brief Compress a message to the server if compression was negotiated.
+ *
+ * @param netmsg Message; the reference of the caller is consumed.
+ *
+ * @return Message to send or NULL on error.
+ */
+static struct net_message *pack(struct net_message *netmsg)
 {
-    struct net_message *net_msg;
-    char buffer[1024];
-    int n, ret = 0;
-
-    buffer[0] = CHAT_MESSAGE;
-    n = chat_message_to_network(chat_msg, buffer + 1, sizeof(buffer) - 1);
-    if (n == -1) {
-        log_debug("Chat message serialisation buffer too small (%zu).\n",
-                sizeof(buffer)); 
-        return -1;
-    }
+    struct net_message *packed;
 
-    net_msg = net_message_new();
-    if (!net_msg) {
-        return -1;
+    if (!netmsg || !compressed) {
+        return netmsg;
     }
 
-    if (net_message_set_body(net_msg, buffer, 1 + n) == -1) {
-        log_debug("Network message body is too long!\n");
-        net_message_unref(net_msg);
+    packed = chat_compress(&compression, netmsg);
+    net_message_unref(netmsg);
+    return packed;
+}
+
+static int send_chat_message(struct net_endpoint *server, const char *message)
+{
+    struct net_message *net_msg;
+    int ret = 0;
+
+    net_msg = pack(chat_channel_message_build(protocol, channel, username, message));
+    if (!net_msg) {
+        log_debug("Unable to create network message: %s\n", strerror(errno));
         return -1;
     }
 
@@ -141,37 +214,251 @@ static int send_chat_message(struct net_endpoint *server, const struct chat_mess
     return ret;
 }
 
-static int join_chat(struct net_endpoint *server)
+/**
+ * @brief Queue a message to the server and send what fits in the socket;
+ *        the main loop sends the rest.
+ *
+ * @param netmsg Message; the reference of the caller is consumed.
+ */
+static int send_now(struct net_endpoint *server, struct net_message *netmsg)
 {
-    struct chat_member_join join = {0};
-    struct net_message *netmsg;
-    char buffer[1024];
-    int len;
-
-    strcpy(join.sender, username);
-
-    buffer[0] = CHAT_MEMBER_JOIN;
-    len = chat_member_join_to_network(&join, buffer + 1, sizeof(buffer) - 1);
+    if (!netmsg) {
+        return -1;
+    }
 
-    netmsg = net_message_new();
-    net_message_set_body(netmsg, buffer, len + 1);
     net_enqueue_message(server, netmsg);
     net_message_unref(netmsg);
 
-    while ((len = net_process_send(server)) > 0)
-        ;
-    
-    if (len == -1) {
+    if (net_process_send(server) == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int join_chat(struct net_endpoint *server)
+{
+    if (send_now(server, pack(chat_member_join_build(protocol, username))) == -1) {
         perror("Unable to join chat");
         return -1;
     }
 
+    joined = true;
+    return 0;
+}
+
+/**
+ * @brief Start the connection: join right away in v1, or offer a later
+ *        version and join once the server has answered.
+ */
+static int greet_server(struct net_endpoint *server, unsigned version)
+{
+    if (version == CHAT_PROTOCOL_V1) {
+        return join_chat(server);
+    }
+
+    if (send_now(server, chat_hello_build(version, CHAT_SUPPORTED_FEATURES)) == -1) {
+        perror("Unable to greet server");
+        return -1;
+    }
+
     return 0;
 }
 
+/**
+ * @brief Start sending a file, one chunk at a time whenever the send queue
+ *        is empty, see send_next_chunk.
+ */
+static void start_upload(struct net_endpoint *server, const char *path)
+{
+    int lowat = UPLOAD_NOTSENT_LOWAT;
+
+    if (protocol < CHAT_PROTOCOL_V2) {
+        log_error("Sending files needs protocol version 2.\n");
+        return;
+    }
+
+    if (upload.fd != -1) {
+        log_error("Already sending %s.\n", upload.name);
+        return;
+    }
+
+    if (upload_open(&upload, path, num_uploads++) == -1) {
+        log_error("Unable to send %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    if (setsockopt(server->fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat,
+                sizeof(lowat)) == -1) {
+        log_debug("TCP_NOTSENT_LOWAT unavailable: %s\n", strerror(errno));
+    }
+
+    log_info("Sending %s (%u bytes)...\n", upload.name, (unsigned)upload.size);
+}
+
+/**
+ * @brief Queue the next chunk of the file being sent.
+ */
+static void send_next_chunk(struct net_endpoint *server)
+{
+    struct net_message *chunk;
+
+    chunk = pack(upload_next_chunk(&upload, protocol, username));
+    if (!chunk || net_enqueue_message(server, chunk) == -1) {
+        log_error("Unable to send %s: %s\n", upload.name, strerror(errno));
+        if (chunk) {
+            net_message_unref(chunk);
+        }
+        upload_close(&upload);
+        return;
+    }
+    net_message_unref(chunk);
+
+    if (upload_done(&upload)) {
+        log_info("Sent %s.\n", upload.name);
+        upload_close(&upload);
+    }
+}
+
+/**
+ * @brief Join a channel, to talk in it once the server confirms.
+ */
+static void join_channel(struct net_endpoint *server, const char *name)
+{
+    if (protocol < CHAT_PROTOCOL_V2) {
+        log_error("Channels need protocol version 2.\n");
+        return;
+    }
+
+    if (name[0] == '\0' || strlen(name) > CHAT_CHANNEL_NAME_MAX_LEN ||
+            !is_utf8(name)) {
+        log_error("Channel names are 1 to %d bytes of UTF-8.\n",
+                CHAT_CHANNEL_NAME_MAX_LEN);
+        return;
+    }
+
+    if (send_now(server, pack(chat_channel_join_build(protocol, name,
+                        username))) == -1) {
+        log_error("Unable to join %s: %s\n", name, strerror(errno));
+    }
+}
+
+/**
+ * @brief Part the channel talked in, to go back to the lobby once the
+ *        server confirms.
+ */
+static void part_channel(struct net_endpoint *server)
+{
+    if (channel[0] == '\0') {
+        log_error("Not in a channel.\n");
+        return;
+    }
+
+    if (send_now(server, pack(chat_channel_part_build(protocol, channel,
+                        username))) == -1) {
+        log_error("Unable to part %s: %s\n", channel, strerror(errno));
+    }
+}
+
+/**
+ * @brief Send a direct message, given as "NAME TEXT".
+ */
+static void send_direct_message(struct net_endpoint *server, const char *args)
+{
+    const char *text = strchr(args, ' ');
+    char recipient[CHAT_MEMBER_NAME_MAX_LEN + 1];
+    struct net_message *msg;
+
+    if (protocol < CHAT_PROTOCOL_V2) {
+        log_error("Direct messages need protocol version 2.\n");
+        return;
+    }
+
+    if (!text || text == args || text - args > CHAT_MEMBER_NAME_MAX_LEN) {
+        log_error("Usage: " MSG_COMMAND "NAME TEXT\n");
+        return;
+    }
+
+    memcpy(recipient, args, text - args);
+    recipient[text - args] = '\0';
+    text++;
+
+    msg = pack(chat_direct_message_build(protocol, recipient, username, text));
+    if (!msg || net_enqueue_message(server, msg) == -1) {
+        log_error("Failed to send direct message.\n");
+    }
+    else {
+        ui_message_fg(UI_FG_MAGENTA);
+        ui_message_printf("-> %s: %s\n", recipient, text);
+        ui_message_fg(UI_FG_DEFAULT);
+    }
+
+    if (msg) {
+        net_message_unref(msg);
+    }
+}
+
+/**
+ * @brief Search the history of the server for messages with all the given
+ *        words.
+ */
+static void search_history(struct net_endpoint *server, const char *query)
+{
+    if (protocol < CHAT_PROTOCOL_V2) {
+        log_error("Searching needs protocol version 2.\n");
+        return;
+    }
+
+    if (query[0] == '\0') {
+        log_error("Usage: " SEARCH_COMMAND "WORDS\n");
+        return;
+    }
+
+    if (send_now(server, pack(chat_search_build(protocol, query, 0))) == -1) {
+        log_error("Unable to search: %s\n", strerror(errno));
+    }
+}
+
+/**
+ * @brief Ask the server for the messages since a time of day, "HH:MM", the
+ *        last one that has been.
+ */
+static void request_history(struct net_endpoint *server, const char *since)
+{
+    struct chat_history range = { 0 };
+    unsigned hours, minutes;
+    time_t now = time(NULL);
+    struct tm tm = *localtime(&now);
+    time_t start;
+
+    if (protocol < CHAT_PROTOCOL_V2) {
+        log_error("The history needs protocol version 2.\n");
+        return;
+    }
+
+    if (sscanf(since, "%u:%u", &hours, &minutes) != 2 || hours > 23 ||
+            minutes > 59) {
+        log_error("Usage: " SINCE_COMMAND "HH:MM\n");
+        return;
+    }
+
+    tm.tm_hour = hours;
+    tm.tm_min = minutes;
+    tm.tm_sec = 0;
+    start = mktime(&tm);
+    if (start > now) {
+        tm.tm_mday--;
+        start = mktime(&tm);
+    }
+
+    range.time = start;
+    if (send_now(server, pack(chat_history_request_build(protocol, &range))) == -1) {
+        log_error("Unable to ask for the history: %s\n", strerror(errno));
+    }
+}
+
 static int handle_user_input(struct net_endpoint *server)
 {
-    struct chat_message chat_msg;
     char *line;
     int err;
 
@@ -180,49 +467,263 @@ static int handle_user_input(struct net_endpoint *server)
         return 0;
     }
     
+    if (!joined) {
+        log_info("Not in the chat yet, message not sent.\n");
+        free(line);
+        return 0;
+    }
+
     if (line[0] == '\0') {
         log_debug("User entered empty message\n");
         return 0;
     }
 
+    if (strncmp(line, SEND_COMMAND, strlen(SEND_COMMAND)) == 0) {
+        start_upload(server, line + strlen(SEND_COMMAND));
+        free(line);
+        return 0;
+    }
+
+    if (strncmp(line, JOIN_COMMAND, strlen(JOIN_COMMAND)) == 0) {
+        join_channel(server, line + strlen(JOIN_COMMAND));
+        free(line);
+        return 0;
+    }
+
+    if (strcmp(line, PART_COMMAND) == 0) {
+        part_channel(server);
+        free(line);
+        return 0;
+    }
+
+    if (strncmp(line, SINCE_COMMAND, strlen(SINCE_COMMAND)) == 0) {
+        request_history(server, line + strlen(SINCE_COMMAND));
+        free(line);
+        return 0;
+    }
+
     log_debug("User entered message: %s", line);
 
-    /* Create a new chat message. */
-    strcpy(chat_msg.sender, username);
-    strncpy(chat_msg.message, line, CHAT_MESSAGE_MAX_LEN);
-    chat_msg.message[CHAT_MESSAGE_MAX_LEN] = '\0';
-    free(line);
+    /* The server drops clients that send invalid UTF-8. */
+    if (!is_utf8(line)) {
+        log_error("Message is not valid UTF-8, not sent.\n");
+        free(line);
+        return 0;
+    }
+
+    line[utf8_truncate(line, CHAT_MESSAGE_MAX_LEN)] = '\0';
 
-    if (send_chat_message(server, &chat_msg) != 0) {
+    if (strncmp(line, MSG_COMMAND, strlen(MSG_COMMAND)) == 0) {
+        send_direct_message(server, line + strlen(MSG_COMMAND));
+    }
+    else if (strncmp(line, SEARCH_COMMAND, strlen(SEARCH_COMMAND)) == 0) {
+        search_history(server, line + strlen(SEARCH_COMMAND));
+    }
+    else if (send_chat_message(server, line) != 0) {
         log_error("Failed to send chat message.\n");
     }
 
+    free(line);
+
     return 0;
 }
 
-static void handle_new_chat_message(const struct chat_message *cm)
+static void handle_new_chat_message(const struct chat_view *view)
+{
+    if (view->channel.len > 0) {
+        ui_message_printf("[%.*s] ", (int)view->channel.len, view->channel.data);
+    }
+    ui_message_printf("%.*s: %.*s\n", (int)view->sender.len, view->sender.data,
+            (int)view->message.len, view->message.data);
+}
+
+static void handle_direct_message(const struct chat_view *view)
+{
+    ui_message_fg(UI_FG_MAGENTA);
+    ui_message_printf("%.*s -> you: %.*s\n", (int)view->sender.len,
+            view->sender.data, (int)view->message.len, view->message.data);
+    ui_message_fg(UI_FG_DEFAULT);
+}
+
+/**
+ * @brief Show a member joining or leaving a channel. The server confirms
+ *        our own joins and parts with these.
+ */
+static void handle_channel_event(const struct chat_view *view)
+{
+    if (view->sender.len == strlen(username) &&
+            !memcmp(view->sender.data, username, view->sender.len)) {
+        if (view->type == CHAT_CHANNEL_JOIN) {
+            memcpy(channel, view->channel.data, view->channel.len);
+            channel[view->channel.len] = '\0';
+        }
+        else if (view->channel.len == strlen(channel) &&
+                !memcmp(view->channel.data, channel, view->channel.len)) {
+            channel[0] = '\0';
+        }
+    }
+
+    ui_message_fg(UI_FG_CYAN);
+    ui_message_printf("%.*s %s %.*s.\n", (int)view->sender.len, view->sender.data,
+            view->type == CHAT_CHANNEL_JOIN ? "joined" : "left",
+            (int)view->channel.len, view->channel.data);
+    ui_message_fg(UI_FG_DEFAULT);
+}
+
+static void handle_history_entry(const struct chat_view *view)
 {
-    ui_message_printf("%s: %s\n", cm->sender, cm->message); 
+    time_t time = view->history.time;
+    char date[32];
+
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M", localtime(&time));
+    ui_message_fg(UI_FG_YELLOW);
+    ui_message_printf("%s ", date);
+    if (view->channel.len > 0) {
+        ui_message_printf("[%.*s] ", (int)view->channel.len, view->channel.data);
+    }
+    ui_message_printf("%.*s: %.*s\n", (int)view->sender.len, view->sender.data,
+            (int)view->message.len, view->message.data);
+    ui_message_fg(UI_FG_DEFAULT);
 }
 
-static void handle_new_chat_member_join(const struct chat_member_join *cm)
+static void handle_history_end(const struct chat_view *view)
+{
+    ui_message_fg(UI_FG_YELLOW);
+    ui_message_printf("%u message%s found.\n", view->history.count,
+            view->history.count == 1 ? "" : "s");
+    ui_message_fg(UI_FG_DEFAULT);
+}
+
+static void handle_new_chat_member_join(const struct chat_view *view)
 {
     ui_message_fg(UI_FG_CYAN);
-    ui_message_printf("%s joined. Say hi!\n", cm->sender);
+    ui_message_printf("%.*s joined. Say hi!\n", (int)view->sender.len,
+            view->sender.data);
     ui_message_fg(UI_FG_DEFAULT);
 }
 
-static void handle_new_chat_member_leave(const struct chat_member_leave *cm)
+static void handle_new_chunk(const struct chat_view *view)
+{
+    const struct download *dl;
+
+    switch (downloads_receive(&downloads, view, &dl)) {
+    case DOWNLOAD_STARTED:
+        ui_message_fg(UI_FG_CYAN);
+        ui_message_printf("%s is sending %s (%u bytes).\n", dl->sender, dl->name,
+                (unsigned)dl->size);
+        ui_message_fg(UI_FG_DEFAULT);
+        break;
+    case DOWNLOAD_RECEIVING:
+        break;
+    case DOWNLOAD_DONE:
+        ui_message_fg(UI_FG_CYAN);
+        ui_message_printf("Received %s from %s, saved as %s.\n", dl->name,
+                dl->sender, dl->path);
+        ui_message_fg(UI_FG_DEFAULT);
+        break;
+    case DOWNLOAD_FAILED:
+        /* Report a transfer once, not for every chunk after a failure. */
+        if (view->chunk.offset == 0 || dl->path[0]) {
+            log_error("Failed to receive %s from %s.\n", dl->name, dl->sender);
+        }
+        break;
+    }
+}
+
+static void handle_new_chat_member_leave(const struct chat_view *view)
 {
+    if (downloads_abort_sender(&downloads, &view->sender) > 0) {
+        log_error("%.*s left before sending everything.\n",
+                (int)view->sender.len, view->sender.data);
+    }
+
     ui_message_fg(UI_FG_CYAN);
-    ui_message_printf("%s left.\n", cm->sender);
+    ui_message_printf("%.*s left.\n", (int)view->sender.len, view->sender.data);
     ui_message_fg(UI_FG_DEFAULT);
 }
 
-static int handle_server_input(struct net_endpoint *server)
+/**
+ * @brief Keep the names of the members by id up to date, and name the
+ *        sender of a message that only has its id.
+ */
+static void track_sender(struct chat_view *view)
+{
+    static char unknown[16];
+    const char *name;
+
+    if (!view->sender_id) {
+        return;
+    }
+
+    switch (view->type) {
+    case CHAT_MEMBER_JOIN:
+    case CHAT_MEMBER_INFO:
+        if (id_table_set(&senders, view->sender_id, view->sender.data,
+                    view->sender.len) == -1) {
+            log_error("Out of memory\n");
+        }
+        return;
+    case CHAT_MEMBER_LEAVE:
+        id_table_remove(&senders, view->sender_id);
+        return;
+    default:
+        break;
+    }
+
+    if (view->sender.len > 0) {
+        return;
+    }
+
+    name = id_table_find(&senders, view->sender_id);
+    if (!name) {
+        /* Its join was dropped on the way. */
+        snprintf(unknown, sizeof(unknown), "#%u", (unsigned)view->sender_id);
+        name = unknown;
+    }
+    view->sender = (struct chat_field){ name, strlen(name) };
+}
+
+/**
+ * @brief Switch to the version the server chose and join the chat.
+ */
+static int handle_hello(struct net_endpoint *server,
+        const struct chat_view *view)
+{
+    if (joined || view->version < CHAT_PROTOCOL_V1 ||
+            view->version > CHAT_PROTOCOL_LATEST) {
+        log_error("Received an unexpected hello.\n");
+        return -1;
+    }
+
+    protocol = view->version;
+    log_debug("Server speaks protocol v%u, features %#x\n", protocol,
+            (unsigned)view->features);
+
+    if (view->features & ~CHAT_SUPPORTED_FEATURES) {
+        log_error("Server chose features that were not offered.\n");
+        return -1;
+    }
+
+    if (view->features & CHAT_FEATURE_COMPRESSION) {
+        if (chat_compression_init(&compression) == -1) {
+            return -1;
+        }
+        compressed = true;
+    }
+
+    return join_chat(server);
+}
+
+/**
+ * @brief Receive and handle one message from the server.
+ *
+ * @return 1 if a message was handled, 0 if none is complete yet, -1 if the
+ *         connection should be closed.
+ */
+static int receive_server_message(struct net_endpoint *server)
 {
     struct net_message *msg;
-    union chat_object cm;
+    struct chat_view view;
     int rc, type;
 
     rc = net_receive(server, &msg);
@@ -239,28 +740,81 @@ static int handle_server_input(struct net_endpoint *server)
         return -1;
     }
 
-    type = network_to_chat_object(&cm, net_message_body(msg),
+    if (compressed && chat_is_compressed(protocol, net_message_body(msg),
+                net_message_body_length(msg))) {
+        struct net_message *inflated = chat_decompress(&compression,
+                net_message_body(msg), net_message_body_length(msg));
+
+        net_message_unref(msg);
+        if (!inflated) {
+            log_error("Received corrupted compressed message.\n");
+            return -1;
+        }
+        msg = inflated;
+    }
+
+    type = chat_view_decode(&view, protocol, net_message_body(msg),
             net_message_body_length(msg));
-    net_message_unref(msg);
 
     if (type == -1) {
+        net_message_unref(msg);
         log_error("Received corrupted message.\n");
         return -1;
     }
 
+    track_sender(&view);
+
     switch ((enum chat_object_type) type) {
     case CHAT_MESSAGE:
-        handle_new_chat_message(&cm.chat);
+        handle_new_chat_message(&view);
         break;
     case CHAT_MEMBER_JOIN:
-        handle_new_chat_member_join(&cm.join);
+        handle_new_chat_member_join(&view);
         break;
     case CHAT_MEMBER_LEAVE:
-        handle_new_chat_member_leave(&cm.leave);
+        handle_new_chat_member_leave(&view);
+        break;
+    case CHAT_HELLO:
+        rc = handle_hello(server, &view);
+        break;
+    case CHAT_CHUNK:
+        handle_new_chunk(&view);
+        break;
+    case CHAT_CHANNEL_JOIN:
+    case CHAT_CHANNEL_PART:
+        handle_channel_event(&view);
+        break;
+    case CHAT_DIRECT_MESSAGE:
+        handle_direct_message(&view);
+        break;
+    case CHAT_MEMBER_INFO:
+        /* Nothing to show, see track_sender. */
+        break;
+    case CHAT_HISTORY_ENTRY:
+        handle_history_entry(&view);
+        break;
+    case CHAT_HISTORY_END:
+        handle_history_end(&view);
+        break;
+    case CHAT_SEARCH:
+    case CHAT_HISTORY_REQUEST:
+        log_info("Received an illegal chat object from server.\n");
         break;
     }
 
-    return 0;
+    net_message_unref(msg);
+    return rc < 0 ? -1 : 1;
+}
+
+static int handle_server_input(struct net_endpoint *server)
+{
+    int rc;
+
+    /* Handle everything that has arrived. */
+    while ((rc = receive_server_message(server)) > 0)
+        ;
+
+    return rc;
 }
 
 int main_loop(struct net_endpoint *server)
@@ -274,6 +828,10 @@ int main_loop(struct net_endpoint *server)
     int pollret, err;
 
     while (!should_exit) {
+        if (server->send_queue_count > 0 || upload.fd != -1) {
+            serverpoll->events |= POLLOUT;
+        }
+
         pollret = poll(fds, 2, -1);
         if (pollret == -1) {
             if (errno != EINTR) {
@@ -290,25 +848,28 @@ int main_loop(struct net_endpoint *server)
             }
         }
 
-        if (serverpoll->revents & POLLIN) {
+        if (serverpoll->revents & (POLLIN | POLLERR | POLLHUP)) {
             err = handle_server_input(server);
             if (err) {
                 return err;
             }
         }
 
-        if (server->send_queue_count > 0) {
-            serverpoll->events |= POLLOUT;
-        }
-
         if (serverpoll->revents & POLLOUT) {
             int queue_len = net_process_send(server);
+
+            /* A chunk only goes out once everything before it has. */
+            if (queue_len == 0 && upload.fd != -1) {
+                send_next_chunk(server);
+                queue_len = net_process_send(server);
+            }
+
             if (queue_len < 0) {
                 if (errno != EAGAIN && errno != EWOULDBLOCK) {
                     log_error("Unable to send to server: %s\n", strerror(errno));
                 }
             }
-            else if (queue_len == 0) {
+            else if (queue_len == 0 && upload.fd == -1) {
                 /* nothing more to send at this time. */
                 serverpoll->events &= ~POLLOUT;
             }
@@ -334,6 +895,11 @@ int main(int argc, char *argv[])
     }
 
     strcpy(username, pargs.username);
+    downloads_init(&downloads, ".");
+    if (id_table_init(&senders) == -1) {
+        eprintf("Out of memory\n");
+        return EXIT_FAILURE;
+    }
 
     signal(SIGINT, on_exit_signal);
     signal(SIGTERM, on_exit_signal);
@@ -344,7 +910,7 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    if (join_chat(server) == -1) {
+    if (greet_server(server, pargs.protocol) == -1) {
         eprintf("Failed to join chat.\n");
         disconnect_server(server);
         return EXIT_SUCCESS;
@@ -356,6 +922,9 @@ int main(int argc, char *argv[])
     log_info("Exiting...\n");
 
     ui_deinit();
+    upload_close(&upload);
+    downloads_deinit(&downloads);
+    id_table_deinit(&senders);
     disconnect_server(server);
 
     return 0;
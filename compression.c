@@ -0,0 +1,128 @@
+#include <errno.h>
+#include <string.h>
+
+#include "compression.h"
+#include "log.h"
+
+/* The empty stored block that ends a flush. */
+static const unsigned char flush_tail[] = { 0x00, 0x00, 0xff, 0xff };
+
+int compression_init(struct compression *comp, const void *dictionary,
+        unsigned dictionary_len)
+{
+    int rc;
+
+    memset(comp, 0, sizeof(*comp));
+
+    /* Negative window bits for raw deflate, without header or checksum. */
+    rc = deflateInit2(&comp->deflate, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+            -COMPRESSION_WINDOW_BITS, COMPRESSION_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+    if (rc != Z_OK) {
+        goto error;
+    }
+    comp->deflate_ready = true;
+
+    rc = inflateInit2(&comp->inflate, -COMPRESSION_WINDOW_BITS);
+    if (rc != Z_OK) {
+        goto error;
+    }
+    comp->inflate_ready = true;
+
+    if (dictionary_len) {
+        rc = deflateSetDictionary(&comp->deflate, dictionary, dictionary_len);
+        if (rc == Z_OK) {
+            rc = inflateSetDictionary(&comp->inflate, dictionary,
+                    dictionary_len);
+        }
+        if (rc != Z_OK) {
+            goto error;
+        }
+    }
+
+    return 0;
+
+error:
+    log_error("Unable to initialise compression: %s\n", zError(rc));
+    compression_deinit(comp);
+    errno = rc == Z_MEM_ERROR ? ENOMEM : EINVAL;
+    return -1;
+}
+
+void compression_deinit(struct compression *comp)
+{
+    if (comp->deflate_ready) {
+        deflateEnd(&comp->deflate);
+        comp->deflate_ready = false;
+    }
+
+    if (comp->inflate_ready) {
+        inflateEnd(&comp->inflate);
+        comp->inflate_ready = false;
+    }
+}
+
+int compression_deflate(struct compression *comp, const void *data,
+        unsigned len, void *out, unsigned out_size)
+{
+    z_stream *strm = &comp->deflate;
+    unsigned produced;
+
+    strm->next_in = (Bytef *)data;
+    strm->avail_in = len;
+    strm->next_out = out;
+    strm->avail_out = out_size;
+
+    /*
+     * A sync flush puts everything out and ends on a byte boundary. Room
+     * left over means the flush is complete.
+     */
+    if (deflate(strm, Z_SYNC_FLUSH) != Z_OK || strm->avail_in || !strm->avail_out) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    produced = out_size - strm->avail_out;
+    if (produced < sizeof(flush_tail) ||
+            memcmp((unsigned char *)out + produced - sizeof(flush_tail),
+                flush_tail, sizeof(flush_tail))) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    return produced - sizeof(flush_tail);
+}
+
+int compression_inflate(struct compression *comp, const void *data,
+        unsigned len, void *out, unsigned out_size)
+{
+    z_stream *strm = &comp->inflate;
+    int rc;
+
+    strm->next_out = out;
+    strm->avail_out = out_size;
+
+    strm->next_in = (Bytef *)data;
+    strm->avail_in = len;
+    rc = inflate(strm, Z_SYNC_FLUSH);
+
+    if (rc == Z_OK || (rc == Z_BUF_ERROR && !strm->avail_in && strm->avail_out)) {
+        strm->next_in = (Bytef *)flush_tail;
+        strm->avail_in = sizeof(flush_tail);
+        rc = inflate(strm, Z_SYNC_FLUSH);
+    }
+
+    /*
+     * Everything given must be consumed and the output must have stopped
+     * short of the end: a full buffer could mean there is more to come.
+     */
+    if ((rc != Z_OK && rc != Z_BUF_ERROR) || strm->avail_in) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (!strm->avail_out) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    return out_size - strm->avail_out;
+}
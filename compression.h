@@ -0,0 +1,72 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <stdbool.h>
+
+#include <zlib.h>
+
+/*
+ * Streaming compression of the messages of one connection with raw
+ * deflate, one context per direction.
+ *
+ * The contexts live as long as the connection, so every message is
+ * compressed against the ones before it, and both are primed with the same
+ * dictionary so that even the first messages find something to refer to.
+ * Every message is flushed on its own, so it can be decompressed as soon
+ * as it arrives and nothing waits for more data. The empty block that ends
+ * a flush (00 00 ff ff) is left out on the wire and put back before
+ * decompressing.
+ *
+ * Since the receiver's context follows the sender's, every compressed
+ * message must be delivered, in order.
+ */
+
+/* Window of 4 KiB: about 40 KiB of memory per connection. */
+#define COMPRESSION_WINDOW_BITS         12
+#define COMPRESSION_MEM_LEVEL           4
+
+/* Most bytes compressed data can take beyond the original. */
+#define COMPRESSION_MAX_OVERHEAD        32u
+
+struct compression {
+    z_stream deflate;
+    z_stream inflate;
+    bool deflate_ready;
+    bool inflate_ready;
+};
+
+/**
+ * @brief Initialise the contexts of a connection.
+ *
+ * @param dictionary Data both sides prime their contexts with.
+ *
+ * @return 0 on success, -1 on error (errno ENOMEM on memory allocation
+ *         error, EINVAL if zlib rejects the parameters or dictionary).
+ */
+int compression_init(struct compression *comp, const void *dictionary,
+        unsigned dictionary_len);
+
+void compression_deinit(struct compression *comp);
+
+/**
+ * @brief Compress the next message of the stream.
+ *
+ * @param out Buffer of at least len + COMPRESSION_MAX_OVERHEAD bytes.
+ *
+ * @return Length of the compressed data or -1 on error, after which the
+ *         stream is unusable.
+ */
+int compression_deflate(struct compression *comp, const void *data,
+        unsigned len, void *out, unsigned out_size);
+
+/**
+ * @brief Decompress the next message of the stream.
+ *
+ * @return Length of the original data, or -1 if data is corrupt or the
+ *         original does not fit in out_size bytes (errno EPROTO or
+ *         EMSGSIZE). The stream is unusable after an error.
+ */
+int compression_inflate(struct compression *comp, const void *data,
+        unsigned len, void *out, unsigned out_size);
+
+#endif /* COMPRESSION_H */
@@ -0,0 +1,147 @@
+#include <stdlib.h>
+#include <errno.h>
+
+#include "conn_table.h"
+
+#define CONN_TABLE_INITIAL_SLOTS                16u
+#define CONN_TABLE_NO_SLOT                      ((unsigned)-1)
+
+/**
+ * @brief Grow the slot array and push the new slots to the free list.
+ *
+ * @return 0 on success, -1 if the table cannot grow.
+ */
+static int conn_table_grow(struct conn_table *table)
+{
+    struct conn_slot *slots;
+    unsigned *dense;
+    unsigned new_num;
+
+    if (table->num_slots == table->max_slots) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    new_num = table->num_slots ? table->num_slots * 2 : CONN_TABLE_INITIAL_SLOTS;
+    if (new_num > table->max_slots) {
+        new_num = table->max_slots;
+    }
+
+    slots = realloc(table->slots, new_num * sizeof(*slots));
+    if (!slots) {
+        errno = ENOMEM;
+        return -1;
+    }
+    table->slots = slots;
+
+    dense = realloc(table->dense, new_num * sizeof(*dense));
+    if (!dense) {
+        errno = ENOMEM;
+        return -1;
+    }
+    table->dense = dense;
+
+    /* Chain the new slots in index order in front of the free list. */
+    for (unsigned i = new_num; i-- > table->num_slots; ) {
+        slots[i].value = NULL;
+        slots[i].generation = 1;
+        slots[i].link = table->free_head;
+        table->free_head = i;
+    }
+
+    table->num_slots = new_num;
+    return 0;
+}
+
+int conn_table_init(struct conn_table *table, unsigned max_entries)
+{
+    table->slots = NULL;
+    table->dense = NULL;
+    table->count = 0;
+    table->num_slots = 0;
+    table->max_slots = max_entries;
+    table->free_head = CONN_TABLE_NO_SLOT;
+
+    if (max_entries > 0 && conn_table_grow(table) == -1) {
+        conn_table_deinit(table);
+        return -1;
+    }
+
+    return 0;
+}
+
+void conn_table_deinit(struct conn_table *table)
+{
+    free(table->slots);
+    free(table->dense);
+    table->slots = NULL;
+    table->dense = NULL;
+    table->count = 0;
+    table->num_slots = 0;
+}
+
+int conn_table_insert(struct conn_table *table, void *value,
+        struct conn_handle *handle)
+{
+    struct conn_slot *slot;
+    unsigned index;
+
+    if (table->free_head == CONN_TABLE_NO_SLOT && conn_table_grow(table) == -1) {
+        return -1;
+    }
+
+    index = table->free_head;
+    slot = &table->slots[index];
+    table->free_head = slot->link;
+
+    slot->value = value;
+    slot->link = table->count;
+    table->dense[table->count++] = index;
+
+    handle->index = index;
+    handle->generation = slot->generation;
+    return 0;
+}
+
+void *conn_table_get(const struct conn_table *table, struct conn_handle handle)
+{
+    const struct conn_slot *slot;
+
+    if (handle.index >= table->num_slots) {
+        return NULL;
+    }
+
+    slot = &table->slots[handle.index];
+    if (slot->generation != handle.generation || !slot->value) {
+        return NULL;
+    }
+
+    return slot->value;
+}
+
+int conn_table_remove(struct conn_table *table, struct conn_handle handle)
+{
+    struct conn_slot *slot;
+    unsigned pos, last;
+
+    if (!conn_table_get(table, handle)) {
+        return -1;
+    }
+
+    slot = &table->slots[handle.index];
+
+    /* Swap-remove from the dense array. */
+    pos = slot->link;
+    last = table->dense[--table->count];
+    table->dense[pos] = last;
+    table->slots[last].link = pos;
+
+    slot->value = NULL;
+    if (++slot->generation == 0) {
+        slot->generation = 1;
+    }
+    slot->link = table->free_head;
+    table->free_head = handle.index;
+
+    return 0;
+}
@@ -0,0 +1,86 @@
+#ifndef CONN_TABLE_H
+#define CONN_TABLE_H
+
+/*
+ * Connection table: a growable slot array with a free list. Entries are
+ * addressed by handles that stay valid until the entry is removed; a handle
+ * of a removed entry is detected as stale by its generation. Live entries
+ * are also kept in a dense array for iteration.
+ */
+
+struct conn_handle {
+    unsigned index;
+    unsigned generation;        /* Never zero for a valid handle. */
+};
+
+struct conn_slot {
+    void *value;
+    unsigned generation;
+    unsigned link;              /* Dense index if in use, else next free slot. */
+};
+
+struct conn_table {
+    struct conn_slot *slots;
+    unsigned *dense;            /* Slot indices of live entries. */
+    unsigned count;             /* Number of live entries. */
+    unsigned num_slots;         /* Number of allocated slots. */
+    unsigned max_slots;
+    unsigned free_head;
+};
+
+/**
+ * @brief Initialise an empty connection table.
+ *
+ * @param table Connection table.
+ * @param max_entries Maximum number of live entries.
+ *
+ * @return 0 on success, -1 on memory allocation error.
+ */
+int conn_table_init(struct conn_table *table, unsigned max_entries);
+
+void conn_table_deinit(struct conn_table *table);
+
+/**
+ * @brief Insert an entry.
+ *
+ * @param table Connection table.
+ * @param value Non-NULL value of the entry.
+ * @param handle Storage for the handle of the new entry.
+ *
+ * @return 0 on success, -1 on error (errno ENOSPC if the table is at
+ *         capacity, ENOMEM on memory allocation error).
+ */
+int conn_table_insert(struct conn_table *table, void *value,
+        struct conn_handle *handle);
+
+/**
+ * @brief Look up an entry.
+ *
+ * @return Value of the entry or NULL if the handle is stale.
+ */
+void *conn_table_get(const struct conn_table *table, struct conn_handle handle);
+
+/**
+ * @brief Remove an entry in constant time.
+ *
+ * @note Removal moves the last entry of the dense array into the hole, so
+ * removing during iteration with conn_table_at() skips an entry.
+ *
+ * @return 0 on success, -1 if the handle is stale.
+ */
+int conn_table_remove(struct conn_table *table, struct conn_handle handle);
+
+static inline unsigned conn_table_count(const struct conn_table *table)
+{
+    return table->count;
+}
+
+/**
+ * @brief Get the i:th live entry, 0 <= i < conn_table_count(table).
+ */
+static inline void *conn_table_at(const struct conn_table *table, unsigned i)
+{
+    return table->slots[table->dense[i]].value;
+}
+
+#endif /* CONN_TABLE_H */
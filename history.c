@@ -0,0 +1,1360 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
+
+#include "history.h"
+#include "network.h"
+#include "log.h"
+
+/* Records are gathered in a buffer of this size for each write. */
+#define HISTORY_BUFFER_BYTES            (256 * 1024)
+
+/* Wait before writing the buffer again after a write failed. */
+#define HISTORY_RETRY_MS                1000u
+
+/* Marks in an index file: id (8) | timestamp (8) | offset (8). */
+#define HISTORY_MARK_LEN                24u
+
+/* A record waiting for the writer. */
+struct history_entry {
+    struct mpsc_node node;
+    struct net_message *frame;
+    uint64_t timestamp;
+};
+
+static void put_le32(unsigned char *p, uint32_t value)
+{
+    for (unsigned i = 0; i < 4; ++i) {
+        p[i] = value >> (8 * i);
+    }
+}
+
+static void put_le64(unsigned char *p, uint64_t value)
+{
+    for (unsigned i = 0; i < 8; ++i) {
+        p[i] = value >> (8 * i);
+    }
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+    uint32_t value = 0;
+
+    for (unsigned i = 0; i < 4; ++i) {
+        value |= (uint32_t)p[i] << (8 * i);
+    }
+
+    return value;
+}
+
+static uint64_t get_le64(const unsigned char *p)
+{
+    uint64_t value = 0;
+
+    for (unsigned i = 0; i < 8; ++i) {
+        value |= (uint64_t)p[i] << (8 * i);
+    }
+
+    return value;
+}
+
+/* The crc of a record, of everything after its length and crc. */
+static uint32_t record_crc(const unsigned char *header,
+        const unsigned char *frame, size_t len)
+{
+    uLong crc = crc32(0, header + 8, HISTORY_RECORD_HEADER_LEN - 8);
+
+    return crc32(crc, frame, len);
+}
+
+static unsigned long long realtime_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+static unsigned long long monotonic_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+static int write_all(int fd, const unsigned char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static void segment_name(char *name, size_t size, uint64_t id)
+{
+    snprintf(name, size, "%020" PRIu64 HISTORY_SEGMENT_SUFFIX, id);
+}
+
+static void index_name(char *name, size_t size, uint64_t id)
+{
+    snprintf(name, size, "%020" PRIu64 HISTORY_INDEX_SUFFIX, id);
+}
+
+/**
+ * @brief Parse the id of a segment from its file name.
+ *
+ * @return 0 on success, -1 if the file is not a segment.
+ */
+static int segment_id_of(const char *name, uint64_t *id)
+{
+    char expected[32];
+    char *end;
+
+    *id = strtoull(name, &end, 10);
+    segment_name(expected, sizeof(expected), *id);
+    return strcmp(name, expected) == 0 ? 0 : -1;
+}
+
+/**
+ * @brief Check the record at an offset of a mapped segment.
+ *
+ * @param id Id the record should have.
+ *
+ * @return Offset of the next record, 0 if there is no valid record there.
+ */
+static size_t read_record(const unsigned char *data, size_t size,
+        size_t offset, uint64_t id, struct history_record *record)
+{
+    const unsigned char *header = data + offset;
+
+    if (size < HISTORY_RECORD_HEADER_LEN ||
+            offset > size - HISTORY_RECORD_HEADER_LEN) {
+        return 0;
+    }
+
+    record->id = get_le64(header + 8);
+    record->timestamp = get_le64(header + 16);
+    record->frame = header + HISTORY_RECORD_HEADER_LEN;
+    record->len = get_le32(header);
+
+    if (record->len > NET_MSG_DATA_SIZE ||
+            record->len > size - offset - HISTORY_RECORD_HEADER_LEN ||
+            record->id != id ||
+            get_le32(header + 4) != record_crc(header, record->frame, record->len)) {
+        return 0;
+    }
+
+    return offset + HISTORY_RECORD_HEADER_LEN + record->len;
+}
+
+/**
+ * @brief Map a whole file of the history directory for reading.
+ *
+ * @param data Mapping, NULL if the file is empty.
+ *
+ * @return 0 on success, -1 on error (check errno).
+ */
+static int map_file(struct history *history, const char *name,
+        const unsigned char **data, size_t *size)
+{
+    struct stat st;
+    void *map = NULL;
+    int fd;
+
+    fd = openat(history->dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    if (st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    close(fd);
+    *data = map;
+    *size = st.st_size;
+    return 0;
+}
+
+static struct history_mark segment_mark(const struct history_segment *segment,
+        unsigned i)
+{
+    const unsigned char *p;
+
+    if (!segment->index) {
+        return segment->marks[i];
+    }
+
+    p = segment->index + i * HISTORY_MARK_LEN;
+    return (struct history_mark){
+        .id = get_le64(p), .timestamp = get_le64(p + 8), .offset = get_le64(p + 16)
+    };
+}
+
+/**
+ * @brief Largest a segment grows to: it is rolled past segment_bytes,
+ *        unless its one record is larger.
+ */
+static size_t segment_max_len(const struct history *history)
+{
+    size_t record_max = HISTORY_RECORD_HEADER_LEN + NET_MSG_DATA_SIZE;
+
+    return history->segment_bytes > record_max ? history->segment_bytes : record_max;
+}
+
+/**
+ * @brief Map a segment for reading until the history is closed.
+ *
+ * @param reserve Length to map past the end of the file, for the last
+ *        segment to be read as it is written, or 0.
+ *
+ * @return 0 on success, -1 on error (check errno).
+ */
+static int map_segment(struct history *history, struct history_segment *segment,
+        size_t reserve)
+{
+    struct stat st;
+    char name[32];
+    void *map;
+    int fd;
+
+    segment_name(name, sizeof(name), segment->first_id);
+    fd = openat(history->dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    segment->len = st.st_size;
+    segment->data_len = segment->len > reserve ? segment->len : reserve;
+    if (segment->data_len > 0) {
+        map = mmap(NULL, segment->data_len, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        segment->data = map;
+    }
+
+    close(fd);
+    return 0;
+}
+
+/**
+ * @brief Add a segment after the others, for reading. The caller holds
+ *        index_lock for writing once the writer runs.
+ *
+ * @param loaded Whether its marks are known, as for an empty segment.
+ *
+ * @return 0 on success, -1 on memory allocation error.
+ */
+static int add_segment(struct history *history, uint64_t first_id, bool loaded)
+{
+    if (history->num_segments == history->segments_capacity) {
+        unsigned capacity = history->segments_capacity ?
+            2 * history->segments_capacity : 16;
+        struct history_segment *segments = realloc(history->segments,
+                capacity * sizeof(*segments));
+
+        if (!segments) {
+            errno = ENOMEM;
+            return -1;
+        }
+        history->segments = segments;
+        history->segments_capacity = capacity;
+    }
+
+    history->segments[history->num_segments++] = (struct history_segment){
+        .first_id = first_id, .loaded = loaded
+    };
+    return 0;
+}
+
+/**
+ * @brief Take down a mark of a segment whose marks are in memory.
+ *
+ * @return 0 on success, -1 on memory allocation error, after which the
+ *         records up to the next mark cannot be found.
+ */
+static int append_mark(struct history_segment *segment,
+        const struct history_record *record, uint64_t offset)
+{
+    if (segment->num_marks == segment->marks_capacity) {
+        unsigned capacity = segment->marks_capacity ?
+            2 * segment->marks_capacity : 64;
+        struct history_mark *marks = realloc(segment->marks,
+                capacity * sizeof(*marks));
+
+        if (!marks) {
+            log_error("Out of memory\n");
+            return -1;
+        }
+        segment->marks = marks;
+        segment->marks_capacity = capacity;
+    }
+
+    segment->marks[segment->num_marks++] = (struct history_mark){
+        .id = record->id, .timestamp = record->timestamp, .offset = offset
+    };
+    return 0;
+}
+
+static bool is_marked(const struct history_segment *segment, uint64_t id)
+{
+    return (id - segment->first_id) % HISTORY_MARK_INTERVAL == 0;
+}
+
+/**
+ * @brief Make the records before an id readable, those of the last segment
+ *        being all there are on file.
+ */
+static void set_readable(struct history *history, uint64_t id)
+{
+    pthread_rwlock_wrlock(&history->index_lock);
+    history->readable_id = id;
+    history->segments[history->num_segments - 1].len = history->segment_len;
+    pthread_rwlock_unlock(&history->index_lock);
+}
+
+/**
+ * @brief Save the marks of a segment whose marks are in memory to its index
+ *        file: the marks, 24 bytes each, and their crc32.
+ */
+static void write_index(struct history *history,
+        const struct history_segment *segment)
+{
+    size_t len = segment->num_marks * HISTORY_MARK_LEN + 4;
+    unsigned char *data = malloc(len);
+    char name[32];
+    int fd;
+
+    if (!data) {
+        log_error("Out of memory\n");
+        return;
+    }
+
+    for (unsigned i = 0; i < segment->num_marks; ++i) {
+        unsigned char *p = data + i * HISTORY_MARK_LEN;
+
+        put_le64(p, segment->marks[i].id);
+        put_le64(p + 8, segment->marks[i].timestamp);
+        put_le64(p + 16, segment->marks[i].offset);
+    }
+    put_le32(data + len - 4, crc32(0, data, len - 4));
+
+    /* A torn index file fails its crc and is made again. */
+    index_name(name, sizeof(name), segment->first_id);
+    fd = openat(history->dirfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+            0644);
+    if (fd == -1 || write_all(fd, data, len) == -1) {
+        log_error("Unable to write %s/%s: %s\n", history->dir, name,
+                strerror(errno));
+    }
+
+    if (fd != -1) {
+        close(fd);
+    }
+    free(data);
+}
+
+/**
+ * @brief Map the index file of a segment, if it is sound.
+ *
+ * @return 0 on success, -1 if it has to be made again.
+ */
+static int map_index(struct history *history, struct history_segment *segment)
+{
+    const unsigned char *data;
+    char name[32];
+    size_t len;
+
+    index_name(name, sizeof(name), segment->first_id);
+    if (map_file(history, name, &data, &len) == -1) {
+        return -1;
+    }
+
+    if (len < HISTORY_MARK_LEN + 4 || (len - 4) % HISTORY_MARK_LEN != 0 ||
+            get_le32(data + len - 4) != crc32(0, data, len - 4) ||
+            get_le64(data) != segment->first_id) {
+        if (data) {
+            munmap((void *)data, len);
+        }
+        return -1;
+    }
+
+    segment->index = data;
+    segment->index_len = len;
+    segment->num_marks = (len - 4) / HISTORY_MARK_LEN;
+    return 0;
+}
+
+/**
+ * @brief Start a new last segment, whose first record gets the next id.
+ *
+ * @return 0 on success, -1 on error (check errno).
+ */
+static int open_segment(struct history *history)
+{
+    struct history_segment mapped = { .first_id = history->next_id };
+    char name[32];
+
+    segment_name(name, sizeof(name), history->next_id);
+    history->fd = openat(history->dirfd, name,
+            O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (history->fd == -1) {
+        return -1;
+    }
+
+    /* The entry of the segment must be on disk before its records. */
+    if (fsync(history->dirfd) == -1 ||
+            map_segment(history, &mapped, segment_max_len(history)) == -1) {
+        close(history->fd);
+        history->fd = -1;
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&history->index_lock);
+    if (add_segment(history, history->next_id, true) == -1) {
+        pthread_rwlock_unlock(&history->index_lock);
+        munmap((void *)mapped.data, mapped.data_len);
+        close(history->fd);
+        history->fd = -1;
+        return -1;
+    }
+    history->segments[history->num_segments - 1].data = mapped.data;
+    history->segments[history->num_segments - 1].data_len = mapped.data_len;
+    pthread_rwlock_unlock(&history->index_lock);
+
+    history->segment_id = history->next_id;
+    history->segment_len = 0;
+    return 0;
+}
+
+/**
+ * @brief Check the records of the last segment, cut off a torn tail, take
+ *        down its marks and pick up the ids and timestamps where they
+ *        stopped.
+ *
+ * @return 0 on success, -1 on error (check errno).
+ */
+static int recover_segment(struct history *history)
+{
+    struct history_segment *segment = &history->segments[history->num_segments - 1];
+    struct history_record record;
+    char name[32];
+    size_t offset = 0, next;
+    uint64_t id = history->segment_id;
+
+    segment_name(name, sizeof(name), history->segment_id);
+    history->fd = openat(history->dirfd, name, O_RDWR | O_APPEND | O_CLOEXEC);
+    if (history->fd == -1 ||
+            map_segment(history, segment, segment_max_len(history)) == -1) {
+        return -1;
+    }
+
+    while ((next = read_record(segment->data, segment->len, offset, id, &record))) {
+        if (is_marked(segment, id)) {
+            append_mark(segment, &record, offset);
+        }
+        history->last_timestamp = record.timestamp;
+        offset = next;
+        id++;
+    }
+    segment->loaded = true;
+
+    if (offset < segment->len) {
+        log_info("Cutting off %zu bytes torn from the tail of %s/%s.\n",
+                segment->len - offset, history->dir, name);
+        if (ftruncate(history->fd, offset) == -1 || fdatasync(history->fd) == -1) {
+            return -1;
+        }
+    }
+
+    segment->len = offset;
+    history->segment_len = offset;
+    history->next_id = id;
+    return 0;
+}
+
+static int compare_ids(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Find the segments of the directory and recover the last one, or
+ *        start the first one.
+ */
+static int recover(struct history *history)
+{
+    DIR *dir;
+    struct dirent *entry;
+    uint64_t *ids = NULL;
+    unsigned num_ids = 0, capacity = 0;
+    int fd;
+
+    fd = dup(history->dirfd);
+    if (fd == -1) {
+        return -1;
+    }
+
+    dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return -1;
+    }
+
+    while ((entry = readdir(dir))) {
+        uint64_t id;
+
+        if (segment_id_of(entry->d_name, &id) == -1) {
+            continue;
+        }
+
+        if (num_ids == capacity) {
+            uint64_t *more;
+
+            capacity = capacity ? 2 * capacity : 16;
+            more = realloc(ids, capacity * sizeof(*ids));
+            if (!more) {
+                free(ids);
+                closedir(dir);
+                errno = ENOMEM;
+                return -1;
+            }
+            ids = more;
+        }
+        ids[num_ids++] = id;
+    }
+    closedir(dir);
+
+    if (num_ids == 0) {
+        history->next_id = 1;
+        history->readable_id = 1;
+        return open_segment(history);
+    }
+
+    /* The marks of all but the last are loaded by the writer, see
+     * load_segment. */
+    qsort(ids, num_ids, sizeof(*ids), compare_ids);
+    for (unsigned i = 0; i < num_ids; ++i) {
+        if (add_segment(history, ids[i], false) == -1) {
+            free(ids);
+            return -1;
+        }
+    }
+    history->segment_id = ids[num_ids - 1];
+    free(ids);
+
+    if (recover_segment(history) == -1) {
+        return -1;
+    }
+
+    history->readable_id = history->next_id;
+    return 0;
+}
+
+/**
+ * @brief Map a segment there was on open, other than the last, and get its
+ *        marks from its index file or, if it has none that is sound, from
+ *        the segment itself, and show the records of any segment to the
+ *        observer. Lookups find none of its records until then.
+ *
+ * The segment is read through only if there is an observer or no index
+ * file, and without index_lock, which is only taken to make the marks
+ * known, so that lookups and appends never wait for it.
+ */
+static void load_segment(struct history *history, unsigned i)
+{
+    /* Only the writer changes the segments, so its copy stays good. */
+    struct history_segment segment = history->segments[i];
+    struct history_record record;
+    char name[32];
+    size_t offset = 0, next;
+    uint64_t id = segment.first_id;
+    bool indexed = segment.loaded || map_index(history, &segment) == 0;
+    bool marking = !indexed;
+
+    segment_name(name, sizeof(name), segment.first_id);
+    if (!segment.loaded && map_segment(history, &segment, 0) == -1) {
+        log_error("Unable to read %s/%s: %s\n", history->dir, name,
+                strerror(errno));
+        if (segment.index) {
+            munmap((void *)segment.index, segment.index_len);
+        }
+        return;
+    }
+
+    if (indexed && !history->observer.record) {
+        goto out;
+    }
+
+    if (!indexed) {
+        log_info("Indexing %s/%s.\n", history->dir, name);
+    }
+
+    if (segment.data) {
+        madvise((void *)segment.data, segment.len, MADV_SEQUENTIAL);
+    }
+    while ((next = read_record(segment.data, segment.len, offset, id, &record))) {
+        /* Without all its marks, the index file is not saved. */
+        if (marking && is_marked(&segment, id) &&
+                append_mark(&segment, &record, offset) == -1) {
+            marking = false;
+        }
+        /* The last segment may have records written since open. */
+        if (history->observer.record && id >= history->observed_id) {
+            history->observer.record(history->observer.arg, &record);
+            history->observed_id = id + 1;
+        }
+        offset = next;
+        id++;
+    }
+
+    /* It is read at random from now on. */
+    if (segment.data) {
+        madvise((void *)segment.data, segment.len, MADV_NORMAL);
+    }
+
+    if (marking) {
+        write_index(history, &segment);
+    }
+
+out:
+    if (!history->segments[i].loaded) {
+        segment.loaded = true;
+        pthread_rwlock_wrlock(&history->index_lock);
+        history->segments[i] = segment;
+        pthread_rwlock_unlock(&history->index_lock);
+    }
+}
+
+/**
+ * @brief Write the buffered records to the last segment.
+ *
+ * @return 0 on success, -1 on error, after which the segment is as it was
+ *         and the records are still buffered, for a later try.
+ */
+static int flush_buffer(struct history *history)
+{
+    if (history->buffered == 0) {
+        return 0;
+    }
+
+    if (write_all(history->fd, history->buffer, history->buffered) == -1) {
+        log_error("Unable to write the history: %s\n", strerror(errno));
+
+        /* Cut off part of a write, so that the records, and the marks
+         * already taken of them, go where they were meant to. */
+        if (ftruncate(history->fd, history->segment_len) == -1) {
+            log_error("Unable to truncate the history: %s\n", strerror(errno));
+        }
+        return -1;
+    }
+
+    history->segment_len += history->buffered;
+    history->buffered = 0;
+    history->dirty = true;
+    set_readable(history, history->next_id);
+    return 0;
+}
+
+static void sync_segment(struct history *history)
+{
+    if (!history->dirty) {
+        return;
+    }
+
+    if (fdatasync(history->fd) == -1) {
+        log_error("Unable to sync the history: %s\n", strerror(errno));
+    }
+
+    history->dirty = false;
+    history->sync_deadline = 0;
+    atomic_fetch_add_explicit(&history->syncs, 1, memory_order_relaxed);
+}
+
+/**
+ * @brief Sync the last segment and start a new one.
+ */
+static void roll_segment(struct history *history)
+{
+    /* The buffered records belong to this segment. */
+    if (flush_buffer(history) == -1) {
+        return;
+    }
+    sync_segment(history);
+    close(history->fd);
+    write_index(history, &history->segments[history->num_segments - 1]);
+
+    while (open_segment(history) == -1) {
+        log_error("Unable to start a history segment: %s\n", strerror(errno));
+        sleep(1);
+    }
+}
+
+/**
+ * @brief Give a record its id and timestamp, and buffer it.
+ *
+ * @return 0 on success, -1 if the buffer is full and cannot be written.
+ */
+static int write_record(struct history *history, const struct history_entry *entry)
+{
+    size_t len = net_message_body_length(entry->frame);
+    size_t record_len = HISTORY_RECORD_HEADER_LEN + len;
+    struct history_record record;
+    unsigned char *header;
+
+    if (history->segment_len + history->buffered > 0 &&
+            history->segment_len + history->buffered + record_len >
+            history->segment_bytes) {
+        roll_segment(history);
+    }
+
+    if (history->buffered + record_len > HISTORY_BUFFER_BYTES &&
+            flush_buffer(history) == -1) {
+        return -1;
+    }
+
+    /* Clocks may step back; the history does not. */
+    if (entry->timestamp > history->last_timestamp) {
+        history->last_timestamp = entry->timestamp;
+    }
+
+    record = (struct history_record){
+        .id = history->next_id++,
+        .timestamp = history->last_timestamp,
+        .frame = history->buffer + history->buffered + HISTORY_RECORD_HEADER_LEN,
+        .len = len
+    };
+
+    if ((record.id - history->segment_id) % HISTORY_MARK_INTERVAL == 0) {
+        pthread_rwlock_wrlock(&history->index_lock);
+        append_mark(&history->segments[history->num_segments - 1], &record,
+                history->segment_len + history->buffered);
+        pthread_rwlock_unlock(&history->index_lock);
+    }
+
+    header = history->buffer + history->buffered;
+    memcpy(header + HISTORY_RECORD_HEADER_LEN, net_message_body(entry->frame), len);
+    put_le32(header, len);
+    put_le64(header + 8, record.id);
+    put_le64(header + 16, record.timestamp);
+    put_le32(header + 4, record_crc(header, record.frame, len));
+    history->buffered += record_len;
+
+    /* Until the observer has caught up, it is shown the record later. */
+    if (history->observer.record && record.id == history->observed_id) {
+        history->observer.record(history->observer.arg, &record);
+        history->observed_id++;
+    }
+    return 0;
+}
+
+/**
+ * @brief Write the records waiting in the queue.
+ */
+static void drain_queue(struct history *history)
+{
+    struct mpsc_node *node;
+
+    while ((node = mpsc_queue_pop(&history->queue))) {
+        struct history_entry *entry = (struct history_entry *)node;
+
+        if (write_record(history, entry) == -1) {
+            log_error("History buffer full, message not kept\n");
+        }
+        net_message_unref(entry->frame);
+        free(entry);
+    }
+
+    if (flush_buffer(history) == -1) {
+        /* Woken to try again then, or by the next append. */
+        history->sync_deadline = monotonic_ms() + HISTORY_RETRY_MS;
+        return;
+    }
+
+    if (history->dirty && history->sync_ms == 0) {
+        sync_segment(history);
+    }
+    else if (history->dirty && history->sync_deadline == 0) {
+        history->sync_deadline = monotonic_ms() + history->sync_ms;
+    }
+}
+
+/**
+ * @brief Wait until records are appended, the history is closed or the
+ *        next sync is due.
+ *
+ * @return false once the history is closed.
+ */
+static bool wait_for_work(struct history *history)
+{
+    bool stopping;
+
+    pthread_mutex_lock(&history->lock);
+    while (!history->stopping && !atomic_load(&history->wake_pending)) {
+        if (history->sync_deadline) {
+            struct timespec until = {
+                .tv_sec = history->sync_deadline / 1000,
+                .tv_nsec = history->sync_deadline % 1000 * 1000000
+            };
+
+            if (pthread_cond_timedwait(&history->cond, &history->lock,
+                        &until) == ETIMEDOUT) {
+                break;
+            }
+        }
+        else {
+            pthread_cond_wait(&history->cond, &history->lock);
+        }
+    }
+    stopping = history->stopping;
+    pthread_mutex_unlock(&history->lock);
+
+    return !stopping;
+}
+
+static bool is_stopping(struct history *history)
+{
+    bool stopping;
+
+    pthread_mutex_lock(&history->lock);
+    stopping = history->stopping;
+    pthread_mutex_unlock(&history->lock);
+
+    return stopping;
+}
+
+static int observe_record(void *arg, const struct history_record *record)
+{
+    struct history *history = arg;
+
+    history->observer.record(history->observer.arg, record);
+    history->observed_id = record->id + 1;
+    return 0;
+}
+
+/**
+ * @brief Show the observer the records written while those there were on
+ *        open were read, once they are on file.
+ */
+static void catch_up_observer(struct history *history)
+{
+    uint64_t readable_id;
+
+    pthread_rwlock_rdlock(&history->index_lock);
+    readable_id = history->readable_id;
+    pthread_rwlock_unlock(&history->index_lock);
+
+    if (history->observed_id < readable_id &&
+            history_scan(history, history->observed_id, UINT_MAX,
+                observe_record, history) <= 0) {
+        log_error("Unable to read history from message %" PRIu64 " on\n",
+                history->observed_id);
+        history->observed_id = readable_id;
+    }
+}
+
+/**
+ * @brief Write the records appended so far, and sync them if it is due.
+ */
+static void write_appended(struct history *history)
+{
+    /* Appends after this wake the writer again. */
+    atomic_store(&history->wake_pending, false);
+    drain_queue(history);
+
+    if (history->sync_deadline && monotonic_ms() >= history->sync_deadline) {
+        sync_segment(history);
+    }
+
+    if (history->observer.record && atomic_load(&history->indexed) &&
+            history->observed_id < history->next_id) {
+        catch_up_observer(history);
+    }
+}
+
+static void *history_run(void *arg)
+{
+    struct history *history = arg;
+    unsigned num_segments = history->num_segments;
+    unsigned i;
+    bool running;
+
+    /* Only the writer adds segments, so these are the ones found on open.
+     * Appends are written in between, not held up behind them all. */
+    for (i = 0; i < num_segments && !is_stopping(history); ++i) {
+        load_segment(history, i);
+        write_appended(history);
+    }
+
+    if (i == num_segments) {
+        atomic_store(&history->indexed, true);
+        write_appended(history);
+    }
+
+    do {
+        running = wait_for_work(history);
+        write_appended(history);
+    } while (running);
+
+    sync_segment(history);
+    return NULL;
+}
+
+static void free_segments(struct history *history)
+{
+    for (unsigned i = 0; i < history->num_segments; ++i) {
+        struct history_segment *segment = &history->segments[i];
+
+        free(segment->marks);
+        if (segment->index) {
+            munmap((void *)segment->index, segment->index_len);
+        }
+        if (segment->data) {
+            munmap((void *)segment->data, segment->data_len);
+        }
+    }
+    free(history->segments);
+}
+
+int history_open(struct history *history, const char *dir,
+        size_t segment_bytes, unsigned sync_ms,
+        const struct history_observer *observer)
+{
+    pthread_condattr_t attr;
+
+    memset(history, 0, sizeof(*history));
+    history->fd = -1;
+    history->segment_bytes = segment_bytes;
+    history->sync_ms = sync_ms;
+    if (observer) {
+        history->observer = *observer;
+    }
+    mpsc_queue_init(&history->queue);
+    atomic_init(&history->wake_pending, false);
+    atomic_init(&history->appended, 0);
+    atomic_init(&history->syncs, 0);
+    atomic_init(&history->indexed, false);
+
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        return -1;
+    }
+
+    history->dir = strdup(dir);
+    history->buffer = malloc(HISTORY_BUFFER_BYTES);
+    if (!history->dir || !history->buffer) {
+        errno = ENOMEM;
+        goto err;
+    }
+
+    history->dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (history->dirfd == -1) {
+        goto err;
+    }
+    pthread_rwlock_init(&history->index_lock, NULL);
+
+    if (recover(history) == -1) {
+        goto err_dirfd;
+    }
+    history->observed_id = history->segments[0].first_id;
+
+    /* Sync deadlines are on the monotonic clock. */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&history->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&history->lock, NULL);
+
+    errno = pthread_create(&history->thread, NULL, history_run, history);
+    if (errno != 0) {
+        pthread_cond_destroy(&history->cond);
+        pthread_mutex_destroy(&history->lock);
+        goto err_dirfd;
+    }
+
+    log_info("History in %s goes on from message %" PRIu64 ".\n", dir,
+            history->next_id);
+    return 0;
+
+err_dirfd:
+    if (history->fd != -1) {
+        close(history->fd);
+    }
+    close(history->dirfd);
+    free_segments(history);
+    pthread_rwlock_destroy(&history->index_lock);
+err:
+    free(history->buffer);
+    free(history->dir);
+    return -1;
+}
+
+void history_close(struct history *history)
+{
+    pthread_mutex_lock(&history->lock);
+    history->stopping = true;
+    pthread_cond_signal(&history->cond);
+    pthread_mutex_unlock(&history->lock);
+    pthread_join(history->thread, NULL);
+
+    /* The writer drained the queue once more after it saw stopping. */
+    close(history->fd);
+    close(history->dirfd);
+    free_segments(history);
+    pthread_rwlock_destroy(&history->index_lock);
+    pthread_cond_destroy(&history->cond);
+    pthread_mutex_destroy(&history->lock);
+    free(history->buffer);
+    free(history->dir);
+}
+
+int history_append(struct history *history, struct net_message *frame)
+{
+    struct history_entry *entry = malloc(sizeof(*entry));
+
+    if (!entry) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    entry->frame = net_message_ref(frame);
+    entry->timestamp = realtime_ms();
+    mpsc_queue_push(&history->queue, &entry->node);
+    atomic_fetch_add_explicit(&history->appended, 1, memory_order_relaxed);
+
+    /* Only the first appender since the writer last woke signals it. */
+    if (!atomic_exchange(&history->wake_pending, true)) {
+        pthread_mutex_lock(&history->lock);
+        pthread_cond_signal(&history->cond);
+        pthread_mutex_unlock(&history->lock);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Find the last segment whose first record is at or before an id,
+ *        with index_lock held.
+ */
+static unsigned find_segment(const struct history *history, uint64_t id)
+{
+    unsigned lo = 0, hi = history->num_segments;
+
+    while (hi - lo > 1) {
+        unsigned mid = lo + (hi - lo) / 2;
+
+        if (history->segments[mid].first_id <= id) {
+            lo = mid;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+/**
+ * @brief Find the last mark of a loaded segment that is at or before an id
+ *        or, if before_time is set, before a time.
+ */
+static struct history_mark find_mark(const struct history_segment *segment,
+        uint64_t id, uint64_t before_time)
+{
+    unsigned lo = 0, hi = segment->num_marks;
+
+    while (hi - lo > 1) {
+        unsigned mid = lo + (hi - lo) / 2;
+        struct history_mark mark = segment_mark(segment, mid);
+
+        if (before_time ? mark.timestamp < before_time : mark.id <= id) {
+            lo = mid;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    return segment_mark(segment, lo);
+}
+
+/**
+ * @brief Find where to start reading for a record.
+ *
+ * @param segment_id First id of the segment of the record.
+ * @param mark Closest mark at or before the record.
+ * @param end Id after the last record on file.
+ * @param data Mapped segment, valid until the history is closed.
+ * @param size Of its records on file, up to end.
+ *
+ * @return 0 on success, -1 if the record is not on file or its segment
+ *         cannot be read.
+ */
+static int locate(struct history *history, uint64_t id, uint64_t *segment_id,
+        struct history_mark *mark, uint64_t *end, const unsigned char **data,
+        size_t *size)
+{
+    unsigned i;
+    int rc = -1;
+
+    pthread_rwlock_rdlock(&history->index_lock);
+    *end = history->readable_id;
+
+    if (id < *end && id >= history->segments[0].first_id) {
+        i = find_segment(history, id);
+        if (history->segments[i].loaded && history->segments[i].num_marks > 0) {
+            *segment_id = history->segments[i].first_id;
+            *mark = find_mark(&history->segments[i], id, 0);
+            *data = history->segments[i].data;
+            *size = history->segments[i].len;
+            rc = 0;
+        }
+    }
+
+    pthread_rwlock_unlock(&history->index_lock);
+    return rc;
+}
+
+uint64_t history_end(struct history *history)
+{
+    uint64_t end;
+
+    pthread_rwlock_rdlock(&history->index_lock);
+    end = history->readable_id;
+    pthread_rwlock_unlock(&history->index_lock);
+
+    return end;
+}
+
+uint64_t history_find_time(struct history *history, uint64_t timestamp)
+{
+    struct history_record record;
+    struct history_mark mark = { 0 };
+    const unsigned char *data;
+    uint64_t next_id, end;
+    unsigned lo = 0, hi;
+    size_t size, offset, next;
+
+    pthread_rwlock_rdlock(&history->index_lock);
+    end = history->readable_id;
+
+    /*
+     * The last segment starting before the time, if any, holds the record
+     * or is followed by it. Segments whose marks are not loaded yet are
+     * passed over to the next that are, which keeps the search in order
+     * when they lie between those that are.
+     */
+    hi = history->num_segments;
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2, probe = mid;
+
+        while (probe < hi && !(history->segments[probe].loaded &&
+                    history->segments[probe].num_marks > 0)) {
+            probe++;
+        }
+
+        if (probe < hi &&
+                segment_mark(&history->segments[probe], 0).timestamp < timestamp) {
+            lo = probe + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    if (lo == 0) {
+        next_id = history->segments[0].first_id;
+        pthread_rwlock_unlock(&history->index_lock);
+        return next_id < end ? next_id : end;
+    }
+
+    next_id = lo < history->num_segments ? history->segments[lo].first_id : end;
+    mark = find_mark(&history->segments[lo - 1], 0, timestamp);
+    data = history->segments[lo - 1].data;
+    size = history->segments[lo - 1].len;
+    pthread_rwlock_unlock(&history->index_lock);
+
+    /* Then on from its last mark before the time. */
+    offset = mark.offset;
+    for (uint64_t id = mark.id; id < end; ++id) {
+        next = read_record(data, size, offset, id, &record);
+        if (!next || record.timestamp >= timestamp) {
+            next_id = next ? id : next_id;
+            break;
+        }
+        offset = next;
+    }
+
+    return next_id < end ? next_id : end;
+}
+
+int history_scan(struct history *history, uint64_t id, unsigned max,
+        history_scan_fn fn, void *arg)
+{
+    unsigned count = 0;
+    bool stopped = false;
+
+    while (count < max && !stopped) {
+        struct history_record record;
+        struct history_mark mark;
+        const unsigned char *data;
+        uint64_t segment_id, end;
+        size_t size, offset, next;
+
+        if (locate(history, id, &segment_id, &mark, &end, &data, &size) == -1) {
+            break;
+        }
+
+        /* Up to the mark interval of records are skipped to get to id. */
+        offset = mark.offset;
+        next = 1;
+        for (uint64_t i = mark.id; i < id && next; ++i) {
+            next = read_record(data, size, offset, i, &record);
+            offset = next;
+        }
+
+        while (next && count < max && id < end &&
+                (next = read_record(data, size, offset, id, &record))) {
+            count++;
+            id++;
+            offset = next;
+            if (fn(arg, &record) != 0) {
+                stopped = true;
+                break;
+            }
+        }
+
+        /* Past the end of the segment, or of what can be read of it. */
+        if (!stopped && count < max && id < end) {
+            uint64_t next_segment_id = end;
+            unsigned i;
+
+            pthread_rwlock_rdlock(&history->index_lock);
+            i = find_segment(history, segment_id);
+            if (i + 1 < history->num_segments) {
+                next_segment_id = history->segments[i + 1].first_id;
+            }
+            pthread_rwlock_unlock(&history->index_lock);
+
+            /* Records lost to corruption are skipped. */
+            if (next_segment_id > id) {
+                id = next_segment_id;
+            }
+        }
+    }
+
+    return count;
+}
+
+/**
+ * @brief Find a record in a mapped segment, going on from a mark at or
+ *        before it.
+ *
+ * @return Offset after the record, 0 if it is not there.
+ */
+static size_t seek_record(const unsigned char *data, size_t size,
+        const struct history_mark *mark, uint64_t id,
+        struct history_record *record)
+{
+    size_t offset = mark->offset, next;
+
+    /* At most HISTORY_MARK_INTERVAL - 1 records are skipped. */
+    for (uint64_t i = mark->id; i <= id &&
+            (next = read_record(data, size, offset, i, record)); ++i) {
+        if (i == id) {
+            return next;
+        }
+        offset = next;
+    }
+
+    return 0;
+}
+
+int history_gather(struct history *history, const uint64_t *ids, unsigned n,
+        history_scan_fn fn, void *arg)
+{
+    unsigned count = 0;
+
+    for (unsigned i = 0; i < n; ++i) {
+        struct history_record record;
+        struct history_mark mark;
+        const unsigned char *data;
+        uint64_t segment_id, end;
+        size_t size;
+
+        if (locate(history, ids[i], &segment_id, &mark, &end, &data, &size) == -1 ||
+                !seek_record(data, size, &mark, ids[i], &record)) {
+            continue;
+        }
+
+        count++;
+        if (fn(arg, &record) != 0) {
+            break;
+        }
+    }
+
+    return count;
+}
+
+int history_read(struct history *history, uint64_t id,
+        struct history_record *record, unsigned char *buffer)
+{
+    struct history_mark mark;
+    const unsigned char *data;
+    uint64_t segment_id, end;
+    size_t size;
+
+    if (locate(history, id, &segment_id, &mark, &end, &data, &size) == -1) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if (!seek_record(data, size, &mark, id, record)) {
+        errno = EIO;
+        return -1;
+    }
+
+    memcpy(buffer, record->frame, record->len);
+    record->frame = buffer;
+    return 0;
+}
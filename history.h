@@ -0,0 +1,223 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <pthread.h>
+
+#include "mpsc.h"
+
+struct net_message;
+
+/*
+ * Chat history: an append-only log of chat messages, in segment files of a
+ * directory, written by a thread of its own so that appending costs the
+ * reactors no disk I/O.
+ *
+ * A segment is named after the id of its first record, in 20 decimal
+ * digits, with HISTORY_SEGMENT_SUFFIX. It holds records of
+ *
+ *      length (4) | crc32 (4) | id (8) | timestamp (8) | frame (length)
+ *
+ * with little-endian numbers. The crc covers the id, the timestamp and the
+ * frame, which is the v2 network format of the message. Ids follow each
+ * other from 1; timestamps are milliseconds since the epoch, and never
+ * decrease.
+ *
+ * Writes are synced to disk once per sync interval whatever their number
+ * (group commit), so a crash of the machine loses at most that much. A
+ * record torn by a crash is cut off when the history is next opened. A
+ * write that fails, as on a full disk, is cut off too and tried again
+ * later; messages that find the buffer full meanwhile are not kept.
+ *
+ * Records are found by id or time through marks, the id, timestamp and
+ * offset of every HISTORY_MARK_INTERVAL-th record of a segment, by binary
+ * search. The writer takes down the marks of the last segment as it writes
+ * and saves them to an index file, named like the segment with
+ * HISTORY_INDEX_SUFFIX, when it starts the next one. Opening a long history
+ * reads none of it but the last segment: the writer maps the index files of
+ * the others when it starts, in the pass that shows their records to the
+ * observer, and makes again from its segment any that is missing or
+ * corrupt. Until then lookups find no record of a segment, so that they
+ * never wait for disk reads of a whole segment.
+ *
+ * An observer sees every record in id order: those there were on open,
+ * read through once by the writer when it starts, then each one written.
+ */
+
+#define HISTORY_SEGMENT_SUFFIX          ".log"
+#define HISTORY_INDEX_SUFFIX            ".idx"
+#define HISTORY_RECORD_HEADER_LEN       24u
+#define HISTORY_DEFAULT_SEGMENT_BYTES   (64u << 20)
+#define HISTORY_MARK_INTERVAL           64u
+
+struct history_record {
+    uint64_t id;
+    uint64_t timestamp;
+    const unsigned char *frame;
+    size_t len;
+};
+
+/* Called by the writer thread, see history_open. */
+struct history_observer {
+    void (*record)(void *arg, const struct history_record *record);
+    void *arg;
+};
+
+struct history_mark {
+    uint64_t id;
+    uint64_t timestamp;
+    uint64_t offset;
+};
+
+struct history_segment {
+    uint64_t first_id;
+    bool loaded;                        /* Its marks are known. */
+    struct history_mark *marks;         /* Taken down, or NULL if mapped. */
+    unsigned num_marks;
+    unsigned marks_capacity;
+    const unsigned char *index;         /* Mapped index file, or NULL. */
+    size_t index_len;
+    const unsigned char *data;          /* Mapped once loaded, or NULL if
+                                           empty. */
+    size_t data_len;                    /* Mapped, past its end if last. */
+    size_t len;                         /* Of its records on file. */
+};
+
+struct history {
+    char *dir;
+    int dirfd;
+    int fd;                             /* Of the last segment. */
+    uint64_t segment_id;                /* Of the last segment. */
+    size_t segment_len;
+    size_t segment_bytes;               /* Segments are rolled past this. */
+    uint64_t next_id;
+    uint64_t last_timestamp;
+    unsigned sync_ms;                   /* 0 to sync after every write. */
+    struct history_observer observer;
+
+    /* What can be read, changed under index_lock. */
+    pthread_rwlock_t index_lock;
+    struct history_segment *segments;   /* By first id. */
+    unsigned num_segments;
+    unsigned segments_capacity;
+    uint64_t readable_id;               /* Records before are on file. */
+
+    /* Records waiting for the writer. */
+    struct mpsc_queue queue;
+    atomic_bool wake_pending;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool stopping;                      /* Under lock. */
+    pthread_t thread;
+
+    /* Writer only. */
+    unsigned char *buffer;
+    size_t buffered;
+    bool dirty;                         /* Written since the last sync. */
+    unsigned long long sync_deadline;   /* Monotonic ms, 0 if not dirty. */
+    uint64_t observed_id;               /* Next record for the observer. */
+
+    atomic_ulong appended;
+    atomic_ulong syncs;
+    atomic_bool indexed;                /* The marks of every segment there
+                                           was on open are known. */
+};
+
+/**
+ * @brief Open the history in a directory, created if needed, recover the
+ *        last segment and start the writer thread.
+ *
+ * @param segment_bytes Size past which a new segment is started.
+ * @param sync_ms Interval between syncs to disk, 0 to sync every write.
+ * @param observer Called for the records already in the history, then for
+ *        each record written, always in id order, or NULL. Records written
+ *        while those already there are read are shown to it afterwards.
+ *
+ * @return 0 on success, -1 on error (check errno).
+ */
+int history_open(struct history *history, const char *dir,
+        size_t segment_bytes, unsigned sync_ms,
+        const struct history_observer *observer);
+
+/**
+ * @brief Write everything appended so far, sync it to disk, stop the
+ *        writer thread and close the history.
+ */
+void history_close(struct history *history);
+
+/**
+ * @brief Append a message, which is given the next id and the current
+ *        time. Safe to call from any thread.
+ *
+ * @param frame Message in the v2 network format, referenced until written.
+ *
+ * @return 0 on success, -1 on memory allocation error.
+ */
+int history_append(struct history *history, struct net_message *frame);
+
+/* Called for each record read by history_scan or history_gather; non-zero
+ * stops it. */
+typedef int (*history_scan_fn)(void *arg, const struct history_record *record);
+
+/**
+ * @brief Get the id after the last record on file. Safe to call from any
+ *        thread.
+ */
+uint64_t history_end(struct history *history);
+
+/**
+ * @brief Find the first record at or after a time. Safe to call from any
+ *        thread.
+ *
+ * @param timestamp Milliseconds since the epoch.
+ *
+ * @return Id of the record, history_end if there is none.
+ */
+uint64_t history_find_time(struct history *history, uint64_t timestamp);
+
+/**
+ * @brief Read records in id order, from their mapped segments. Safe to call
+ *        from any thread.
+ *
+ * @param id Id of the first record.
+ * @param max Most records to read.
+ * @param fn Called with each record, whose frame is only valid during the
+ *        call.
+ *
+ * @return Number of records read, fewer than max if the history ends or fn
+ *         stops early.
+ */
+int history_scan(struct history *history, uint64_t id, unsigned max,
+        history_scan_fn fn, void *arg);
+
+/**
+ * @brief Read records by id from their mapped segments. Safe to call from
+ *        any thread.
+ *
+ * @param ids Ids of the records, best in ascending or descending order.
+ * @param fn Called with each record on file, in the order of ids, whose
+ *        frame is only valid during the call. Ids not on file are skipped.
+ *
+ * @return Number of records read, fewer than n if some are not on file or
+ *         fn stops early.
+ */
+int history_gather(struct history *history, const uint64_t *ids, unsigned n,
+        history_scan_fn fn, void *arg);
+
+/**
+ * @brief Read a record. Safe to call from any thread.
+ *
+ * @param buffer Where the frame of the record is read to, of at least
+ *        NET_MSG_DATA_SIZE bytes.
+ *
+ * @return 0 on success, -1 on error (errno ENOENT if the record is not in
+ *         the history or not on file yet).
+ */
+int history_read(struct history *history, uint64_t id,
+        struct history_record *record, unsigned char *buffer);
+
+#endif /* HISTORY_H */
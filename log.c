@@ -74,7 +74,7 @@ static char *dynamic_vsnprintf(const char *fmt, va_list va)
     }
     else if (buf_size > n_written) {
         /* Shrink to fit */
-        temp = realloc(buf, n_written);
+        temp = realloc(buf, n_written + 1);
         if (temp) {
             buf = temp;
         }
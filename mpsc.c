@@ -0,0 +1,60 @@
+#include <stddef.h>
+
+#include "mpsc.h"
+
+void mpsc_queue_init(struct mpsc_queue *queue)
+{
+    atomic_init(&queue->stub.next, NULL);
+    atomic_init(&queue->head, &queue->stub);
+    queue->tail = &queue->stub;
+}
+
+void mpsc_queue_push(struct mpsc_queue *queue, struct mpsc_node *node)
+{
+    struct mpsc_node *prev;
+
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    prev = atomic_exchange_explicit(&queue->head, node, memory_order_acq_rel);
+    /* Between the exchange and this store the queue is briefly unlinked. */
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+struct mpsc_node *mpsc_queue_pop(struct mpsc_queue *queue)
+{
+    struct mpsc_node *tail = queue->tail;
+    struct mpsc_node *next;
+
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (tail == &queue->stub) {
+        if (!next) {
+            return NULL;
+        }
+
+        /* Skip the stub. */
+        queue->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+
+    if (next) {
+        queue->tail = next;
+        return tail;
+    }
+
+    if (tail != atomic_load_explicit(&queue->head, memory_order_acquire)) {
+        /* A producer is in the middle of pushing. */
+        return NULL;
+    }
+
+    /* tail is the last node: put the stub behind it so it can be popped. */
+    mpsc_queue_push(queue, &queue->stub);
+
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next) {
+        queue->tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
@@ -0,0 +1,40 @@
+#ifndef MPSC_H
+#define MPSC_H
+
+#include <stdatomic.h>
+
+/*
+ * Intrusive lock-free multi-producer single-consumer FIFO queue.
+ *
+ * Any thread may push; only one thread may pop. Items pushed by one
+ * producer are popped in the order they were pushed.
+ */
+
+struct mpsc_node {
+    _Atomic(struct mpsc_node *) next;
+};
+
+struct mpsc_queue {
+    _Atomic(struct mpsc_node *) head;   /* Last pushed node. */
+    struct mpsc_node *tail;             /* Next node to pop (consumer only). */
+    struct mpsc_node stub;
+};
+
+void mpsc_queue_init(struct mpsc_queue *queue);
+
+/**
+ * @brief Push a node to the queue. Safe to call from any thread.
+ */
+void mpsc_queue_push(struct mpsc_queue *queue, struct mpsc_node *node);
+
+/**
+ * @brief Pop a node from the queue. Must only be called by the consumer.
+ *
+ * @note NULL may be returned while a concurrent push is in progress. The
+ * pushing thread is expected to notify the consumer after pushing.
+ *
+ * @return The oldest node or NULL if none is available.
+ */
+struct mpsc_node *mpsc_queue_pop(struct mpsc_queue *queue);
+
+#endif /* MPSC_H */
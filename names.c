@@ -0,0 +1,295 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "names.h"
+
+#define NAME_TABLE_INITIAL_SLOTS        64u
+#define ID_TABLE_INITIAL_SLOTS          64u
+
+/* FNV-1a. */
+static uint32_t name_hash(const char *name, unsigned len)
+{
+    uint32_t hash = 2166136261u;
+
+    for (unsigned i = 0; i < len; ++i) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/**
+ * @brief Find the slot of a name, or the free slot where it would go.
+ */
+static unsigned name_table_probe(const struct name_table *table, uint32_t hash,
+        const char *name, unsigned len)
+{
+    unsigned mask = table->num_slots - 1;
+    unsigned i = hash & mask;
+
+    while (table->slots[i].name) {
+        const struct name_entry *entry = &table->slots[i];
+
+        if (entry->hash == hash && entry->len == len &&
+                memcmp(entry->name, name, len) == 0) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+
+    return i;
+}
+
+int name_table_init(struct name_table *table)
+{
+    table->slots = calloc(NAME_TABLE_INITIAL_SLOTS, sizeof(*table->slots));
+    if (!table->slots) {
+        return -1;
+    }
+
+    table->num_slots = NAME_TABLE_INITIAL_SLOTS;
+    table->count = 0;
+    return 0;
+}
+
+void name_table_deinit(struct name_table *table)
+{
+    free(table->slots);
+    table->slots = NULL;
+    table->num_slots = 0;
+    table->count = 0;
+}
+
+/**
+ * @brief Double the number of slots, keeping the table at most half full.
+ */
+static int name_table_grow(struct name_table *table)
+{
+    struct name_entry *old = table->slots;
+    unsigned old_num = table->num_slots;
+
+    table->slots = calloc(2 * old_num, sizeof(*table->slots));
+    if (!table->slots) {
+        table->slots = old;
+        return -1;
+    }
+    table->num_slots = 2 * old_num;
+
+    for (unsigned i = 0; i < old_num; ++i) {
+        if (old[i].name) {
+            table->slots[name_table_probe(table, old[i].hash, old[i].name,
+                    old[i].len)] = old[i];
+        }
+    }
+
+    free(old);
+    return 0;
+}
+
+int name_table_insert(struct name_table *table, const char *name,
+        unsigned len, uint32_t id, unsigned shard, struct conn_handle handle)
+{
+    uint32_t hash = name_hash(name, len);
+    unsigned slot = name_table_probe(table, hash, name, len);
+
+    if (table->slots[slot].name) {
+        errno = EEXIST;
+        return -1;
+    }
+
+    if (2 * (table->count + 1) > table->num_slots) {
+        if (name_table_grow(table) == -1) {
+            errno = ENOMEM;
+            return -1;
+        }
+        slot = name_table_probe(table, hash, name, len);
+    }
+
+    table->slots[slot] = (struct name_entry){
+        .name = name, .len = len, .hash = hash, .id = id, .shard = shard,
+        .handle = handle
+    };
+    table->count++;
+    return 0;
+}
+
+const struct name_entry *name_table_find(const struct name_table *table,
+        const char *name, unsigned len)
+{
+    const struct name_entry *entry = &table->slots[name_table_probe(table,
+            name_hash(name, len), name, len)];
+
+    return entry->name ? entry : NULL;
+}
+
+int name_table_remove(struct name_table *table, const char *name, unsigned len)
+{
+    unsigned mask = table->num_slots - 1;
+    unsigned hole = name_table_probe(table, name_hash(name, len), name, len);
+    unsigned i = hole;
+
+    if (!table->slots[hole].name) {
+        return -1;
+    }
+
+    table->slots[hole].name = NULL;
+    table->count--;
+
+    /*
+     * No tombstones: later entries of the same probe run are shifted back
+     * into the hole, unless their home lies cyclically in (hole, i].
+     */
+    for (;;) {
+        unsigned home;
+
+        i = (i + 1) & mask;
+        if (!table->slots[i].name) {
+            break;
+        }
+
+        home = table->slots[i].hash & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            table->slots[hole] = table->slots[i];
+            table->slots[i].name = NULL;
+            hole = i;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Fibonacci hashing: ids are consecutive, so spread them over the slots by
+ * the high bits of their product with 2^64 / phi.
+ */
+static unsigned id_home(const struct id_table *table, uint32_t id)
+{
+    return (id * 0x9E3779B97F4A7C15ull) >> (64 - __builtin_ctz(table->num_slots));
+}
+
+/**
+ * @brief Find the slot of an id, or the free slot where it would go.
+ */
+static unsigned id_table_probe(const struct id_table *table, uint32_t id)
+{
+    unsigned mask = table->num_slots - 1;
+    unsigned i = id_home(table, id);
+
+    while (table->slots[i].id && table->slots[i].id != id) {
+        i = (i + 1) & mask;
+    }
+
+    return i;
+}
+
+int id_table_init(struct id_table *table)
+{
+    table->slots = calloc(ID_TABLE_INITIAL_SLOTS, sizeof(*table->slots));
+    if (!table->slots) {
+        return -1;
+    }
+
+    table->num_slots = ID_TABLE_INITIAL_SLOTS;
+    table->count = 0;
+    return 0;
+}
+
+void id_table_deinit(struct id_table *table)
+{
+    free(table->slots);
+    table->slots = NULL;
+    table->num_slots = 0;
+    table->count = 0;
+}
+
+/**
+ * @brief Double the number of slots, keeping the table at most half full.
+ */
+static int id_table_grow(struct id_table *table)
+{
+    struct id_entry *old = table->slots;
+    unsigned old_num = table->num_slots;
+
+    table->slots = calloc(2 * old_num, sizeof(*table->slots));
+    if (!table->slots) {
+        table->slots = old;
+        return -1;
+    }
+    table->num_slots = 2 * old_num;
+
+    for (unsigned i = 0; i < old_num; ++i) {
+        if (old[i].id) {
+            table->slots[id_table_probe(table, old[i].id)] = old[i];
+        }
+    }
+
+    free(old);
+    return 0;
+}
+
+int id_table_set(struct id_table *table, uint32_t id, const char *name,
+        unsigned len)
+{
+    unsigned slot = id_table_probe(table, id);
+    struct id_entry *entry;
+
+    if (!table->slots[slot].id) {
+        if (2 * (table->count + 1) > table->num_slots) {
+            if (id_table_grow(table) == -1) {
+                errno = ENOMEM;
+                return -1;
+            }
+            slot = id_table_probe(table, id);
+        }
+        table->count++;
+    }
+
+    entry = &table->slots[slot];
+    entry->id = id;
+    memcpy(entry->name, name, len);
+    entry->name[len] = '\0';
+    return 0;
+}
+
+const char *id_table_find(const struct id_table *table, uint32_t id)
+{
+    const struct id_entry *entry = &table->slots[id_table_probe(table, id)];
+
+    return entry->id ? entry->name : NULL;
+}
+
+int id_table_remove(struct id_table *table, uint32_t id)
+{
+    unsigned mask = table->num_slots - 1;
+    unsigned hole = id_table_probe(table, id);
+    unsigned i = hole;
+
+    if (!table->slots[hole].id) {
+        return -1;
+    }
+
+    table->slots[hole].id = 0;
+    table->count--;
+
+    /* As for names, shift the rest of the probe run back into the hole. */
+    for (;;) {
+        unsigned home;
+
+        i = (i + 1) & mask;
+        if (!table->slots[i].id) {
+            break;
+        }
+
+        home = id_home(table, table->slots[i].id);
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            table->slots[hole] = table->slots[i];
+            table->slots[i].id = 0;
+            hole = i;
+        }
+    }
+
+    return 0;
+}
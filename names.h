@@ -0,0 +1,119 @@
+#ifndef NAMES_H
+#define NAMES_H
+
+#include <stdint.h>
+
+#include "chat.h"
+#include "conn_table.h"
+
+/*
+ * Name table: the members of the server by name, in an open addressing
+ * hash table with linear probing, so that a member is found in constant
+ * time whatever the number of connections. Names are not copied: each
+ * entry points to the one copy of its name, which its connection keeps
+ * for as long as it is in the table.
+ *
+ * The table is not thread-safe.
+ *
+ * Id table: the other way round for clients, the names of the members by
+ * id, see CHAT_FEATURE_SENDER_IDS. Names are copied.
+ */
+
+struct name_entry {
+    const char *name;                   /* NULL if the slot is free. */
+    unsigned len;
+    uint32_t hash;
+    uint32_t id;                        /* See CHAT_FEATURE_SENDER_IDS. */
+    unsigned shard;                     /* Of the connection. */
+    struct conn_handle handle;          /* In the conn_table of the shard. */
+};
+
+struct name_table {
+    struct name_entry *slots;
+    unsigned num_slots;                 /* Power of two. */
+    unsigned count;
+};
+
+struct id_entry {
+    uint32_t id;                        /* 0 if the slot is free. */
+    char name[CHAT_MEMBER_NAME_MAX_LEN + 1];
+};
+
+struct id_table {
+    struct id_entry *slots;
+    unsigned num_slots;                 /* Power of two. */
+    unsigned count;
+};
+
+/**
+ * @brief Initialise an empty name table.
+ *
+ * @return 0 on success, -1 on memory allocation error.
+ */
+int name_table_init(struct name_table *table);
+
+void name_table_deinit(struct name_table *table);
+
+/**
+ * @brief Add a name.
+ *
+ * @param name Name, not null-terminated, that must outlive the entry.
+ *
+ * @return 0 on success, -1 on error (errno EEXIST if the name is taken,
+ *         ENOMEM on memory allocation error).
+ */
+int name_table_insert(struct name_table *table, const char *name,
+        unsigned len, uint32_t id, unsigned shard, struct conn_handle handle);
+
+/**
+ * @brief Look up a name.
+ *
+ * @return Entry, valid until the table is next changed, or NULL.
+ */
+const struct name_entry *name_table_find(const struct name_table *table,
+        const char *name, unsigned len);
+
+/**
+ * @brief Remove a name.
+ *
+ * @return 0 on success, -1 if the name is not in the table.
+ */
+int name_table_remove(struct name_table *table, const char *name, unsigned len);
+
+/**
+ * @brief Initialise an empty id table.
+ *
+ * @return 0 on success, -1 on memory allocation error.
+ */
+int id_table_init(struct id_table *table);
+
+void id_table_deinit(struct id_table *table);
+
+/**
+ * @brief Set the name of an id, replacing any name it had.
+ *
+ * @param id Id, not 0.
+ * @param name Name, not null-terminated, of at most
+ *        CHAT_MEMBER_NAME_MAX_LEN bytes.
+ *
+ * @return 0 on success, -1 on memory allocation error.
+ */
+int id_table_set(struct id_table *table, uint32_t id, const char *name,
+        unsigned len);
+
+/**
+ * @brief Look up the name of an id.
+ *
+ * @return Null-terminated name, valid until the table is next changed, or
+ *         NULL.
+ */
+const char *id_table_find(const struct id_table *table, uint32_t id);
+
+/**
+ * @brief Remove an id.
+ *
+ * @return 0 on success, -1 if the id is not in the table.
+ */
+int id_table_remove(struct id_table *table, uint32_t id);
+
+#endif /* NAMES_H */
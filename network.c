@@ -3,35 +3,151 @@
 #include <errno.h>
 #include <unistd.h>
 #include <assert.h>
+#include <stddef.h>
 
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <pthread.h>
 
 #include "log.h"
 #include "network.h"
+#include "reactor.h"
 
-struct net_message *net_message_new(void)
+#define container_of(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+
+static _Thread_local struct net_stats stats;
+
+void net_get_stats(struct net_stats *out)
 {
-    struct net_message *ptr = malloc(sizeof(*ptr));
+    *out = stats;
+}
 
+/*
+ * Messages come from a pool per size class, see net_message_pool_configure.
+ * Sizes include the message header; most chat frames fit in the first two.
+ */
+static const unsigned message_class_sizes[NET_MSG_NUM_SIZE_CLASSES] = {
+    64, 256, 1024, sizeof(struct net_message) + NET_MSG_DATA_SIZE
+};
+static struct pool message_pools[NET_MSG_NUM_SIZE_CLASSES];
+static pthread_once_t message_pool_once = PTHREAD_ONCE_INIT;
+static size_t message_pool_max_cached = NET_MSG_POOL_MAX_CACHED;
+static bool message_pool_hugepages;
+static bool message_pool_ready;
+
+static void net_message_pool_init(void)
+{
+    for (unsigned i = 0; i < NET_MSG_NUM_SIZE_CLASSES; ++i) {
+        if (pool_init(&message_pools[i], message_class_sizes[i],
+                    message_pool_max_cached, message_pool_hugepages) == -1) {
+            log_error("Failed to create the message pools: %s\n",
+                    strerror(errno));
+            return;
+        }
+    }
+
+    message_pool_ready = true;
+}
+
+static unsigned net_message_capacity(const struct net_message *msg)
+{
+    return message_class_sizes[msg->size_class] - sizeof(struct net_message);
+}
+
+void net_message_pool_configure(size_t max_cached, bool hugepages)
+{
+    message_pool_max_cached = max_cached;
+    message_pool_hugepages = hugepages;
+}
+
+int net_message_pool_stats(unsigned size_class, struct pool_stats *stats)
+{
+    if (size_class >= NET_MSG_NUM_SIZE_CLASSES) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_once(&message_pool_once, net_message_pool_init);
+
+    if (message_pool_ready) {
+        pool_get_stats(&message_pools[size_class], stats);
+    }
+    else {
+        memset(stats, 0, sizeof(*stats));
+        stats->object_size = message_class_sizes[size_class];
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Allocate a message from the smallest size class that holds a frame
+ *        of frame_len bytes, frame_len <= NET_MSG_DATA_SIZE.
+ */
+static struct net_message *net_message_alloc(unsigned frame_len)
+{
+    struct net_message *ptr;
+    unsigned size_class = 0;
+
+    pthread_once(&message_pool_once, net_message_pool_init);
+
+    if (!message_pool_ready) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    while (sizeof(*ptr) + frame_len > message_class_sizes[size_class]) {
+        size_class++;
+    }
+
+    ptr = pool_alloc(&message_pools[size_class]);
     if (ptr) {
-        ptr->ref_count = 1;
+        atomic_init(&ptr->ref_count, 1);
+        ptr->size_class = size_class;
     }
 
     return ptr;
 }
 
+struct net_message *net_message_new(void)
+{
+    return net_message_alloc(NET_MSG_DATA_SIZE);
+}
+
+struct net_message *net_message_new_with_body(const void *body, unsigned len)
+{
+    struct net_message *msg;
+
+    if (NET_MSG_HEADER_LEN + len > NET_MSG_DATA_SIZE) {
+        errno = EMSGSIZE;
+        return NULL;
+    }
+
+    msg = net_message_alloc(NET_MSG_HEADER_LEN + len);
+    if (msg) {
+        net_message_set_body(msg, body, len);
+    }
+
+    return msg;
+}
+
 struct net_message *net_message_ref(struct net_message *msg)
 {
-    ++msg->ref_count;
+    atomic_fetch_add_explicit(&msg->ref_count, 1, memory_order_relaxed);
     return msg;
 }
 
 void net_message_unref(struct net_message *msg)
 {
-    assert(msg->ref_count > 0);
+    unsigned prev;
+
+    prev = atomic_fetch_sub_explicit(&msg->ref_count, 1, memory_order_acq_rel);
+    assert(prev > 0);
 
-    if (--msg->ref_count == 0) {
-        free(msg);
+    if (prev == 1) {
+        pool_free(&message_pools[msg->size_class], msg);
     }
 }
 
@@ -41,33 +157,252 @@ struct net_endpoint *net_endpoint_new(int fd)
     
     if (endpoint) {
         endpoint->fd = fd;
+        endpoint->rx_head = -1;
+        endpoint->rx_tail = -1;
     }
 
     return endpoint;
 }
 
-void net_endpoint_destroy(struct net_endpoint *endpoint)
+static void net_uring_release_rx(struct net_endpoint *endp)
+{
+    while (endp->rx_head != -1) {
+        int bid = endp->rx_head;
+        endp->rx_head = endp->uring->buf_next[bid];
+        uring_buffer_recycle(endp->uring, bid);
+    }
+
+    endp->rx_tail = -1;
+    endp->rx_offset = 0;
+}
+
+/**
+ * @brief Get the i:th message of the send queue, counting from the head.
+ */
+static struct net_message **net_send_queue_at(struct net_endpoint *endp, unsigned i)
+{
+    return &endp->send_queue[(endp->send_queue_head + i) &
+        (endp->send_queue_capacity - 1)];
+}
+
+/**
+ * @brief Remove the fully sent head message of the send queue.
+ */
+static void net_send_queue_pop(struct net_endpoint *endp)
+{
+    net_message_unref(*net_send_queue_at(endp, 0));
+    endp->num_bytes_sent = 0;
+    endp->send_queue_head = (endp->send_queue_head + 1) &
+        (endp->send_queue_capacity - 1);
+    endp->send_queue_count--;
+    stats.num_messages_sent++;
+}
+
+static void net_endpoint_free(struct net_endpoint *endpoint)
 {
     for (unsigned i = 0; i < endpoint->send_queue_count; ++i) {
-        net_message_unref(endpoint->send_queue[i]);
+        net_message_unref(*net_send_queue_at(endpoint, i));
+    }
+
+    free(endpoint->send_queue);
+
+    for (unsigned i = 0; i < endpoint->zerocopy_count; ++i) {
+        net_message_unref(endpoint->zerocopy_refs[i].msg);
     }
 
-    if (endpoint->receive_msg)
-        net_message_unref(endpoint->receive_msg);
+    free(endpoint->zerocopy_refs);
+
+    free(endpoint->rx_carry);
+
+    if (endpoint->uring)
+        net_uring_release_rx(endpoint);
 
     free(endpoint);
 }
 
-int net_enqueue_message(struct net_endpoint *endpoint, struct net_message *msg)
+void net_endpoint_destroy(struct net_endpoint *endpoint)
 {
-    if (endpoint->send_queue_count == NET_ENDP_SEND_QUEUE_SIZE) {
-        log_debug("Network endpoint send queue is full!\n");
+    if (endpoint->uring && endpoint->io_refs > 0) {
+        endpoint->destroyed = true;
+        net_uring_release_rx(endpoint);
+
+        if (endpoint->recv_armed)
+            uring_cancel(endpoint->uring, &endpoint->recv_op);
+        if (endpoint->send_in_flight)
+            uring_cancel(endpoint->uring, &endpoint->send_op);
+        return;
+    }
+
+    net_endpoint_free(endpoint);
+}
+
+/**
+ * @brief Drop fully sent messages from the head of the send queue.
+ *
+ * @param endp Endpoint.
+ * @param n Number of bytes sent, starting at num_bytes_sent of the head.
+ */
+static void net_consume_sent(struct net_endpoint *endp, size_t n);
+
+static int net_uring_arm_recv(struct net_endpoint *endp)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(endp->uring);
+
+    if (!sqe) {
         return -1;
     }
 
-    net_message_ref(msg);
-    endpoint->send_queue[endpoint->send_queue_count++] = msg;
-    return endpoint->send_queue_count;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = endp->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = (unsigned long)&endp->recv_op;
+
+    endp->recv_armed = true;
+    endp->io_refs++;
+    endp->uring->num_ops++;
+    return 0;
+}
+
+static unsigned net_uring_recv_complete(struct uring_op *op, int res, unsigned flags)
+{
+    struct net_endpoint *endp = container_of(op, struct net_endpoint, recv_op);
+    struct uring *ring = endp->uring;
+    bool terminated = !(flags & IORING_CQE_F_MORE);
+
+    if (flags & IORING_CQE_F_BUFFER) {
+        int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+        if (res > 0 && !endp->destroyed) {
+            ring->buf_len[bid] = res;
+            ring->buf_next[bid] = -1;
+
+            if (endp->rx_tail == -1)
+                endp->rx_head = bid;
+            else
+                ring->buf_next[endp->rx_tail] = bid;
+            endp->rx_tail = bid;
+        }
+        else {
+            uring_buffer_recycle(ring, bid);
+        }
+    }
+
+    if (terminated) {
+        endp->recv_armed = false;
+        endp->io_refs--;
+        ring->num_ops--;
+    }
+
+    if (endp->destroyed) {
+        if (endp->io_refs == 0)
+            net_endpoint_free(endp);
+        return 0;
+    }
+
+    if (res == 0) {
+        endp->rx_eof = true;
+    }
+    else if (res < 0 && res != -ENOBUFS) {
+        endp->io_error = -res;
+    }
+    else if (terminated && net_uring_arm_recv(endp) == -1) {
+        /* Out of buffers or the kernel ended the multishot: re-arm. */
+        endp->io_error = errno;
+    }
+
+    return REACTOR_IN;
+}
+
+static unsigned net_uring_send_complete(struct uring_op *op, int res, unsigned flags)
+{
+    struct net_endpoint *endp = container_of(op, struct net_endpoint, send_op);
+
+    endp->send_in_flight = false;
+    endp->io_refs--;
+    endp->uring->num_ops--;
+
+    if (endp->destroyed) {
+        if (endp->io_refs == 0)
+            net_endpoint_free(endp);
+        return 0;
+    }
+
+    endp->send_in_flight_count = 0;
+
+    if (res < 0) {
+        endp->io_error = -res;
+        return REACTOR_OUT | REACTOR_ERR;
+    }
+
+    net_consume_sent(endp, res);
+    return REACTOR_OUT;
+}
+
+int net_endpoint_attach_uring(struct net_endpoint *endp, struct uring *ring,
+        void *data)
+{
+    endp->uring = ring;
+    endp->recv_op.complete = net_uring_recv_complete;
+    endp->recv_op.data = data;
+    endp->send_op.complete = net_uring_send_complete;
+    endp->send_op.data = data;
+
+    if (net_uring_arm_recv(endp) == -1) {
+        endp->uring = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Copy received bytes out of an endpoint's io_uring buffers.
+ *
+ * @return Like recv(): number of bytes, 0 on peer shutdown or -1 on error
+ *         (EAGAIN if nothing has been received).
+ */
+static ssize_t net_uring_read(struct net_endpoint *endp, unsigned char *buf, size_t len)
+{
+    struct uring *ring = endp->uring;
+    size_t copied = 0;
+
+    while (copied < len && endp->rx_head != -1) {
+        int bid = endp->rx_head;
+        size_t avail = ring->buf_len[bid] - endp->rx_offset;
+        size_t n = len - copied < avail ? len - copied : avail;
+
+        memcpy(buf + copied, uring_buffer(ring, bid) + endp->rx_offset, n);
+        copied += n;
+        endp->rx_offset += n;
+
+        if (endp->rx_offset == ring->buf_len[bid]) {
+            endp->rx_head = ring->buf_next[bid];
+            if (endp->rx_head == -1)
+                endp->rx_tail = -1;
+            endp->rx_offset = 0;
+            uring_buffer_recycle(ring, bid);
+        }
+    }
+
+    if (copied > 0)
+        return copied;
+    if (endp->rx_eof)
+        return 0;
+
+    errno = endp->io_error ? endp->io_error : EAGAIN;
+    return -1;
+}
+
+static ssize_t net_read(struct net_endpoint *endp, unsigned char *buf, size_t len)
+{
+    if (endp->uring) {
+        return net_uring_read(endp, buf, len);
+    }
+
+    stats.num_syscalls++;
+    return recv(endp->fd, buf, len, 0);
 }
 
 static unsigned net_message_length(const struct net_message *msg)
@@ -77,6 +412,100 @@ static unsigned net_message_length(const struct net_message *msg)
     return len;
 }
 
+void net_endpoint_set_send_limit(struct net_endpoint *endpoint, size_t limit)
+{
+    endpoint->send_queue_limit = limit;
+}
+
+/**
+ * @brief Double the capacity of the send queue, unwrapping the ring.
+ */
+static int net_send_queue_grow(struct net_endpoint *endp)
+{
+    unsigned capacity = endp->send_queue_capacity ?
+        endp->send_queue_capacity * 2 : NET_ENDP_SEND_QUEUE_MIN_SIZE;
+    struct net_message **queue;
+
+    queue = malloc(capacity * sizeof(*queue));
+    if (!queue) {
+        return -1;
+    }
+
+    for (unsigned i = 0; i < endp->send_queue_count; ++i) {
+        queue[i] = *net_send_queue_at(endp, i);
+    }
+
+    free(endp->send_queue);
+    endp->send_queue = queue;
+    endp->send_queue_capacity = capacity;
+    endp->send_queue_head = 0;
+    return 0;
+}
+
+bool net_endpoint_has_room(const struct net_endpoint *endpoint, size_t len)
+{
+    return !endpoint->send_queue_limit || endpoint->send_queue_count == 0 ||
+        endpoint->send_queue_bytes + len <= endpoint->send_queue_limit;
+}
+
+int net_enqueue_message(struct net_endpoint *endpoint, struct net_message *msg)
+{
+    unsigned len = net_message_length(msg);
+
+    if (!net_endpoint_has_room(endpoint, len)) {
+        log_debug("Network endpoint send queue is full!\n");
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    if (endpoint->send_queue_count == endpoint->send_queue_capacity &&
+            net_send_queue_grow(endpoint) == -1) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    *net_send_queue_at(endpoint, endpoint->send_queue_count++) = net_message_ref(msg);
+    endpoint->send_queue_bytes += len;
+    return endpoint->send_queue_count;
+}
+
+unsigned net_drop_queued(struct net_endpoint *endpoint, size_t bytes)
+{
+    unsigned first, n_dropped = 0;
+    size_t freed = 0;
+
+    /* Messages that are partially sent or referenced by a send must stay. */
+    first = endpoint->send_in_flight_count;
+    if (first == 0 && endpoint->num_bytes_sent > 0) {
+        first = 1;
+    }
+
+    while (first + n_dropped < endpoint->send_queue_count &&
+            (endpoint->send_queue_limit == 0 ||
+             endpoint->send_queue_bytes - freed + bytes > endpoint->send_queue_limit)) {
+        struct net_message *msg = *net_send_queue_at(endpoint, first + n_dropped);
+
+        freed += net_message_length(msg);
+        net_message_unref(msg);
+        n_dropped++;
+    }
+
+    if (n_dropped == 0) {
+        return 0;
+    }
+
+    /* Close the gap by moving the kept head messages forward. */
+    for (unsigned i = first; i-- > 0;) {
+        *net_send_queue_at(endpoint, i + n_dropped) = *net_send_queue_at(endpoint, i);
+    }
+
+    endpoint->send_queue_head = (endpoint->send_queue_head + n_dropped) &
+        (endpoint->send_queue_capacity - 1);
+    endpoint->send_queue_count -= n_dropped;
+    endpoint->send_queue_bytes -= freed;
+    return n_dropped;
+}
+
 unsigned net_message_body_length(const struct net_message *msg)
 {
     return net_message_length(msg) - NET_MSG_HEADER_LEN;
@@ -102,7 +531,7 @@ static void net_message_set_body_length(struct net_message *msg, unsigned len)
 
 int net_message_set_body(struct net_message *msg, const void *body, unsigned len)
 {
-    if (NET_MSG_HEADER_LEN + len > NET_MSG_DATA_SIZE) {
+    if (NET_MSG_HEADER_LEN + len > net_message_capacity(msg)) {
         return -1;
     }
 
@@ -111,112 +540,487 @@ int net_message_set_body(struct net_message *msg, const void *body, unsigned len
     return 0;
 }
 
+int net_builder_init(struct net_builder *builder, unsigned max_len)
+{
+    if (NET_MSG_HEADER_LEN + max_len > NET_MSG_DATA_SIZE) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    builder->msg = net_message_alloc(NET_MSG_HEADER_LEN + max_len);
+    if (!builder->msg) {
+        return -1;
+    }
+
+    builder->len = 0;
+    builder->max_len = max_len;
+    builder->overflow = false;
+    return 0;
+}
+
+int net_builder_put(struct net_builder *builder, const void *data, unsigned len)
+{
+    if (len > builder->max_len - builder->len) {
+        builder->overflow = true;
+        return -1;
+    }
+
+    memcpy(net_message_body(builder->msg) + builder->len, data, len);
+    builder->len += len;
+    return 0;
+}
+
+struct net_message *net_builder_finish(struct net_builder *builder)
+{
+    struct net_message *msg = builder->msg;
+
+    builder->msg = NULL;
+
+    if (builder->overflow) {
+        net_message_unref(msg);
+        errno = EMSGSIZE;
+        return NULL;
+    }
+
+    net_message_set_body_length(msg, builder->len);
+    return msg;
+}
+
+void net_builder_discard(struct net_builder *builder)
+{
+    if (builder->msg) {
+        net_message_unref(builder->msg);
+        builder->msg = NULL;
+    }
+}
+
+static void net_consume_sent(struct net_endpoint *endp, size_t n)
+{
+    endp->total_bytes_sent += n;
+    endp->send_queue_bytes -= n;
+
+    while (n > 0 && endp->send_queue_count > 0) {
+        struct net_message *msg = *net_send_queue_at(endp, 0);
+        size_t remaining = net_message_length(msg) - endp->num_bytes_sent;
+
+        if (n < remaining) {
+            endp->num_bytes_sent += n;
+            break;
+        }
+
+        n -= remaining;
+        net_send_queue_pop(endp);
+    }
+}
+
 /**
- * @brief Resume or begin sending a network message.
+ * @brief Point iovecs at the unsent data of the head of the send queue.
  *
- * @param endp Endpoint.
- * @param msg Partially sent network message.
- * @param num_sent Pointer to the number of bytes sent so far.
- *                 Value shall be updated before returning.
+ * @return Number of iovecs filled in.
+ */
+static unsigned net_fill_send_iov(struct net_endpoint *endp, struct iovec *iov,
+        unsigned max_iov, size_t *total)
+{
+    unsigned n_iov = endp->send_queue_count < max_iov ?
+        endp->send_queue_count : max_iov;
+
+    *total = 0;
+
+    for (unsigned i = 0; i < n_iov; ++i) {
+        struct net_message *msg = *net_send_queue_at(endp, i);
+        unsigned offset = i == 0 ? endp->num_bytes_sent : 0;
+
+        iov[i].iov_base = msg->data + offset;
+        iov[i].iov_len = net_message_length(msg) - offset;
+        *total += iov[i].iov_len;
+    }
+
+    return n_iov;
+}
+
+/**
+ * @brief Prepare one vectored send of the head of the send queue.
+ */
+static int net_uring_process_send(struct net_endpoint *endp)
+{
+    struct io_uring_sqe *sqe;
+
+    if (endp->io_error) {
+        errno = endp->io_error;
+        return -1;
+    }
+
+    if (endp->send_in_flight || endp->send_queue_count == 0) {
+        return endp->send_queue_count;
+    }
+
+    sqe = uring_get_sqe(endp->uring);
+    if (!sqe) {
+        return -1;
+    }
+
+    endp->send_in_flight_count = net_fill_send_iov(endp, endp->send_iov,
+            NET_ENDP_SEND_IOV_MAX, &(size_t){0});
+
+    memset(&endp->send_hdr, 0, sizeof(endp->send_hdr));
+    endp->send_hdr.msg_iov = endp->send_iov;
+    endp->send_hdr.msg_iovlen = endp->send_in_flight_count;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = endp->fd;
+    sqe->addr = (unsigned long)&endp->send_hdr;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (unsigned long)&endp->send_op;
+
+    endp->send_in_flight = true;
+    endp->io_refs++;
+    endp->uring->num_ops++;
+
+    return endp->send_queue_count;
+}
+
+int net_endpoint_set_zerocopy(struct net_endpoint *endpoint, size_t min_bytes)
+{
+    if (min_bytes > 0 &&
+            setsockopt(endpoint->fd, SOL_SOCKET, SO_ZEROCOPY, &(int){1},
+                sizeof(int)) == -1) {
+        return -1;
+    }
+
+    endpoint->zerocopy_min = min_bytes;
+    return 0;
+}
+
+/**
+ * @brief Keep the messages of a zerocopy send referenced until it completes.
+ *
+ * @return 0 on success, -1 if out of memory.
+ */
+static int net_hold_zerocopy(struct net_endpoint *endp, unsigned n_msgs)
+{
+    if (endp->zerocopy_count + n_msgs > endp->zerocopy_capacity) {
+        unsigned capacity = endp->zerocopy_capacity ? endp->zerocopy_capacity : 64;
+        struct net_zerocopy_ref *refs;
+
+        while (capacity < endp->zerocopy_count + n_msgs) {
+            capacity *= 2;
+        }
+
+        refs = realloc(endp->zerocopy_refs, capacity * sizeof(*refs));
+        if (!refs) {
+            return -1;
+        }
+
+        endp->zerocopy_refs = refs;
+        endp->zerocopy_capacity = capacity;
+    }
+
+    for (unsigned i = 0; i < n_msgs; ++i) {
+        struct net_zerocopy_ref *ref = &endp->zerocopy_refs[endp->zerocopy_count++];
+
+        ref->msg = net_message_ref(*net_send_queue_at(endp, i));
+        ref->seq = endp->zerocopy_seq;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Release the messages of the zerocopy sends lo to hi (inclusive).
+ */
+static void net_release_zerocopy(struct net_endpoint *endp, unsigned lo, unsigned hi)
+{
+    unsigned kept = 0;
+
+    for (unsigned i = 0; i < endp->zerocopy_count; ++i) {
+        struct net_zerocopy_ref *ref = &endp->zerocopy_refs[i];
+
+        /* Sequence numbers wrap around. */
+        if (ref->seq - lo <= hi - lo) {
+            net_message_unref(ref->msg);
+        }
+        else {
+            endp->zerocopy_refs[kept++] = *ref;
+        }
+    }
+
+    endp->zerocopy_count = kept;
+}
+
+int net_reap_zerocopy(struct net_endpoint *endp)
+{
+    unsigned char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+    struct msghdr hdr;
+    struct cmsghdr *cmsg;
+
+    while (endp->zerocopy_count > 0) {
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_control = control;
+        hdr.msg_controllen = sizeof(control);
+
+        stats.num_syscalls++;
+        if (recvmsg(endp->fd, &hdr, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+
+        for (cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+            struct sock_extended_err *err;
+
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+                    !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+
+            err = (struct sock_extended_err *)CMSG_DATA(cmsg);
+            if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+
+            net_release_zerocopy(endp, err->ee_info, err->ee_data);
+
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                /* E.g. loopback: pinning pages only adds overhead. */
+                log_debug("Zerocopy send was copied, disabling zerocopy.\n");
+                endp->zerocopy_min = 0;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Send the head of the send queue with one sendmsg().
  *
- * @return Positive integer indicating fully sent message,
- *         -1 indicating failure (check errno).
+ * @return 1 if everything that was offered got sent, 0 if the socket is
+ *         full, -1 on error.
  */
-static int net_process_one_send(
-        struct net_endpoint *endp,
-        struct net_message *msg,
-        unsigned *num_sent)
+static int net_sendmsg_queue(struct net_endpoint *endp)
 {
-    unsigned msg_len;
+    struct iovec iov[NET_ENDP_SEND_IOV_MAX];
+    struct msghdr hdr = { .msg_iov = iov };
+    bool zerocopy;
+    size_t total;
     ssize_t n;
 
-    msg_len = net_message_length(msg);
+    hdr.msg_iovlen = net_fill_send_iov(endp, iov, NET_ENDP_SEND_IOV_MAX, &total);
 
-    while (*num_sent < msg_len) {
-        n = send(endp->fd, msg->data + *num_sent, msg_len - *num_sent, 0);
-        if (n < 0) {
-            break;
+    zerocopy = endp->zerocopy_min > 0 && total >= endp->zerocopy_min &&
+        net_hold_zerocopy(endp, hdr.msg_iovlen) == 0;
+
+    stats.num_syscalls++;
+    n = sendmsg(endp->fd, &hdr, MSG_NOSIGNAL | (zerocopy ? MSG_ZEROCOPY : 0));
+
+    if (zerocopy && n < 0) {
+        /* Nothing was sent, so the kernel holds no references. */
+        net_release_zerocopy(endp, endp->zerocopy_seq, endp->zerocopy_seq);
+
+        /* Out of socket option memory for notifications: copy instead. */
+        if (errno == ENOBUFS) {
+            stats.num_syscalls++;
+            n = sendmsg(endp->fd, &hdr, MSG_NOSIGNAL);
         }
+    }
+    else if (zerocopy) {
+        endp->zerocopy_seq++;
+        stats.num_zerocopy_sends++;
+    }
 
-        *num_sent += n;
+    if (n < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
     }
 
-    return n;
+    net_consume_sent(endp, n);
+    return (size_t)n == total;
 }
 
 int net_process_send(struct net_endpoint *endp)
 {
-    struct net_message *msg;
-    unsigned n_processed;
-    int err = 0;
+    int rc;
+
+    if (endp->uring) {
+        return net_uring_process_send(endp);
+    }
 
-    for (n_processed = 0; n_processed < endp->send_queue_count; ++n_processed) {
-        msg = endp->send_queue[n_processed];
-        if (net_process_one_send(endp, msg, &endp->num_bytes_sent) > 0) {
-            /* Message sent fully. */
-            net_message_unref(msg);
-            endp->num_bytes_sent = 0;
+    while (endp->send_queue_count > 0) {
+        rc = net_sendmsg_queue(endp);
+        if (rc == -1) {
+            return -1;
         }
-        else {
-            err = errno;
+        else if (rc == 0) {
             break;
         }
     }
 
-    /* Shift the queue. */
-    endp->send_queue_count -= n_processed;
-    if (endp->send_queue_count > 0 && n_processed > 0) {
-        memmove(endp->send_queue, endp->send_queue + n_processed,
-                endp->send_queue_count * sizeof(*endp->send_queue));
+    return endp->send_queue_count;
+}
+
+/* One read per batch lands here; only leftovers are copied per endpoint. */
+static _Thread_local unsigned char recv_buffer[NET_RECV_BUFFER_SIZE];
+
+/**
+ * @brief Cut the frame at the start of buf out into a new message.
+ *
+ * @return Frame length, 0 if buf does not hold a complete frame, or -1 on
+ *         error (check errno).
+ */
+static int net_slice_frame(const unsigned char *buf, unsigned len,
+        struct net_message **msg)
+{
+    unsigned frame_len;
+
+    if (len < NET_MSG_HEADER_LEN) {
+        return 0;
+    }
+
+    frame_len = (buf[0] & 0xffu) << 8 | buf[1] & 0xffu;
+    if (frame_len < NET_MSG_HEADER_LEN || frame_len > NET_MSG_DATA_SIZE) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if (len < frame_len) {
+        return 0;
     }
 
-    if (err) {
-        errno = err;
+    /* Only as large as the frame, most are far below the maximum. */
+    *msg = net_message_alloc(frame_len);
+    if (!*msg) {
+        errno = ENOMEM;
         return -1;
     }
 
-    return endp->send_queue_count;
+    memcpy((*msg)->data, buf, frame_len);
+    stats.num_messages_received++;
+    return frame_len;
 }
 
-int net_receive(struct net_endpoint *endp, struct net_message **msg)
+/**
+ * @brief Slice complete frames out of a buffer.
+ *
+ * @param consumed Set to the number of bytes sliced.
+ *
+ * @return Number of messages stored, or -1 if none could be due to an error.
+ */
+static int net_slice_frames(const unsigned char *buf, unsigned len,
+        struct net_message **msgs, unsigned max_msgs, unsigned *consumed)
 {
-    unsigned needed;
-    ssize_t n;
+    unsigned count = 0;
+    int n;
+
+    *consumed = 0;
+
+    while (count < max_msgs) {
+        n = net_slice_frame(buf + *consumed, len - *consumed, &msgs[count]);
+        if (n == -1) {
+            /* Report the error once the frames before it are handled. */
+            return count > 0 ? (int)count : -1;
+        }
+        else if (n == 0) {
+            break;
+        }
+
+        *consumed += n;
+        count++;
+    }
+
+    return count;
+}
+
+/**
+ * @brief Keep the unconsumed bytes of a buffer for the next batch.
+ *
+ * @return 0 on success, -1 if out of memory.
+ */
+static int net_keep_carry(struct net_endpoint *endp, const unsigned char *buf,
+        unsigned len)
+{
+    unsigned char *carry = NULL;
 
-    /* Get receive buffer. */
-    if (!endp->receive_msg) {
-        endp->receive_msg = net_message_new();
-        if (!endp->receive_msg) {
+    if (len > 0) {
+        carry = malloc(len);
+        if (!carry) {
             errno = ENOMEM;
             return -1;
         }
+        memcpy(carry, buf, len);
+    }
+
+    free(endp->rx_carry);
+    endp->rx_carry = carry;
+    endp->rx_carry_len = len;
+    endp->rx_carry_start = 0;
+    return 0;
+}
+
+int net_receive_batch(struct net_endpoint *endp, struct net_message **msgs,
+        unsigned max_msgs)
+{
+    unsigned carried, consumed;
+    ssize_t n;
+    int count;
+
+    carried = endp->rx_carry_len - endp->rx_carry_start;
+
+    if (carried > 0) {
+        /* Frames left over from the last read go first. */
+        count = net_slice_frames(endp->rx_carry + endp->rx_carry_start, carried,
+                msgs, max_msgs, &consumed);
+        if (count != 0) {
+            endp->rx_carry_start += consumed;
+            if (endp->rx_carry_start == endp->rx_carry_len) {
+                net_keep_carry(endp, NULL, 0);
+            }
+            return count;
+        }
+
+        /* Less than one frame is carried over, so it fits in front of a read. */
+        memcpy(recv_buffer, endp->rx_carry + endp->rx_carry_start, carried);
     }
 
-    if (endp->num_bytes_received < NET_MSG_HEADER_LEN) {
-        /* Need to receive header first. */
-        needed = NET_MSG_HEADER_LEN;
+    n = net_read(endp, recv_buffer + carried, sizeof(recv_buffer) - carried);
+    if (n <= 0) {
+        return n;
     }
-    else {
-        needed = net_message_length(endp->receive_msg);
+
+    count = net_slice_frames(recv_buffer, carried + n, msgs, max_msgs, &consumed);
+    if (count == -1) {
+        return -1;
     }
 
-    while (endp->num_bytes_received < needed) {
-        n = recv(endp->fd, endp->receive_msg->data + endp->num_bytes_received,
-                needed - endp->num_bytes_received, 0);
-        if (n <= 0) {
-            return n;
+    if (net_keep_carry(endp, recv_buffer + consumed, carried + n - consumed) == -1) {
+        while (count-- > 0) {
+            net_message_unref(msgs[count]);
         }
+        return -1;
+    }
 
-        endp->num_bytes_received += n;
-        if (endp->num_bytes_received == NET_MSG_HEADER_LEN) {
-            needed = net_message_length(endp->receive_msg);
-        }
+    if (count == 0) {
+        errno = EAGAIN;
+        return -1;
     }
 
-    /* Message received fully. */
-    *msg = endp->receive_msg;
-    endp->receive_msg = NULL;
-    endp->num_bytes_received = 0;
+    return count;
+}
+
+bool net_has_carried_frame(const struct net_endpoint *endp)
+{
+    const unsigned char *carry = endp->rx_carry + endp->rx_carry_start;
+    unsigned carried = endp->rx_carry_len - endp->rx_carry_start;
+
+    /* A bad length counts too, so that the next call reports it. */
+    return carried >= NET_MSG_HEADER_LEN &&
+        ((carry[0] & 0xffu) << 8 | carry[1] & 0xffu) <= carried;
+}
+
+int net_receive(struct net_endpoint *endp, struct net_message **msg)
+{
+    int rc = net_receive_batch(endp, msg, 1);
+
+    if (rc <= 0) {
+        return rc;
+    }
 
-    return needed;
+    return net_message_length(*msg);
 }
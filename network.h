@@ -1,39 +1,191 @@
 #ifndef NETWORK_H
 #define NETWORK_H
 
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "pool.h"
+#include "uring.h"
+
 #define NET_MSG_DATA_SIZE                       2048u
 #define NET_MSG_LEN_DATA_SIZE                   2u
 #define NET_MSG_HEADER_LEN                      NET_MSG_LEN_DATA_SIZE
-#define NET_ENDP_SEND_QUEUE_SIZE                16u
+#define NET_ENDP_SEND_QUEUE_MIN_SIZE            16u
+#define NET_ENDP_SEND_IOV_MAX                   64u
+#define NET_RECV_BUFFER_SIZE                    65536u
+#define NET_MSG_POOL_MAX_CACHED                 4096u
+#define NET_MSG_NUM_SIZE_CLASSES                4u
 
+/*
+ * Network messages are reference counted and may be shared by endpoints
+ * owned by different threads. The contents must not change once shared.
+ *
+ * A message is allocated from the smallest size class its frame fits in;
+ * the largest class holds frames of NET_MSG_DATA_SIZE bytes.
+ */
 struct net_message {
-    unsigned ref_count;
-    unsigned char data[NET_MSG_DATA_SIZE];
+    atomic_uint ref_count;
+    unsigned size_class;
+    unsigned char data[];                   /* Frame: header and body. */
+};
+
+/*
+ * Builds the body of a network message in place, see net_builder_init.
+ */
+struct net_builder {
+    struct net_message *msg;
+    unsigned len;                           /* Body bytes written. */
+    unsigned max_len;                       /* Body bytes reserved. */
+    bool overflow;                          /* A write did not fit. */
+};
+
+/* A message the kernel may still read from after a MSG_ZEROCOPY send. */
+struct net_zerocopy_ref {
+    struct net_message *msg;
+    unsigned seq;                           /* Zerocopy send it belongs to. */
 };
 
 struct net_endpoint {
     void *identifier;
     int fd;
     unsigned num_bytes_sent;
-    unsigned num_bytes_received;
+    unsigned long long total_bytes_sent;    /* Send progress ever made. */
+
+    /*
+     * Received bytes that do not form a complete frame yet, or complete
+     * frames that did not fit in the last batch. NULL when empty.
+     */
+    unsigned char *rx_carry;
+    unsigned rx_carry_len;
+    unsigned rx_carry_start;
+
+    /*
+     * Send queue: a ring of messages that grows as needed. num_bytes_sent
+     * applies to the message at send_queue_head.
+     */
+    struct net_message **send_queue;
+    unsigned send_queue_capacity;           /* Power of two. */
+    unsigned send_queue_head;
     unsigned send_queue_count;
-    struct net_message *receive_msg;
-    struct net_message *send_queue[NET_ENDP_SEND_QUEUE_SIZE];
+    size_t send_queue_bytes;                /* Bytes not sent yet. */
+    size_t send_queue_limit;                /* Budget of send_queue_bytes or 0. */
+
+    /* MSG_ZEROCOPY state, see net_endpoint_set_zerocopy. */
+    size_t zerocopy_min;                    /* Smallest zerocopy send or 0. */
+    unsigned zerocopy_seq;                  /* Number of zerocopy sends. */
+    struct net_zerocopy_ref *zerocopy_refs;
+    unsigned zerocopy_count;
+    unsigned zerocopy_capacity;
+
+    /* io_uring state, used if uring is not NULL. */
+    struct uring *uring;
+    struct uring_op recv_op;
+    struct uring_op send_op;
+    struct msghdr send_hdr;
+    struct iovec send_iov[NET_ENDP_SEND_IOV_MAX];
+    unsigned send_in_flight_count;          /* Messages the send refers to. */
+    unsigned io_refs;           /* Operations that have not completed. */
+    int rx_head;                /* Chain of received buffers or -1. */
+    int rx_tail;
+    unsigned rx_offset;         /* Bytes consumed of the first buffer. */
+    int io_error;
+    bool recv_armed;
+    bool send_in_flight;
+    bool rx_eof;
+    bool destroyed;             /* Freed when the last operation completes. */
+};
+
+/* Per-thread I/O counters. */
+struct net_stats {
+    unsigned long long num_syscalls;
+    unsigned long long num_messages_sent;
+    unsigned long long num_messages_received;
+    unsigned long long num_zerocopy_sends;
 };
 
 struct net_endpoint *net_endpoint_new(int fd);
 
+/**
+ * @brief Destroy an endpoint.
+ *
+ * @note With io_uring, outstanding operations are cancelled and the endpoint
+ * is freed once they complete. The caller may close the fd right away.
+ */
 void net_endpoint_destroy(struct net_endpoint *endpoint);
 
 /**
- * @brief Allocate memory for a network message buffer.
+ * @brief Perform the I/O of an endpoint through io_uring.
+ *
+ * @description A multishot receive into the ring's provided buffers is armed
+ * immediately. net_receive then consumes the received buffers and
+ * net_process_send prepares one vectored send of the whole send queue.
+ * Nothing is submitted until the reactor owning the ring waits. Completions
+ * are reported by the reactor as REACTOR_IN/REACTOR_OUT events with data.
+ *
+ * @param endpoint Endpoint.
+ * @param ring Ring of the reactor.
+ * @param data User data reported with the endpoint's events.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int net_endpoint_attach_uring(struct net_endpoint *endpoint, struct uring *ring,
+        void *data);
+
+/**
+ * @brief Get the I/O counters of the calling thread.
+ */
+void net_get_stats(struct net_stats *stats);
+
+/**
+ * @brief Configure the pools network messages are allocated from.
+ *
+ * @note Must be called before the first message is allocated.
+ *
+ * @param max_cached Number of free messages of each size class to keep
+ *        before giving memory back to the system (default
+ *        NET_MSG_POOL_MAX_CACHED).
+ * @param hugepages Back the pools with huge pages if available.
+ */
+void net_message_pool_configure(size_t max_cached, bool hugepages);
+
+/**
+ * @brief Get the statistics of the pool of a message size class.
+ *
+ * @param size_class Size class, 0 <= size_class < NET_MSG_NUM_SIZE_CLASSES.
+ * @param stats Storage for the statistics.
+ *
+ * @return 0 on success, -1 if there is no such size class.
+ */
+int net_message_pool_stats(unsigned size_class, struct pool_stats *stats);
+
+/**
+ * @brief Allocate memory for a network message buffer that can hold a body
+ *        of any length.
+ *
+ * @note Prefer net_message_new_with_body, which allocates only as much as
+ * the body needs.
  *
  * @return Network message of ref count 1 or NULL on memory allocation error.
  */
 struct net_message *net_message_new(void);
 
+/**
+ * @brief Allocate a network message sized for a body and copy the body in.
+ *
+ * @param body Network message body.
+ * @param len Length of body.
+ *
+ * @return Network message of ref count 1 or NULL on error (errno EMSGSIZE
+ *         if body is too long, ENOMEM on memory allocation error).
+ */
+struct net_message *net_message_new_with_body(const void *body, unsigned len);
+
 /**
  * @brief Increment the reference count of a network message.
+ *        Safe to call from any thread holding a reference.
  *
  * @param msg Network message.
  *
@@ -43,7 +195,7 @@ struct net_message *net_message_ref(struct net_message *msg);
 
 /**
  * @brief Decrement the reference count of a network message,
- *        possibly freeing it.
+ *        possibly freeing it. Safe to call from any thread.
  *
  * @note If the reference count reaches 0, further usage of msg is not allowed.
  *
@@ -58,7 +210,8 @@ void net_message_unref(struct net_message *msg);
  * @param body Network message body.
  * @param len Length of body.
  *
- * @return On success, zero. If body is too long, return -1. 
+ * @return On success, zero. If body is too long for the size class of the
+ *         message, return -1.
  */
 int net_message_set_body(struct net_message *msg, const void *body, unsigned len);
 
@@ -80,31 +233,157 @@ unsigned char *net_message_body(struct net_message *msg);
  */
 unsigned net_message_body_length(const struct net_message *msg);
 
+/**
+ * @brief Start building a network message.
+ *
+ * @description The body is written straight into a pooled message with
+ *              net_builder_put and the length header is filled in by
+ *              net_builder_finish, so the body is never copied.
+ *
+ * @param builder Builder.
+ * @param max_len Largest body that will be written; decides the size class
+ *        of the message.
+ *
+ * @return 0 on success, -1 on error (errno EMSGSIZE if max_len is too long
+ *         for a message, ENOMEM on memory allocation error).
+ */
+int net_builder_init(struct net_builder *builder, unsigned max_len);
+
+/**
+ * @brief Append data to the body of a message being built.
+ *
+ * @note A write beyond max_len is dropped and makes net_builder_finish fail,
+ * so callers may check for errors only once at the end.
+ *
+ * @return 0 on success, -1 if data does not fit.
+ */
+int net_builder_put(struct net_builder *builder, const void *data, unsigned len);
+
+/**
+ * @brief Finish building a message.
+ *
+ * @return Network message of ref count 1, or NULL (errno EMSGSIZE) if a
+ *         write did not fit, in which case the message is freed.
+ */
+struct net_message *net_builder_finish(struct net_builder *builder);
+
+/**
+ * @brief Abandon a message being built.
+ */
+void net_builder_discard(struct net_builder *builder);
+
+/**
+ * @brief Limit the number of unsent bytes in the send queue of an endpoint.
+ *
+ * @param endpoint Endpoint.
+ * @param limit Byte budget or 0 for no limit.
+ */
+void net_endpoint_set_send_limit(struct net_endpoint *endpoint, size_t limit);
+
+/**
+ * @brief Send large batches from the send queue with MSG_ZEROCOPY.
+ *
+ * @description The pages of the messages are then handed to the network
+ * stack instead of being copied, and the messages are kept referenced until
+ * the kernel reports the send complete on the socket's error queue, which
+ * the reactor signals as REACTOR_ERR (see net_reap_zerocopy). If the kernel
+ * reports that it had to copy anyway, zerocopy is turned off again.
+ *
+ * @note Not used for endpoints attached to io_uring.
+ *
+ * @param endpoint Endpoint.
+ * @param min_bytes Smallest send to use zerocopy for, or 0 to disable.
+ *
+ * @return 0 on success, -1 if the socket does not support it (check errno).
+ */
+int net_endpoint_set_zerocopy(struct net_endpoint *endpoint, size_t min_bytes);
+
+/**
+ * @brief Release the messages of completed zerocopy sends.
+ *
+ * @return 0 on success, -1 on error (check errno).
+ */
+int net_reap_zerocopy(struct net_endpoint *endpoint);
+
+/**
+ * @brief Check whether net_enqueue_message would accept a message of len
+ *        bytes, header included, into the send queue budget.
+ */
+bool net_endpoint_has_room(const struct net_endpoint *endpoint, size_t len);
+
 /**
  * @brief Enqueue a network message to be sent to an endpoint.
  *
+ * @note A message is always accepted into an empty queue, even if it is
+ * larger than the budget.
+ *
  * @param endpoint Endpoint.
  * @param msg Valid positive length network message.
  *
- * @return On success, the new queue length. On error, -1.
+ * @return On success, the new queue length. On error, -1 and errno is
+ *         ENOBUFS if the message does not fit in the budget or ENOMEM.
  */
 int net_enqueue_message(struct net_endpoint *endpoint, struct net_message *msg);
 
+/**
+ * @brief Drop the oldest queued messages that have not begun sending.
+ *
+ * @param endpoint Endpoint.
+ * @param bytes Number of bytes to make room for in the budget.
+ *
+ * @return Number of messages dropped.
+ */
+unsigned net_drop_queued(struct net_endpoint *endpoint, size_t bytes);
+
 /**
  * @brief Send as much queued data as possible to an endpoint.
  *
+ * @description Queued messages are gathered into vectored sends of up to
+ * NET_ENDP_SEND_IOV_MAX messages.
+ *
+ * @note With io_uring, the send is only prepared and the queue shrinks when
+ * it completes; a positive return value then means "call again on
+ * REACTOR_OUT".
+ *
  * @param endpoint Endpoint.
  *
- * @return Send queue length or -1 if an error occurred (check errno).
+ * @return Send queue length, which is positive if the socket cannot take
+ *         more data right now, or -1 if an error occurred (check errno).
  */
 int net_process_send(struct net_endpoint *endpoint);
 
+/**
+ * @brief Receive a batch of network messages.
+ *
+ * @description Complete frames left over from the previous call are
+ * returned first. Otherwise as many bytes as are available (up to
+ * NET_RECV_BUFFER_SIZE) are read with a single read and every complete frame
+ * in them is returned, up to max_msgs. A trailing partial frame is kept for
+ * the next call.
+ *
+ * @param endpoint Endpoint.
+ * @param msgs Storage for the received messages. The caller owns them.
+ * @param max_msgs Capacity of msgs.
+ *
+ * @return Number of messages stored, 0 if the peer has shut down, or -1 on
+ *         error (check errno; EAGAIN if no complete message is available).
+ */
+int net_receive_batch(struct net_endpoint *endpoint, struct net_message **msgs,
+        unsigned max_msgs);
+
+/**
+ * @brief Check whether a complete frame was carried over from the last read,
+ *        which the next net_receive_batch returns without reading.
+ */
+bool net_has_carried_frame(const struct net_endpoint *endpoint);
+
 /**
  * @brief Resume or begin receiving a network message.
  *
  * @description Resume or begin receiving a network message. When the message
  * is complete, it is stored in msg. If an error occurs, errno is set and the
  * function returns -1. If the peer has shutdown, return 0.
+ * Same as net_receive_batch with room for one message.
  *
  * @param endpoint Endpoint.
  * @param msg Pointer to storage for the received message.
@@ -0,0 +1,390 @@
+#include <stdint.h>
+#include <errno.h>
+
+#include <sys/mman.h>
+
+#include "log.h"
+#include "pool.h"
+
+#define POOL_CACHE_LINE                 64u
+#define POOL_SLAB_HEADER_SIZE           \
+    ((sizeof(struct pool_slab) + POOL_CACHE_LINE - 1) & ~(size_t)(POOL_CACHE_LINE - 1))
+
+struct pool_free_object {
+    struct pool_free_object *next;
+};
+
+/* Header at the start of every slab; slabs are aligned to POOL_SLAB_SIZE. */
+struct pool_slab {
+    struct pool_slab *prev;             /* In the available list. */
+    struct pool_slab *next;
+    struct pool_free_object *free_list;
+    unsigned num_used;                  /* Objects out of the slab. */
+    unsigned num_carved;                /* Objects ever taken from the slab. */
+    bool huge;
+};
+
+/* Free objects cached by a thread, most recently freed last. */
+struct pool_magazine {
+    unsigned count;
+    void *objects[POOL_MAGAZINE_SIZE];
+};
+
+static _Thread_local struct pool_magazine magazines[POOL_MAX_POOLS];
+static _Thread_local bool thread_registered;
+
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pool *pools[POOL_MAX_POOLS];
+static unsigned num_pools;
+
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;
+
+static void pool_thread_exit(void *arg)
+{
+    pool_flush_thread_cache();
+}
+
+static void pool_create_thread_key(void)
+{
+    pthread_key_create(&thread_key, pool_thread_exit);
+}
+
+/**
+ * @brief Make sure the magazines of the calling thread are flushed when it
+ *        exits.
+ */
+static void pool_register_thread(void)
+{
+    pthread_once(&thread_key_once, pool_create_thread_key);
+    pthread_setspecific(thread_key, magazines);
+    thread_registered = true;
+}
+
+static struct pool_slab *pool_slab_of(void *object)
+{
+    return (struct pool_slab *)((uintptr_t)object & ~(uintptr_t)(POOL_SLAB_SIZE - 1));
+}
+
+static void pool_link_slab(struct pool *pool, struct pool_slab *slab)
+{
+    slab->prev = NULL;
+    slab->next = pool->available;
+    if (pool->available) {
+        pool->available->prev = slab;
+    }
+    pool->available = slab;
+}
+
+static void pool_unlink_slab(struct pool *pool, struct pool_slab *slab)
+{
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    }
+    else {
+        pool->available = slab->next;
+    }
+
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+/**
+ * @brief Map a new slab and make it available.
+ *
+ * @return Slab or NULL on memory allocation error.
+ */
+static struct pool_slab *pool_map_slab(struct pool *pool)
+{
+    struct pool_slab *slab;
+    char *mem = MAP_FAILED;
+    bool huge = false;
+    size_t head;
+
+    if (pool->hugepages) {
+        mem = mmap(NULL, POOL_SLAB_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+        if (mem != MAP_FAILED && ((uintptr_t)mem & (POOL_SLAB_SIZE - 1))) {
+            /* Huge pages of some other size. */
+            munmap(mem, POOL_SLAB_SIZE);
+            mem = MAP_FAILED;
+        }
+
+        huge = mem != MAP_FAILED;
+    }
+
+    if (mem == MAP_FAILED) {
+        /* Map twice the size and trim it down to an aligned slab. */
+        mem = mmap(NULL, 2 * POOL_SLAB_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        head = -(uintptr_t)mem & (POOL_SLAB_SIZE - 1);
+        if (head > 0) {
+            munmap(mem, head);
+        }
+        munmap(mem + head + POOL_SLAB_SIZE, POOL_SLAB_SIZE - head);
+        mem += head;
+
+        if (pool->hugepages) {
+            log_info("No huge pages available for a pool of %zu byte "
+                     "objects, using transparent huge pages\n",
+                     pool->object_size);
+
+            /* Do not try again for every slab. */
+            pool->hugepages = false;
+            madvise(mem, POOL_SLAB_SIZE, MADV_HUGEPAGE);
+        }
+    }
+
+    /* Anonymous memory is zeroed. */
+    slab = (struct pool_slab *)mem;
+    slab->huge = huge;
+
+    pool->num_slabs++;
+    pool->num_huge_slabs += huge;
+    pool_link_slab(pool, slab);
+
+    return slab;
+}
+
+static void pool_unmap_slab(struct pool *pool, struct pool_slab *slab)
+{
+    pool_unlink_slab(pool, slab);
+    pool->num_carved -= slab->num_carved;
+    pool->num_slabs--;
+    pool->num_huge_slabs -= slab->huge;
+    munmap(slab, POOL_SLAB_SIZE);
+}
+
+/**
+ * @brief Take a free object from the slabs. Called with the lock held.
+ *
+ * @return Object or NULL on memory allocation error.
+ */
+static void *pool_take(struct pool *pool)
+{
+    struct pool_slab *slab = pool->available;
+    void *object;
+
+    if (!slab) {
+        slab = pool_map_slab(pool);
+        if (!slab) {
+            return NULL;
+        }
+    }
+
+    if (slab->free_list) {
+        object = slab->free_list;
+        slab->free_list = slab->free_list->next;
+    }
+    else {
+        /* Untouched memory, so that a fresh slab costs no page faults. */
+        object = (char *)slab + POOL_SLAB_HEADER_SIZE +
+            slab->num_carved++ * pool->object_size;
+        pool->num_carved++;
+    }
+
+    if (++slab->num_used == pool->objects_per_slab) {
+        pool_unlink_slab(pool, slab);
+    }
+
+    return object;
+}
+
+/**
+ * @brief Return a free object to its slab. Called with the lock held.
+ */
+static void pool_give(struct pool *pool, void *object)
+{
+    struct pool_slab *slab = pool_slab_of(object);
+    struct pool_free_object *free_object = object;
+    size_t cached;
+
+    free_object->next = slab->free_list;
+    slab->free_list = free_object;
+
+    if (slab->num_used-- == pool->objects_per_slab) {
+        pool_link_slab(pool, slab);
+    }
+
+    if (slab->num_used == 0) {
+        cached = pool->num_carved -
+            atomic_load_explicit(&pool->live, memory_order_relaxed);
+
+        if (cached > pool->max_cached) {
+            pool_unmap_slab(pool, slab);
+        }
+    }
+}
+
+int pool_init(struct pool *pool, size_t object_size, size_t max_cached,
+        bool hugepages)
+{
+    size_t size = (object_size + POOL_CACHE_LINE - 1) &
+        ~(size_t)(POOL_CACHE_LINE - 1);
+
+    if (size == 0 || size > POOL_SLAB_SIZE - POOL_SLAB_HEADER_SIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&pools_lock);
+
+    if (num_pools == POOL_MAX_POOLS) {
+        pthread_mutex_unlock(&pools_lock);
+        errno = ENOSPC;
+        return -1;
+    }
+
+    pool->index = num_pools;
+    pool->object_size = size;
+    pool->objects_per_slab = (POOL_SLAB_SIZE - POOL_SLAB_HEADER_SIZE) / size;
+    pool->max_cached = max_cached;
+    pool->hugepages = hugepages;
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->available = NULL;
+    pool->num_carved = 0;
+    pool->num_slabs = 0;
+    pool->num_huge_slabs = 0;
+    atomic_init(&pool->live, 0);
+    atomic_init(&pool->high_water, 0);
+
+    pools[num_pools++] = pool;
+
+    pthread_mutex_unlock(&pools_lock);
+    return 0;
+}
+
+void pool_deinit(struct pool *pool)
+{
+    struct pool_magazine *magazine = &magazines[pool->index];
+
+    pthread_mutex_lock(&pools_lock);
+    pools[pool->index] = NULL;
+    pthread_mutex_unlock(&pools_lock);
+
+    /* Nothing is live, so every slab is available once this is returned. */
+    pthread_mutex_lock(&pool->lock);
+    while (magazine->count > 0) {
+        pool_give(pool, magazine->objects[--magazine->count]);
+    }
+
+    while (pool->available) {
+        pool_unmap_slab(pool, pool->available);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    pthread_mutex_destroy(&pool->lock);
+}
+
+void *pool_alloc(struct pool *pool)
+{
+    struct pool_magazine *magazine = &magazines[pool->index];
+    size_t live, high_water;
+    void *object;
+
+    if (magazine->count == 0) {
+        if (!thread_registered) {
+            pool_register_thread();
+        }
+
+        /* Refill half of the magazine, leaving room for frees. */
+        pthread_mutex_lock(&pool->lock);
+        while (magazine->count < POOL_MAGAZINE_SIZE / 2) {
+            object = pool_take(pool);
+            if (!object) {
+                break;
+            }
+            magazine->objects[magazine->count++] = object;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        if (magazine->count == 0) {
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+
+    live = atomic_fetch_add_explicit(&pool->live, 1, memory_order_relaxed) + 1;
+    high_water = atomic_load_explicit(&pool->high_water, memory_order_relaxed);
+    while (live > high_water &&
+            !atomic_compare_exchange_weak_explicit(&pool->high_water,
+                &high_water, live, memory_order_relaxed, memory_order_relaxed)) {
+    }
+
+    return magazine->objects[--magazine->count];
+}
+
+void pool_free(struct pool *pool, void *object)
+{
+    struct pool_magazine *magazine = &magazines[pool->index];
+    const unsigned spill = POOL_MAGAZINE_SIZE / 2;
+
+    atomic_fetch_sub_explicit(&pool->live, 1, memory_order_relaxed);
+
+    if (!thread_registered) {
+        pool_register_thread();
+    }
+
+    if (magazine->count == POOL_MAGAZINE_SIZE) {
+        /* Spill the older half; the recently freed ones are still warm. */
+        pthread_mutex_lock(&pool->lock);
+        for (unsigned i = 0; i < spill; ++i) {
+            pool_give(pool, magazine->objects[i]);
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        for (unsigned i = spill; i < POOL_MAGAZINE_SIZE; ++i) {
+            magazine->objects[i - spill] = magazine->objects[i];
+        }
+        magazine->count -= spill;
+    }
+
+    magazine->objects[magazine->count++] = object;
+}
+
+void pool_flush_thread_cache(void)
+{
+    struct pool_magazine *magazine;
+    struct pool *pool;
+
+    pthread_mutex_lock(&pools_lock);
+
+    for (unsigned i = 0; i < num_pools; ++i) {
+        magazine = &magazines[i];
+        pool = pools[i];
+
+        if (pool && magazine->count > 0) {
+            pthread_mutex_lock(&pool->lock);
+            while (magazine->count > 0) {
+                pool_give(pool, magazine->objects[--magazine->count]);
+            }
+            pthread_mutex_unlock(&pool->lock);
+        }
+
+        magazine->count = 0;
+    }
+
+    pthread_mutex_unlock(&pools_lock);
+}
+
+void pool_get_stats(struct pool *pool, struct pool_stats *stats)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    stats->object_size = pool->object_size;
+    stats->live = atomic_load_explicit(&pool->live, memory_order_relaxed);
+    stats->cached = pool->num_carved - stats->live;
+    stats->high_water = atomic_load_explicit(&pool->high_water,
+            memory_order_relaxed);
+    stats->slabs = pool->num_slabs;
+    stats->huge_slabs = pool->num_huge_slabs;
+
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,102 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <pthread.h>
+
+/*
+ * Fixed-size object pool.
+ *
+ * Objects are carved from 2 MiB slabs that are mapped on demand, optionally
+ * backed by huge pages. Every thread keeps a small magazine of free objects
+ * per pool, so allocating and freeing usually takes no lock; magazines are
+ * refilled from and spilled to the free lists of the slabs in batches.
+ *
+ * Free objects kept by a pool are bounded: once more than max_cached
+ * objects are free, slabs that become completely free are unmapped.
+ *
+ * An object may be freed by any thread, not just the one that allocated it.
+ */
+
+#define POOL_MAX_POOLS                  32u
+#define POOL_MAGAZINE_SIZE              32u
+#define POOL_SLAB_SIZE                  (2u << 20)
+
+struct pool_slab;
+
+struct pool {
+    unsigned index;                     /* Magazine slot of the pool. */
+    size_t object_size;
+    unsigned objects_per_slab;
+    size_t max_cached;
+    bool hugepages;
+
+    pthread_mutex_t lock;
+    struct pool_slab *available;        /* Slabs with free objects. */
+    size_t num_carved;                  /* Objects ever taken from slabs. */
+    size_t num_slabs;
+    size_t num_huge_slabs;
+
+    atomic_size_t live;
+    atomic_size_t high_water;
+};
+
+struct pool_stats {
+    size_t object_size;
+    size_t live;                        /* Objects allocated. */
+    size_t cached;                      /* Free objects kept for reuse. */
+    size_t high_water;                  /* Most objects ever live at once. */
+    size_t slabs;                       /* Slabs mapped. */
+    size_t huge_slabs;                  /* Slabs backed by huge pages. */
+};
+
+/**
+ * @brief Initialise an empty pool.
+ *
+ * @param pool Pool.
+ * @param object_size Size of the objects; rounded up to a cache line.
+ * @param max_cached Number of free objects to keep before giving memory back.
+ * @param hugepages Try to back slabs with huge pages. Falls back to
+ *        transparent huge pages and then to normal pages if none are
+ *        available.
+ *
+ * @return 0 on success, -1 on error (errno EINVAL if an object does not fit
+ *         in a slab, ENOSPC if POOL_MAX_POOLS pools have been created).
+ */
+int pool_init(struct pool *pool, size_t object_size, size_t max_cached,
+        bool hugepages);
+
+/**
+ * @brief Unmap the memory of a pool.
+ *
+ * @note No objects of the pool may be live and no thread other than the
+ * caller may have freed objects of the pool since it last called
+ * pool_flush_thread_cache().
+ */
+void pool_deinit(struct pool *pool);
+
+/**
+ * @brief Allocate an object.
+ *
+ * @return Uninitialised object or NULL on memory allocation error.
+ */
+void *pool_alloc(struct pool *pool);
+
+/**
+ * @brief Return an object to its pool. Safe to call from any thread.
+ */
+void pool_free(struct pool *pool, void *object);
+
+/**
+ * @brief Return the objects cached by the calling thread to their pools.
+ *
+ * @description Done automatically when a thread exits.
+ */
+void pool_flush_thread_cache(void);
+
+void pool_get_stats(struct pool *pool, struct pool_stats *stats);
+
+#endif /* POOL_H */
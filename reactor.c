@@ -0,0 +1,661 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <poll.h>
+#include <sys/epoll.h>
+
+#include "log.h"
+#include "reactor.h"
+#include "uring.h"
+
+#define URING_SQ_ENTRIES                1024u
+#define URING_NUM_BUFFERS               1024u
+#define URING_BUFFER_SIZE               2048u
+
+struct reactor_ops {
+    int (*init)(struct reactor *reactor);
+    void (*deinit)(struct reactor *reactor);
+    int (*add)(struct reactor *reactor, int fd, unsigned events, void *data);
+    int (*modify)(struct reactor *reactor, int fd, unsigned events, void *data);
+    int (*remove)(struct reactor *reactor, int fd);
+    int (*wait)(struct reactor *reactor, struct reactor_event *events,
+            int max_events, int timeout_ms);
+};
+
+struct reactor {
+    enum reactor_backend backend;
+    const struct reactor_ops *ops;
+
+    unsigned long long num_syscalls;
+
+    /* epoll backend */
+    int epfd;
+
+    /* io_uring backend, watches are indexed by fd like in the poll backend. */
+    struct uring *ring;
+    struct uring_watch **watches;
+    unsigned cap_watches;
+
+    /* poll backend */
+    struct pollfd *fds;
+    void **data;
+    unsigned num_fds;
+    unsigned cap_fds;
+    int *fd_index;          /* fd -> index into fds, -1 if not watched. */
+    unsigned cap_fd_index;
+};
+
+/* poll backend */
+
+static short to_poll_events(unsigned events)
+{
+    short pev = 0;
+
+    if (events & REACTOR_IN)
+        pev |= POLLIN;
+    if (events & REACTOR_OUT)
+        pev |= POLLOUT;
+
+    return pev;
+}
+
+static unsigned from_poll_events(short pev)
+{
+    unsigned events = 0;
+
+    if (pev & POLLIN)
+        events |= REACTOR_IN;
+    if (pev & POLLOUT)
+        events |= REACTOR_OUT;
+    if (pev & (POLLERR | POLLHUP | POLLNVAL))
+        events |= REACTOR_ERR;
+
+    return events;
+}
+
+static int poll_init(struct reactor *r)
+{
+    r->fds = NULL;
+    r->data = NULL;
+    r->fd_index = NULL;
+    return 0;
+}
+
+static void poll_deinit(struct reactor *r)
+{
+    free(r->fds);
+    free(r->data);
+    free(r->fd_index);
+}
+
+static int poll_reserve_fd_index(struct reactor *r, int fd)
+{
+    unsigned new_cap;
+    int *temp;
+
+    if ((unsigned)fd < r->cap_fd_index) {
+        return 0;
+    }
+
+    new_cap = r->cap_fd_index ? r->cap_fd_index : 64;
+    while (new_cap <= (unsigned)fd) {
+        new_cap *= 2;
+    }
+
+    temp = realloc(r->fd_index, new_cap * sizeof(*temp));
+    if (!temp) {
+        return -1;
+    }
+
+    for (unsigned i = r->cap_fd_index; i < new_cap; ++i) {
+        temp[i] = -1;
+    }
+
+    r->fd_index = temp;
+    r->cap_fd_index = new_cap;
+    return 0;
+}
+
+static int poll_lookup(const struct reactor *r, int fd)
+{
+    if (fd < 0 || (unsigned)fd >= r->cap_fd_index) {
+        return -1;
+    }
+
+    return r->fd_index[fd];
+}
+
+static int poll_add(struct reactor *r, int fd, unsigned events, void *data)
+{
+    if (fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if (poll_lookup(r, fd) != -1) {
+        errno = EEXIST;
+        return -1;
+    }
+
+    if (poll_reserve_fd_index(r, fd) == -1) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (r->num_fds == r->cap_fds) {
+        unsigned new_cap = r->cap_fds ? r->cap_fds * 2 : 16;
+        struct pollfd *new_fds;
+        void **new_data;
+
+        new_fds = realloc(r->fds, new_cap * sizeof(*new_fds));
+        if (!new_fds) {
+            errno = ENOMEM;
+            return -1;
+        }
+        r->fds = new_fds;
+
+        new_data = realloc(r->data, new_cap * sizeof(*new_data));
+        if (!new_data) {
+            errno = ENOMEM;
+            return -1;
+        }
+        r->data = new_data;
+
+        r->cap_fds = new_cap;
+    }
+
+    r->fds[r->num_fds].fd = fd;
+    r->fds[r->num_fds].events = to_poll_events(events);
+    r->fds[r->num_fds].revents = 0;
+    r->data[r->num_fds] = data;
+    r->fd_index[fd] = r->num_fds;
+    r->num_fds++;
+
+    return 0;
+}
+
+static int poll_modify(struct reactor *r, int fd, unsigned events, void *data)
+{
+    int i = poll_lookup(r, fd);
+
+    if (i == -1) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    r->fds[i].events = to_poll_events(events);
+    r->data[i] = data;
+    return 0;
+}
+
+static int poll_remove(struct reactor *r, int fd)
+{
+    int i = poll_lookup(r, fd);
+    unsigned last;
+
+    if (i == -1) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    /* Move the last entry into the hole. */
+    last = r->num_fds - 1;
+    if ((unsigned)i != last) {
+        r->fds[i] = r->fds[last];
+        r->data[i] = r->data[last];
+        r->fd_index[r->fds[i].fd] = i;
+    }
+
+    r->fd_index[fd] = -1;
+    r->num_fds--;
+    return 0;
+}
+
+static int poll_wait(struct reactor *r, struct reactor_event *events,
+        int max_events, int timeout_ms)
+{
+    int n, count = 0;
+
+    r->num_syscalls++;
+    n = poll(r->fds, r->num_fds, timeout_ms);
+    if (n <= 0) {
+        return n;
+    }
+
+    for (unsigned i = 0; n > 0 && count < max_events && i < r->num_fds; ++i) {
+        if (!r->fds[i].revents) {
+            continue;
+        }
+
+        n--;
+        events[count].data = r->data[i];
+        events[count].events = from_poll_events(r->fds[i].revents);
+        count++;
+    }
+
+    return count;
+}
+
+static const struct reactor_ops poll_ops = {
+    .init = poll_init,
+    .deinit = poll_deinit,
+    .add = poll_add,
+    .modify = poll_modify,
+    .remove = poll_remove,
+    .wait = poll_wait,
+};
+
+/* epoll backend */
+
+static unsigned to_epoll_events(unsigned events)
+{
+    unsigned epev = 0;
+
+    if (events & REACTOR_IN)
+        epev |= EPOLLIN | EPOLLRDHUP;
+    if (events & REACTOR_OUT)
+        epev |= EPOLLOUT;
+
+    return epev;
+}
+
+static unsigned from_epoll_events(unsigned epev)
+{
+    unsigned events = 0;
+
+    if (epev & (EPOLLIN | EPOLLRDHUP))
+        events |= REACTOR_IN;
+    if (epev & EPOLLOUT)
+        events |= REACTOR_OUT;
+    if (epev & (EPOLLERR | EPOLLHUP))
+        events |= REACTOR_ERR;
+
+    return events;
+}
+
+static int epoll_init(struct reactor *r)
+{
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (r->epfd == -1) {
+        log_error("epoll_create1: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static void epoll_deinit(struct reactor *r)
+{
+    close(r->epfd);
+}
+
+static int epoll_add(struct reactor *r, int fd, unsigned events, void *data)
+{
+    struct epoll_event ev = {
+        .events = to_epoll_events(events),
+        .data.ptr = data
+    };
+
+    r->num_syscalls++;
+    return epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static int epoll_modify(struct reactor *r, int fd, unsigned events, void *data)
+{
+    struct epoll_event ev = {
+        .events = to_epoll_events(events),
+        .data.ptr = data
+    };
+
+    r->num_syscalls++;
+    return epoll_ctl(r->epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+static int epoll_remove(struct reactor *r, int fd)
+{
+    r->num_syscalls++;
+    return epoll_ctl(r->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static int epoll_wait_events(struct reactor *r, struct reactor_event *events,
+        int max_events, int timeout_ms)
+{
+    struct epoll_event epevents[64];
+    int n;
+
+    if (max_events > (int)(sizeof(epevents) / sizeof(*epevents))) {
+        max_events = sizeof(epevents) / sizeof(*epevents);
+    }
+
+    r->num_syscalls++;
+    n = epoll_wait(r->epfd, epevents, max_events, timeout_ms);
+
+    for (int i = 0; i < n; ++i) {
+        events[i].data = epevents[i].data.ptr;
+        events[i].events = from_epoll_events(epevents[i].events);
+    }
+
+    return n;
+}
+
+static const struct reactor_ops epoll_ops = {
+    .init = epoll_init,
+    .deinit = epoll_deinit,
+    .add = epoll_add,
+    .modify = epoll_modify,
+    .remove = epoll_remove,
+    .wait = epoll_wait_events,
+};
+
+/*
+ * io_uring backend
+ *
+ * Watched descriptors get a one-shot poll request that is re-armed after each
+ * completion, which gives level-triggered semantics. Endpoints attached to the
+ * ring (network.c) submit their own receive and send operations instead.
+ */
+
+struct uring_watch {
+    struct uring_op op;         /* op.data is the user data of the watch. */
+    struct reactor *reactor;
+    int fd;
+    unsigned events;
+    int active;                 /* Cleared on removal; freed on completion. */
+};
+
+static unsigned uring_watch_complete(struct uring_op *op, int res, unsigned flags);
+
+static int uring_watch_arm(struct reactor *r, struct uring_watch *w)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(r->ring);
+
+    if (!sqe) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = w->fd;
+    sqe->poll32_events = to_poll_events(w->events);
+    sqe->user_data = (unsigned long)&w->op;
+    r->ring->num_ops++;
+    return 0;
+}
+
+static unsigned uring_watch_complete(struct uring_op *op, int res, unsigned flags)
+{
+    struct uring_watch *w = (struct uring_watch *)op;
+    struct reactor *r = w->reactor;
+
+    r->ring->num_ops--;
+
+    if (!w->active) {
+        free(w);
+        return 0;
+    }
+
+    if (res == -ECANCELED) {
+        return 0;
+    }
+
+    if (uring_watch_arm(r, w) == -1) {
+        log_error("Unable to re-arm poll of fd %d\n", w->fd);
+    }
+
+    return res < 0 ? REACTOR_ERR : from_poll_events(res);
+}
+
+static int uring_init(struct reactor *r)
+{
+    r->watches = NULL;
+    r->cap_watches = 0;
+
+    r->ring = uring_new(URING_SQ_ENTRIES, URING_NUM_BUFFERS, URING_BUFFER_SIZE);
+    if (!r->ring) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void uring_deinit(struct reactor *r)
+{
+    /* Outstanding polls are freed as they complete with -ECANCELED. */
+    for (unsigned fd = 0; fd < r->cap_watches; ++fd) {
+        if (r->watches[fd]) {
+            r->watches[fd]->active = 0;
+        }
+    }
+
+    uring_destroy(r->ring);
+    free(r->watches);
+}
+
+static int uring_add(struct reactor *r, int fd, unsigned events, void *data)
+{
+    struct uring_watch *w;
+
+    if (fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if ((unsigned)fd >= r->cap_watches) {
+        unsigned new_cap = r->cap_watches ? r->cap_watches : 64;
+        struct uring_watch **temp;
+
+        while (new_cap <= (unsigned)fd) {
+            new_cap *= 2;
+        }
+
+        temp = realloc(r->watches, new_cap * sizeof(*temp));
+        if (!temp) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        memset(temp + r->cap_watches, 0,
+                (new_cap - r->cap_watches) * sizeof(*temp));
+        r->watches = temp;
+        r->cap_watches = new_cap;
+    }
+
+    if (r->watches[fd]) {
+        errno = EEXIST;
+        return -1;
+    }
+
+    w = calloc(1, sizeof(*w));
+    if (!w) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    w->op.complete = uring_watch_complete;
+    w->op.data = data;
+    w->reactor = r;
+    w->fd = fd;
+    w->events = events;
+    w->active = 1;
+
+    if (uring_watch_arm(r, w) == -1) {
+        free(w);
+        return -1;
+    }
+
+    r->watches[fd] = w;
+    return 0;
+}
+
+static int uring_remove(struct reactor *r, int fd)
+{
+    struct uring_watch *w;
+
+    if (fd < 0 || (unsigned)fd >= r->cap_watches || !r->watches[fd]) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    w = r->watches[fd];
+    r->watches[fd] = NULL;
+
+    w->active = 0;
+    return uring_cancel(r->ring, &w->op);
+}
+
+static int uring_modify(struct reactor *r, int fd, unsigned events, void *data)
+{
+    if (uring_remove(r, fd) == -1) {
+        return -1;
+    }
+
+    return uring_add(r, fd, events, data);
+}
+
+static int uring_wait(struct reactor *r, struct reactor_event *events,
+        int max_events, int timeout_ms)
+{
+    struct io_uring_cqe *cqe;
+    int count = 0;
+    int wait = uring_peek_cqe(r->ring) == NULL;
+
+    /* One submission per wait: everything prepared since the last one. */
+    if (uring_submit(r->ring, wait, timeout_ms) == -1) {
+        return -1;
+    }
+
+    while (count < max_events && (cqe = uring_peek_cqe(r->ring))) {
+        struct uring_op *op = (struct uring_op *)(unsigned long)cqe->user_data;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+        unsigned revents;
+
+        uring_cqe_seen(r->ring);
+
+        if (!op) {
+            continue;
+        }
+
+        revents = op->complete(op, res, flags);
+        if (revents) {
+            events[count].data = op->data;
+            events[count].events = revents;
+            count++;
+        }
+    }
+
+    return count;
+}
+
+static const struct reactor_ops uring_ops = {
+    .init = uring_init,
+    .deinit = uring_deinit,
+    .add = uring_add,
+    .modify = uring_modify,
+    .remove = uring_remove,
+    .wait = uring_wait,
+};
+
+/* Common interface */
+
+struct reactor *reactor_new(enum reactor_backend backend)
+{
+    struct reactor *reactor = calloc(1, sizeof(*reactor));
+
+    if (!reactor) {
+        return NULL;
+    }
+
+    reactor->backend = backend;
+
+    switch (backend) {
+    case REACTOR_BACKEND_POLL:
+        reactor->ops = &poll_ops;
+        break;
+    case REACTOR_BACKEND_EPOLL:
+        reactor->ops = &epoll_ops;
+        break;
+    case REACTOR_BACKEND_URING:
+        reactor->ops = &uring_ops;
+        break;
+    default:
+        free(reactor);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (reactor->ops->init(reactor) == -1) {
+        free(reactor);
+        return NULL;
+    }
+
+    return reactor;
+}
+
+void reactor_destroy(struct reactor *reactor)
+{
+    reactor->ops->deinit(reactor);
+    free(reactor);
+}
+
+int reactor_add(struct reactor *reactor, int fd, unsigned events, void *data)
+{
+    return reactor->ops->add(reactor, fd, events, data);
+}
+
+int reactor_modify(struct reactor *reactor, int fd, unsigned events, void *data)
+{
+    return reactor->ops->modify(reactor, fd, events, data);
+}
+
+int reactor_remove(struct reactor *reactor, int fd)
+{
+    return reactor->ops->remove(reactor, fd);
+}
+
+int reactor_wait(struct reactor *reactor, struct reactor_event *events,
+        int max_events, int timeout_ms)
+{
+    return reactor->ops->wait(reactor, events, max_events, timeout_ms);
+}
+
+struct uring *reactor_uring(struct reactor *reactor)
+{
+    return reactor->backend == REACTOR_BACKEND_URING ? reactor->ring : NULL;
+}
+
+unsigned long long reactor_num_syscalls(const struct reactor *reactor)
+{
+    if (reactor->backend == REACTOR_BACKEND_URING) {
+        return reactor->num_syscalls + reactor->ring->num_enters;
+    }
+
+    return reactor->num_syscalls;
+}
+
+int reactor_backend_from_name(const char *name)
+{
+    if (!strcmp(name, "poll"))
+        return REACTOR_BACKEND_POLL;
+    if (!strcmp(name, "epoll"))
+        return REACTOR_BACKEND_EPOLL;
+    if (!strcmp(name, "uring"))
+        return REACTOR_BACKEND_URING;
+
+    return -1;
+}
+
+const char *reactor_backend_name(enum reactor_backend backend)
+{
+    switch (backend) {
+    case REACTOR_BACKEND_POLL:
+        return "poll";
+    case REACTOR_BACKEND_EPOLL:
+        return "epoll";
+    case REACTOR_BACKEND_URING:
+        return "io_uring";
+    }
+
+    return "unknown";
+}
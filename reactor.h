@@ -0,0 +1,101 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+/*
+ * Reactor event flags. Readiness is level-triggered with every backend: a
+ * descriptor is reported for as long as it is ready.
+ */
+#define REACTOR_IN                      0x1u
+#define REACTOR_OUT                     0x2u
+#define REACTOR_ERR                     0x4u    /* Error or hangup. */
+
+enum reactor_backend {
+    REACTOR_BACKEND_POLL,
+    REACTOR_BACKEND_EPOLL,
+    REACTOR_BACKEND_URING
+};
+
+struct reactor_event {
+    void *data;
+    unsigned events;
+};
+
+struct reactor;
+struct uring;
+
+/**
+ * @brief Create a new reactor.
+ *
+ * @param backend Readiness notification mechanism to use.
+ *
+ * @return Reactor or NULL on error (check errno).
+ */
+struct reactor *reactor_new(enum reactor_backend backend);
+
+void reactor_destroy(struct reactor *reactor);
+
+/**
+ * @brief Start watching a file descriptor.
+ *
+ * @param reactor Reactor.
+ * @param fd File descriptor.
+ * @param events Events of interest (REACTOR_IN, REACTOR_OUT).
+ * @param data User data reported with the events of fd.
+ *
+ * @return 0 on success, -1 on error (check errno).
+ */
+int reactor_add(struct reactor *reactor, int fd, unsigned events, void *data);
+
+/**
+ * @brief Change the events of interest of a watched file descriptor.
+ *
+ * @return 0 on success, -1 on error (check errno).
+ */
+int reactor_modify(struct reactor *reactor, int fd, unsigned events, void *data);
+
+/**
+ * @brief Stop watching a file descriptor.
+ *
+ * @return 0 on success, -1 on error (check errno).
+ */
+int reactor_remove(struct reactor *reactor, int fd);
+
+/**
+ * @brief Wait for events.
+ *
+ * @param reactor Reactor.
+ * @param events Storage for ready events.
+ * @param max_events Capacity of events.
+ * @param timeout_ms Timeout in milliseconds or -1 to wait indefinitely.
+ *
+ * @return Number of events stored or -1 on error (check errno).
+ */
+int reactor_wait(struct reactor *reactor, struct reactor_event *events,
+        int max_events, int timeout_ms);
+
+/**
+ * @brief Get the io_uring instance of a reactor.
+ *
+ * @description Completion-based I/O (see net_endpoint_attach_uring) submitted
+ * to this ring is reaped by reactor_wait. Submissions are batched and
+ * flushed once per reactor_wait call.
+ *
+ * @return Ring or NULL if the reactor does not use the io_uring backend.
+ */
+struct uring *reactor_uring(struct reactor *reactor);
+
+/**
+ * @brief Get the number of system calls made by the reactor so far.
+ */
+unsigned long long reactor_num_syscalls(const struct reactor *reactor);
+
+/**
+ * @brief Get a backend by its name ("poll", "epoll" or "uring").
+ *
+ * @return Backend or -1 if the name is unknown.
+ */
+int reactor_backend_from_name(const char *name);
+
+const char *reactor_backend_name(enum reactor_backend backend);
+
+#endif /* REACTOR_H */
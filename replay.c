@@ -0,0 +1,82 @@
+#include <stdlib.h>
+
+#include "replay.h"
+#include "network.h"
+
+int replay_ring_init(struct replay_ring *ring, unsigned max_count,
+        size_t max_bytes)
+{
+    ring->entries = NULL;
+    ring->max_count = max_count;
+    ring->max_bytes = max_bytes;
+    ring->head = 0;
+    ring->count = 0;
+    ring->bytes = 0;
+
+    if (max_count > 0) {
+        ring->entries = calloc(max_count, sizeof(*ring->entries));
+        if (!ring->entries) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Drop the oldest entry.
+ */
+static void replay_ring_pop(struct replay_ring *ring)
+{
+    struct replay_entry *entry = &ring->entries[ring->head];
+
+    for (unsigned i = 0; i < CHAT_NUM_PROTOCOLS; ++i) {
+        if (entry->msgs[i]) {
+            net_message_unref(entry->msgs[i]);
+            entry->msgs[i] = NULL;
+        }
+    }
+
+    ring->bytes -= entry->bytes;
+    ring->head = (ring->head + 1) % ring->max_count;
+    ring->count--;
+}
+
+void replay_ring_deinit(struct replay_ring *ring)
+{
+    while (ring->count > 0) {
+        replay_ring_pop(ring);
+    }
+
+    free(ring->entries);
+    ring->entries = NULL;
+}
+
+void replay_ring_push(struct replay_ring *ring,
+        struct net_message *const msgs[CHAT_NUM_PROTOCOLS])
+{
+    struct replay_entry *entry;
+    size_t bytes = 0;
+
+    for (unsigned i = 0; i < CHAT_NUM_PROTOCOLS; ++i) {
+        if (msgs[i]) {
+            bytes += net_message_body_length(msgs[i]);
+        }
+    }
+
+    if (ring->max_count == 0 || bytes > ring->max_bytes) {
+        return;
+    }
+
+    while (ring->count == ring->max_count || ring->bytes + bytes > ring->max_bytes) {
+        replay_ring_pop(ring);
+    }
+
+    entry = &ring->entries[(ring->head + ring->count) % ring->max_count];
+    for (unsigned i = 0; i < CHAT_NUM_PROTOCOLS; ++i) {
+        entry->msgs[i] = msgs[i] ? net_message_ref(msgs[i]) : NULL;
+    }
+    entry->bytes = bytes;
+    ring->bytes += bytes;
+    ring->count++;
+}
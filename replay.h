@@ -0,0 +1,62 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stddef.h>
+
+#include "chat.h"
+
+struct net_message;
+
+/*
+ * Replay ring: the most recent chat messages as they were broadcast, in the
+ * network format of every protocol version, for members that join later.
+ * The ring holds references, so keeping and replaying a message copies
+ * nothing. It is bounded both by a number of messages and by their bytes;
+ * the oldest messages make room.
+ */
+
+struct replay_entry {
+    struct net_message *msgs[CHAT_NUM_PROTOCOLS];   /* NULL if a version
+                                                       has none. */
+    size_t bytes;                       /* Of all versions. */
+};
+
+struct replay_ring {
+    struct replay_entry *entries;
+    unsigned max_count;                 /* 0 keeps nothing. */
+    size_t max_bytes;
+    unsigned head;                      /* Oldest entry. */
+    unsigned count;
+    size_t bytes;
+};
+
+/**
+ * @brief Initialise an empty ring.
+ *
+ * @return 0 on success, -1 on memory allocation error.
+ */
+int replay_ring_init(struct replay_ring *ring, unsigned max_count,
+        size_t max_bytes);
+
+void replay_ring_deinit(struct replay_ring *ring);
+
+/**
+ * @brief Keep a message, dropping the oldest ones if the ring is full.
+ *
+ * @param msgs Message in each protocol version, each referenced by the
+ *        ring, NULL if a version has none. A message larger than the ring
+ *        is not kept.
+ */
+void replay_ring_push(struct replay_ring *ring,
+        struct net_message *const msgs[CHAT_NUM_PROTOCOLS]);
+
+/**
+ * @brief Get a message, 0 being the oldest.
+ */
+static inline const struct replay_entry *replay_ring_at(
+        const struct replay_ring *ring, unsigned i)
+{
+    return &ring->entries[(ring->head + i) % ring->max_count];
+}
+
+#endif /* REPLAY_H */
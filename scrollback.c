@@ -0,0 +1,87 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "scrollback.h"
+
+int scrollback_init(struct scrollback *scrollback, unsigned max_rows,
+        size_t max_bytes)
+{
+    scrollback->max_bytes = max_bytes;
+    scrollback->tail = 0;
+    scrollback->max_rows = max_rows;
+    scrollback->head = 0;
+    scrollback->count = 0;
+    scrollback->bytes = 0;
+
+    scrollback->data = malloc(max_bytes);
+    scrollback->rows = calloc(max_rows, sizeof(*scrollback->rows));
+    if (!scrollback->data || !scrollback->rows) {
+        scrollback_deinit(scrollback);
+        return -1;
+    }
+
+    return 0;
+}
+
+void scrollback_deinit(struct scrollback *scrollback)
+{
+    free(scrollback->data);
+    free(scrollback->rows);
+    scrollback->data = NULL;
+    scrollback->rows = NULL;
+    scrollback->count = 0;
+}
+
+/**
+ * @brief Drop the oldest row.
+ */
+static void scrollback_pop(struct scrollback *scrollback)
+{
+    scrollback->bytes -= scrollback->rows[scrollback->head].len;
+    scrollback->head = (scrollback->head + 1) % scrollback->max_rows;
+    scrollback->count--;
+}
+
+static const struct scrollback_row *oldest(const struct scrollback *scrollback)
+{
+    return &scrollback->rows[scrollback->head];
+}
+
+void scrollback_push(struct scrollback *scrollback, const void *data,
+        size_t len)
+{
+    size_t offset = scrollback->tail;
+
+    if (len > scrollback->max_bytes) {
+        len = scrollback->max_bytes;
+    }
+
+    if (scrollback->count == scrollback->max_rows) {
+        scrollback_pop(scrollback);
+    }
+
+    if (offset + len > scrollback->max_bytes) {
+        /* Rows between the tail and the end would be older than the rows
+         * before them; drop them along with those in the way. */
+        while (scrollback->count > 0 &&
+                oldest(scrollback)->offset >= scrollback->tail) {
+            scrollback_pop(scrollback);
+        }
+        offset = 0;
+    }
+
+    /* The rows after the tail are the oldest, in order. */
+    while (scrollback->count > 0 && oldest(scrollback)->offset >= offset &&
+            oldest(scrollback)->offset < offset + len) {
+        scrollback_pop(scrollback);
+    }
+
+    memcpy(scrollback->data + offset, data, len);
+    scrollback->rows[(scrollback->head + scrollback->count) %
+        scrollback->max_rows] = (struct scrollback_row){
+            .offset = offset, .len = len
+        };
+    scrollback->tail = offset + len;
+    scrollback->bytes += len;
+    scrollback->count++;
+}
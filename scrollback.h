@@ -0,0 +1,73 @@
+#ifndef SCROLLBACK_H
+#define SCROLLBACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Scrollback: the most recent lines of the message window, as formatted for
+ * the screen, so that they can be paged back to. Each row of the screen is
+ * kept as its bytes, one after the other in a ring of bytes, with its place
+ * in a ring of rows. Both rings are allocated once, so the memory taken is
+ * the same after a million rows as after a hundred; the oldest rows make
+ * room. A row is kept whole, so one that does not fit before the end of the
+ * byte ring starts over at its beginning.
+ */
+
+struct scrollback_row {
+    uint32_t offset;                    /* In the byte ring. */
+    uint32_t len;
+};
+
+struct scrollback {
+    unsigned char *data;
+    size_t max_bytes;
+    size_t tail;                        /* Where the next row goes. */
+    struct scrollback_row *rows;
+    unsigned max_rows;
+    unsigned head;                      /* Oldest row. */
+    unsigned count;
+    size_t bytes;                       /* Of the rows kept. */
+};
+
+/**
+ * @brief Initialise an empty scrollback.
+ *
+ * @param max_rows Most rows kept, at least 1.
+ * @param max_bytes Most bytes of rows kept, at most UINT32_MAX.
+ *
+ * @return 0 on success, -1 on memory allocation error.
+ */
+int scrollback_init(struct scrollback *scrollback, unsigned max_rows,
+        size_t max_bytes);
+
+void scrollback_deinit(struct scrollback *scrollback);
+
+/**
+ * @brief Keep a row after the others, dropping the oldest ones to make
+ *        room.
+ *
+ * @param data Bytes of the row, copied. A row larger than the byte ring is
+ *        cut to its size.
+ */
+void scrollback_push(struct scrollback *scrollback, const void *data,
+        size_t len);
+
+/**
+ * @brief Get a row, 0 being the oldest.
+ *
+ * @param len Where the length of the row is written.
+ *
+ * @return Bytes of the row, valid until the next push.
+ */
+static inline const unsigned char *scrollback_at(
+        const struct scrollback *scrollback, unsigned i, size_t *len)
+{
+    const struct scrollback_row *row =
+        &scrollback->rows[(scrollback->head + i) % scrollback->max_rows];
+
+    *len = row->len;
+    return scrollback->data + row->offset;
+}
+
+#endif /* SCROLLBACK_H */
@@ -0,0 +1,407 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "search.h"
+#include "chat.h"
+
+#define SEARCH_INDEX_INITIAL_SLOTS      1024u
+
+/* Of the ids of a block, those of the rarest term decoded, then the others. */
+struct search_cursor {
+    const struct search_postings *postings;
+    unsigned block;                     /* Decoded, UINT_MAX for none. */
+    uint64_t ids[SEARCH_BLOCK_IDS];
+};
+
+static bool is_term_byte(unsigned char c)
+{
+    return c >= 0x80 || (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+        (c >= 'A' && c <= 'Z');
+}
+
+unsigned search_next_term(const char **text, size_t *len, char *term)
+{
+    const unsigned char *p = (const unsigned char *)*text;
+    const unsigned char *end = p + *len;
+    unsigned n = 0;
+
+    while (p < end && !is_term_byte(*p)) {
+        p++;
+    }
+
+    while (p < end && is_term_byte(*p)) {
+        if (n < SEARCH_TERM_MAX_LEN) {
+            term[n++] = *p >= 'A' && *p <= 'Z' ? *p - 'A' + 'a' : *p;
+        }
+        p++;
+    }
+
+    *len -= p - (const unsigned char *)*text;
+    *text = (const char *)p;
+    return n;
+}
+
+/* FNV-1a. */
+static uint32_t term_hash(const char *term, unsigned len)
+{
+    uint32_t hash = 2166136261u;
+
+    for (unsigned i = 0; i < len; ++i) {
+        hash ^= (unsigned char)term[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/**
+ * @brief Find the slot of a term, or the free slot where it would go.
+ */
+static unsigned search_index_probe(const struct search_index *index,
+        uint32_t hash, const char *term, unsigned len)
+{
+    unsigned mask = index->num_slots - 1;
+    unsigned i = hash & mask;
+
+    while (index->slots[i].len) {
+        const struct search_term *entry = &index->slots[i];
+
+        if (entry->hash == hash && entry->len == len &&
+                memcmp(entry->term, term, len) == 0) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+
+    return i;
+}
+
+int search_index_init(struct search_index *index)
+{
+    index->slots = calloc(SEARCH_INDEX_INITIAL_SLOTS, sizeof(*index->slots));
+    if (!index->slots) {
+        return -1;
+    }
+
+    index->num_slots = SEARCH_INDEX_INITIAL_SLOTS;
+    index->count = 0;
+    index->last_id = 0;
+    index->bytes = 0;
+    pthread_rwlock_init(&index->lock, NULL);
+    return 0;
+}
+
+void search_index_deinit(struct search_index *index)
+{
+    for (unsigned i = 0; i < index->num_slots; ++i) {
+        free(index->slots[i].postings.blocks);
+        free(index->slots[i].postings.deltas);
+    }
+
+    free(index->slots);
+    index->slots = NULL;
+    pthread_rwlock_destroy(&index->lock);
+}
+
+/**
+ * @brief Double the number of slots, keeping the table at most half full.
+ */
+static int search_index_grow(struct search_index *index)
+{
+    struct search_term *old = index->slots;
+    unsigned old_num = index->num_slots;
+
+    index->slots = calloc(2 * old_num, sizeof(*index->slots));
+    if (!index->slots) {
+        index->slots = old;
+        return -1;
+    }
+    index->num_slots = 2 * old_num;
+
+    for (unsigned i = 0; i < old_num; ++i) {
+        if (old[i].len) {
+            index->slots[search_index_probe(index, old[i].hash, old[i].term,
+                    old[i].len)] = old[i];
+        }
+    }
+
+    free(old);
+    return 0;
+}
+
+/**
+ * @brief Find a term, adding it if it is new.
+ *
+ * @return Term or NULL on memory allocation error.
+ */
+static struct search_term *search_index_insert(struct search_index *index,
+        const char *term, unsigned len)
+{
+    uint32_t hash = term_hash(term, len);
+    unsigned slot = search_index_probe(index, hash, term, len);
+    struct search_term *entry = &index->slots[slot];
+
+    if (entry->len) {
+        return entry;
+    }
+
+    if (2 * (index->count + 1) > index->num_slots) {
+        if (search_index_grow(index) == -1) {
+            return NULL;
+        }
+        entry = &index->slots[search_index_probe(index, hash, term, len)];
+    }
+
+    memcpy(entry->term, term, len);
+    entry->len = len;
+    entry->hash = hash;
+    index->count++;
+    return entry;
+}
+
+static const struct search_term *search_index_find(
+        const struct search_index *index, const char *term, unsigned len)
+{
+    const struct search_term *entry = &index->slots[search_index_probe(index,
+            term_hash(term, len), term, len)];
+
+    return entry->len ? entry : NULL;
+}
+
+/**
+ * @brief Add an id after the others of a term.
+ *
+ * @return Bytes taken, -1 on memory allocation error.
+ */
+static long postings_add(struct search_postings *postings, uint64_t id)
+{
+    struct search_block *block = postings->num_blocks ?
+        &postings->blocks[postings->num_blocks - 1] : NULL;
+    size_t n;
+
+    /* A term twice in a message. */
+    if (block && block->last_id == id) {
+        return 0;
+    }
+
+    if (!block || block->count == SEARCH_BLOCK_IDS ||
+            id - block->last_id > UINT32_MAX) {
+        if (postings->num_blocks == postings->blocks_capacity) {
+            unsigned capacity = postings->blocks_capacity ?
+                2 * postings->blocks_capacity : 1;
+            struct search_block *blocks = realloc(postings->blocks,
+                    capacity * sizeof(*blocks));
+
+            if (!blocks) {
+                return -1;
+            }
+            postings->blocks = blocks;
+            postings->blocks_capacity = capacity;
+        }
+
+        postings->blocks[postings->num_blocks++] = (struct search_block){
+            .first_id = id, .last_id = id, .offset = postings->len, .count = 1
+        };
+        postings->count++;
+        return sizeof(*block);
+    }
+
+    if (postings->capacity - postings->len < CHAT_VARINT_MAX_LEN) {
+        uint32_t capacity = postings->capacity ? 2 * postings->capacity : 16;
+        unsigned char *deltas = realloc(postings->deltas, capacity);
+
+        if (!deltas) {
+            return -1;
+        }
+        postings->deltas = deltas;
+        postings->capacity = capacity;
+    }
+
+    n = chat_varint_encode(postings->deltas + postings->len,
+            id - block->last_id);
+    postings->len += n;
+    block->last_id = id;
+    block->count++;
+    postings->count++;
+    return n;
+}
+
+int search_index_add(struct search_index *index, uint64_t id,
+        const char *text, size_t len)
+{
+    char term[SEARCH_TERM_MAX_LEN];
+    unsigned term_len;
+    int rc = 0;
+
+    pthread_rwlock_wrlock(&index->lock);
+
+    if (id <= index->last_id) {
+        pthread_rwlock_unlock(&index->lock);
+        errno = EINVAL;
+        return -1;
+    }
+    index->last_id = id;
+
+    while ((term_len = search_next_term(&text, &len, term))) {
+        struct search_term *entry = search_index_insert(index, term, term_len);
+        long bytes = entry ? postings_add(&entry->postings, id) : -1;
+
+        if (bytes == -1) {
+            rc = -1;
+            continue;
+        }
+        index->bytes += bytes;
+    }
+
+    pthread_rwlock_unlock(&index->lock);
+
+    if (rc == -1) {
+        errno = ENOMEM;
+    }
+    return rc;
+}
+
+/**
+ * @brief Decode the ids of a block.
+ */
+static void decode_block(const struct search_postings *postings, unsigned b,
+        uint64_t *ids)
+{
+    const struct search_block *block = &postings->blocks[b];
+    const unsigned char *data = postings->deltas + block->offset;
+    size_t len = (b + 1 < postings->num_blocks ?
+            postings->blocks[b + 1].offset : postings->len) - block->offset;
+
+    ids[0] = block->first_id;
+    for (unsigned i = 1; i < block->count; ++i) {
+        uint32_t delta = 0;
+
+        chat_varint_decode(&delta, &data, &len);
+        ids[i] = ids[i - 1] + delta;
+    }
+}
+
+/**
+ * @brief Check whether the postings of a cursor hold an id.
+ */
+static bool cursor_holds(struct search_cursor *cursor, uint64_t id)
+{
+    const struct search_postings *postings = cursor->postings;
+    const struct search_block *block;
+    unsigned lo = 0, hi = postings->num_blocks;
+
+    if (hi == 0 || postings->blocks[0].first_id > id) {
+        return false;
+    }
+
+    /* Last block starting at or before id. */
+    while (hi - lo > 1) {
+        unsigned mid = lo + (hi - lo) / 2;
+
+        if (postings->blocks[mid].first_id <= id) {
+            lo = mid;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    block = &postings->blocks[lo];
+    if (block->last_id < id) {
+        return false;
+    }
+
+    if (cursor->block != lo) {
+        decode_block(postings, lo, cursor->ids);
+        cursor->block = lo;
+    }
+
+    hi = block->count;
+    lo = 0;
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+
+        if (cursor->ids[mid] < id) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    return lo < block->count && cursor->ids[lo] == id;
+}
+
+unsigned search_index_query(struct search_index *index, const char *query,
+        size_t len, uint64_t before_id, uint64_t *ids, unsigned max)
+{
+    struct search_cursor cursors[SEARCH_QUERY_MAX_TERMS];
+    const struct search_term *terms[SEARCH_QUERY_MAX_TERMS];
+    char term[SEARCH_TERM_MAX_LEN];
+    unsigned num_terms = 0, rarest = 0, count = 0;
+    unsigned term_len;
+    const struct search_postings *postings;
+
+    pthread_rwlock_rdlock(&index->lock);
+
+    while (num_terms < SEARCH_QUERY_MAX_TERMS &&
+            (term_len = search_next_term(&query, &len, term))) {
+        const struct search_term *entry = search_index_find(index, term,
+                term_len);
+        bool repeated = false;
+
+        /* No message holds a term that was never seen. */
+        if (!entry) {
+            goto out;
+        }
+
+        for (unsigned i = 0; i < num_terms; ++i) {
+            repeated |= terms[i] == entry;
+        }
+        if (repeated) {
+            continue;
+        }
+
+        if (num_terms > 0 && entry->postings.count <
+                terms[rarest]->postings.count) {
+            rarest = num_terms;
+        }
+        terms[num_terms] = entry;
+        cursors[num_terms].postings = &entry->postings;
+        cursors[num_terms].block = UINT_MAX;
+        num_terms++;
+    }
+
+    if (num_terms == 0) {
+        goto out;
+    }
+
+    postings = &terms[rarest]->postings;
+    for (unsigned b = postings->num_blocks; b-- > 0 && count < max; ) {
+        uint64_t *block_ids = cursors[rarest].ids;
+
+        if (postings->blocks[b].first_id >= before_id) {
+            continue;
+        }
+
+        decode_block(postings, b, block_ids);
+        for (unsigned i = postings->blocks[b].count; i-- > 0 && count < max; ) {
+            bool match = block_ids[i] < before_id;
+
+            for (unsigned t = 0; t < num_terms && match; ++t) {
+                match = t == rarest || cursor_holds(&cursors[t], block_ids[i]);
+            }
+
+            if (match) {
+                ids[count++] = block_ids[i];
+            }
+        }
+    }
+
+out:
+    pthread_rwlock_unlock(&index->lock);
+    return count;
+}
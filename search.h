@@ -0,0 +1,112 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <pthread.h>
+
+/*
+ * Search index: an inverted index of the text of chat messages, from each
+ * term to the ids of the messages that hold it, for full-text search of
+ * the history.
+ *
+ * Terms are the runs of letters and digits of a text, ASCII lowercased and
+ * cut to SEARCH_TERM_MAX_LEN bytes. Bytes past ASCII count as letters, so
+ * that a word of any script is one term, compared byte for byte.
+ *
+ * The ids of a term, its postings, only ever grow, so they are kept as
+ * varint deltas, mostly a byte each, in blocks of at most SEARCH_BLOCK_IDS
+ * with their first and last ids, which let a query skip whole blocks.
+ * A query goes through the postings of its rarest term newest first and
+ * looks up each id in the postings of the others.
+ *
+ * Messages are added in id order by one thread, and queried from any
+ * number of others.
+ */
+
+#define SEARCH_TERM_MAX_LEN             32u
+#define SEARCH_BLOCK_IDS                128u
+#define SEARCH_QUERY_MAX_TERMS          8u
+
+struct search_block {
+    uint64_t first_id;
+    uint64_t last_id;
+    uint32_t offset;                    /* Of the deltas after first_id. */
+    uint32_t count;                     /* Ids, first_id included. */
+};
+
+struct search_postings {
+    struct search_block *blocks;
+    unsigned num_blocks;
+    unsigned blocks_capacity;
+    unsigned char *deltas;
+    uint32_t len;
+    uint32_t capacity;
+    uint64_t count;                     /* Ids in all blocks. */
+};
+
+struct search_term {
+    char term[SEARCH_TERM_MAX_LEN];
+    unsigned len;                       /* 0 if the slot is free. */
+    uint32_t hash;
+    struct search_postings postings;
+};
+
+struct search_index {
+    pthread_rwlock_t lock;
+    struct search_term *slots;
+    unsigned num_slots;                 /* Power of two. */
+    unsigned count;
+    uint64_t last_id;
+    size_t bytes;                       /* Of postings. */
+};
+
+/**
+ * @brief Find the next term of a text.
+ *
+ * @param text Text, advanced past the term.
+ * @param len Length of text, decreased accordingly.
+ * @param term Where the term is written, lowercased and not
+ *        null-terminated, of at least SEARCH_TERM_MAX_LEN bytes.
+ *
+ * @return Length of the term, 0 if there is none left.
+ */
+unsigned search_next_term(const char **text, size_t *len, char *term);
+
+/**
+ * @brief Initialise an empty index.
+ *
+ * @return 0 on success, -1 on memory allocation error.
+ */
+int search_index_init(struct search_index *index);
+
+void search_index_deinit(struct search_index *index);
+
+/**
+ * @brief Index the text of a message.
+ *
+ * @param id Id of the message, greater than that of any message added.
+ *
+ * @return 0 on success, -1 on error (errno EINVAL if id is out of order,
+ *         ENOMEM on memory allocation error, after which some terms of the
+ *         message may be missing).
+ */
+int search_index_add(struct search_index *index, uint64_t id,
+        const char *text, size_t len);
+
+/**
+ * @brief Find the messages that hold every term of a query, newest first.
+ *
+ * @param before_id Only ids below this are given, to go on from where a
+ *        previous query stopped.
+ * @param ids Where the ids are written.
+ * @param max Most ids to write.
+ *
+ * @return Number of ids written, 0 if the query holds no terms. Terms past
+ *         SEARCH_QUERY_MAX_TERMS are ignored.
+ */
+unsigned search_index_query(struct search_index *index, const char *query,
+        size_t len, uint64_t before_id, uint64_t *ids, unsigned max);
+
+#endif /* SEARCH_H */
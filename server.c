@@ -1,402 +1,2928 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <locale.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <inttypes.h>
 
 #include <unistd.h>
-#include <poll.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 
 #include "log.h"
 #include "network.h"
 #include "chat.h"
+#include "compression.h"
+#include "reactor.h"
+#include "conn_table.h"
+#include "channel.h"
+#include "names.h"
+#include "history.h"
+#include "replay.h"
+#include "search.h"
+#include "mpsc.h"
+
+#define DEFAULT_MAX_CONNECTIONS                         1024
+#define MAX_NUM_THREADS                                 256
+#define MAX_EVENTS_PER_WAIT                             64
+#define DEFAULT_LISTEN_BACKLOG                          SOMAXCONN
+#define ACCEPT_BUDGET_PER_TICK                          256
+#define INPUT_BUDGET_PER_WAKEUP                         16
+#define RECEIVE_BATCH_SIZE                              64
+#define DEFAULT_STALL_TIMEOUT_MS                        30000
+#define DEFAULT_SEND_QUEUE_BYTES                        (256 * 1024)
+#define DEFAULT_BULK_QUEUE_BYTES                        (1024 * 1024)
+#define DEFAULT_HISTORY_SYNC_MS                         200
+#define DEFAULT_REPLAY_MESSAGES                         32
+#define DEFAULT_REPLAY_BYTES                            (16 * 1024)
+
+/*
+ * Bulk messages are fed to a send queue holding less than this, and the
+ * socket of a client that gets them holds no more than this unsent, so
+ * that chat messages never wait behind much bulk data.
+ */
+#define BULK_FEED_BYTES                                 (16 * 1024)
+
+/*
+ * Senders of bulk data are paused while a bulk queue or the bulk data
+ * posted to a shard is past this share of --bulk-queue-bytes, and go on
+ * once all are back to the smaller share. The headroom takes what is on
+ * its way when the pause starts.
+ */
+#define BULK_CONGESTED_DIVISOR                          4
+#define BULK_UNCONGESTED_DIVISOR                        8
+
+/*
+ * Messages sent back for a CHAT_SEARCH that does not say, and at most. At
+ * most SEARCH_MAX_CANDIDATES matches are read from the history for one,
+ * those in channels the client is not in included, SEARCH_BATCH_IDS at a
+ * time from the mapped segments.
+ */
+#define SEARCH_DEFAULT_RESULTS                          10
+#define SEARCH_MAX_RESULTS                              50
+#define SEARCH_MAX_CANDIDATES                           256
+#define SEARCH_BATCH_IDS                                64
+
+/*
+ * The history asked for with a CHAT_HISTORY_REQUEST, at most
+ * HISTORY_MAX_RESULTS messages, is read a batch of HISTORY_BATCH_RECORDS
+ * at a time: one batch per client and loop round, while the send queue of
+ * the client holds less than BULK_FEED_BYTES.
+ */
+#define HISTORY_BATCH_RECORDS                           64
+#define HISTORY_MAX_RESULTS                             10000
+
+/* Sender of the messages the server itself writes to clients. */
+#define SERVER_SENDER_NAME                              "*"
+
+/* What to do with a message that does not fit in a client's send queue. */
+enum overflow_policy {
+    OVERFLOW_DROP_OLDEST,   /* Make room by dropping the oldest unsent ones. */
+    OVERFLOW_DROP_NEWEST,   /* Drop the message. */
+    OVERFLOW_DISCONNECT,    /* Disconnect the client. */
+    OVERFLOW_MARKER         /* Drop it and tell the client how many it missed. */
+};
 
-#define MAX_NUM_CONNECTIONS                             16
+static const char *const overflow_policy_names[] = {
+    [OVERFLOW_DROP_OLDEST] = "drop-oldest",
+    [OVERFLOW_DROP_NEWEST] = "drop-newest",
+    [OVERFLOW_DISCONNECT] = "disconnect",
+    [OVERFLOW_MARKER] = "marker",
+};
 
 struct arguments {
     int port;
+    enum reactor_backend backend;
+    unsigned max_connections;
+    unsigned backlog;
+    unsigned stall_timeout_ms;
+    unsigned send_queue_bytes;
+    unsigned bulk_queue_bytes;
+    enum overflow_policy overflow;
+    unsigned zerocopy_min;
+    unsigned num_threads;
+    bool pin_cpus;
+    unsigned message_cache;
+    bool hugepages;
+    bool compression;
+    const char *history_dir;    /* NULL to keep no history. */
+    unsigned history_sync_ms;
+    unsigned replay_messages;
+    unsigned replay_bytes;
 } pargs;
 
-struct server {
+struct client {
+    struct net_endpoint *endpoint;
+    struct conn_handle handle;
+    unsigned events;        /* Reactor events the client is watched for. */
+    bool closing;           /* Disconnect scheduled at the end of the loop. */
+    struct client *next_closing;
+    bool flush_pending;     /* Send scheduled at the end of the loop. */
+    struct client *next_flush;
+    unsigned missed;        /* Messages dropped since the last marker. */
+    unsigned protocol;      /* Protocol version in use, see chat.h. */
+    uint32_t features;      /* Features negotiated with CHAT_HELLO. */
+    bool greeted;           /* Sent its first object, after which a
+                               CHAT_HELLO is no longer accepted. */
+    struct compression *compression;    /* NULL unless negotiated. */
+    struct channel_member member;       /* Named channels of the client. */
+    uint32_t sender_id;                 /* Given on join, 0 before. */
+    bool sender_ids;                    /* Knows the ids of the members and
+                                           gets compact messages, see
+                                           send_roster. */
+
+    /*
+     * Bulk messages (transfer chunks) waiting for the send queue to run
+     * low, in a ring that grows as needed, see feed_bulk.
+     */
+    struct net_message **bulk;
+    unsigned bulk_capacity;             /* Power of two. */
+    unsigned bulk_head;
+    unsigned bulk_count;
+    size_t bulk_bytes;
+    bool bulk_lowat;                    /* Socket unsent data is limited. */
+    bool bulk_congested;                /* Counted in bulk_congested of the
+                                           server, see deliver_bulk. */
+    bool paused;                        /* Input paused, see pause_input. */
+    struct client *next_paused;
+    bool carrying;                      /* Whole frames left over from the
+                                           last read, see receive_carried. */
+    struct client *next_carrying;
+
+    /* History being sent a batch at a time, see feed_history. */
+    bool streaming;
+    struct client *next_streaming;
+    uint64_t stream_id;                 /* Next record to read. */
+    uint64_t stream_end;                /* Id to stop at. */
+    uint64_t stream_until;              /* Time to stop after, in ms. */
+    unsigned stream_left;               /* Entries still wanted. */
+    unsigned stream_sent;
+
+    /* Write-stall timer, armed while there is data to send. */
+    unsigned long long stall_deadline;      /* 0 if not armed. */
+    unsigned long long stall_mark;          /* Bytes sent when armed. */
+    struct client *stall_prev;
+    struct client *stall_next;
+};
+
+/*
+ * A chat object to broadcast in the network format of every protocol
+ * version, since clients of all versions get the same broadcasts. A
+ * version whose build failed or that cannot hold the object is NULL.
+ */
+struct encodings {
+    struct net_message *msgs[CHAT_NUM_PROTOCOLS];
+    struct net_message *compact;    /* v2 with the sender id instead of its
+                                       name, or NULL, see deliver_encoded. */
+    bool bulk;                      /* Sent after chat traffic. */
+    const struct client *origin;    /* Not delivered to if set. */
+    char channel[CHAT_CHANNEL_NAME_MAX_LEN + 1];    /* Members of this
+                                                       channel only, or
+                                                       everyone if empty. */
+    bool direct;                    /* To target only. */
+    struct conn_handle target;      /* In the shard delivered on. */
+    bool replay;                    /* Replayed to members that join later. */
+};
+
+/* A message handed over to another shard for delivery to its clients. */
+struct shard_delivery {
+    struct mpsc_node node;
+    struct encodings enc;
+    size_t bulk_len;                    /* Counted in inbox_bulk_bytes. */
+};
+
+/*
+ * Per-shard counters. They are only written by the owning shard and read
+ * by whichever shard dumps the statistics.
+ */
+struct shard_stats {
+    atomic_ulong accepted;
+    atomic_ulong refused;   /* Accepted and closed right away: at capacity
+                               or out of descriptors. */
+    atomic_ulong deferred;  /* Most left in the backlog when the budget ran
+                               out, as a high-water mark. */
+    atomic_ulong stalled;   /* Evicted for making no send progress. */
+    atomic_ulong overflows; /* Messages that did not fit in a send queue. */
+    atomic_ulong dropped;   /* Messages dropped due to overflows. */
+    atomic_ulong compressed_in;     /* Bytes of messages sent compressed, */
+    atomic_ulong compressed_out;    /* and what they compressed to. */
+    atomic_ulong bulk_dropped;  /* Bulk messages that did not fit. */
+};
+
+/*
+ * A shard is one reactor thread with its own listening socket (bound with
+ * SO_REUSEPORT when there are several shards) and the clients accepted on it.
+ * Only the owning thread touches a shard, except for its inbox and wakefd.
+ */
+struct shard {
+    struct server *server;
+    unsigned index;
+    pthread_t thread;
     int listenfd;
-    struct net_endpoint *clients[MAX_NUM_CONNECTIONS];
-    struct pollfd fds[MAX_NUM_CONNECTIONS + 1];
-    unsigned num_clients;
-    unsigned num_fds;
+    int spare_fd;           /* Released to refuse connections on EMFILE. */
+    int wakefd;             /* eventfd signalled when the inbox is non-empty. */
+    atomic_bool wake_pending;
+    struct mpsc_queue inbox;
+    atomic_size_t inbox_bulk_bytes;     /* Chunks posted but not delivered. */
+    atomic_bool inbox_congested;        /* Counted in bulk_congested. */
+    struct reactor *reactor;
+    struct conn_table clients;
+    struct channel_table channels;  /* Of the clients of the shard. */
+    struct replay_ring recent;      /* Lobby messages, for joining clients. */
+    struct client *closing; /* Clients to disconnect at the end of the loop. */
+    struct client *flushing;/* io_uring clients to send to at the end of the loop. */
+    struct client *paused;  /* Clients whose input waits for bulk queues to drain. */
+    struct client *carrying;    /* Clients with frames read but not handled. */
+    struct client *streaming;   /* Clients being sent history. */
+
+    /*
+     * Clients with armed stall timers. Every timer runs for the same time,
+     * so appending on (re)arm keeps the list sorted by deadline.
+     */
+    struct client *stall_head;
+    struct client *stall_tail;
+    unsigned long long now_ms;  /* Monotonic time of the last wakeup. */
+
+    struct shard_stats stats;
+};
+
+struct server {
+    struct shard *shards;
+    unsigned num_shards;
+    bool pin_cpus;
+    unsigned stall_timeout_ms;  /* 0 disables write-stall eviction. */
+    unsigned send_queue_bytes;
+    unsigned bulk_queue_bytes;
+    enum overflow_policy overflow;
+    unsigned zerocopy_min;      /* 0 disables MSG_ZEROCOPY. */
+    uint32_t features;          /* Features offered to clients. */
+    atomic_uint bulk_congested; /* Congested bulk queues and inboxes. */
+    pthread_mutex_t names_lock;
+    struct name_table names;    /* Joined clients of all shards. */
+    uint32_t last_sender_id;    /* Under names_lock. */
+    struct history *history;    /* NULL unless --history. */
+    struct search_index *search;    /* Of the history, built by its writer. */
+    atomic_bool stopping;
 } server;
 
+/* Set by SIGUSR1, handled by shard 0. */
+static volatile sig_atomic_t dump_stats;
+
 enum server_code {
     SERVER_FATAL,
     SERVER_DISCONNECT,
-    SERVER_OK
+    SERVER_OK,
+    SERVER_AGAIN            /* No complete message available yet. */
 };
 
+static void print_usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options] port\n"
+            "options:\n"
+            "  --backend=poll|epoll|uring\n"
+            "                          I/O backend (default epoll); uring falls\n"
+            "                          back to epoll if io_uring is unavailable\n"
+            "  --max-connections=N     maximum number of clients (default %d)\n"
+            "  --backlog=N             listen backlog per thread (default %d)\n"
+            "  --stall-timeout=MS      disconnect clients that accept no data\n"
+            "                          for MS milliseconds, 0 to never (default %d)\n"
+            "  --send-queue-bytes=N    unsent bytes buffered per client (default %d)\n"
+            "  --bulk-queue-bytes=N    transfer chunks buffered per client, which\n"
+            "                          are sent once chat messages are (default %d)\n"
+            "  --overflow=POLICY       when a send queue is full: drop-oldest,\n"
+            "                          drop-newest, disconnect or marker, which\n"
+            "                          tells the client how many messages it\n"
+            "                          missed (default marker)\n"
+            "  --zerocopy-min=N        send batches of at least N bytes with\n"
+            "                          MSG_ZEROCOPY, 0 to never (default 0)\n"
+            "  --threads=N             number of reactor threads (default 1)\n"
+            "  --pin-cpus              pin each reactor thread to its own CPU\n"
+            "  --message-cache=N       free message buffers kept for reuse\n"
+            "                          (default %u)\n"
+            "  --hugepages             allocate message buffers from huge pages\n"
+            "  --no-compression        turn down clients that ask for compression\n"
+            "  --history=DIR           keep the chat messages in a log in DIR\n"
+            "  --history-sync=MS       sync the history to disk every MS\n"
+            "                          milliseconds, 0 after every write\n"
+            "                          (default %d)\n"
+            "  --replay=N              send joining clients the last N lobby\n"
+            "                          messages, 0 to send none (default %d)\n"
+            "  --replay-bytes=N        but no more than N bytes of them\n"
+            "                          (default %d)\n",
+            prog, DEFAULT_MAX_CONNECTIONS, DEFAULT_LISTEN_BACKLOG,
+            DEFAULT_STALL_TIMEOUT_MS, DEFAULT_SEND_QUEUE_BYTES,
+            DEFAULT_BULK_QUEUE_BYTES, NET_MSG_POOL_MAX_CACHED,
+            DEFAULT_HISTORY_SYNC_MS, DEFAULT_REPLAY_MESSAGES,
+            DEFAULT_REPLAY_BYTES);
+}
+
+static int overflow_policy_from_name(const char *name)
+{
+    for (unsigned i = 0; i < sizeof(overflow_policy_names) /
+            sizeof(*overflow_policy_names); ++i) {
+        if (strcmp(name, overflow_policy_names[i]) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
 static int scan_arguments(struct arguments* pargs, int argc, char *argv[])
 {
+    static const struct option long_options[] = {
+        { "backend", required_argument, NULL, 'b' },
+        { "max-connections", required_argument, NULL, 'c' },
+        { "backlog", required_argument, NULL, 'l' },
+        { "stall-timeout", required_argument, NULL, 's' },
+        { "send-queue-bytes", required_argument, NULL, 'q' },
+        { "bulk-queue-bytes", required_argument, NULL, 'B' },
+        { "overflow", required_argument, NULL, 'o' },
+        { "zerocopy-min", required_argument, NULL, 'z' },
+        { "threads", required_argument, NULL, 't' },
+        { "pin-cpus", no_argument, NULL, 'p' },
+        { "message-cache", required_argument, NULL, 'm' },
+        { "hugepages", no_argument, NULL, 'H' },
+        { "no-compression", no_argument, NULL, 'Z' },
+        { "history", required_argument, NULL, 'y' },
+        { "history-sync", required_argument, NULL, 'Y' },
+        { "replay", required_argument, NULL, 'r' },
+        { "replay-bytes", required_argument, NULL, 'R' },
+        { 0 }
+    };
     const char *port_str;
+    int opt, backend, policy;
+
+    pargs->backend = REACTOR_BACKEND_EPOLL;
+    pargs->max_connections = DEFAULT_MAX_CONNECTIONS;
+    pargs->backlog = DEFAULT_LISTEN_BACKLOG;
+    pargs->stall_timeout_ms = DEFAULT_STALL_TIMEOUT_MS;
+    pargs->send_queue_bytes = DEFAULT_SEND_QUEUE_BYTES;
+    pargs->bulk_queue_bytes = DEFAULT_BULK_QUEUE_BYTES;
+    pargs->overflow = OVERFLOW_MARKER;
+    pargs->zerocopy_min = 0;
+    pargs->num_threads = 1;
+    pargs->pin_cpus = false;
+    pargs->message_cache = NET_MSG_POOL_MAX_CACHED;
+    pargs->hugepages = false;
+    pargs->compression = true;
+    pargs->history_dir = NULL;
+    pargs->history_sync_ms = DEFAULT_HISTORY_SYNC_MS;
+    pargs->replay_messages = DEFAULT_REPLAY_MESSAGES;
+    pargs->replay_bytes = DEFAULT_REPLAY_BYTES;
+
+    /* Reset getopt so that arguments may be scanned more than once. */
+    optind = 0;
+
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'b':
+            backend = reactor_backend_from_name(optarg);
+            if (backend == -1) {
+                fprintf(stderr, "Unknown backend: %s\n", optarg);
+                return -1;
+            }
+            pargs->backend = backend;
+            break;
+        case 'c':
+            if (atoi(optarg) <= 0) {
+                fprintf(stderr, "Invalid connection limit: %s\n", optarg);
+                return -1;
+            }
+            pargs->max_connections = atoi(optarg);
+            break;
+        case 'l':
+            if (atoi(optarg) <= 0) {
+                fprintf(stderr, "Invalid listen backlog: %s\n", optarg);
+                return -1;
+            }
+            pargs->backlog = atoi(optarg);
+            break;
+        case 's':
+            if (atoi(optarg) < 0) {
+                fprintf(stderr, "Invalid stall timeout: %s\n", optarg);
+                return -1;
+            }
+            pargs->stall_timeout_ms = atoi(optarg);
+            break;
+        case 'q':
+            if (atoi(optarg) <= 0) {
+                fprintf(stderr, "Invalid send queue size: %s\n", optarg);
+                return -1;
+            }
+            pargs->send_queue_bytes = atoi(optarg);
+            break;
+        case 'B':
+            if (atoi(optarg) <= 0) {
+                fprintf(stderr, "Invalid bulk queue size: %s\n", optarg);
+                return -1;
+            }
+            pargs->bulk_queue_bytes = atoi(optarg);
+            break;
+        case 'o':
+            policy = overflow_policy_from_name(optarg);
+            if (policy == -1) {
+                fprintf(stderr, "Unknown overflow policy: %s\n", optarg);
+                return -1;
+            }
+            pargs->overflow = policy;
+            break;
+        case 'z':
+            if (atoi(optarg) < 0) {
+                fprintf(stderr, "Invalid zerocopy threshold: %s\n", optarg);
+                return -1;
+            }
+            pargs->zerocopy_min = atoi(optarg);
+            break;
+        case 't':
+            if (atoi(optarg) <= 0 || atoi(optarg) > MAX_NUM_THREADS) {
+                fprintf(stderr, "Invalid number of threads: %s\n", optarg);
+                return -1;
+            }
+            pargs->num_threads = atoi(optarg);
+            break;
+        case 'p':
+            pargs->pin_cpus = true;
+            break;
+        case 'm':
+            if (atoi(optarg) < 0) {
+                fprintf(stderr, "Invalid message cache size: %s\n", optarg);
+                return -1;
+            }
+            pargs->message_cache = atoi(optarg);
+            break;
+        case 'H':
+            pargs->hugepages = true;
+            break;
+        case 'Z':
+            pargs->compression = false;
+            break;
+        case 'y':
+            pargs->history_dir = optarg;
+            break;
+        case 'Y':
+            if (atoi(optarg) < 0) {
+                fprintf(stderr, "Invalid history sync interval: %s\n", optarg);
+                return -1;
+            }
+            pargs->history_sync_ms = atoi(optarg);
+            break;
+        case 'r':
+            if (atoi(optarg) < 0) {
+                fprintf(stderr, "Invalid number of messages to replay: %s\n", optarg);
+                return -1;
+            }
+            pargs->replay_messages = atoi(optarg);
+            break;
+        case 'R':
+            if (atoi(optarg) < 0) {
+                fprintf(stderr, "Invalid size of messages to replay: %s\n", optarg);
+                return -1;
+            }
+            pargs->replay_bytes = atoi(optarg);
+            break;
+        default:
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
 
-    if (argc < 2) {
-        fprintf(stderr, "usage: %s port\n", argv[0]);
+    if (optind >= argc) {
+        print_usage(argv[0]);
         return -1;
     }
 
-    port_str = argv[1];
+    port_str = argv[optind];
     pargs->port = atoi(port_str);
 
     return 0;
 }
 
-static int init_server(struct server *serv, short port)
+static unsigned long long monotonic_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+static int open_listener(short port, bool reuse_port, unsigned backlog)
 {
     struct sockaddr_in addr = {
         .sin_family = AF_INET,
         .sin_addr.s_addr = INADDR_ANY,
         .sin_port = htons(port)
     };
+    int fd;
 
-    memset(serv, 0, sizeof(*serv));
-
-    serv->listenfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (serv->listenfd == -1) {
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
         log_error("socket: %s\n", strerror(errno));
         return -1;
     }
 
-    if (setsockopt(serv->listenfd, SOL_SOCKET, SO_REUSEADDR,
-                &(int){1}, sizeof(int)) < 0) {
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0) {
         log_error("setsockopt: %s\n", strerror(errno));
     }
 
-    if (bind(serv->listenfd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    if (reuse_port &&
+            setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0) {
+        log_error("setsockopt(SO_REUSEPORT): %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
         log_error("bind: %s\n", strerror(errno));
-        close(serv->listenfd);
+        close(fd);
         return -1;
     }
 
-    if (listen(serv->listenfd, 0) == -1) {
+    /* The kernel silently caps the backlog at net.core.somaxconn. */
+    if (listen(fd, backlog) == -1) {
         log_error("listen: %s\n", strerror(errno));
-        close(serv->listenfd);
+        close(fd);
         return -1;
     }
 
-    serv->fds[0].fd = serv->listenfd;
-    serv->fds[0].events = POLLIN;
-    serv->num_fds = 1;
-
-    return 0;
+    return fd;
 }
 
-static void deinit_server(struct server *serv)
+static int init_shard(struct shard *shard, struct server *serv, unsigned index,
+        const struct arguments *args, unsigned max_connections)
 {
-    close(serv->listenfd);
-
-    for (unsigned i = 0; i < serv->num_clients; ++i) {
-        close(serv->clients[i]->fd);
-        free(serv->clients[i]->identifier);
-        net_endpoint_destroy(serv->clients[i]);
+    enum reactor_backend backend = args->backend;
+
+    memset(shard, 0, sizeof(*shard));
+    shard->server = serv;
+    shard->index = index;
+    shard->wakefd = -1;
+    atomic_init(&shard->wake_pending, false);
+    atomic_init(&shard->inbox_bulk_bytes, 0);
+    atomic_init(&shard->inbox_congested, false);
+    atomic_init(&shard->stats.accepted, 0);
+    atomic_init(&shard->stats.refused, 0);
+    atomic_init(&shard->stats.deferred, 0);
+    atomic_init(&shard->stats.stalled, 0);
+    atomic_init(&shard->stats.overflows, 0);
+    atomic_init(&shard->stats.compressed_in, 0);
+    atomic_init(&shard->stats.compressed_out, 0);
+    atomic_init(&shard->stats.bulk_dropped, 0);
+    atomic_init(&shard->stats.dropped, 0);
+    shard->now_ms = monotonic_ms();
+    mpsc_queue_init(&shard->inbox);
+
+    shard->listenfd = open_listener(args->port, serv->num_shards > 1,
+            args->backlog);
+    if (shard->listenfd == -1) {
+        return -1;
     }
-}
 
-static struct net_endpoint *accept_endpoint(struct server *serv)
-{
-    struct net_endpoint *endp;
-    int sockfd;
+    shard->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
 
-    sockfd = accept(serv->listenfd, NULL, NULL);
-    if (sockfd == -1) {
-        log_error("accept: %s\n", strerror(errno));
-        return NULL;
+    shard->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (shard->wakefd == -1) {
+        log_error("eventfd: %s\n", strerror(errno));
+        goto err_close;
     }
 
-    endp = net_endpoint_new(sockfd);
-    if (!endp) {
-        close(sockfd);
+    if (conn_table_init(&shard->clients, max_connections) == -1) {
         log_error("Out of memory\n");
-        return NULL;
+        goto err_close;
     }
 
-    return endp;
-}
+    if (channel_table_init(&shard->channels) == -1) {
+        log_error("Out of memory\n");
+        goto err_table;
+    }
 
-static int add_endpoint(struct server *serv, struct net_endpoint *endp)
-{
-    if (serv->num_clients == MAX_NUM_CONNECTIONS) {
-        log_error("Unable to add endpoint: server is at capacity.\n");
-        return -1;
+    if (replay_ring_init(&shard->recent, args->replay_messages,
+                args->replay_bytes) == -1) {
+        log_error("Out of memory\n");
+        goto err_channels;
+    }
+
+    shard->reactor = reactor_new(backend);
+    if (!shard->reactor && backend == REACTOR_BACKEND_URING) {
+        log_info("io_uring is unavailable (%s), falling back to epoll.\n",
+                strerror(errno));
+        shard->reactor = reactor_new(REACTOR_BACKEND_EPOLL);
     }
 
-    serv->fds[serv->num_fds].fd = endp->fd;
-    serv->fds[serv->num_fds].events = POLLIN;
-    serv->num_fds++;
+    if (!shard->reactor) {
+        log_error("Unable to create %s reactor: %s\n",
+                reactor_backend_name(backend), strerror(errno));
+        goto err_recent;
+    }
 
-    serv->clients[serv->num_clients] = endp;
-    serv->num_clients++;
+    /* The listener and wakefd are told apart from clients by their address. */
+    if (reactor_add(shard->reactor, shard->listenfd, REACTOR_IN,
+                &shard->listenfd) == -1 ||
+            reactor_add(shard->reactor, shard->wakefd, REACTOR_IN,
+                &shard->wakefd) == -1) {
+        log_error("Unable to watch shard descriptors: %s\n", strerror(errno));
+        goto err_reactor;
+    }
 
     return 0;
+
+err_reactor:
+    reactor_destroy(shard->reactor);
+err_recent:
+    replay_ring_deinit(&shard->recent);
+err_channels:
+    channel_table_deinit(&shard->channels);
+err_table:
+    conn_table_deinit(&shard->clients);
+err_close:
+    if (shard->wakefd != -1) {
+        close(shard->wakefd);
+    }
+    if (shard->spare_fd != -1) {
+        close(shard->spare_fd);
+    }
+    close(shard->listenfd);
+    return -1;
 }
 
-static int remove_endpoint(struct server *serv, struct net_endpoint *endp)
+static void encodings_unref(struct encodings *enc)
 {
-    unsigned tail_len;
-
-    for (int i = 0; i < serv->num_clients; ++i) {
-        if (serv->clients[i] == endp) {
-            /* Number of elements after the one being removed. */
-            tail_len = serv->num_clients - i - 1;
-
-            /* Shift arrays. */
-            memmove(serv->clients + i, serv->clients + i + 1,
-                    sizeof(endp) * tail_len);
-            memmove(serv->fds + i + 1, serv->fds + i + 2,
-                    sizeof(*serv->fds) * tail_len);
-
-            serv->num_clients--;
-            serv->num_fds--;
-            return 0;
+    for (unsigned i = 0; i < CHAT_NUM_PROTOCOLS; ++i) {
+        if (enc->msgs[i]) {
+            net_message_unref(enc->msgs[i]);
         }
     }
+    if (enc->compact) {
+        net_message_unref(enc->compact);
+    }
+}
 
-    log_debug("Cannot remove endpoint %p from server %p because it is not found\n",
-            (void *)endp, (void *)serv);
+static void destroy_client(struct client *client)
+{
+    for (unsigned i = 0; i < client->bulk_count; ++i) {
+        net_message_unref(client->bulk[(client->bulk_head + i) &
+                (client->bulk_capacity - 1)]);
+    }
+    free(client->bulk);
 
-    return -1;
+    if (client->compression) {
+        compression_deinit(client->compression);
+        free(client->compression);
+    }
+    close(client->endpoint->fd);
+    free(client->endpoint->identifier);
+    net_endpoint_destroy(client->endpoint);
+    free(client);
 }
 
-static void broadcast_data(struct server *serv, const unsigned char *data, size_t len)
+static void deinit_shard(struct shard *shard)
 {
-    struct net_message *msg;
+    struct mpsc_node *node;
 
-    msg = net_message_new();
-    if (!msg) {
-        return;
+    close(shard->listenfd);
+    close(shard->wakefd);
+    if (shard->spare_fd != -1) {
+        close(shard->spare_fd);
     }
 
-    if (net_message_set_body(msg, data, len) == -1) {
-        net_message_unref(msg);
-        return;
+    while ((node = mpsc_queue_pop(&shard->inbox))) {
+        struct shard_delivery *delivery = (struct shard_delivery *)node;
+        encodings_unref(&delivery->enc);
+        free(delivery);
     }
 
-    for (unsigned i = 0; i < serv->num_clients; ++i) {
-        if (net_enqueue_message(serv->clients[i], msg) > 0) {
-            serv->fds[1 + i].events |= POLLOUT;
-        }
+    for (unsigned i = 0; i < conn_table_count(&shard->clients); ++i) {
+        destroy_client(conn_table_at(&shard->clients, i));
     }
 
-    net_message_unref(msg);
+    replay_ring_deinit(&shard->recent);
+    channel_table_deinit(&shard->channels);
+    conn_table_deinit(&shard->clients);
+    reactor_destroy(shard->reactor);
 }
 
-static void disconnect_client(struct server *serv, struct net_endpoint *ept)
+/**
+ * @brief Index the text of a chat message of the history, on its writer
+ *        thread, see struct history_observer.
+ */
+static void index_record(void *arg, const struct history_record *record)
 {
-    struct chat_member_leave leave = {0};
-    char buffer[1024];
-    int len;
+    struct search_index *index = arg;
+    struct chat_view view;
+
+    if (chat_view_decode(&view, CHAT_PROTOCOL_V2, record->frame,
+                record->len) == CHAT_MESSAGE &&
+            search_index_add(index, record->id, view.message.data,
+                view.message.len) == -1) {
+        log_error("Unable to index message %" PRIu64 ": %s\n", record->id,
+                strerror(errno));
+    }
+}
 
-    strcpy(leave.sender, ept->identifier);
+/**
+ * @brief Open the history and its search index, which it builds from then
+ *        on as it goes through the records already there and appends more.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int open_history(struct server *serv, const char *dir, unsigned sync_ms)
+{
+    struct history_observer observer = { index_record, NULL };
 
-    remove_endpoint(serv, ept);
-    close(ept->fd);
-    free(ept->identifier);
-    net_endpoint_destroy(ept);
+    serv->history = malloc(sizeof(*serv->history));
+    serv->search = malloc(sizeof(*serv->search));
+    if (!serv->history || !serv->search || search_index_init(serv->search) == -1) {
+        log_error("Out of memory\n");
+        goto err;
+    }
 
-    buffer[0] = CHAT_MEMBER_LEAVE;
-    len = chat_member_leave_to_network(&leave, buffer + 1, sizeof(buffer) - 1);
+    observer.arg = serv->search;
+    if (history_open(serv->history, dir, HISTORY_DEFAULT_SEGMENT_BYTES,
+                sync_ms, &observer) == -1) {
+        log_error("Unable to open the history in %s: %s\n", dir,
+                strerror(errno));
+        search_index_deinit(serv->search);
+        goto err;
+    }
 
-    broadcast_data(serv, buffer, len + 1);
+    return 0;
 
-    log_info("Chat member %s disconnected.\n", leave.sender);
+err:
+    free(serv->history);
+    free(serv->search);
+    serv->history = NULL;
+    serv->search = NULL;
+    return -1;
 }
 
-static void handle_new_chat_message(struct server *serv, 
-        struct net_endpoint *sender, struct chat_message *cm)
+static void close_history(struct server *serv)
 {
-    unsigned char data[1024];
-    int conv;
-
-    if (!sender->identifier) {
-        /* Sender never joined. */
-        return;
+    if (serv->history) {
+        /* Which stops the writer, that adds to the index. */
+        history_close(serv->history);
+        search_index_deinit(serv->search);
+        free(serv->history);
+        free(serv->search);
     }
+}
 
-    /* Client is not required to put anything in sender field. */
-    strcpy(cm->sender, sender->identifier);
+static int init_server(struct server *serv, const struct arguments *args)
+{
+    unsigned per_shard;
 
-    data[0] = CHAT_MESSAGE;
-    conv = chat_message_to_network(cm, data + 1, sizeof(data) - 1);
-    if (conv == -1) {
-        return;
+    memset(serv, 0, sizeof(*serv));
+    serv->num_shards = args->num_threads;
+    serv->pin_cpus = args->pin_cpus;
+    serv->stall_timeout_ms = args->stall_timeout_ms;
+    serv->send_queue_bytes = args->send_queue_bytes;
+    serv->bulk_queue_bytes = args->bulk_queue_bytes;
+    serv->overflow = args->overflow;
+    serv->zerocopy_min = args->zerocopy_min;
+    serv->features = CHAT_SUPPORTED_FEATURES;
+    if (!args->compression) {
+        serv->features &= ~CHAT_FEATURE_COMPRESSION;
     }
+    atomic_init(&serv->bulk_congested, 0);
+    atomic_init(&serv->stopping, false);
 
-    broadcast_data(serv, data, conv + 1);
-}
+    net_message_pool_configure(args->message_cache, args->hugepages);
 
-static void handle_new_chat_member_join(struct server *serv,
-        struct net_endpoint *sender, struct chat_member_join *cm)
-{
-    unsigned char data[1024];
-    int conv;
+    pthread_mutex_init(&serv->names_lock, NULL);
+    if (name_table_init(&serv->names) == -1) {
+        log_error("Out of memory\n");
+        return -1;
+    }
 
-    if (sender->identifier) {
-        /* Sender already joined. */
-        return;
+    serv->shards = calloc(serv->num_shards, sizeof(*serv->shards));
+    if (!serv->shards) {
+        log_error("Out of memory\n");
+        name_table_deinit(&serv->names);
+        return -1;
     }
 
-    sender->identifier = strdup(cm->sender);
-    if (!sender->identifier) {
-        /* Fatal: no memory. */
-        return;
+    if (args->history_dir && open_history(serv, args->history_dir,
+                args->history_sync_ms) == -1) {
+        free(serv->shards);
+        name_table_deinit(&serv->names);
+        return -1;
     }
 
-    data[0] = CHAT_MEMBER_JOIN;
-    conv = chat_member_join_to_network(cm, data + 1, sizeof(data) - 1);
-    if (conv == -1) {
-        return;
+    /* The connection limit is split evenly between the shards. */
+    per_shard = (args->max_connections + serv->num_shards - 1) / serv->num_shards;
+
+    for (unsigned i = 0; i < serv->num_shards; ++i) {
+        if (init_shard(&serv->shards[i], serv, i, args, per_shard) == -1) {
+            while (i-- > 0) {
+                deinit_shard(&serv->shards[i]);
+            }
+            close_history(serv);
+            free(serv->shards);
+            name_table_deinit(&serv->names);
+            return -1;
+        }
     }
 
-    broadcast_data(serv, data, conv + 1);
+    log_info("Listening on port %d using %s with %u thread(s).\n", args->port,
+            reactor_backend_name(args->backend), serv->num_shards);
+
+    return 0;
 }
 
-static int handle_endpoint_input(struct server *serv,
-        struct net_endpoint *endpoint)
+static void deinit_server(struct server *serv)
 {
-    union chat_object cm;
-    struct net_message *msg;
-    int rc, type;
+    for (unsigned i = 0; i < serv->num_shards; ++i) {
+        deinit_shard(&serv->shards[i]);
+    }
 
-    rc = net_receive(endpoint, &msg);
-    if (rc < 0) {
-        if (errno == EWOULDBLOCK || errno == EAGAIN) {
-            return SERVER_OK;
-        }
+    /* After the shards, which append to it. */
+    close_history(serv);
 
-        log_error("Unable to receive data: %s\n", strerror(errno));
-        return SERVER_DISCONNECT;
-    }
-    else if (rc == 0) {
-        log_debug("Peer closed connection.\n");
-        return SERVER_DISCONNECT;
-    }
+    free(serv->shards);
+    name_table_deinit(&serv->names);
+    pthread_mutex_destroy(&serv->names_lock);
+}
 
-    type = network_to_chat_object(&cm, net_message_body(msg),
-            net_message_body_length(msg));
-    net_message_unref(msg);
+/**
+ * @brief Accept and immediately close a pending connection when out of file
+ *        descriptors, so that it does not keep the listener readable.
+ *
+ * @return 0 if a connection was refused, -1 otherwise.
+ */
+static int refuse_connection(struct shard *shard)
+{
+    int sockfd;
 
-    if (type == -1) {
-        log_error("Received corrupted message.\n");
-        return SERVER_DISCONNECT;
+    if (shard->spare_fd == -1) {
+        return -1;
     }
 
-    switch ((enum chat_object_type) type) {
-    case CHAT_MESSAGE:
-        handle_new_chat_message(serv, endpoint, &cm.chat);
-        break;
-    case CHAT_MEMBER_JOIN:
-        handle_new_chat_member_join(serv, endpoint, &cm.join);
-        break;
-    case CHAT_MEMBER_LEAVE:
-        log_info("Received an illegal chat object from client.\n");
-        break;
+    close(shard->spare_fd);
+    sockfd = accept(shard->listenfd, NULL, NULL);
+    if (sockfd != -1) {
+        close(sockfd);
     }
+    shard->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
 
-    return SERVER_OK;
+    return sockfd == -1 ? -1 : 0;
 }
 
-int handle_incoming_connection(struct server *serv)
+/**
+ * @brief Accept a pending connection.
+ *
+ * @return Endpoint or NULL (check errno). errno is EAGAIN if the backlog is
+ *         empty and EINTR if the connection was dropped.
+ */
+static struct net_endpoint *accept_endpoint(struct shard *shard)
 {
-    struct net_endpoint *endpt;
+    struct net_endpoint *endp;
+    int sockfd;
 
-    endpt = accept_endpoint(serv);
-    if (!endpt) {
-        return SERVER_FATAL;
+    sockfd = accept4(shard->listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (sockfd == -1) {
+        switch (errno) {
+        case EAGAIN:
+        case EINTR:
+            break;
+        case ECONNABORTED:
+            /* The peer gave up while in the backlog. */
+            errno = EINTR;
+            break;
+        case EMFILE:
+        case ENFILE:
+            log_error("accept: %s\n", strerror(errno));
+            if (refuse_connection(shard) == 0) {
+                atomic_fetch_add_explicit(&shard->stats.refused, 1,
+                        memory_order_relaxed);
+                errno = EINTR;
+            }
+            break;
+        default:
+            log_error("accept: %s\n", strerror(errno));
+            break;
+        }
+        return NULL;
     }
 
-    if (add_endpoint(serv, endpt) == -1) {
-        close(endpt->fd);
-        net_endpoint_destroy(endpt);
+    endp = net_endpoint_new(sockfd);
+    if (!endp) {
+        close(sockfd);
+        log_error("Out of memory\n");
+        errno = ENOMEM;
+        return NULL;
     }
 
-    return SERVER_OK;
+    return endp;
 }
 
-static int loop(struct server *serv)
+static int add_endpoint(struct shard *shard, struct net_endpoint *endp)
 {
-    int n, err;
+    struct client *client;
+    struct uring *ring;
+    int rc;
 
-    if ((n = poll(serv->fds, serv->num_fds, -1)) == -1) {
-        log_error("poll: %s\n", strerror(errno));
+    client = calloc(1, sizeof(*client));
+    if (!client) {
+        log_error("Out of memory\n");
         return -1;
     }
 
-    if (serv->fds[0].revents & POLLIN) {
-        /* incoming connection. */
-        if (handle_incoming_connection(serv) == SERVER_FATAL) {
-            return -1;
+    if (conn_table_insert(&shard->clients, client, &client->handle) == -1) {
+        if (errno == ENOSPC) {
+            log_error("Unable to add endpoint: server is at capacity.\n");
         }
-        n--;
+        else {
+            log_error("Out of memory\n");
+        }
+        free(client);
+        return -1;
     }
 
-    for (unsigned i = 1; n > 0 && i < serv->num_fds; ++i) {
-        struct net_endpoint *endp;
-        int revents;
+    client->endpoint = endp;
+    client->member.value = client;
+    client->events = REACTOR_IN;
+    client->protocol = CHAT_PROTOCOL_V1;
+    net_endpoint_set_send_limit(endp, shard->server->send_queue_bytes);
 
-        revents = serv->fds[i].revents;
-        endp = serv->clients[i - 1];
-
-        if (revents)
-            n--;
-        else
-            continue;
+    ring = reactor_uring(shard->reactor);
+    if (ring) {
+        rc = net_endpoint_attach_uring(endp, ring, client);
+    }
+    else {
+        rc = reactor_add(shard->reactor, endp->fd, client->events, client);
 
-        if (revents & POLLIN) {
-            switch (handle_endpoint_input(serv, endp)) {
-            case SERVER_DISCONNECT:
-                disconnect_client(serv, endp);
-                break;
-            case SERVER_FATAL:
-                return -1;
-                break;
-            case SERVER_OK:
-                break;
-            }
+        if (rc == 0 && shard->server->zerocopy_min > 0 &&
+                net_endpoint_set_zerocopy(endp, shard->server->zerocopy_min) == -1) {
+            log_debug("MSG_ZEROCOPY unavailable: %s\n", strerror(errno));
         }
+    }
 
-        if (revents & POLLOUT) {
-            int queue_len = net_process_send(endp);
-            if (queue_len < 0) {
-                if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                    log_error("Unable to send data: %s\n", strerror(errno));
-                }
-            }
-            else if (queue_len == 0) {
-                /* nothing more to send at this time. */
-                serv->fds[i].events &= ~POLLOUT;
-            }
-        }
+    if (rc == -1) {
+        log_error("Unable to watch endpoint: %s\n", strerror(errno));
+        conn_table_remove(&shard->clients, client->handle);
+        free(client);
+        return -1;
     }
 
     return 0;
 }
 
-int main(int argc, char *argv[])
+static int remove_client(struct shard *shard, struct client *client)
 {
-    if (scan_arguments(&pargs, argc, argv) != 0) {
-        return 1;
+    if (conn_table_remove(&shard->clients, client->handle) == -1) {
+        log_debug("Cannot remove client %p from shard %p because it is not found\n",
+                (void *)client, (void *)shard);
+        return -1;
     }
 
-    if (init_server(&server, pargs.port) == -1) {
-        return 1;
+    if (!client->endpoint->uring) {
+        reactor_remove(shard->reactor, client->endpoint->fd);
     }
 
-    for (;;) {
-        if (loop(&server) == -1) {
-            log_info("Exiting due to fatal error.\n");
-            break;
-        }
+    return 0;
+}
+
+static void disarm_stall_timer(struct shard *shard, struct client *client)
+{
+    if (!client->stall_deadline) {
+        return;
+    }
+
+    if (client->stall_prev) {
+        client->stall_prev->stall_next = client->stall_next;
+    }
+    else {
+        shard->stall_head = client->stall_next;
+    }
+
+    if (client->stall_next) {
+        client->stall_next->stall_prev = client->stall_prev;
+    }
+    else {
+        shard->stall_tail = client->stall_prev;
     }
 
+    client->stall_deadline = 0;
+    client->stall_prev = client->stall_next = NULL;
+}
+
+/**
+ * @brief Start or restart the write-stall timer of a client.
+ */
+static void arm_stall_timer(struct shard *shard, struct client *client)
+{
+    unsigned timeout_ms = shard->server->stall_timeout_ms;
+
+    if (timeout_ms == 0) {
+        return;
+    }
+
+    disarm_stall_timer(shard, client);
+
+    client->stall_deadline = shard->now_ms + timeout_ms;
+    client->stall_mark = client->endpoint->total_bytes_sent;
+    client->stall_prev = shard->stall_tail;
+    if (shard->stall_tail) {
+        shard->stall_tail->stall_next = client;
+    }
+    else {
+        shard->stall_head = client;
+    }
+    shard->stall_tail = client;
+}
+
+/**
+ * @brief Schedule a client to be disconnected at the end of the current loop
+ *        iteration. Further events of the client are ignored.
+ */
+static void disconnect_client(struct shard *shard, struct client *client)
+{
+    if (client->closing) {
+        return;
+    }
+
+    client->closing = true;
+    client->next_closing = shard->closing;
+    shard->closing = client;
+    disarm_stall_timer(shard, client);
+
+    /* Direct messages stop here; the name is freed with the client. */
+    if (client->endpoint->identifier) {
+        const char *name = client->endpoint->identifier;
+
+        pthread_mutex_lock(&shard->server->names_lock);
+        name_table_remove(&shard->server->names, name, strlen(name));
+        pthread_mutex_unlock(&shard->server->names_lock);
+    }
+}
+
+/**
+ * @brief Schedule a send to an io_uring client at the end of the loop
+ *        iteration, so that everything enqueued meanwhile goes in one batch.
+ */
+static void schedule_flush(struct shard *shard, struct client *client)
+{
+    if (client->flush_pending) {
+        return;
+    }
+
+    client->flush_pending = true;
+    client->next_flush = shard->flushing;
+    shard->flushing = client;
+}
+
+/**
+ * @brief Update the reactor events a client is watched for.
+ *
+ * @param shard Shard owning the client.
+ * @param client Client.
+ * @param events New events of interest.
+ */
+static void set_client_events(struct shard *shard, struct client *client,
+        unsigned events)
+{
+    if (client->events == events) {
+        return;
+    }
+
+    /* The client has to make send progress while there is data to send. */
+    if ((events & REACTOR_OUT) && !(client->events & REACTOR_OUT)) {
+        arm_stall_timer(shard, client);
+    }
+    else if (!(events & REACTOR_OUT) && (client->events & REACTOR_OUT)) {
+        disarm_stall_timer(shard, client);
+    }
+
+    if (client->endpoint->uring) {
+        /* Completions drive io_uring clients; there is nothing to watch. */
+        if ((events & REACTOR_OUT) && !(client->events & REACTOR_OUT)) {
+            schedule_flush(shard, client);
+        }
+
+        client->events = events;
+        return;
+    }
+
+    if (reactor_modify(shard->reactor, client->endpoint->fd, events, client) == -1) {
+        log_error("Unable to modify watched events: %s\n", strerror(errno));
+        return;
+    }
+
+    client->events = events;
+}
+
+/* Count messages dropped from or refused by a send queue. */
+static void count_dropped(struct shard *shard, unsigned n)
+{
+    atomic_fetch_add_explicit(&shard->stats.dropped, n, memory_order_relaxed);
+}
+
+/**
+ * @brief Enqueue a message to a client, compressed if the client
+ *        negotiated compression.
+ *
+ * @return As net_enqueue_message. If compression fails, the client is
+ *         disconnected and errno is EPROTO.
+ */
+static int enqueue_to_client(struct shard *shard, struct client *client,
+        struct net_message *msg)
+{
+    unsigned len = net_message_body_length(msg);
+    struct net_message *packed;
+    int rc;
+
+    if (!client->compression) {
+        return net_enqueue_message(client->endpoint, msg);
+    }
+
+    /* Once compressed, a message has to be sent: check for room first. */
+    if (!net_endpoint_has_room(client->endpoint,
+                NET_MSG_HEADER_LEN + 1 + len + COMPRESSION_MAX_OVERHEAD)) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    packed = chat_compress(client->compression, msg);
+    rc = packed ? net_enqueue_message(client->endpoint, packed) : -1;
+    if (rc == -1) {
+        if (packed) {
+            net_message_unref(packed);
+        }
+        log_error("Unable to compress message: %s\n", strerror(errno));
+        disconnect_client(shard, client);
+        errno = EPROTO;
+        return -1;
+    }
+
+    atomic_fetch_add_explicit(&shard->stats.compressed_in, len,
+            memory_order_relaxed);
+    atomic_fetch_add_explicit(&shard->stats.compressed_out,
+            net_message_body_length(packed), memory_order_relaxed);
+    net_message_unref(packed);
+
+    return rc;
+}
+
+/**
+ * @brief Enqueue a "you missed N messages" chat message to a client.
+ *
+ * @return 0 on success, -1 if it does not fit in the send queue either.
+ */
+static int enqueue_missed_marker(struct shard *shard, struct client *client)
+{
+    char text[CHAT_MESSAGE_MAX_LEN + 1];
+    struct net_message *msg;
+    int rc;
+
+    snprintf(text, sizeof(text),
+            "You missed %u message(s) because you were not keeping up.",
+            client->missed);
+
+    msg = chat_message_build(client->protocol, SERVER_SENDER_NAME, text);
+    if (!msg) {
+        return -1;
+    }
+
+    rc = enqueue_to_client(shard, client, msg);
+    net_message_unref(msg);
+
+    if (rc == -1) {
+        return -1;
+    }
+
+    client->missed = 0;
+    return 0;
+}
+
+/**
+ * @brief Apply the overflow policy to a message that did not fit in the
+ *        send queue of a client.
+ */
+static void handle_overflow(struct shard *shard, struct client *client,
+        struct net_message *msg)
+{
+    struct net_endpoint *endp = client->endpoint;
+
+    atomic_fetch_add_explicit(&shard->stats.overflows, 1, memory_order_relaxed);
+
+    switch (shard->server->overflow) {
+    case OVERFLOW_DROP_OLDEST:
+        /*
+         * Queued compressed messages cannot be dropped since the ones
+         * after them refer to them: drop the new one instead.
+         */
+        if (!client->compression) {
+            count_dropped(shard, net_drop_queued(endp,
+                        NET_MSG_HEADER_LEN + net_message_body_length(msg)));
+            if (net_enqueue_message(endp, msg) == -1) {
+                count_dropped(shard, 1);
+            }
+            break;
+        }
+        /* Fall through. */
+    case OVERFLOW_DROP_NEWEST:
+        count_dropped(shard, 1);
+        break;
+    case OVERFLOW_DISCONNECT:
+        log_info("Disconnecting %s: send queue overflow.\n",
+                endp->identifier ? (char *)endp->identifier : "client");
+        disconnect_client(shard, client);
+        break;
+    case OVERFLOW_MARKER:
+        count_dropped(shard, 1);
+        client->missed++;
+        break;
+    }
+}
+
+/**
+ * @brief Enqueue a message to a client, applying the overflow policy if
+ *        the client is not keeping up.
+ */
+static void deliver_to_client(struct shard *shard, struct client *client,
+        struct net_message *msg)
+{
+    /* The marker has to go before anything sent after the gap. */
+    if (client->missed > 0 && enqueue_missed_marker(shard, client) == -1) {
+        handle_overflow(shard, client, msg);
+        return;
+    }
+
+    if (enqueue_to_client(shard, client, msg) == -1) {
+        if (errno == ENOBUFS) {
+            handle_overflow(shard, client, msg);
+        }
+        else {
+            log_error("Unable to enqueue message: %s\n", strerror(errno));
+        }
+        return;
+    }
+
+    set_client_events(shard, client, client->events | REACTOR_OUT);
+}
+
+/**
+ * @brief Wake up a shard so that it drains its inbox.
+ */
+static void wake_shard(struct shard *shard)
+{
+    /* Only the first waker since the last drain writes to the eventfd. */
+    if (!atomic_exchange(&shard->wake_pending, true)) {
+        if (write(shard->wakefd, &(uint64_t){1}, sizeof(uint64_t)) == -1 &&
+                errno != EAGAIN) {
+            log_error("Unable to wake shard %u: %s\n", shard->index,
+                    strerror(errno));
+        }
+    }
+}
+
+/**
+ * @brief Count one congestion less, and let paused clients go on once there
+ *        is none left.
+ */
+static void uncongest(struct server *serv)
+{
+    if (atomic_fetch_sub(&serv->bulk_congested, 1) == 1) {
+        for (unsigned i = 0; i < serv->num_shards; ++i) {
+            wake_shard(&serv->shards[i]);
+        }
+    }
+}
+
+/**
+ * @brief Take a client out of the congested count, and let paused clients
+ *        go on once no client is congested.
+ */
+static void clear_congested(struct shard *shard, struct client *client)
+{
+    if (client->bulk_congested) {
+        client->bulk_congested = false;
+        uncongest(shard->server);
+    }
+}
+
+/**
+ * @brief Move bulk messages of a client to its send queue while the queue
+ *        runs low, so that chat messages enqueued meanwhile go first.
+ */
+static void feed_bulk(struct shard *shard, struct client *client)
+{
+    while (client->bulk_count > 0 && !client->closing &&
+            client->endpoint->send_queue_bytes < BULK_FEED_BYTES) {
+        struct net_message *msg = client->bulk[client->bulk_head];
+
+        client->bulk_head = (client->bulk_head + 1) & (client->bulk_capacity - 1);
+        client->bulk_count--;
+        client->bulk_bytes -= net_message_body_length(msg);
+
+        deliver_to_client(shard, client, msg);
+        net_message_unref(msg);
+    }
+
+    if (client->bulk_bytes <= shard->server->bulk_queue_bytes / BULK_UNCONGESTED_DIVISOR) {
+        clear_congested(shard, client);
+    }
+}
+
+/**
+ * @brief Queue a bulk message to a client behind its chat traffic, or drop
+ *        it if the bulk budget of the client is used up.
+ */
+static void deliver_bulk(struct shard *shard, struct client *client,
+        struct net_message *msg)
+{
+    unsigned len = net_message_body_length(msg);
+    int lowat = BULK_FEED_BYTES;
+
+    if (client->bulk_bytes + len > shard->server->bulk_queue_bytes) {
+        atomic_fetch_add_explicit(&shard->stats.bulk_dropped, 1,
+                memory_order_relaxed);
+        return;
+    }
+
+    if (client->bulk_count == client->bulk_capacity) {
+        unsigned capacity = client->bulk_capacity ? 2 * client->bulk_capacity : 16;
+        struct net_message **bulk = malloc(capacity * sizeof(*bulk));
+
+        if (!bulk) {
+            log_error("Out of memory\n");
+            return;
+        }
+
+        for (unsigned i = 0; i < client->bulk_count; ++i) {
+            bulk[i] = client->bulk[(client->bulk_head + i) &
+                (client->bulk_capacity - 1)];
+        }
+        free(client->bulk);
+        client->bulk = bulk;
+        client->bulk_capacity = capacity;
+        client->bulk_head = 0;
+    }
+
+    /*
+     * Otherwise the socket buffer takes in megabytes of bulk data, which
+     * chat messages would have to wait behind.
+     */
+    if (!client->bulk_lowat) {
+        if (setsockopt(client->endpoint->fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                    &lowat, sizeof(lowat)) == -1) {
+            log_debug("TCP_NOTSENT_LOWAT unavailable: %s\n", strerror(errno));
+        }
+        client->bulk_lowat = true;
+    }
+
+    client->bulk[(client->bulk_head + client->bulk_count) &
+        (client->bulk_capacity - 1)] = net_message_ref(msg);
+    client->bulk_count++;
+    client->bulk_bytes += len;
+
+    /* Senders of bulk data wait while anyone is this far behind. */
+    if (!client->bulk_congested &&
+            client->bulk_bytes > shard->server->bulk_queue_bytes / BULK_CONGESTED_DIVISOR) {
+        client->bulk_congested = true;
+        atomic_fetch_add(&shard->server->bulk_congested, 1);
+    }
+
+    feed_bulk(shard, client);
+}
+
+static void deliver_encoded(struct shard *shard, struct client *client,
+        const struct encodings *enc)
+{
+    struct net_message *msg = enc->msgs[client->protocol - 1];
+
+    if (enc->compact && client->sender_ids) {
+        msg = enc->compact;
+    }
+
+    if (client->closing || !msg || client == enc->origin) {
+        return;
+    }
+
+    if (enc->bulk) {
+        deliver_bulk(shard, client, msg);
+    }
+    else {
+        deliver_to_client(shard, client, msg);
+    }
+}
+
+/**
+ * @brief Enqueue a message to every client of a shard it is for: the target
+ *        of a direct message, the members of a channel, who share its
+ *        encodings, or everyone for the lobby.
+ */
+static void deliver_local(struct shard *shard, const struct encodings *enc)
+{
+    struct channel *channel;
+
+    if (enc->direct) {
+        struct client *client = conn_table_get(&shard->clients, enc->target);
+
+        /* Gone if the handle is stale. */
+        if (client) {
+            deliver_encoded(shard, client, enc);
+        }
+        return;
+    }
+
+    if (!enc->channel[0]) {
+        for (unsigned i = 0; i < conn_table_count(&shard->clients); ++i) {
+            deliver_encoded(shard, conn_table_at(&shard->clients, i), enc);
+        }
+        if (enc->replay) {
+            replay_ring_push(&shard->recent, enc->msgs);
+        }
+        return;
+    }
+
+    channel = channel_table_find(&shard->channels, enc->channel,
+            strlen(enc->channel));
+    if (!channel) {
+        return;
+    }
+
+    for (unsigned i = 0; i < channel->count; ++i) {
+        deliver_encoded(shard, channel->members[i]->value, enc);
+    }
+}
+
+/**
+ * @brief Hand a message over to another shard for delivery.
+ *
+ * @note Messages posted by one shard are delivered in the order they were
+ * posted, so the order of each sender's messages is preserved everywhere.
+ */
+static void post_to_shard(struct shard *shard, const struct encodings *enc)
+{
+    struct shard_delivery *delivery;
+
+    delivery = malloc(sizeof(*delivery));
+    if (!delivery) {
+        log_error("Out of memory\n");
+        return;
+    }
+
+    delivery->enc = *enc;
+    for (unsigned i = 0; i < CHAT_NUM_PROTOCOLS; ++i) {
+        delivery->enc.msgs[i] = enc->msgs[i] ? net_message_ref(enc->msgs[i]) : NULL;
+    }
+    delivery->enc.compact = enc->compact ? net_message_ref(enc->compact) : NULL;
+    delivery->enc.origin = NULL;        /* Only ever on the posting shard. */
+    delivery->bulk_len = 0;
+
+    /*
+     * Chunks waiting in the inbox are as far behind as chunks in bulk
+     * queues, and the posting shard would not otherwise see them.
+     */
+    if (enc->bulk && enc->msgs[CHAT_PROTOCOL_V2 - 1]) {
+        delivery->bulk_len = net_message_body_length(enc->msgs[CHAT_PROTOCOL_V2 - 1]);
+        if (atomic_fetch_add(&shard->inbox_bulk_bytes, delivery->bulk_len) +
+                delivery->bulk_len > shard->server->bulk_queue_bytes / BULK_CONGESTED_DIVISOR &&
+                !atomic_exchange(&shard->inbox_congested, true)) {
+            atomic_fetch_add(&shard->server->bulk_congested, 1);
+        }
+    }
+
+    mpsc_queue_push(&shard->inbox, &delivery->node);
+    wake_shard(shard);
+}
+
+/**
+ * @brief Deliver messages posted to a shard by other shards.
+ */
+static void drain_inbox(struct shard *shard)
+{
+    struct mpsc_node *node;
+    uint64_t count;
+
+    /* Clear the flag before draining so that a concurrent post wakes us. */
+    atomic_store(&shard->wake_pending, false);
+    if (read(shard->wakefd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        log_error("Unable to read wakefd: %s\n", strerror(errno));
+    }
+
+    while ((node = mpsc_queue_pop(&shard->inbox))) {
+        struct shard_delivery *delivery = (struct shard_delivery *)node;
+
+        deliver_local(shard, &delivery->enc);
+        encodings_unref(&delivery->enc);
+        atomic_fetch_sub(&shard->inbox_bulk_bytes, delivery->bulk_len);
+        free(delivery);
+    }
+
+    /* Every post wakes us, so this sees the inbox after a congesting one. */
+    if (atomic_load(&shard->inbox_bulk_bytes) <=
+            shard->server->bulk_queue_bytes / BULK_UNCONGESTED_DIVISOR &&
+            atomic_exchange(&shard->inbox_congested, false)) {
+        uncongest(shard->server);
+    }
+}
+
+/**
+ * @brief Deliver a chat object to every client of every shard.
+ *
+ * @param enc Encodings; the references of the caller are consumed.
+ */
+static void broadcast_message(struct shard *shard, struct encodings *enc)
+{
+    struct server *serv = shard->server;
+
+    deliver_local(shard, enc);
+
+    for (unsigned i = 0; i < serv->num_shards; ++i) {
+        if (&serv->shards[i] != shard) {
+            post_to_shard(&serv->shards[i], enc);
+        }
+    }
+
+    encodings_unref(enc);
+}
+
+/**
+ * @brief Take a client out of its channels, telling the members left.
+ */
+static void part_channels(struct shard *shard, struct client *client,
+        const char *name)
+{
+    while (client->member.num_channels > 0) {
+        struct channel *channel = client->member.channels[0].channel;
+        struct encodings enc = { 0 };
+
+        /* The channel is gone with its last member. */
+        memcpy(enc.channel, channel->name, channel->name_len + 1);
+        channel_leave(&shard->channels, &client->member, channel);
+
+        for (unsigned v = CHAT_PROTOCOL_V2; v <= CHAT_NUM_PROTOCOLS; ++v) {
+            enc.msgs[v - 1] = chat_channel_part_build(v, enc.channel, name);
+        }
+        broadcast_message(shard, &enc);
+    }
+}
+
+static void stop_streaming(struct shard *shard, struct client *client)
+{
+    struct client **pp = &shard->streaming;
+
+    if (!client->streaming) {
+        return;
+    }
+
+    while (*pp != client) {
+        pp = &(*pp)->next_streaming;
+    }
+    *pp = client->next_streaming;
+    client->streaming = false;
+}
+
+static void finish_disconnect(struct shard *shard, struct client *client)
+{
+    const char *name = client->endpoint->identifier;
+    bool joined = name != NULL;
+    struct encodings enc = { 0 };
+
+    /* A client that never joined is in no channel, and nobody saw it. */
+    if (joined) {
+        part_channels(shard, client, name);
+
+        for (unsigned v = 1; v <= CHAT_NUM_PROTOCOLS; ++v) {
+            enc.msgs[v - 1] = chat_member_build(v, CHAT_MEMBER_LEAVE, name,
+                    v == CHAT_PROTOCOL_V1 ? 0 : client->sender_id);
+        }
+        log_info("Chat member %s disconnected.\n", name);
+    }
+
+    clear_congested(shard, client);
+    stop_streaming(shard, client);
+    if (client->paused) {
+        struct client **pp = &shard->paused;
+
+        while (*pp != client) {
+            pp = &(*pp)->next_paused;
+        }
+        *pp = client->next_paused;
+    }
+    if (client->carrying) {
+        struct client **pp = &shard->carrying;
+
+        while (*pp != client) {
+            pp = &(*pp)->next_carrying;
+        }
+        *pp = client->next_carrying;
+    }
+    remove_client(shard, client);
+    destroy_client(client);
+
+    if (joined) {
+        broadcast_message(shard, &enc);
+    }
+}
+
+/**
+ * @brief Check whether a received message can be broadcast as it is to
+ *        clients of a protocol version: it is in that version and holds
+ *        nothing but the decoded chat object, with no sender id since ids
+ *        are given by the server.
+ */
+static bool can_relay_verbatim(const struct client *client, unsigned version,
+        struct net_message *msg, const struct chat_view *view)
+{
+    return client->protocol == version && view->flags == 0 &&
+        view->sender_id == 0 && view->len == net_message_body_length(msg);
+}
+
+static bool field_equals(const struct chat_field *field, const char *str)
+{
+    return strlen(str) == field->len && memcmp(field->data, str, field->len) == 0;
+}
+
+static void handle_new_chat_message(struct shard *shard,
+        struct client *client, struct net_message *msg,
+        const struct chat_view *view)
+{
+    const char *name = client->endpoint->identifier;
+    struct encodings enc = { 0 };
+
+    if (!name) {
+        /* Sender never joined. */
+        return;
+    }
+
+    if (view->channel.len > 0) {
+        if (!channel_member_find(&client->member, view->channel.data,
+                    view->channel.len)) {
+            log_debug("%s is not in channel %.*s\n", name,
+                    (int)view->channel.len, view->channel.data);
+            return;
+        }
+        memcpy(enc.channel, view->channel.data, view->channel.len);
+    }
+
+    /*
+     * Client is not required to put anything in sender field. Those that
+     * send their own name get their frame relayed without a copy to the
+     * clients of their protocol version.
+     */
+    for (unsigned v = 1; v <= CHAT_NUM_PROTOCOLS; ++v) {
+        if (can_relay_verbatim(client, v, msg, view) &&
+                field_equals(&view->sender, name)) {
+            enc.msgs[v - 1] = net_message_ref(msg);
+        }
+        else {
+            enc.msgs[v - 1] = chat_message_relay(v, view, name);
+        }
+    }
+    enc.compact = chat_message_relay_compact(CHAT_PROTOCOL_V2, view,
+            client->sender_id);
+    enc.replay = view->channel.len == 0;
+
+    if (shard->server->history && enc.msgs[CHAT_PROTOCOL_V2 - 1] &&
+            history_append(shard->server->history,
+                enc.msgs[CHAT_PROTOCOL_V2 - 1]) == -1) {
+        log_error("Unable to keep a message in the history: %s\n",
+                strerror(errno));
+    }
+
+    broadcast_message(shard, &enc);
+}
+
+/**
+ * @brief Send a chat message from the server to a client.
+ */
+static void send_notice(struct shard *shard, struct client *client,
+        const char *text)
+{
+    struct net_message *msg = chat_message_build(client->protocol,
+            SERVER_SENDER_NAME, text);
+
+    if (msg) {
+        deliver_to_client(shard, client, msg);
+        net_message_unref(msg);
+    }
+}
+
+/* Matches of a search found so far, see collect_match. */
+struct search_results {
+    struct client *client;
+    struct net_message *found[SEARCH_MAX_RESULTS];
+    unsigned count;
+    unsigned wanted;
+};
+
+/**
+ * @brief Keep a message matching a search as a history entry, unless it is
+ *        in a channel the client is not in.
+ *
+ * @return Non-zero once as many as wanted are kept.
+ */
+static int collect_match(void *arg, const struct history_record *record)
+{
+    struct search_results *results = arg;
+    struct client *client = results->client;
+    struct chat_view message;
+
+    if (chat_view_decode(&message, CHAT_PROTOCOL_V2, record->frame,
+                record->len) != CHAT_MESSAGE) {
+        return 0;
+    }
+
+    if (message.channel.len > 0 && !channel_member_find(&client->member,
+                message.channel.data, message.channel.len)) {
+        return 0;
+    }
+
+    results->found[results->count] = chat_history_entry_build(
+            client->protocol, &message, record->id, record->timestamp / 1000);
+    if (results->found[results->count]) {
+        results->count++;
+    }
+
+    return results->count == results->wanted;
+}
+
+/**
+ * @brief Answer a CHAT_SEARCH with the newest messages of the history that
+ *        match and that the client may see, oldest first.
+ *
+ * @note The matches are read from the mapped segments of the history on
+ * the shard thread, from the page cache mostly, since they are the latest
+ * of the log.
+ */
+static void handle_search(struct shard *shard, struct client *client,
+        const struct chat_view *view)
+{
+    struct server *serv = shard->server;
+    struct search_results results = {
+        .client = client, .count = 0, .wanted = SEARCH_DEFAULT_RESULTS
+    };
+    uint64_t ids[SEARCH_BATCH_IDS];
+    uint64_t before_id = UINT64_MAX;
+    unsigned examined = 0, n;
+    struct net_message *end;
+
+    if (!client->endpoint->identifier) {
+        /* Client never joined. */
+        return;
+    }
+
+    if (!serv->history) {
+        send_notice(shard, client, "This server keeps no history.");
+        return;
+    }
+
+    if (view->history.count > 0) {
+        results.wanted = view->history.count < SEARCH_MAX_RESULTS ?
+            view->history.count : SEARCH_MAX_RESULTS;
+    }
+
+    /* Newest first, the latest matches being the ones wanted. */
+    while (results.count < results.wanted &&
+            examined < SEARCH_MAX_CANDIDATES &&
+            (n = search_index_query(serv->search, view->message.data,
+                view->message.len, before_id, ids, sizeof(ids) / sizeof(ids[0]))) > 0) {
+        examined += n;
+        before_id = ids[n - 1];
+        history_gather(serv->history, ids, n, collect_match, &results);
+    }
+
+    for (unsigned i = results.count; i-- > 0; ) {
+        deliver_to_client(shard, client, results.found[i]);
+        net_message_unref(results.found[i]);
+    }
+
+    end = chat_history_end_build(client->protocol, results.count);
+    if (end) {
+        deliver_to_client(shard, client, end);
+        net_message_unref(end);
+    }
+}
+
+/* A batch of history read for a client, see feed_history. */
+struct history_batch {
+    struct shard *shard;
+    struct client *client;
+    bool done;
+};
+
+/**
+ * @brief Send a record of the history to a client that asked for it,
+ *        unless it is in a channel the client is not in.
+ *
+ * @return Non-zero once the client has had all it asked for.
+ */
+static int stream_record(void *arg, const struct history_record *record)
+{
+    struct history_batch *batch = arg;
+    struct client *client = batch->client;
+    struct chat_view message;
+    struct net_message *entry;
+
+    if (record->id >= client->stream_end ||
+            record->timestamp > client->stream_until) {
+        batch->done = true;
+        return 1;
+    }
+    client->stream_id = record->id + 1;
+
+    if (chat_view_decode(&message, CHAT_PROTOCOL_V2, record->frame,
+                record->len) != CHAT_MESSAGE ||
+            (message.channel.len > 0 && !channel_member_find(&client->member,
+                message.channel.data, message.channel.len))) {
+        return 0;
+    }
+
+    entry = chat_history_entry_build(client->protocol, &message, record->id,
+            record->timestamp / 1000);
+    if (!entry) {
+        return 0;
+    }
+
+    deliver_to_client(batch->shard, client, entry);
+    net_message_unref(entry);
+    client->stream_sent++;
+    if (--client->stream_left == 0) {
+        batch->done = true;
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Send the next batch of the history a client asked for, and the
+ *        CHAT_HISTORY_END after the last.
+ */
+static void feed_history(struct shard *shard, struct client *client)
+{
+    struct history_batch batch = { shard, client, false };
+    struct net_message *end;
+    int n;
+
+    n = history_scan(shard->server->history, client->stream_id,
+            HISTORY_BATCH_RECORDS, stream_record, &batch);
+
+    /* A short batch reached the end of the history. */
+    if (!batch.done && n == HISTORY_BATCH_RECORDS &&
+            client->stream_id < client->stream_end) {
+        return;
+    }
+
+    end = chat_history_end_build(client->protocol, client->stream_sent);
+    if (end) {
+        deliver_to_client(shard, client, end);
+        net_message_unref(end);
+    }
+    stop_streaming(shard, client);
+}
+
+/**
+ * @brief Feed the clients being sent history whose send queues have room,
+ *        a batch each.
+ */
+static void feed_streams(struct shard *shard)
+{
+    struct client *client = shard->streaming;
+
+    while (client) {
+        struct client *next = client->next_streaming;
+
+        if (!client->closing &&
+                client->endpoint->send_queue_bytes < BULK_FEED_BYTES) {
+            feed_history(shard, client);
+        }
+        client = next;
+    }
+}
+
+/**
+ * @brief Start sending the messages of the history from a message id or a
+ *        time on that the client may see, oldest first.
+ */
+static void handle_history_request(struct shard *shard, struct client *client,
+        const struct chat_view *view)
+{
+    struct server *serv = shard->server;
+    const struct chat_history *range = &view->history;
+
+    if (!client->endpoint->identifier) {
+        /* Client never joined. */
+        return;
+    }
+
+    if (!serv->history) {
+        send_notice(shard, client, "This server keeps no history.");
+        return;
+    }
+
+    if (client->streaming) {
+        send_notice(shard, client, "The history asked for before is still "
+                "on its way.");
+        return;
+    }
+
+    if (!atomic_load_explicit(&serv->history->indexed, memory_order_acquire)) {
+        send_notice(shard, client, "The history is still being indexed; "
+                "older messages may be missing.");
+    }
+
+    /* Messages appended from now on reach the client anyway. */
+    client->stream_end = history_end(serv->history);
+    client->stream_id = range->message_id ? range->message_id :
+        history_find_time(serv->history, range->time * 1000ull);
+    client->stream_until = range->until ? range->until * 1000ull + 999 :
+        UINT64_MAX;
+    client->stream_left = range->count > 0 && range->count < HISTORY_MAX_RESULTS ?
+        range->count : HISTORY_MAX_RESULTS;
+    client->stream_sent = 0;
+
+    client->streaming = true;
+    client->next_streaming = shard->streaming;
+    shard->streaming = client;
+    feed_history(shard, client);
+}
+
+/**
+ * @brief Give a joining client its name, unless another client has it.
+ *
+ * @return 0 on success, -1 if the name is taken or on error.
+ */
+static int register_name(struct shard *shard, struct client *client,
+        const struct chat_view *view)
+{
+    struct server *serv = shard->server;
+    char text[CHAT_MESSAGE_MAX_LEN + 1];
+    uint32_t id = 0;
+    char *name;
+    int rc = -1;
+
+    name = strndup(view->sender.data, view->sender.len);
+    if (!name) {
+        /* Fatal: no memory. */
+        return -1;
+    }
+
+    /* Text fields hold no null bytes, so strlen(name) is the length. */
+    if (strcmp(name, SERVER_SENDER_NAME) != 0) {
+        pthread_mutex_lock(&serv->names_lock);
+        id = serv->last_sender_id + 1;
+        rc = name_table_insert(&serv->names, name, view->sender.len, id,
+                shard->index, client->handle);
+        if (rc == 0) {
+            serv->last_sender_id = id;
+        }
+        pthread_mutex_unlock(&serv->names_lock);
+    }
+    else {
+        errno = EEXIST;
+    }
+
+    if (rc == -1) {
+        if (errno == EEXIST) {
+            snprintf(text, sizeof(text), "The name %s is taken.", name);
+            send_notice(shard, client, text);
+        }
+        free(name);
+        return -1;
+    }
+
+    client->endpoint->identifier = name;
+    client->sender_id = id;
+    return 0;
+}
+
+/**
+ * @brief Seed the send queue of a joining client with the recent lobby
+ *        messages, which go out together with the next flush.
+ */
+static void replay_recent(struct shard *shard, struct client *client)
+{
+    const struct replay_ring *ring = &shard->recent;
+
+    for (unsigned i = 0; i < ring->count; ++i) {
+        struct net_message *msg = replay_ring_at(ring, i)->msgs[client->protocol - 1];
+
+        /* Replay is best effort: what does not fit is no overflow. */
+        if (msg && enqueue_to_client(shard, client, msg) == -1) {
+            break;
+        }
+    }
+
+    if (ring->count > 0) {
+        set_client_events(shard, client, client->events | REACTOR_OUT);
+    }
+}
+
+/**
+ * @brief Tell a client that joined with CHAT_FEATURE_SENDER_IDS the ids of
+ *        the members already there, after which it gets compact messages.
+ *
+ * @note Members that join later are posted to the shard of the client after
+ * the snapshot taken here, so their joins reach it before their messages.
+ */
+static void send_roster(struct shard *shard, struct client *client)
+{
+    struct server *serv = shard->server;
+    struct roster_entry {
+        char name[CHAT_MEMBER_NAME_MAX_LEN + 1];
+        uint32_t id;
+    } *roster;
+    unsigned count = 0;
+
+    /* Copied out: delivering may disconnect, which takes the lock. */
+    pthread_mutex_lock(&serv->names_lock);
+    roster = malloc(serv->names.count * sizeof(*roster));
+    for (unsigned i = 0; roster && i < serv->names.num_slots; ++i) {
+        const struct name_entry *entry = &serv->names.slots[i];
+
+        if (entry->name && entry->id != client->sender_id) {
+            memcpy(roster[count].name, entry->name, entry->len);
+            roster[count].name[entry->len] = '\0';
+            roster[count].id = entry->id;
+            count++;
+        }
+    }
+    pthread_mutex_unlock(&serv->names_lock);
+
+    if (!roster) {
+        /* Go on with names. */
+        log_error("Out of memory\n");
+        return;
+    }
+
+    for (unsigned i = 0; i < count; ++i) {
+        struct net_message *msg = chat_member_build(client->protocol,
+                CHAT_MEMBER_INFO, roster[i].name, roster[i].id);
+
+        if (msg) {
+            deliver_to_client(shard, client, msg);
+            net_message_unref(msg);
+        }
+    }
+
+    free(roster);
+    client->sender_ids = true;
+}
+
+static void handle_new_chat_member_join(struct shard *shard,
+        struct client *client, struct net_message *msg,
+        const struct chat_view *view)
+{
+    struct net_endpoint *sender = client->endpoint;
+    struct encodings enc = { 0 };
+
+    if (sender->identifier) {
+        /* Sender already joined. */
+        return;
+    }
+
+    if (register_name(shard, client, view) == -1) {
+        return;
+    }
+
+    if (client->features & CHAT_FEATURE_SENDER_IDS) {
+        send_roster(shard, client);
+    }
+    replay_recent(shard, client);
+
+    /* The id of the member is news to v2 clients. */
+    if (can_relay_verbatim(client, CHAT_PROTOCOL_V1, msg, view)) {
+        enc.msgs[CHAT_PROTOCOL_V1 - 1] = net_message_ref(msg);
+    }
+    else {
+        enc.msgs[CHAT_PROTOCOL_V1 - 1] = chat_member_join_build(CHAT_PROTOCOL_V1,
+                sender->identifier);
+    }
+    for (unsigned v = CHAT_PROTOCOL_V2; v <= CHAT_NUM_PROTOCOLS; ++v) {
+        enc.msgs[v - 1] = chat_member_build(v, CHAT_MEMBER_JOIN,
+                sender->identifier, client->sender_id);
+    }
+
+    broadcast_message(shard, &enc);
+}
+
+/**
+ * @brief Deliver a direct message to its recipient, on whichever shard, in
+ *        one lookup.
+ */
+static void handle_direct_message(struct shard *shard, struct client *client,
+        struct net_message *msg, const struct chat_view *view)
+{
+    const char *name = client->endpoint->identifier;
+    struct server *serv = shard->server;
+    const struct name_entry *entry;
+    struct encodings enc = { .direct = true };
+    char text[CHAT_MESSAGE_MAX_LEN + 1];
+    unsigned target_shard = 0;
+
+    if (!name) {
+        /* Sender never joined. */
+        return;
+    }
+
+    pthread_mutex_lock(&serv->names_lock);
+    entry = name_table_find(&serv->names, view->recipient.data,
+            view->recipient.len);
+    if (entry) {
+        target_shard = entry->shard;
+        enc.target = entry->handle;
+    }
+    pthread_mutex_unlock(&serv->names_lock);
+
+    if (!entry) {
+        snprintf(text, sizeof(text), "Nobody is called %.*s.",
+                (int)view->recipient.len, view->recipient.data);
+        send_notice(shard, client, text);
+        return;
+    }
+
+    /* v1 has no direct messages. */
+    for (unsigned v = CHAT_PROTOCOL_V2; v <= CHAT_NUM_PROTOCOLS; ++v) {
+        if (can_relay_verbatim(client, v, msg, view) &&
+                field_equals(&view->sender, name)) {
+            enc.msgs[v - 1] = net_message_ref(msg);
+        }
+        else {
+            enc.msgs[v - 1] = chat_message_relay(v, view, name);
+        }
+    }
+    enc.compact = chat_message_relay_compact(CHAT_PROTOCOL_V2, view,
+            client->sender_id);
+
+    if (target_shard == shard->index) {
+        deliver_local(shard, &enc);
+    }
+    else {
+        post_to_shard(&serv->shards[target_shard], &enc);
+    }
+    encodings_unref(&enc);
+}
+
+/**
+ * @brief Pass a CHAT_CHANNEL_JOIN or CHAT_CHANNEL_PART on to the members of
+ *        its channel, the client included.
+ */
+static void broadcast_channel_event(struct shard *shard, struct client *client,
+        struct net_message *msg, const struct chat_view *view)
+{
+    const char *name = client->endpoint->identifier;
+    struct encodings enc = { 0 };
+
+    memcpy(enc.channel, view->channel.data, view->channel.len);
+
+    /* v1 has no channels. */
+    for (unsigned v = CHAT_PROTOCOL_V2; v <= CHAT_NUM_PROTOCOLS; ++v) {
+        if (can_relay_verbatim(client, v, msg, view) &&
+                field_equals(&view->sender, name)) {
+            enc.msgs[v - 1] = net_message_ref(msg);
+        }
+        else if (view->type == CHAT_CHANNEL_JOIN) {
+            enc.msgs[v - 1] = chat_channel_join_build(v, enc.channel, name);
+        }
+        else {
+            enc.msgs[v - 1] = chat_channel_part_build(v, enc.channel, name);
+        }
+    }
+
+    broadcast_message(shard, &enc);
+}
+
+static void handle_channel_join(struct shard *shard, struct client *client,
+        struct net_message *msg, const struct chat_view *view)
+{
+    const char *name = client->endpoint->identifier;
+
+    if (!name) {
+        /* Sender never joined. */
+        return;
+    }
+
+    if (!channel_join(&shard->channels, &client->member, view->channel.data,
+                view->channel.len)) {
+        log_debug("%s cannot join channel %.*s: %s\n", name,
+                (int)view->channel.len, view->channel.data, strerror(errno));
+        return;
+    }
+
+    broadcast_channel_event(shard, client, msg, view);
+}
+
+static void handle_channel_part(struct shard *shard, struct client *client,
+        struct net_message *msg, const struct chat_view *view)
+{
+    struct channel *channel = channel_member_find(&client->member,
+            view->channel.data, view->channel.len);
+
+    if (!channel) {
+        /* Not a member, or never joined. */
+        return;
+    }
+
+    /* While still a member, so that the client gets it too. */
+    broadcast_channel_event(shard, client, msg, view);
+    channel_leave(&shard->channels, &client->member, channel);
+}
+
+/**
+ * @brief Stop reading from a client until no client is congested with bulk
+ *        data, see resume_paused.
+ *
+ * @note io_uring clients are not paused, since their data would fill the
+ * buffers shared by all clients; their chunks may be dropped instead.
+ */
+static void pause_input(struct shard *shard, struct client *client)
+{
+    if (client->paused || client->endpoint->uring) {
+        return;
+    }
+
+    client->paused = true;
+    client->next_paused = shard->paused;
+    shard->paused = client;
+    set_client_events(shard, client, client->events & ~REACTOR_IN);
+}
+
+/**
+ * @brief Relay a transfer chunk to everyone else as bulk traffic, chunk by
+ *        chunk without putting the payload together.
+ */
+static void handle_new_chunk(struct shard *shard, struct client *client,
+        struct net_message *msg, const struct chat_view *view)
+{
+    const char *name = client->endpoint->identifier;
+    struct encodings enc = { .bulk = true, .origin = client };
+
+    if (!name) {
+        /* Sender never joined. */
+        return;
+    }
+
+    /* v1 has no chunks; v1 clients do not get transfers. */
+    for (unsigned v = CHAT_PROTOCOL_V2; v <= CHAT_NUM_PROTOCOLS; ++v) {
+        if (can_relay_verbatim(client, v, msg, view) &&
+                field_equals(&view->sender, name)) {
+            enc.msgs[v - 1] = net_message_ref(msg);
+        }
+        else {
+            enc.msgs[v - 1] = chat_chunk_build(v, name, &view->chunk);
+        }
+    }
+
+    broadcast_message(shard, &enc);
+
+    if (atomic_load(&shard->server->bulk_congested) > 0) {
+        pause_input(shard, client);
+    }
+}
+
+/**
+ * @brief Answer a CHAT_HELLO with the version and features to use, and
+ *        switch the client over to them.
+ */
+static int handle_hello(struct shard *shard, struct client *client,
+        const struct chat_view *view)
+{
+    unsigned version = view->version < CHAT_PROTOCOL_LATEST ?
+        view->version : CHAT_PROTOCOL_LATEST;
+    uint32_t features = view->features & shard->server->features;
+    struct net_message *reply;
+
+    if (client->greeted || version < CHAT_PROTOCOL_V1) {
+        log_info("Received an illegal chat object from client.\n");
+        return SERVER_DISCONNECT;
+    }
+
+    /* Compression is done on v2 frames, which alone have sender ids. */
+    if (version < CHAT_PROTOCOL_V2) {
+        features &= ~(CHAT_FEATURE_COMPRESSION | CHAT_FEATURE_SENDER_IDS);
+    }
+
+    if (features & CHAT_FEATURE_COMPRESSION) {
+        client->compression = malloc(sizeof(*client->compression));
+        if (!client->compression ||
+                chat_compression_init(client->compression) == -1) {
+            /* Go on without. */
+            free(client->compression);
+            client->compression = NULL;
+            features &= ~CHAT_FEATURE_COMPRESSION;
+        }
+    }
+
+    reply = chat_hello_build(version, features);
+    if (!reply) {
+        log_error("Unable to answer hello: %s\n", strerror(errno));
+        return SERVER_DISCONNECT;
+    }
+
+    /* The reply is the first thing queued to the client, uncompressed. */
+    if (net_enqueue_message(client->endpoint, reply) == -1) {
+        log_error("Unable to answer hello: %s\n", strerror(errno));
+        net_message_unref(reply);
+        return SERVER_DISCONNECT;
+    }
+    net_message_unref(reply);
+    set_client_events(shard, client, client->events | REACTOR_OUT);
+
+    /* Whatever the client sends after its hello is in the new version. */
+    client->protocol = version;
+    client->features = features;
+    log_debug("Client speaks protocol v%u, features %#x\n", version, features);
+
+    return SERVER_OK;
+}
+
+static int handle_object(struct shard *shard, struct client *client,
+        struct net_message *msg)
+{
+    struct chat_view view;
+    int type, rc = SERVER_OK;
+
+    /* Decoded in place: the fields point into msg. */
+    type = chat_view_decode(&view, client->protocol, net_message_body(msg),
+            net_message_body_length(msg));
+
+    if (type == -1) {
+        log_error("Received corrupted message.\n");
+        return SERVER_DISCONNECT;
+    }
+
+    switch ((enum chat_object_type) type) {
+    case CHAT_MESSAGE:
+        handle_new_chat_message(shard, client, msg, &view);
+        break;
+    case CHAT_MEMBER_JOIN:
+        handle_new_chat_member_join(shard, client, msg, &view);
+        break;
+    case CHAT_MEMBER_LEAVE:
+        log_info("Received an illegal chat object from client.\n");
+        break;
+    case CHAT_HELLO:
+        rc = handle_hello(shard, client, &view);
+        break;
+    case CHAT_CHUNK:
+        handle_new_chunk(shard, client, msg, &view);
+        break;
+    case CHAT_CHANNEL_JOIN:
+        handle_channel_join(shard, client, msg, &view);
+        break;
+    case CHAT_CHANNEL_PART:
+        handle_channel_part(shard, client, msg, &view);
+        break;
+    case CHAT_DIRECT_MESSAGE:
+        handle_direct_message(shard, client, msg, &view);
+        break;
+    case CHAT_SEARCH:
+        handle_search(shard, client, &view);
+        break;
+    case CHAT_HISTORY_REQUEST:
+        handle_history_request(shard, client, &view);
+        break;
+    case CHAT_MEMBER_INFO:
+    case CHAT_HISTORY_ENTRY:
+    case CHAT_HISTORY_END:
+        log_info("Received an illegal chat object from client.\n");
+        break;
+    }
+
+    client->greeted = true;
+    return rc;
+}
+
+static int handle_message(struct shard *shard, struct client *client,
+        struct net_message *msg)
+{
+    struct net_message *inflated;
+    int rc;
+
+    if (!client->compression || !chat_is_compressed(client->protocol,
+                net_message_body(msg), net_message_body_length(msg))) {
+        return handle_object(shard, client, msg);
+    }
+
+    inflated = chat_decompress(client->compression, net_message_body(msg),
+            net_message_body_length(msg));
+    if (!inflated) {
+        log_error("Received corrupted compressed message.\n");
+        return SERVER_DISCONNECT;
+    }
+
+    /* Clients of the same version get the inflated message verbatim. */
+    rc = handle_object(shard, client, inflated);
+    net_message_unref(inflated);
+    return rc;
+}
+
+/**
+ * @brief Receive a batch of messages from a client and handle them.
+ */
+static int receive_batch(struct shard *shard, struct client *client)
+{
+    struct net_endpoint *endpoint = client->endpoint;
+    struct net_message *msgs[RECEIVE_BATCH_SIZE];
+    int n, rc = SERVER_OK;
+
+    n = net_receive_batch(endpoint, msgs, RECEIVE_BATCH_SIZE);
+    if (n < 0) {
+        if (errno == EWOULDBLOCK || errno == EAGAIN) {
+            return SERVER_AGAIN;
+        }
+
+        log_error("Unable to receive data: %s\n", strerror(errno));
+        return SERVER_DISCONNECT;
+    }
+    else if (n == 0) {
+        log_debug("Peer closed connection.\n");
+        return SERVER_DISCONNECT;
+    }
+
+    for (int i = 0; i < n; ++i) {
+        if (rc == SERVER_OK) {
+            rc = handle_message(shard, client, msgs[i]);
+        }
+        net_message_unref(msgs[i]);
+    }
+
+    return rc;
+}
+
+static int handle_endpoint_input(struct shard *shard, struct client *client)
+{
+    unsigned budget = INPUT_BUDGET_PER_WAKEUP;
+    int rc;
+
+    /*
+     * The reactor reports a socket again while it is readable, so a budget
+     * keeps one busy client from starving the rest. io_uring reports data
+     * only once when it arrives, so it has to be consumed completely.
+     */
+    do {
+        rc = receive_batch(shard, client);
+    } while (rc == SERVER_OK && !client->paused &&
+            (client->endpoint->uring || --budget > 0));
+
+    /*
+     * The last read may have drained the socket, so that it is not reported
+     * again, with whole frames still carried over.
+     */
+    if (rc == SERVER_OK && !client->paused && !client->carrying &&
+            net_has_carried_frame(client->endpoint)) {
+        client->carrying = true;
+        client->next_carrying = shard->carrying;
+        shard->carrying = client;
+    }
+
+    return rc == SERVER_AGAIN ? SERVER_OK : rc;
+}
+
+/**
+ * @brief Handle the frames carried over by clients whose input budget ran
+ *        out, see handle_endpoint_input.
+ */
+static void receive_carried(struct shard *shard)
+{
+    struct client *carrying = shard->carrying;
+
+    /* Clients with frames still left go on the list for the next round. */
+    shard->carrying = NULL;
+    while (carrying) {
+        struct client *client = carrying;
+
+        carrying = client->next_carrying;
+        client->carrying = false;
+
+        /* Paused clients are read from again once resumed. */
+        if (client->closing || client->paused) {
+            continue;
+        }
+
+        if (handle_endpoint_input(shard, client) == SERVER_DISCONNECT) {
+            disconnect_client(shard, client);
+        }
+    }
+}
+
+/**
+ * @brief Get the number of connections waiting in the listen backlog.
+ */
+static unsigned listen_queue_length(int listenfd)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+
+    /* For a listening socket, tcpi_unacked is the accept queue length. */
+    if (getsockopt(listenfd, IPPROTO_TCP, TCP_INFO, &info, &len) == -1) {
+        return 0;
+    }
+
+    return info.tcpi_unacked;
+}
+
+/**
+ * @brief Accept pending connections until the backlog is empty or the
+ *        per-tick budget is used up. The rest is accepted on the next tick,
+ *        after the clients that are already connected have been served.
+ */
+int handle_incoming_connection(struct shard *shard)
+{
+    struct net_endpoint *endpt;
+    unsigned budget, waiting;
+
+    for (budget = ACCEPT_BUDGET_PER_TICK; budget > 0; --budget) {
+        endpt = accept_endpoint(shard);
+        if (!endpt) {
+            if (errno == EINTR) {
+                continue;
+            }
+            /* Empty backlog or an error that retrying right away won't fix. */
+            return SERVER_OK;
+        }
+
+        if (add_endpoint(shard, endpt) == -1) {
+            close(endpt->fd);
+            net_endpoint_destroy(endpt);
+            atomic_fetch_add_explicit(&shard->stats.refused, 1,
+                    memory_order_relaxed);
+            continue;
+        }
+
+        atomic_fetch_add_explicit(&shard->stats.accepted, 1,
+                memory_order_relaxed);
+    }
+
+    /* The same backlog may be left over several ticks. */
+    waiting = listen_queue_length(shard->listenfd);
+    if (waiting > atomic_load_explicit(&shard->stats.deferred,
+                memory_order_relaxed)) {
+        atomic_store_explicit(&shard->stats.deferred, waiting,
+                memory_order_relaxed);
+    }
+
+    return SERVER_OK;
+}
+
+static void flush_client(struct shard *shard, struct client *client)
+{
+    int queue_len = net_process_send(client->endpoint);
+
+    /* An empty queue always has room for the marker. */
+    if (queue_len == 0 && client->missed > 0 && enqueue_missed_marker(shard, client) == 0) {
+        queue_len = net_process_send(client->endpoint);
+    }
+
+    /* Bulk data goes out while the socket takes it. */
+    while (queue_len >= 0 && client->bulk_count > 0 && !client->closing &&
+            client->endpoint->send_queue_bytes < BULK_FEED_BYTES) {
+        feed_bulk(shard, client);
+        queue_len = net_process_send(client->endpoint);
+    }
+
+    if (queue_len < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            log_error("Unable to send data: %s\n", strerror(errno));
+        }
+    }
+    else if (queue_len == 0) {
+        /* nothing more to send at this time. */
+        set_client_events(shard, client, client->events & ~REACTOR_OUT);
+        return;
+    }
+
+    if (client->stall_deadline &&
+            client->endpoint->total_bytes_sent != client->stall_mark) {
+        arm_stall_timer(shard, client);
+    }
+}
+
+/**
+ * @brief Disconnect clients whose stall timers have expired.
+ */
+static void expire_stalled_clients(struct shard *shard)
+{
+    while (shard->stall_head && shard->stall_head->stall_deadline <= shard->now_ms) {
+        struct client *client = shard->stall_head;
+
+        log_info("Disconnecting %s: no send progress for %u ms.\n",
+                client->endpoint->identifier ?
+                    (char *)client->endpoint->identifier : "client",
+                shard->server->stall_timeout_ms);
+        atomic_fetch_add_explicit(&shard->stats.stalled, 1, memory_order_relaxed);
+        disconnect_client(shard, client);
+    }
+}
+
+/**
+ * @brief Get the reactor wait timeout until the next stall deadline.
+ */
+static int next_timeout_ms(const struct shard *shard)
+{
+    unsigned long long now;
+
+    /* Frames carried over are handled at once. */
+    if (shard->carrying) {
+        return 0;
+    }
+
+    /* History goes on at once to clients with room for it. */
+    for (const struct client *c = shard->streaming; c; c = c->next_streaming) {
+        if (c->endpoint->send_queue_bytes < BULK_FEED_BYTES) {
+            return 0;
+        }
+    }
+
+    if (!shard->stall_head) {
+        return -1;
+    }
+
+    now = monotonic_ms();
+    if (shard->stall_head->stall_deadline <= now) {
+        return 0;
+    }
+
+    if (shard->stall_head->stall_deadline - now > INT_MAX) {
+        return INT_MAX;
+    }
+
+    return shard->stall_head->stall_deadline - now;
+}
+
+static void log_stats(struct server *serv)
+{
+    struct pool_stats pool;
+
+    for (unsigned i = 0; i < serv->num_shards; ++i) {
+        struct shard *shard = &serv->shards[i];
+
+        log_info("Shard %u: %lu accepted, %lu refused, %lu deferred at most, "
+                "%lu stalled, %lu overflows, %lu dropped, %lu chunks dropped, "
+                "%lu bytes sent compressed to %lu\n", i,
+                atomic_load_explicit(&shard->stats.accepted, memory_order_relaxed),
+                atomic_load_explicit(&shard->stats.refused, memory_order_relaxed),
+                atomic_load_explicit(&shard->stats.deferred, memory_order_relaxed),
+                atomic_load_explicit(&shard->stats.stalled, memory_order_relaxed),
+                atomic_load_explicit(&shard->stats.overflows, memory_order_relaxed),
+                atomic_load_explicit(&shard->stats.dropped, memory_order_relaxed),
+                atomic_load_explicit(&shard->stats.bulk_dropped, memory_order_relaxed),
+                atomic_load_explicit(&shard->stats.compressed_in, memory_order_relaxed),
+                atomic_load_explicit(&shard->stats.compressed_out, memory_order_relaxed));
+    }
+
+    for (unsigned i = 0; net_message_pool_stats(i, &pool) == 0; ++i) {
+        log_info("Messages of %zu bytes: %zu live, %zu cached, %zu high-water, "
+                "%zu slabs (%zu on huge pages)\n", pool.object_size, pool.live,
+                pool.cached, pool.high_water, pool.slabs, pool.huge_slabs);
+    }
+
+    if (serv->history) {
+        log_info("History: %lu messages appended, %lu syncs\n",
+                atomic_load_explicit(&serv->history->appended, memory_order_relaxed),
+                atomic_load_explicit(&serv->history->syncs, memory_order_relaxed));
+    }
+}
+
+/**
+ * @brief Read from paused clients again, starting with the input that was
+ *        left waiting.
+ */
+static void resume_paused(struct shard *shard)
+{
+    struct client *paused = shard->paused;
+
+    /* Clients paused again on the way wait for the next round. */
+    shard->paused = NULL;
+    while (paused) {
+        struct client *client = paused;
+
+        paused = client->next_paused;
+        client->paused = false;
+        if (client->closing) {
+            continue;
+        }
+
+        set_client_events(shard, client, client->events | REACTOR_IN);
+        if (handle_endpoint_input(shard, client) == SERVER_DISCONNECT) {
+            disconnect_client(shard, client);
+        }
+    }
+}
+
+static int loop(struct shard *shard)
+{
+    struct reactor_event events[MAX_EVENTS_PER_WAIT];
+    int n;
+
+    n = reactor_wait(shard->reactor, events, MAX_EVENTS_PER_WAIT,
+            next_timeout_ms(shard));
+    shard->now_ms = monotonic_ms();
+    if (n == -1) {
+        if (errno == EINTR) {
+            return 0;
+        }
+
+        log_error("reactor_wait: %s\n", strerror(errno));
+        return -1;
+    }
+
+    for (int i = 0; i < n; ++i) {
+        struct client *client = events[i].data;
+        unsigned revents = events[i].events;
+
+        if (events[i].data == &shard->listenfd) {
+            /* incoming connection. */
+            if (handle_incoming_connection(shard) == SERVER_FATAL) {
+                return -1;
+            }
+            continue;
+        }
+
+        if (events[i].data == &shard->wakefd) {
+            drain_inbox(shard);
+            if (shard->paused &&
+                    atomic_load(&shard->server->bulk_congested) == 0) {
+                resume_paused(shard);
+            }
+            if (shard->index == 0 && dump_stats) {
+                dump_stats = 0;
+                log_stats(shard->server);
+            }
+            continue;
+        }
+
+        if (client->closing) {
+            continue;
+        }
+
+        /* Zerocopy completions are reported as errors. */
+        if ((revents & REACTOR_ERR) && net_reap_zerocopy(client->endpoint) == -1) {
+            log_error("Unable to reap zerocopy sends: %s\n", strerror(errno));
+        }
+
+        if (revents & (REACTOR_IN | REACTOR_ERR)) {
+            switch (handle_endpoint_input(shard, client)) {
+            case SERVER_DISCONNECT:
+                disconnect_client(shard, client);
+                continue;
+            case SERVER_FATAL:
+                return -1;
+            default:
+                break;
+            }
+        }
+
+        if (revents & REACTOR_OUT) {
+            if (client->endpoint->uring) {
+                schedule_flush(shard, client);
+            }
+            else {
+                flush_client(shard, client);
+            }
+        }
+    }
+
+    receive_carried(shard);
+    expire_stalled_clients(shard);
+    feed_streams(shard);
+
+    /*
+     * Flush before disconnecting: disconnected clients are freed, but they
+     * may be on the flush list. Disconnecting broadcasts, which may schedule
+     * further flushes.
+     */
+    while (shard->flushing || shard->closing) {
+        while (shard->flushing) {
+            struct client *client = shard->flushing;
+            shard->flushing = client->next_flush;
+            client->flush_pending = false;
+
+            if (!client->closing) {
+                flush_client(shard, client);
+            }
+        }
+
+        while (shard->closing) {
+            struct client *client = shard->closing;
+            shard->closing = client->next_closing;
+            finish_disconnect(shard, client);
+        }
+    }
+
+    return 0;
+}
+
+static void stop_server(struct server *serv)
+{
+    atomic_store(&serv->stopping, true);
+
+    for (unsigned i = 0; i < serv->num_shards; ++i) {
+        wake_shard(&serv->shards[i]);
+    }
+}
+
+/**
+ * @brief Have shard 0 log the statistics. Only async-signal-safe calls are
+ *        made here; the eventfd is written without wake_shard, which may
+ *        log, and a wakeup too many costs nothing.
+ */
+static void handle_sigusr1(int sig)
+{
+    int saved_errno = errno;
+    ssize_t rc;
+
+    (void)sig;
+
+    dump_stats = 1;
+    rc = write(server.shards[0].wakefd, &(uint64_t){1}, sizeof(uint64_t));
+    (void)rc;
+    errno = saved_errno;
+}
+
+static void *run_shard(void *arg)
+{
+    struct shard *shard = arg;
+    struct server *serv = shard->server;
+
+    if (serv->pin_cpus) {
+        cpu_set_t cpus;
+        long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        CPU_ZERO(&cpus);
+        CPU_SET(shard->index % (num_cpus > 0 ? num_cpus : 1), &cpus);
+
+        errno = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (errno != 0) {
+            log_error("Unable to pin shard %u: %s\n", shard->index,
+                    strerror(errno));
+        }
+    }
+
+    while (!atomic_load(&serv->stopping)) {
+        if (loop(shard) == -1) {
+            log_info("Exiting due to fatal error.\n");
+            stop_server(serv);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Run the server until a fatal error occurs. Shard 0 runs on the
+ *        calling thread and the others on threads of their own.
+ */
+static void run_server(struct server *serv)
+{
+    unsigned num_started;
+
+    for (num_started = 1; num_started < serv->num_shards; ++num_started) {
+        struct shard *shard = &serv->shards[num_started];
+
+        errno = pthread_create(&shard->thread, NULL, run_shard, shard);
+        if (errno != 0) {
+            log_error("Unable to start thread: %s\n", strerror(errno));
+            stop_server(serv);
+            break;
+        }
+    }
+
+    run_shard(&serv->shards[0]);
+
+    for (unsigned i = 1; i < num_started; ++i) {
+        pthread_join(serv->shards[i].thread, NULL);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (scan_arguments(&pargs, argc, argv) != 0) {
+        return 1;
+    }
+
+    if (init_server(&server, &pargs) == -1) {
+        return 1;
+    }
+
+    sigaction(SIGUSR1, &(struct sigaction){
+            .sa_handler = handle_sigusr1,
+            .sa_flags = SA_RESTART
+        }, NULL);
+
+    run_server(&server);
+
     deinit_server(&server);
 
     return 0;
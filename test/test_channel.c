@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "../channel.h"
+#include "test.h"
+
+#define NUM_MEMBERS                     8
+#define NUM_CHANNELS                    200
+
+static struct channel_member members[NUM_MEMBERS];
+
+static bool has_member(const struct channel *channel,
+        const struct channel_member *member)
+{
+    for (unsigned i = 0; i < channel->count; ++i) {
+        if (channel->members[i] == member) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void test_join_leave(void)
+{
+    struct channel_table table;
+    struct channel *a, *b;
+
+    EXPECT_TRUE(channel_table_init(&table) == 0, "Initialisation should succeed\n");
+
+    for (unsigned i = 0; i < NUM_MEMBERS; ++i) {
+        members[i] = (struct channel_member){ .value = &members[i] };
+        EXPECT_TRUE(channel_join(&table, &members[i], "a", 1) != NULL,
+                "Join failed\n");
+    }
+
+    a = channel_table_find(&table, "a", 1);
+    EXPECT_TRUE(a && a->count == NUM_MEMBERS, "Expected %d members\n", NUM_MEMBERS);
+    EXPECT_TRUE(channel_table_find(&table, "b", 1) == NULL, "Unexpected channel\n");
+
+    EXPECT_TRUE(channel_join(&table, &members[0], "a", 1) == NULL && errno == EEXIST,
+            "Joining twice should fail\n");
+    EXPECT_TRUE(channel_join(&table, &members[0], "", 0) == NULL && errno == EINVAL,
+            "Joining the lobby should fail\n");
+
+    b = channel_join(&table, &members[0], "b", 1);
+    EXPECT_TRUE(b && channel_member_find(&members[0], "b", 1) == b,
+            "Expected member of b\n");
+
+    /* Leaving moves the last member into the hole, which must stay found. */
+    channel_leave(&table, &members[0], a);
+    EXPECT_TRUE(a->count == NUM_MEMBERS - 1 && !has_member(a, &members[0]),
+            "Member still in channel\n");
+    EXPECT_TRUE(channel_member_find(&members[0], "a", 1) == NULL,
+            "Channel still in member\n");
+    channel_leave(&table, &members[NUM_MEMBERS - 1], a);
+    EXPECT_TRUE(a->count == NUM_MEMBERS - 2 && !has_member(a, &members[NUM_MEMBERS - 1]),
+            "Moved member did not leave\n");
+
+    for (unsigned i = 1; i < NUM_MEMBERS - 1; ++i) {
+        channel_leave(&table, &members[i], a);
+    }
+    EXPECT_TRUE(channel_table_find(&table, "a", 1) == NULL,
+            "Empty channel should be gone\n");
+    EXPECT_TRUE(channel_table_find(&table, "b", 1) == b, "Other channel lost\n");
+
+    channel_leave(&table, &members[0], b);
+    EXPECT_TRUE(table.count == 0, "Expected no channels\n");
+
+    channel_table_deinit(&table);
+}
+
+static void test_many_channels(void)
+{
+    struct channel_table table;
+    char name[16];
+
+    EXPECT_TRUE(channel_table_init(&table) == 0, "Initialisation should succeed\n");
+
+    /* Each member is in as many channels as it may be. */
+    for (unsigned c = 0; c < NUM_CHANNELS; ++c) {
+        snprintf(name, sizeof(name), "#%u", c);
+        EXPECT_TRUE(channel_join(&table, &members[c % NUM_MEMBERS], name,
+                    strlen(name)) != NULL || c / NUM_MEMBERS >= CHANNEL_MAX_PER_MEMBER,
+                "Join of %s failed\n", name);
+    }
+    EXPECT_TRUE(channel_join(&table, &members[0], "x", 1) == NULL && errno == ENOSPC,
+            "Member should be in too many channels\n");
+    EXPECT_TRUE(table.count == NUM_MEMBERS * CHANNEL_MAX_PER_MEMBER,
+            "Expected %u channels, got %u\n", NUM_MEMBERS * CHANNEL_MAX_PER_MEMBER,
+            table.count);
+
+    /* Remove every other channel; the rest must still be found. */
+    for (unsigned c = 0; c < NUM_MEMBERS * CHANNEL_MAX_PER_MEMBER; c += 2) {
+        struct channel *channel;
+
+        snprintf(name, sizeof(name), "#%u", c);
+        channel = channel_table_find(&table, name, strlen(name));
+        EXPECT_TRUE(channel != NULL, "Channel %s lost\n", name);
+        channel_leave(&table, &members[c % NUM_MEMBERS], channel);
+    }
+
+    for (unsigned c = 0; c < NUM_MEMBERS * CHANNEL_MAX_PER_MEMBER; ++c) {
+        snprintf(name, sizeof(name), "#%u", c);
+        EXPECT_TRUE((channel_table_find(&table, name, strlen(name)) != NULL) == (c % 2),
+                "Channel %s in the wrong state\n", name);
+    }
+
+    channel_table_deinit(&table);
+}
+
+int main(int argc, char *argv[])
+{
+    test_join_leave();
+    test_many_channels();
+    return 0;
+}
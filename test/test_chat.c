@@ -102,10 +102,465 @@ void test_chat_member_leave(void)
     EXPECT_TRUE(!strcmp(cm.sender, SENDER), "Converted data is invalid\n");
 }
 
+static void test_build(void)
+{
+    struct net_builder builder;
+    struct net_message *msg;
+    char long_message[NET_MSG_DATA_SIZE];
+
+    msg = chat_message_build(CHAT_PROTOCOL_V1, SENDER, MESSAGE);
+    EXPECT_TRUE(msg != NULL, "Expected successful build\n");
+    EXPECT_TRUE(net_message_body_length(msg) == 1 + EXPECTED_NET_CM_LEN,
+            "Incorrect built length (%u)\n", net_message_body_length(msg));
+    EXPECT_TRUE(net_message_body(msg)[0] == CHAT_MESSAGE &&
+            !memcmp(net_message_body(msg) + 1, EXPECTED_NET_CM, EXPECTED_NET_CM_LEN),
+            "Built data is invalid\n");
+    net_message_unref(msg);
+
+    msg = chat_member_leave_build(CHAT_PROTOCOL_V1, SENDER);
+    EXPECT_TRUE(msg != NULL, "Expected successful build\n");
+    EXPECT_TRUE(net_message_body_length(msg) == 1 + EXPECTED_NET_CML_LEN &&
+            net_message_body(msg)[0] == CHAT_MEMBER_LEAVE &&
+            !memcmp(net_message_body(msg) + 1, EXPECTED_NET_CML, EXPECTED_NET_CML_LEN),
+            "Built data is invalid\n");
+    net_message_unref(msg);
+
+    memset(long_message, 'a', sizeof(long_message) - 1);
+    long_message[sizeof(long_message) - 1] = '\0';
+    EXPECT_TRUE(chat_message_build(CHAT_PROTOCOL_V1, SENDER, long_message) == NULL && errno == EMSGSIZE,
+            "Expected message to be too long\n");
+
+    // Writes beyond the reserved length fail the whole message
+    EXPECT_TRUE(net_builder_init(&builder, 4) == 0, "Expected successful init\n");
+    EXPECT_TRUE(net_builder_put(&builder, "abc", 3) == 0, "Expected put to fit\n");
+    EXPECT_TRUE(net_builder_put(&builder, "de", 2) == -1, "Expected put to overflow\n");
+    EXPECT_TRUE(net_builder_finish(&builder) == NULL && errno == EMSGSIZE,
+            "Expected overflowed message to fail\n");
+}
+
+static void test_view(void)
+{
+    const unsigned char data[] = "\0" EXPECTED_NET_CM "trailing";
+    struct chat_view view;
+    struct net_message *msg;
+
+    EXPECT_TRUE(chat_view_decode(&view, CHAT_PROTOCOL_V1, data, 1 + EXPECTED_NET_CM_LEN) == CHAT_MESSAGE,
+            "Expected successful decode\n");
+    EXPECT_TRUE(view.sender.data == (const char *)data + 1 &&
+            view.sender.len == sizeof(SENDER) - 1, "Sender should point into data\n");
+    EXPECT_TRUE(!strcmp(view.message.data, MESSAGE) &&
+            view.message.len == sizeof(MESSAGE) - 1, "Decoded message is invalid\n");
+    EXPECT_TRUE(view.len == 1 + EXPECTED_NET_CM_LEN, "Incorrect decoded length (%u)\n",
+            view.len);
+
+    // Trailing bytes are not part of the object
+    EXPECT_TRUE(chat_view_decode(&view, CHAT_PROTOCOL_V1, data, sizeof(data)) == CHAT_MESSAGE &&
+            view.len == 1 + EXPECTED_NET_CM_LEN, "Trailing bytes should be left\n");
+
+    EXPECT_TRUE(chat_view_decode(&view, CHAT_PROTOCOL_V1, data, 10) < 0,
+            "Expected error for corrupt message\n");
+    EXPECT_TRUE(chat_view_decode(&view, CHAT_PROTOCOL_V1, (const unsigned char *)"\x07x", 3) < 0,
+            "Expected error for invalid type\n");
+    EXPECT_TRUE(chat_view_decode(&view, CHAT_PROTOCOL_V1,
+                (const unsigned char *)"\0Billy\0caf\xe9\0", 12) < 0,
+            "Expected error for invalid UTF-8\n");
+
+    // Relay with another sender
+    chat_view_decode(&view, CHAT_PROTOCOL_V1, data, 1 + EXPECTED_NET_CM_LEN);
+    msg = chat_message_relay(CHAT_PROTOCOL_V1, &view, "Bob");
+    EXPECT_TRUE(msg != NULL, "Expected successful relay\n");
+    EXPECT_TRUE(net_message_body_length(msg) == sizeof("\0Bob\0" MESSAGE) &&
+            !memcmp(net_message_body(msg), "\0Bob\0" MESSAGE, sizeof("\0Bob\0" MESSAGE)),
+            "Relayed data is invalid\n");
+    net_message_unref(msg);
+}
+
+static void test_varint(void)
+{
+    static const uint32_t values[] = { 0, 1, 127, 128, 16383, 16384, UINT32_MAX };
+    unsigned char buffer[CHAT_VARINT_MAX_LEN];
+    const unsigned char *p;
+    uint32_t value;
+    size_t n, len;
+
+    for (size_t i = 0; i < sizeof(values) / sizeof(*values); ++i) {
+        n = chat_varint_encode(buffer, values[i]);
+        EXPECT_TRUE(n == chat_varint_size(values[i]), "Wrong varint size\n");
+
+        p = buffer;
+        len = n;
+        EXPECT_TRUE(chat_varint_decode(&value, &p, &len) == 0 &&
+                value == values[i] && len == 0, "Varint %u did not round trip\n",
+                values[i]);
+
+        // Truncated
+        p = buffer;
+        len = n - 1;
+        EXPECT_TRUE(chat_varint_decode(&value, &p, &len) == -1,
+                "Expected error for truncated varint\n");
+    }
+
+    // More than 32 bits
+    p = (const unsigned char *)"\xff\xff\xff\xff\x1f";
+    len = 5;
+    EXPECT_TRUE(chat_varint_decode(&value, &p, &len) == -1,
+            "Expected error for varint overflow\n");
+}
+
+static void test_v2(void)
+{
+    const unsigned char expected[] = "\0\0" "\x01\x05" SENDER "\x02\x11" MESSAGE;
+    struct chat_view view;
+    struct net_message *msg;
+
+    msg = chat_message_build(CHAT_PROTOCOL_V2, SENDER, MESSAGE);
+    EXPECT_TRUE(msg != NULL, "Expected successful build\n");
+    EXPECT_TRUE(net_message_body_length(msg) == sizeof(expected) - 1 &&
+            !memcmp(net_message_body(msg), expected, sizeof(expected) - 1),
+            "Built data is invalid\n");
+    net_message_unref(msg);
+
+    EXPECT_TRUE(chat_view_decode(&view, CHAT_PROTOCOL_V2, expected,
+                sizeof(expected) - 1) == CHAT_MESSAGE, "Expected successful decode\n");
+    EXPECT_TRUE(view.sender.len == sizeof(SENDER) - 1 &&
+            !memcmp(view.sender.data, SENDER, view.sender.len) &&
+            view.message.len == sizeof(MESSAGE) - 1 &&
+            !memcmp(view.message.data, MESSAGE, view.message.len),
+            "Decoded message is invalid\n");
+    EXPECT_TRUE(view.len == sizeof(expected) - 1, "Incorrect decoded length (%u)\n",
+            view.len);
+
+    // Any order, unknown fields skipped, absent fields empty
+    EXPECT_TRUE(chat_view_decode(&view, CHAT_PROTOCOL_V2,
+                (const unsigned char *)"\0\0" "\x09\x02xy" "\x02\x02hi", 10) == CHAT_MESSAGE,
+            "Expected successful decode\n");
+    EXPECT_TRUE(view.sender.len == 0 && view.message.len == 2 &&
+            !memcmp(view.message.data, "hi", 2) && view.len == 6,
+            "Decoded message is invalid\n");
+
+    EXPECT_TRUE(chat_view_decode(&view, CHAT_PROTOCOL_V2,
+                (const unsigned char *)"\0\0" "\x02\x05hi", 6) < 0,
+            "Expected error for truncated field\n");
+    EXPECT_TRUE(chat_view_decode(&view, CHAT_PROTOCOL_V2,
+                (const unsigned char *)"\0\0" "\x01\x01" "a" "\x01\x01" "b", 8) < 0,
+            "Expected error for duplicate field\n");
+    EXPECT_TRUE(chat_view_decode(&view, CHAT_PROTOCOL_V2,
+                (const unsigned char *)"\0\0" "\x02\x03" "a\0b", 7) < 0,
+            "Expected error for null byte in text\n");
+    EXPECT_TRUE(chat_view_decode(&view, CHAT_PROTOCOL_V2,
+                (const unsigned char *)"\0\0" "\x02\x02" "\xc3(", 6) < 0,
+            "Expected error for invalid UTF-8\n");
+    EXPECT_TRUE(chat_view_decode(&view, CHAT_PROTOCOL_V2,
+                (const unsigned char *)"\x80\x01", 2) < 0,
+            "Expected error for unknown flags\n");
+    EXPECT_TRUE(chat_view_decode(&view, CHAT_PROTOCOL_V2,
+                (const unsigned char *)"\0\x03", 2) < 0,
+            "Hello should only be accepted in v1\n");
+
+    // Relay into another version
+    chat_view_decode(&view, CHAT_PROTOCOL_V2, expected, sizeof(expected) - 1);
+    msg = chat_message_relay(CHAT_PROTOCOL_V1, &view, "Bob");
+    EXPECT_TRUE(msg != NULL &&
+            net_message_body_length(msg) == sizeof("\0Bob\0" MESSAGE) &&
+            !memcmp(net_message_body(msg), "\0Bob\0" MESSAGE, sizeof("\0Bob\0" MESSAGE)),
+            "Relayed data is invalid\n");
+    net_message_unref(msg);
+}
+
+static void test_hello(void)
+{
+    struct chat_view view;
+    struct net_message *msg;
+
+    msg = chat_hello_build(CHAT_PROTOCOL_V2, 0x81);
+    EXPECT_TRUE(msg != NULL, "Expected successful build\n");
+    EXPECT_TRUE(net_message_body_length(msg) == 4 &&
+            !memcmp(net_message_body(msg), "\x03\x02\x81\x01", 4),
+            "Built data is invalid\n");
+
+    EXPECT_TRUE(chat_view_decode(&view, CHAT_PROTOCOL_V1, net_message_body(msg),
+                net_message_body_length(msg)) == CHAT_HELLO,
+            "Expected successful decode\n");
+    EXPECT_TRUE(view.version == CHAT_PROTOCOL_V2 && view.features == 0x81,
+            "Decoded hello is invalid\n");
+    net_message_unref(msg);
+
+    EXPECT_TRUE(chat_view_decode(&view, CHAT_PROTOCOL_V1,
+                (const unsigned char *)"\x03\x02", 2) < 0,
+            "Expected error for truncated hello\n");
+}
+
+static void test_chunk(void)
+{
+    struct chat_chunk chunk = {
+        .transfer = 7, .offset = 300, .size = 1000,
+        .name = { "a.bin", 5 }, .data = { "\0\xff\0", 3 }
+    };
+    struct chat_view view;
+    struct net_message *msg;
+
+    msg = chat_chunk_build(CHAT_PROTOCOL_V2, SENDER, &chunk);
+    EXPECT_TRUE(msg != NULL, "Expected successful build\n");
+    EXPECT_TRUE(chat_view_decode(&view, CHAT_PROTOCOL_V2, net_message_body(msg),
+                net_message_body_length(msg)) == CHAT_CHUNK,
+            "Expected successful decode\n");
+    EXPECT_TRUE(view.chunk.transfer == 7 && view.chunk.offset == 300 &&
+            view.chunk.size == 1000 && view.chunk.name.len == 5 &&
+            !memcmp(view.chunk.name.data, "a.bin", 5) && view.chunk.data.len == 3 &&
+            !memcmp(view.chunk.data.data, "\0\xff\0", 3) &&
+            view.sender.len == sizeof(SENDER) - 1, "Decoded chunk is invalid\n");
+    net_message_unref(msg);
+
+    EXPECT_TRUE(chat_chunk_build(CHAT_PROTOCOL_V1, SENDER, &chunk) == NULL,
+            "Chunks should not exist in v1\n");
+
+    chunk.offset = 999;
+    msg = chat_chunk_build(CHAT_PROTOCOL_V2, SENDER, &chunk);
+    EXPECT_TRUE(chat_view_decode(&view, CHAT_PROTOCOL_V2, net_message_body(msg),
+                net_message_body_length(msg)) < 0,
+            "Expected error for data past the end of the transfer\n");
+    net_message_unref(msg);
+
+    EXPECT_TRUE(chat_view_decode(&view, CHAT_PROTOCOL_V2,
+                (const unsigned char *)"\0\x04" "\x03\x02\x80\x80", 6) < 0,
+            "Expected error for truncated number\n");
+    EXPECT_TRUE(chat_view_decode(&view, CHAT_PROTOCOL_V2,
+                (const unsigned char *)"\0\x04" "\x03\x02\x01\x01", 6) < 0,
+            "Expected error for bytes after a number\n");
+}
+
+static void test_channel(void)
+{
+    struct chat_view view;
+    struct net_message *msg, *relayed;
+
+    msg = chat_channel_message_build(CHAT_PROTOCOL_V2, "#ops", SENDER, "up");
+    EXPECT_TRUE(msg != NULL, "Expected successful build\n");
+    EXPECT_TRUE(chat_view_decode(&view, CHAT_PROTOCOL_V2, net_message_body(msg),
+                net_message_body_length(msg)) == CHAT_MESSAGE,
+            "Expected successful decode\n");
+    EXPECT_TRUE(view.channel.len == 4 && !memcmp(view.channel.data, "#ops", 4) &&
+            view.message.len == 2, "Decoded channel message is invalid\n");
+
+    /* A relayed message stays in its channel, which v1 cannot hold. */
+    relayed = chat_message_relay(CHAT_PROTOCOL_V2, &view, "Joe");
+    EXPECT_TRUE(relayed && chat_view_decode(&view, CHAT_PROTOCOL_V2,
+                net_message_body(relayed), net_message_body_length(relayed)) ==
+            CHAT_MESSAGE && view.channel.len == 4, "Relay lost the channel\n");
+    EXPECT_TRUE(chat_message_relay(CHAT_PROTOCOL_V1, &view, "Joe") == NULL &&
+            errno == EPROTONOSUPPORT, "Channels should not exist in v1\n");
+    net_message_unref(relayed);
+    net_message_unref(msg);
+
+    msg = chat_message_build(CHAT_PROTOCOL_V1, SENDER, "hi");
+    EXPECT_TRUE(chat_view_decode(&view, CHAT_PROTOCOL_V1, net_message_body(msg),
+                net_message_body_length(msg)) == CHAT_MESSAGE &&
+            view.channel.len == 0, "v1 messages are in the lobby\n");
+    net_message_unref(msg);
+
+    msg = chat_channel_join_build(CHAT_PROTOCOL_V2, "#ops", SENDER);
+    EXPECT_TRUE(chat_view_decode(&view, CHAT_PROTOCOL_V2, net_message_body(msg),
+                net_message_body_length(msg)) == CHAT_CHANNEL_JOIN &&
+            view.channel.len == 4, "Expected successful decode\n");
+    net_message_unref(msg);
+
+    EXPECT_TRUE(chat_channel_part_build(CHAT_PROTOCOL_V1, "#ops", SENDER) == NULL,
+            "Channels should not exist in v1\n");
+    EXPECT_TRUE(chat_view_decode(&view, CHAT_PROTOCOL_V2,
+                (const unsigned char *)"\0\x06" "\x01\x01x", 5) < 0,
+            "Expected error for a part without a channel\n");
+}
+
+static void test_direct_message(void)
+{
+    struct chat_view view;
+    struct net_message *msg, *relayed;
+
+    msg = chat_direct_message_build(CHAT_PROTOCOL_V2, "Joe", SENDER, "psst");
+    EXPECT_TRUE(msg && chat_view_decode(&view, CHAT_PROTOCOL_V2,
+                net_message_body(msg), net_message_body_length(msg)) ==
+            CHAT_DIRECT_MESSAGE, "Expected successful decode\n");
+    EXPECT_TRUE(view.recipient.len == 3 && !memcmp(view.recipient.data, "Joe", 3) &&
+            view.message.len == 4 && view.channel.len == 0,
+            "Decoded direct message is invalid\n");
+
+    relayed = chat_message_relay(CHAT_PROTOCOL_V2, &view, "Ann");
+    EXPECT_TRUE(relayed && chat_view_decode(&view, CHAT_PROTOCOL_V2,
+                net_message_body(relayed), net_message_body_length(relayed)) ==
+            CHAT_DIRECT_MESSAGE && view.recipient.len == 3 && view.sender.len == 3,
+            "Relay lost the recipient\n");
+    net_message_unref(relayed);
+    net_message_unref(msg);
+
+    EXPECT_TRUE(chat_direct_message_build(CHAT_PROTOCOL_V1, "Joe", SENDER, "x") == NULL,
+            "Direct messages should not exist in v1\n");
+    EXPECT_TRUE(chat_view_decode(&view, CHAT_PROTOCOL_V2,
+                (const unsigned char *)"\0\x07" "\x02\x01x", 5) < 0,
+            "Expected error for a direct message without a recipient\n");
+}
+
+static void test_sender_ids(void)
+{
+    struct chat_view view;
+    struct net_message *msg, *full, *compact;
+
+    msg = chat_member_build(CHAT_PROTOCOL_V2, CHAT_MEMBER_JOIN, SENDER, 300);
+    EXPECT_TRUE(msg && chat_view_decode(&view, CHAT_PROTOCOL_V2,
+                net_message_body(msg), net_message_body_length(msg)) ==
+            CHAT_MEMBER_JOIN && view.sender_id == 300 &&
+            view.sender.len == strlen(SENDER), "Decoded join is invalid\n");
+    net_message_unref(msg);
+
+    msg = chat_member_build(CHAT_PROTOCOL_V2, CHAT_MEMBER_INFO, SENDER, 7);
+    EXPECT_TRUE(msg && chat_view_decode(&view, CHAT_PROTOCOL_V2,
+                net_message_body(msg), net_message_body_length(msg)) ==
+            CHAT_MEMBER_INFO && view.sender_id == 7, "Decoded info is invalid\n");
+    net_message_unref(msg);
+
+    EXPECT_TRUE(chat_member_build(CHAT_PROTOCOL_V1, CHAT_MEMBER_JOIN, SENDER, 7) == NULL &&
+            chat_member_build(CHAT_PROTOCOL_V1, CHAT_MEMBER_INFO, SENDER, 0) == NULL,
+            "Ids should not exist in v1\n");
+
+    /* A compact message holds the id instead of the name, and is smaller. */
+    full = chat_channel_message_build(CHAT_PROTOCOL_V2, "#c", SENDER, MESSAGE);
+    EXPECT_TRUE(full && chat_view_decode(&view, CHAT_PROTOCOL_V2,
+                net_message_body(full), net_message_body_length(full)) ==
+            CHAT_MESSAGE && view.sender_id == 0, "Expected no sender id\n");
+    compact = chat_message_relay_compact(CHAT_PROTOCOL_V2, &view, 42);
+    EXPECT_TRUE(compact && net_message_body_length(compact) <
+            net_message_body_length(full), "Compact message is not smaller\n");
+    EXPECT_TRUE(chat_view_decode(&view, CHAT_PROTOCOL_V2, net_message_body(compact),
+                net_message_body_length(compact)) == CHAT_MESSAGE &&
+            view.sender.len == 0 && view.sender_id == 42 && view.channel.len == 2 &&
+            view.message.len == strlen(MESSAGE), "Decoded compact message is invalid\n");
+    net_message_unref(compact);
+    net_message_unref(full);
+
+    EXPECT_TRUE(chat_view_decode(&view, CHAT_PROTOCOL_V2,
+                (const unsigned char *)"\0\x08" "\x01\x01x", 5) < 0,
+            "Expected error for member info without an id\n");
+}
+
+static void test_history_objects(void)
+{
+    struct chat_view view, message;
+    struct net_message *msg, *entry;
+
+    msg = chat_search_build(CHAT_PROTOCOL_V2, "two words", 5);
+    EXPECT_TRUE(msg && chat_view_decode(&view, CHAT_PROTOCOL_V2,
+                net_message_body(msg), net_message_body_length(msg)) ==
+            CHAT_SEARCH && view.history.count == 5 && view.message.len == 9,
+            "Decoded search is invalid\n");
+    net_message_unref(msg);
+
+    EXPECT_TRUE(chat_search_build(CHAT_PROTOCOL_V1, "words", 0) == NULL &&
+            chat_history_end_build(CHAT_PROTOCOL_V1, 0) == NULL,
+            "History objects should not exist in v1\n");
+    EXPECT_TRUE(chat_view_decode(&view, CHAT_PROTOCOL_V2,
+                (const unsigned char *)"\0\x09" "\x05\x01\x03", 5) < 0,
+            "Expected error for a search without a query\n");
+
+    msg = chat_channel_message_build(CHAT_PROTOCOL_V2, "#c", SENDER, MESSAGE);
+    EXPECT_TRUE(chat_view_decode(&message, CHAT_PROTOCOL_V2,
+                net_message_body(msg), net_message_body_length(msg)) ==
+            CHAT_MESSAGE, "Expected a chat message\n");
+    entry = chat_history_entry_build(CHAT_PROTOCOL_V2, &message, 1234,
+            1700000000);
+    EXPECT_TRUE(entry && chat_view_decode(&view, CHAT_PROTOCOL_V2,
+                net_message_body(entry), net_message_body_length(entry)) ==
+            CHAT_HISTORY_ENTRY && view.history.message_id == 1234 &&
+            view.history.time == 1700000000 && view.channel.len == 2 &&
+            view.sender.len == strlen(SENDER) &&
+            view.message.len == strlen(MESSAGE), "Decoded entry is invalid\n");
+    net_message_unref(entry);
+    net_message_unref(msg);
+
+    msg = chat_history_request_build(CHAT_PROTOCOL_V2, &(struct chat_history){
+            .time = 1700000000, .until = 1700003600, .count = 100 });
+    EXPECT_TRUE(msg && chat_view_decode(&view, CHAT_PROTOCOL_V2,
+                net_message_body(msg), net_message_body_length(msg)) ==
+            CHAT_HISTORY_REQUEST && view.history.message_id == 0 &&
+            view.history.time == 1700000000 && view.history.until == 1700003600 &&
+            view.history.count == 100, "Decoded history request is invalid\n");
+    net_message_unref(msg);
+
+    msg = chat_history_end_build(CHAT_PROTOCOL_V2, 3);
+    EXPECT_TRUE(msg && chat_view_decode(&view, CHAT_PROTOCOL_V2,
+                net_message_body(msg), net_message_body_length(msg)) ==
+            CHAT_HISTORY_END && view.history.count == 3,
+            "Decoded end is invalid\n");
+    net_message_unref(msg);
+}
+
+static void test_compression(void)
+{
+    struct compression sender, receiver;
+    struct net_message *msg, *packed, *inflated;
+    struct chat_view view;
+    unsigned first_len = 0;
+
+    EXPECT_TRUE(chat_compression_init(&sender) == 0 &&
+            chat_compression_init(&receiver) == 0, "Expected successful init\n");
+
+    msg = chat_message_build(CHAT_PROTOCOL_V2, SENDER, MESSAGE);
+
+    // The same message again compresses better: the context is kept.
+    for (int i = 0; i < 3; ++i) {
+        packed = chat_compress(&sender, msg);
+        EXPECT_TRUE(packed != NULL, "Expected successful compression\n");
+        EXPECT_TRUE(chat_is_compressed(CHAT_PROTOCOL_V2, net_message_body(packed),
+                    net_message_body_length(packed)), "Expected compressed flag\n");
+        EXPECT_TRUE(chat_view_decode(&view, CHAT_PROTOCOL_V2, net_message_body(packed),
+                    net_message_body_length(packed)) < 0,
+                "Compressed object should not decode as it is\n");
+
+        if (i == 0) {
+            first_len = net_message_body_length(packed);
+        }
+        else {
+            EXPECT_TRUE(net_message_body_length(packed) < first_len,
+                    "Expected context across messages (%u >= %u)\n",
+                    net_message_body_length(packed), first_len);
+        }
+
+        inflated = chat_decompress(&receiver, net_message_body(packed),
+                net_message_body_length(packed));
+        EXPECT_TRUE(inflated != NULL &&
+                net_message_body_length(inflated) == net_message_body_length(msg) &&
+                !memcmp(net_message_body(inflated), net_message_body(msg),
+                    net_message_body_length(msg)), "Decompressed data is invalid\n");
+        net_message_unref(inflated);
+        net_message_unref(packed);
+    }
+
+    EXPECT_TRUE(!chat_is_compressed(CHAT_PROTOCOL_V2, net_message_body(msg),
+                net_message_body_length(msg)), "Expected no compressed flag\n");
+    EXPECT_TRUE(!chat_is_compressed(CHAT_PROTOCOL_V1,
+                (const unsigned char *)"\x01", 1), "v1 objects are never compressed\n");
+    net_message_unref(msg);
+
+    EXPECT_TRUE(chat_decompress(&receiver, (const unsigned char *)"\x01\xff\xff\xff", 4)
+            == NULL, "Expected error for corrupt data\n");
+
+    compression_deinit(&sender);
+    compression_deinit(&receiver);
+}
+
 int main(int argc, char *argv[])
 {
     test_chat_message();    
     test_chat_member_join();    
     test_chat_member_leave();    
+    test_build();
+    test_view();
+    test_varint();
+    test_v2();
+    test_hello();
+    test_chunk();
+    test_channel();
+    test_direct_message();
+    test_sender_ids();
+    test_history_objects();
+    test_compression();
     return 0;
 }
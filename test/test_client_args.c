@@ -27,6 +27,16 @@ int main(int argc, char *argv[])
         "Port should match the one that was given\n");
     EXPECT_TRUE(!strcmp(pargs.username, "Joe"),
         "Username should match the one that was given\n");
+    EXPECT_TRUE(pargs.protocol == CHAT_PROTOCOL_LATEST,
+        "Latest protocol version should be the default\n");
+
+    EXPECT_TRUE(
+            0 == scan_arguments(&pargs, 5, (char*[]){ "client", "127.0.0.1", "14000", "Joe", "1" }) &&
+            pargs.protocol == CHAT_PROTOCOL_V1,
+            "Protocol version should match the one that was given\n");
+    EXPECT_TRUE(
+            0 != scan_arguments(&pargs, 5, (char*[]){ "client", "127.0.0.1", "14000", "Joe", "9" }),
+            "Unknown protocol version should be rejected\n");
 
     return 0;
 }
@@ -0,0 +1,79 @@
+#include "../conn_table.h"
+#include "test.h"
+
+static int values[64];
+
+static void test_insert_get_remove(void)
+{
+    struct conn_table table;
+    struct conn_handle a, b, c;
+    int rc;
+
+    rc = conn_table_init(&table, 3);
+    EXPECT_TRUE(rc == 0, "Initialisation should succeed\n");
+
+    EXPECT_TRUE(conn_table_insert(&table, &values[0], &a) == 0, "Insert failed\n");
+    EXPECT_TRUE(conn_table_insert(&table, &values[1], &b) == 0, "Insert failed\n");
+    EXPECT_TRUE(conn_table_insert(&table, &values[2], &c) == 0, "Insert failed\n");
+    EXPECT_TRUE(conn_table_count(&table) == 3, "Expected 3 entries\n");
+
+    rc = conn_table_insert(&table, &values[3], &(struct conn_handle){0});
+    EXPECT_TRUE(rc == -1, "Table should be at capacity\n");
+
+    EXPECT_TRUE(conn_table_get(&table, b) == &values[1], "Lookup returned wrong value\n");
+
+    EXPECT_TRUE(conn_table_remove(&table, a) == 0, "Remove failed\n");
+    EXPECT_TRUE(conn_table_get(&table, a) == NULL, "Removed handle should be stale\n");
+    EXPECT_TRUE(conn_table_remove(&table, a) == -1, "Double remove should fail\n");
+    EXPECT_TRUE(conn_table_count(&table) == 2, "Expected 2 entries\n");
+
+    /* The freed slot is reused with a new generation. */
+    EXPECT_TRUE(conn_table_insert(&table, &values[3], &a) == 0, "Insert failed\n");
+    EXPECT_TRUE(conn_table_get(&table, a) == &values[3], "Lookup returned wrong value\n");
+    EXPECT_TRUE(conn_table_get(&table, c) == &values[2], "Unrelated handle changed\n");
+
+    conn_table_deinit(&table);
+}
+
+static void test_growth_and_iteration(void)
+{
+    struct conn_table table;
+    struct conn_handle handles[64];
+    unsigned seen = 0;
+
+    EXPECT_TRUE(conn_table_init(&table, 64) == 0, "Initialisation should succeed\n");
+
+    for (int i = 0; i < 64; ++i) {
+        EXPECT_TRUE(conn_table_insert(&table, &values[i], &handles[i]) == 0,
+                "Insert %d failed\n", i);
+    }
+
+    /* Remove every other entry. */
+    for (int i = 0; i < 64; i += 2) {
+        EXPECT_TRUE(conn_table_remove(&table, handles[i]) == 0, "Remove failed\n");
+    }
+
+    EXPECT_TRUE(conn_table_count(&table) == 32, "Expected 32 entries\n");
+
+    for (unsigned i = 0; i < conn_table_count(&table); ++i) {
+        int *value = conn_table_at(&table, i);
+        EXPECT_TRUE((value - values) % 2 == 1, "Removed entry still iterated\n");
+        seen++;
+    }
+
+    EXPECT_TRUE(seen == 32, "Iteration visited %u entries\n", seen);
+
+    for (int i = 1; i < 64; i += 2) {
+        EXPECT_TRUE(conn_table_get(&table, handles[i]) == &values[i],
+                "Handle %d lost its entry\n", i);
+    }
+
+    conn_table_deinit(&table);
+}
+
+int main(int argc, char *argv[])
+{
+    test_insert_get_remove();
+    test_growth_and_iteration();
+    return 0;
+}
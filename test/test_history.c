@@ -0,0 +1,353 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "../history.h"
+#include "../chat.h"
+#include "../network.h"
+#include "test.h"
+
+#define NUM_MESSAGES                    200
+#define SEGMENT_BYTES                   4096
+
+static char dir[] = "/tmp/chatti-history-XXXXXX";
+
+/**
+ * @brief Count the segments and find the path of the last one.
+ */
+static unsigned find_segments(char *last, size_t size)
+{
+    char name[64] = "";
+    struct dirent *entry;
+    unsigned count = 0;
+    DIR *d = opendir(dir);
+
+    while ((entry = readdir(d))) {
+        if (strstr(entry->d_name, HISTORY_SEGMENT_SUFFIX)) {
+            count++;
+            if (strcmp(entry->d_name, name) > 0) {
+                snprintf(name, sizeof(name), "%s", entry->d_name);
+            }
+        }
+    }
+    closedir(d);
+
+    snprintf(last, size, "%s/%s", dir, name);
+    return count;
+}
+
+static off_t file_size(const char *path)
+{
+    struct stat st;
+
+    return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+static void append_messages(unsigned n, unsigned sync_ms)
+{
+    struct history history;
+    char text[32];
+
+    EXPECT_TRUE(history_open(&history, dir, SEGMENT_BYTES, sync_ms, NULL) == 0,
+            "Open failed: %s\n", strerror(errno));
+
+    for (unsigned i = 0; i < n; ++i) {
+        struct net_message *msg;
+
+        snprintf(text, sizeof(text), "message %u", i);
+        msg = chat_message_build(CHAT_PROTOCOL_V2, "Ann", text);
+        EXPECT_TRUE(msg && history_append(&history, msg) == 0, "Append failed\n");
+        net_message_unref(msg);
+    }
+
+    history_close(&history);
+}
+
+static uint64_t reopen(void)
+{
+    struct history history;
+    uint64_t next_id;
+
+    EXPECT_TRUE(history_open(&history, dir, SEGMENT_BYTES, 0, NULL) == 0,
+            "Reopen failed: %s\n", strerror(errno));
+    next_id = history.next_id;
+    history_close(&history);
+
+    return next_id;
+}
+
+static void test_append_and_recover(void)
+{
+    char last[PATH_MAX];
+    off_t size;
+    int fd;
+
+    append_messages(NUM_MESSAGES / 2, 0);
+    append_messages(NUM_MESSAGES / 2, 50);
+
+    EXPECT_TRUE(find_segments(last, sizeof(last)) > 1, "Expected several segments\n");
+    EXPECT_TRUE(reopen() == NUM_MESSAGES + 1, "Expected ids to go on from %d\n",
+            NUM_MESSAGES + 1);
+
+    /* A half-written record is cut off. */
+    size = file_size(last);
+    fd = open(last, O_WRONLY | O_APPEND);
+    EXPECT_TRUE(fd != -1 && write(fd, "\x40\0\0\0torn", 8) == 8, "Write failed\n");
+    close(fd);
+    EXPECT_TRUE(reopen() == NUM_MESSAGES + 1 && file_size(last) == size,
+            "Torn tail was not cut off\n");
+
+    /* So is a record whose crc does not match, with the rest of the segment. */
+    fd = open(last, O_WRONLY);
+    EXPECT_TRUE(fd != -1 && pwrite(fd, "X", 1, size - 1) == 1, "Write failed\n");
+    close(fd);
+    EXPECT_TRUE(reopen() == NUM_MESSAGES && file_size(last) < size,
+            "Corrupt record was not cut off\n");
+
+    append_messages(1, 0);
+    EXPECT_TRUE(reopen() == NUM_MESSAGES + 1, "Expected the id to be reused\n");
+}
+
+/**
+ * @brief Wait for the writer to load the marks of the segments found on
+ *        open, before which their records cannot be looked up.
+ */
+static void wait_indexed(struct history *history)
+{
+    while (!atomic_load(&history->indexed)) {
+        usleep(1000);
+    }
+}
+
+static void count_record(void *arg, const struct history_record *record)
+{
+    unsigned *count = arg;
+
+    /* Records are shown in id order, from the first. */
+    if (record->id == *count + 1) {
+        (*count)++;
+    }
+}
+
+static bool holds(const struct history_record *record, unsigned i)
+{
+    char text[32];
+    struct chat_view view;
+
+    snprintf(text, sizeof(text), "message %u", i);
+    return chat_view_decode(&view, CHAT_PROTOCOL_V2, record->frame,
+            record->len) == CHAT_MESSAGE && view.message.len == strlen(text) &&
+        !memcmp(view.message.data, text, view.message.len);
+}
+
+static void test_read(void)
+{
+    struct history history;
+    struct history_observer observer = { count_record, NULL };
+    struct history_record record;
+    unsigned char *buffer = malloc(NET_MSG_DATA_SIZE);
+    unsigned count = 0;
+    int rc;
+
+    observer.arg = &count;
+    EXPECT_TRUE(history_open(&history, dir, SEGMENT_BYTES, 0, &observer) == 0,
+            "Open failed: %s\n", strerror(errno));
+    wait_indexed(&history);
+
+    /* The last record replaced a corrupt one. */
+    for (unsigned id = 1; id <= NUM_MESSAGES; ++id) {
+        rc = history_read(&history, id, &record, buffer);
+        EXPECT_TRUE(rc == 0 && record.id == id && holds(&record,
+                    id < NUM_MESSAGES ? (id - 1) % (NUM_MESSAGES / 2) : 0),
+                "Record %u could not be read\n", id);
+    }
+
+    rc = history_read(&history, NUM_MESSAGES + 1, &record, buffer);
+    EXPECT_TRUE(rc == -1 && errno == ENOENT, "Record past the end was read\n");
+    rc = history_read(&history, 0, &record, buffer);
+    EXPECT_TRUE(rc == -1 && errno == ENOENT, "Record 0 was read\n");
+
+    history_close(&history);
+    EXPECT_TRUE(count == NUM_MESSAGES, "Observer saw %u records\n", count);
+    free(buffer);
+}
+
+struct collected {
+    uint64_t ids[NUM_MESSAGES];
+    uint64_t timestamps[NUM_MESSAGES];
+    unsigned count;
+    unsigned stop_after;                /* 0 to go on to the end. */
+};
+
+static int collect(void *arg, const struct history_record *record)
+{
+    struct collected *c = arg;
+
+    if (c->count < NUM_MESSAGES) {
+        c->ids[c->count] = record->id;
+        c->timestamps[c->count] = record->timestamp;
+    }
+    c->count++;
+    return c->count == c->stop_after;
+}
+
+static unsigned count_index_files(void)
+{
+    struct dirent *entry;
+    unsigned count = 0;
+    DIR *d = opendir(dir);
+
+    while ((entry = readdir(d))) {
+        count += strstr(entry->d_name, HISTORY_INDEX_SUFFIX) != NULL;
+    }
+    closedir(d);
+
+    return count;
+}
+
+static void test_scan(void)
+{
+    struct history history;
+    struct collected all = { .count = 0 }, some = { .stop_after = 10 };
+    struct collected gathered = { .count = 0 };
+    const uint64_t ids[] = { NUM_MESSAGES + 5, NUM_MESSAGES, 150, 149, 64, 3, 1 };
+    unsigned num_ids = sizeof(ids) / sizeof(ids[0]);
+    char path[PATH_MAX];
+    unsigned segments = find_segments(path, sizeof(path));
+    bool in_order = true;
+    struct dirent *entry;
+    DIR *d;
+    int fd;
+
+    /* Every segment but the last has an index file. */
+    EXPECT_TRUE(count_index_files() == segments - 1, "Expected %u index files\n",
+            segments - 1);
+
+    /* Missing and corrupt ones are made again. */
+    snprintf(path, sizeof(path), "%s/%020u%s", dir, 1, HISTORY_INDEX_SUFFIX);
+    unlink(path);
+    d = opendir(dir);
+    while ((entry = readdir(d))) {
+        if (strstr(entry->d_name, HISTORY_INDEX_SUFFIX)) {
+            snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+            fd = open(path, O_WRONLY | O_TRUNC);
+            EXPECT_TRUE(fd != -1 && write(fd, "junk", 4) == 4, "Write failed\n");
+            close(fd);
+        }
+    }
+    closedir(d);
+
+    EXPECT_TRUE(history_open(&history, dir, SEGMENT_BYTES, 0, NULL) == 0,
+            "Open failed: %s\n", strerror(errno));
+    wait_indexed(&history);
+    EXPECT_TRUE(history_end(&history) == NUM_MESSAGES + 1, "Expected the end at %d\n",
+            NUM_MESSAGES + 1);
+
+    EXPECT_TRUE(history_scan(&history, 1, NUM_MESSAGES + 10, collect, &all) ==
+            NUM_MESSAGES && all.count == NUM_MESSAGES, "Scanned %u records\n",
+            all.count);
+    for (unsigned i = 0; i < all.count; ++i) {
+        in_order &= all.ids[i] == i + 1 &&
+            (i == 0 || all.timestamps[i] >= all.timestamps[i - 1]);
+    }
+    EXPECT_TRUE(in_order, "Records out of order\n");
+    EXPECT_TRUE(count_index_files() == segments - 1, "Index file not made again\n");
+
+    /* From the middle of a segment on, until the callback stops. */
+    EXPECT_TRUE(history_scan(&history, 95, 100, collect, &some) == 10 &&
+            some.ids[0] == 95 && some.ids[9] == 104, "Partial scan failed\n");
+    EXPECT_TRUE(history_scan(&history, NUM_MESSAGES + 1, 10, collect, &some) == 0,
+            "Scan past the end read records\n");
+
+    /* Records by id, newest first across segments, those past the end
+     * skipped. */
+    EXPECT_TRUE(history_gather(&history, ids, num_ids, collect, &gathered) ==
+            (int)num_ids - 1 && gathered.count == num_ids - 1,
+            "Gathered %u records\n", gathered.count);
+    for (unsigned i = 1; i < num_ids; ++i) {
+        EXPECT_TRUE(gathered.ids[i - 1] == ids[i], "Record %u is not %llu\n",
+                i - 1, (unsigned long long)ids[i]);
+    }
+
+    /* The first record at or after each time. */
+    for (unsigned i = 0; i < all.count; i += 7) {
+        uint64_t expected = i + 1;
+
+        while (expected > 1 && all.timestamps[expected - 2] == all.timestamps[i]) {
+            expected--;
+        }
+        EXPECT_TRUE(history_find_time(&history, all.timestamps[i]) == expected,
+                "Expected record %llu at the time of record %u\n",
+                (unsigned long long)expected, i + 1);
+    }
+    EXPECT_TRUE(history_find_time(&history, 0) == 1 &&
+            history_find_time(&history, all.timestamps[all.count - 1] + 1) ==
+            NUM_MESSAGES + 1, "Times out of the history not found\n");
+
+    /* A segment not loaded yet does not hide those after it. */
+    pthread_rwlock_wrlock(&history.index_lock);
+    history.segments[1].loaded = false;
+    pthread_rwlock_unlock(&history.index_lock);
+    EXPECT_TRUE(history_find_time(&history, all.timestamps[all.count - 1] + 1) ==
+            NUM_MESSAGES + 1, "Time after a segment not loaded not found\n");
+
+    history_close(&history);
+}
+
+static void test_append_while_indexing(void)
+{
+    struct history history;
+    struct history_observer observer = { count_record, NULL };
+    unsigned count = 0;
+
+    /* Appends do not wait for the segments there are to be read, and the
+     * observer is shown them after those. */
+    observer.arg = &count;
+    EXPECT_TRUE(history_open(&history, dir, SEGMENT_BYTES, 0, &observer) == 0,
+            "Open failed: %s\n", strerror(errno));
+    for (unsigned i = 0; i < NUM_MESSAGES / 4; ++i) {
+        struct net_message *msg = chat_message_build(CHAT_PROTOCOL_V2, "Ann", "hi");
+
+        EXPECT_TRUE(msg && history_append(&history, msg) == 0, "Append failed\n");
+        net_message_unref(msg);
+    }
+    wait_indexed(&history);
+    history_close(&history);
+
+    EXPECT_TRUE(count == NUM_MESSAGES + NUM_MESSAGES / 4,
+            "Observer saw %u records\n", count);
+}
+
+static void remove_dir(void)
+{
+    char path[PATH_MAX];
+    struct dirent *entry;
+    DIR *d = opendir(dir);
+
+    while ((entry = readdir(d))) {
+        if (entry->d_name[0] != '.') {
+            snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+            unlink(path);
+        }
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+int main(int argc, char *argv[])
+{
+    EXPECT_TRUE(mkdtemp(dir) != NULL, "Unable to create %s\n", dir);
+    test_append_and_recover();
+    test_read();
+    test_scan();
+    test_append_while_indexing();
+    remove_dir();
+    return 0;
+}
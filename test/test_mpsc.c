@@ -0,0 +1,81 @@
+#include <pthread.h>
+
+#include "../mpsc.h"
+#include "test.h"
+
+#define NUM_PRODUCERS           4
+#define NUM_ITEMS               100000
+
+struct item {
+    struct mpsc_node node;
+    int producer;
+    int seq;
+};
+
+static struct mpsc_queue queue;
+static struct item items[NUM_PRODUCERS][NUM_ITEMS];
+
+static void *produce(void *arg)
+{
+    int producer = (int)(long)arg;
+
+    for (int i = 0; i < NUM_ITEMS; ++i) {
+        items[producer][i].producer = producer;
+        items[producer][i].seq = i;
+        mpsc_queue_push(&queue, &items[producer][i].node);
+    }
+
+    return NULL;
+}
+
+static void test_empty(void)
+{
+    struct item item;
+
+    mpsc_queue_init(&queue);
+    EXPECT_TRUE(mpsc_queue_pop(&queue) == NULL, "New queue should be empty\n");
+
+    mpsc_queue_push(&queue, &item.node);
+    EXPECT_TRUE(mpsc_queue_pop(&queue) == &item.node, "Expected pushed node\n");
+    EXPECT_TRUE(mpsc_queue_pop(&queue) == NULL, "Queue should be empty again\n");
+}
+
+static void test_per_producer_order(void)
+{
+    pthread_t threads[NUM_PRODUCERS];
+    int next_seq[NUM_PRODUCERS] = {0};
+    int num_popped = 0;
+
+    mpsc_queue_init(&queue);
+
+    for (long i = 0; i < NUM_PRODUCERS; ++i) {
+        pthread_create(&threads[i], NULL, produce, (void *)i);
+    }
+
+    while (num_popped < NUM_PRODUCERS * NUM_ITEMS) {
+        struct item *item = (struct item *)mpsc_queue_pop(&queue);
+
+        if (!item) {
+            continue;
+        }
+
+        EXPECT_TRUE(item->seq == next_seq[item->producer],
+                "Producer %d: expected item %d, got %d\n",
+                item->producer, next_seq[item->producer], item->seq);
+        next_seq[item->producer]++;
+        num_popped++;
+    }
+
+    for (int i = 0; i < NUM_PRODUCERS; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    EXPECT_TRUE(mpsc_queue_pop(&queue) == NULL, "Queue should be empty\n");
+}
+
+int main(int argc, char *argv[])
+{
+    test_empty();
+    test_per_producer_order();
+    return 0;
+}
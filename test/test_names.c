@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "../names.h"
+#include "test.h"
+
+#define NUM_NAMES                       1000
+
+static char names[NUM_NAMES][16];
+
+static struct conn_handle handle_of(unsigned i)
+{
+    return (struct conn_handle){ .index = i, .generation = 1 };
+}
+
+static void test_insert_find_remove(void)
+{
+    struct name_table table;
+    const struct name_entry *entry;
+
+    EXPECT_TRUE(name_table_init(&table) == 0, "Initialisation should succeed\n");
+
+    for (unsigned i = 0; i < NUM_NAMES; ++i) {
+        snprintf(names[i], sizeof(names[i]), "user%u", i);
+        EXPECT_TRUE(name_table_insert(&table, names[i], strlen(names[i]), i + 1,
+                    i % 4, handle_of(i)) == 0, "Insert of %s failed\n", names[i]);
+    }
+
+    EXPECT_TRUE(name_table_insert(&table, "user7", 5, 1, 0, handle_of(0)) == -1 &&
+            errno == EEXIST, "Names should be unique\n");
+
+    entry = name_table_find(&table, "user7", 5);
+    EXPECT_TRUE(entry && entry->name == names[7] && entry->id == 8 &&
+            entry->shard == 3 && entry->handle.index == 7,
+            "Lookup returned wrong entry\n");
+    EXPECT_TRUE(name_table_find(&table, "user", 4) == NULL, "Unexpected entry\n");
+
+    /* Remove every other name; the rest must still be found. */
+    for (unsigned i = 0; i < NUM_NAMES; i += 2) {
+        EXPECT_TRUE(name_table_remove(&table, names[i], strlen(names[i])) == 0,
+                "Remove of %s failed\n", names[i]);
+    }
+    EXPECT_TRUE(name_table_remove(&table, names[0], strlen(names[0])) == -1,
+            "Double remove should fail\n");
+    EXPECT_TRUE(table.count == NUM_NAMES / 2, "Expected %d names\n", NUM_NAMES / 2);
+
+    for (unsigned i = 0; i < NUM_NAMES; ++i) {
+        entry = name_table_find(&table, names[i], strlen(names[i]));
+        EXPECT_TRUE((entry != NULL) == (i % 2) && (!entry || entry->handle.index == i),
+                "Name %s in the wrong state\n", names[i]);
+    }
+
+    /* A removed name can be taken again. */
+    EXPECT_TRUE(name_table_insert(&table, names[0], strlen(names[0]),
+                NUM_NAMES + 1, 1, handle_of(5000)) == 0,
+            "Insert after remove failed\n");
+
+    name_table_deinit(&table);
+}
+
+static void test_ids(void)
+{
+    struct id_table table;
+    const char *name;
+
+    EXPECT_TRUE(id_table_init(&table) == 0, "Initialisation should succeed\n");
+
+    for (unsigned i = 0; i < NUM_NAMES; ++i) {
+        EXPECT_TRUE(id_table_set(&table, i + 1, names[i], strlen(names[i])) == 0,
+                "Set of %u failed\n", i + 1);
+    }
+    EXPECT_TRUE(table.count == NUM_NAMES, "Expected %d ids\n", NUM_NAMES);
+
+    /* Setting an id again renames it. */
+    EXPECT_TRUE(id_table_set(&table, 1, "renamed", 7) == 0 &&
+            table.count == NUM_NAMES, "Rename failed\n");
+    name = id_table_find(&table, 1);
+    EXPECT_TRUE(name && strcmp(name, "renamed") == 0, "Expected renamed\n");
+    EXPECT_TRUE(id_table_find(&table, NUM_NAMES + 1) == NULL, "Unexpected id\n");
+
+    for (unsigned i = 0; i < NUM_NAMES; i += 2) {
+        EXPECT_TRUE(id_table_remove(&table, i + 1) == 0, "Remove of %u failed\n",
+                i + 1);
+    }
+    EXPECT_TRUE(id_table_remove(&table, 1) == -1, "Double remove should fail\n");
+
+    for (unsigned i = 1; i < NUM_NAMES; ++i) {
+        name = id_table_find(&table, i + 1);
+        EXPECT_TRUE((name != NULL) == (i % 2) && (!name || !strcmp(name, names[i])),
+                "Id %u in the wrong state\n", i + 1);
+    }
+
+    id_table_deinit(&table);
+}
+
+int main(int argc, char *argv[])
+{
+    test_insert_find_remove();
+    test_ids();
+    return 0;
+}
@@ -0,0 +1,176 @@
+#include <string.h>
+#include <pthread.h>
+
+#include "../network.h"
+#include "../pool.h"
+#include "test.h"
+
+#define NUM_OBJECTS                     1000
+
+static void *objects[NUM_OBJECTS];
+
+static void test_reuse_and_stats(void)
+{
+    struct pool pool;
+    struct pool_stats stats;
+
+    EXPECT_TRUE(pool_init(&pool, 100, 2 * NUM_OBJECTS, false) == 0, "pool_init failed\n");
+
+    for (int i = 0; i < NUM_OBJECTS; ++i) {
+        objects[i] = pool_alloc(&pool);
+        EXPECT_TRUE(objects[i] != NULL, "Out of memory\n");
+        memset(objects[i], 0xaa, 100);
+    }
+
+    pool_get_stats(&pool, &stats);
+    EXPECT_TRUE(stats.object_size == 128, "Objects should fill cache lines\n");
+    EXPECT_TRUE(stats.live == NUM_OBJECTS && stats.high_water == NUM_OBJECTS,
+            "Wrong live count %zu\n", stats.live);
+
+    for (int i = 0; i < NUM_OBJECTS; ++i) {
+        pool_free(&pool, objects[i]);
+    }
+
+    pool_get_stats(&pool, &stats);
+    EXPECT_TRUE(stats.live == 0 && stats.cached >= NUM_OBJECTS &&
+            stats.high_water == NUM_OBJECTS, "Freed objects should be cached\n");
+
+    /* Objects are reused, most recently freed first. */
+    EXPECT_TRUE(pool_alloc(&pool) == objects[NUM_OBJECTS - 1],
+            "Recently freed object should be reused\n");
+    pool_free(&pool, objects[NUM_OBJECTS - 1]);
+
+    pool_flush_thread_cache();
+    pool_get_stats(&pool, &stats);
+    EXPECT_TRUE(stats.slabs == 1 && stats.cached >= NUM_OBJECTS,
+            "Cached objects should stay mapped\n");
+
+    pool_deinit(&pool);
+}
+
+static void test_bounded_cache(void)
+{
+    struct pool pool;
+    struct pool_stats stats;
+    unsigned per_slab;
+
+    /* 64 KiB objects, 31 in a slab. */
+    EXPECT_TRUE(pool_init(&pool, 65536, 0, false) == 0, "pool_init failed\n");
+    per_slab = pool.objects_per_slab;
+
+    for (unsigned i = 0; i < 3 * per_slab; ++i) {
+        objects[i] = pool_alloc(&pool);
+        EXPECT_TRUE(objects[i] != NULL, "Out of memory\n");
+    }
+
+    pool_get_stats(&pool, &stats);
+    EXPECT_TRUE(stats.slabs >= 3, "Expected 3 slabs, got %zu\n", stats.slabs);
+
+    for (unsigned i = 0; i < 3 * per_slab; ++i) {
+        pool_free(&pool, objects[i]);
+    }
+    pool_flush_thread_cache();
+
+    pool_get_stats(&pool, &stats);
+    EXPECT_TRUE(stats.slabs == 0 && stats.cached == 0,
+            "Free slabs should be unmapped, %zu left\n", stats.slabs);
+
+    pool_deinit(&pool);
+}
+
+static void *free_objects(void *arg)
+{
+    struct pool *pool = arg;
+
+    for (int i = 0; i < NUM_OBJECTS; ++i) {
+        pool_free(pool, objects[i]);
+    }
+
+    return NULL;
+}
+
+static void test_free_from_other_thread(void)
+{
+    struct pool pool;
+    struct pool_stats stats;
+    pthread_t thread;
+
+    EXPECT_TRUE(pool_init(&pool, 2048, 0, true) == 0, "pool_init failed\n");
+
+    for (int i = 0; i < NUM_OBJECTS; ++i) {
+        objects[i] = pool_alloc(&pool);
+        EXPECT_TRUE(objects[i] != NULL, "Out of memory\n");
+    }
+    pool_flush_thread_cache();
+
+    EXPECT_TRUE(pthread_create(&thread, NULL, free_objects, &pool) == 0,
+            "pthread_create failed\n");
+    pthread_join(thread, NULL);
+
+    /* The magazine of the exited thread was returned as well. */
+    pool_get_stats(&pool, &stats);
+    EXPECT_TRUE(stats.live == 0 && stats.slabs == 0,
+            "Objects freed by an exited thread should be returned\n");
+
+    pool_deinit(&pool);
+}
+
+static void test_message_size_classes(void)
+{
+    static const char join[] = "\x01alice";
+    struct pool_stats before[NET_MSG_NUM_SIZE_CLASSES], after;
+    unsigned char body[NET_MSG_DATA_SIZE] = {0};
+    struct net_message *small, *large, *any;
+
+    for (unsigned i = 0; i < NET_MSG_NUM_SIZE_CLASSES; ++i) {
+        EXPECT_TRUE(net_message_pool_stats(i, &before[i]) == 0, "No class %u\n", i);
+    }
+    EXPECT_TRUE(net_message_pool_stats(NET_MSG_NUM_SIZE_CLASSES, &after) == -1,
+            "Size class out of range\n");
+
+    /* A join frame takes the smallest class, a full frame the largest. */
+    small = net_message_new_with_body(join, sizeof(join));
+    large = net_message_new_with_body(body, NET_MSG_DATA_SIZE - NET_MSG_HEADER_LEN);
+    EXPECT_TRUE(small && large, "Out of memory\n");
+    EXPECT_TRUE(net_message_body_length(small) == sizeof(join) &&
+            memcmp(net_message_body(small), join, sizeof(join)) == 0,
+            "Wrong body\n");
+    EXPECT_TRUE(!net_message_new_with_body(body, NET_MSG_DATA_SIZE),
+            "Body too long for any class should be rejected\n");
+
+    net_message_pool_stats(0, &after);
+    EXPECT_TRUE(after.object_size == 64 && after.live == before[0].live + 1,
+            "Small message should use the 64 byte class\n");
+    net_message_pool_stats(NET_MSG_NUM_SIZE_CLASSES - 1, &after);
+    EXPECT_TRUE(after.object_size >= NET_MSG_DATA_SIZE &&
+            after.live == before[NET_MSG_NUM_SIZE_CLASSES - 1].live + 1,
+            "Full frame should use the largest class\n");
+
+    /* The body of a small message cannot grow beyond its class. */
+    EXPECT_TRUE(net_message_set_body(small, body, 1000) == -1,
+            "Body should not fit in the small class\n");
+
+    any = net_message_new();
+    EXPECT_TRUE(any && net_message_set_body(any, body, 2000) == 0,
+            "net_message_new should hold any body\n");
+
+    net_message_unref(net_message_ref(small));
+    net_message_unref(small);
+    net_message_unref(large);
+    net_message_unref(any);
+
+    for (unsigned i = 0; i < NET_MSG_NUM_SIZE_CLASSES; ++i) {
+        net_message_pool_stats(i, &after);
+        EXPECT_TRUE(after.live == before[i].live, "Messages should be freed\n");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    test_reuse_and_stats();
+    test_bounded_cache();
+    test_free_from_other_thread();
+    test_message_size_classes();
+
+    return 0;
+}
@@ -0,0 +1,109 @@
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "../network.h"
+#include "test.h"
+
+/**
+ * @brief Write a frame whose body is len bytes of tag.
+ */
+static void write_frame(int fd, unsigned char tag, unsigned len, unsigned split)
+{
+    unsigned char frame[NET_MSG_DATA_SIZE];
+
+    frame[0] = ((len + NET_MSG_HEADER_LEN) >> 8) & 0xff;
+    frame[1] = (len + NET_MSG_HEADER_LEN) & 0xff;
+    memset(frame + NET_MSG_HEADER_LEN, tag, len);
+
+    /* Only the first split bytes if split is non-zero. */
+    if (split == 0) {
+        split = len + NET_MSG_HEADER_LEN;
+    }
+
+    EXPECT_TRUE(write(fd, frame, split) == split, "write failed\n");
+}
+
+static void test_batch_and_partial_frames(int fds[2])
+{
+    struct net_endpoint *endp = net_endpoint_new(fds[0]);
+    struct net_message *msgs[8];
+    struct net_stats before, after;
+    int n;
+
+    net_get_stats(&before);
+
+    /* Three frames and the start of a fourth arrive together. */
+    write_frame(fds[1], 1, 10, 0);
+    write_frame(fds[1], 2, 100, 0);
+    write_frame(fds[1], 3, 1000, 0);
+    write_frame(fds[1], 4, 20, 5);
+
+    n = net_receive_batch(endp, msgs, 8);
+    EXPECT_TRUE(n == 3, "Expected 3 messages, got %d\n", n);
+    EXPECT_TRUE(net_message_body(msgs[0])[0] == 1 &&
+            net_message_body_length(msgs[0]) == 10, "Wrong first message\n");
+    EXPECT_TRUE(net_message_body(msgs[2])[999] == 3 &&
+            net_message_body_length(msgs[2]) == 1000, "Wrong third message\n");
+    for (int i = 0; i < n; ++i) {
+        net_message_unref(msgs[i]);
+    }
+
+    net_get_stats(&after);
+    EXPECT_TRUE(after.num_syscalls - before.num_syscalls == 1,
+            "One read should suffice for the whole batch\n");
+
+    n = net_receive_batch(endp, msgs, 8);
+    EXPECT_TRUE(n == -1 && errno == EAGAIN, "Partial frame should not be returned\n");
+
+    /* The rest of the fourth frame and two more, fetched one by one. */
+    EXPECT_TRUE(write(fds[1], (unsigned char[17]){ 4, 4, 4 }, 17) == 17, "write failed\n");
+    write_frame(fds[1], 5, 30, 0);
+    write_frame(fds[1], 6, 40, 0);
+
+    EXPECT_TRUE(net_receive_batch(endp, msgs, 1) == 1, "Expected one message\n");
+    EXPECT_TRUE(net_message_body(msgs[0])[0] == 4 &&
+            net_message_body_length(msgs[0]) == 20, "Wrong fourth message\n");
+    net_message_unref(msgs[0]);
+
+    net_get_stats(&before);
+    EXPECT_TRUE(net_receive(endp, &msgs[0]) == 32, "Expected the fifth message\n");
+    net_message_unref(msgs[0]);
+    EXPECT_TRUE(net_receive(endp, &msgs[0]) == 42, "Expected the sixth message\n");
+    net_message_unref(msgs[0]);
+    net_get_stats(&after);
+    EXPECT_TRUE(after.num_syscalls == before.num_syscalls,
+            "Carried over frames should not need a read\n");
+
+    net_endpoint_destroy(endp);
+}
+
+static void test_oversized_frame(int fds[2])
+{
+    struct net_endpoint *endp = net_endpoint_new(fds[0]);
+    struct net_message *msg;
+
+    EXPECT_TRUE(write(fds[1], (unsigned char[]){ 0xff, 0xff, 0 }, 3) == 3,
+            "write failed\n");
+    EXPECT_TRUE(net_receive(endp, &msg) == -1 && errno == EMSGSIZE,
+            "Oversized frame should be rejected\n");
+
+    net_endpoint_destroy(endp);
+}
+
+int main(int argc, char *argv[])
+{
+    int fds[2];
+
+    EXPECT_TRUE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0, "socketpair failed\n");
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+    test_batch_and_partial_frames(fds);
+    test_oversized_frame(fds);
+
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+}
@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "../replay.h"
+#include "../network.h"
+#include "test.h"
+
+#define MAX_COUNT                       8
+
+static void build(struct net_message *msgs[CHAT_NUM_PROTOCOLS], unsigned i)
+{
+    char text[32];
+
+    snprintf(text, sizeof(text), "message %u", i);
+    for (unsigned v = 1; v <= CHAT_NUM_PROTOCOLS; ++v) {
+        msgs[v - 1] = chat_message_build(v, "Ann", text);
+    }
+}
+
+static void unref(struct net_message *msgs[CHAT_NUM_PROTOCOLS])
+{
+    for (unsigned v = 0; v < CHAT_NUM_PROTOCOLS; ++v) {
+        net_message_unref(msgs[v]);
+    }
+}
+
+static bool holds(const struct replay_entry *entry, unsigned i)
+{
+    char text[32];
+    struct chat_view view;
+    struct net_message *msg = entry->msgs[CHAT_PROTOCOL_V2 - 1];
+
+    snprintf(text, sizeof(text), "message %u", i);
+    return chat_view_decode(&view, CHAT_PROTOCOL_V2, net_message_body(msg),
+            net_message_body_length(msg)) == CHAT_MESSAGE &&
+        view.message.len == strlen(text) && !memcmp(view.message.data, text,
+                view.message.len);
+}
+
+static void test_count(void)
+{
+    struct replay_ring ring;
+    struct net_message *msgs[CHAT_NUM_PROTOCOLS];
+
+    EXPECT_TRUE(replay_ring_init(&ring, MAX_COUNT, 1 << 20) == 0,
+            "Initialisation should succeed\n");
+
+    for (unsigned i = 0; i < 3 * MAX_COUNT; ++i) {
+        build(msgs, i);
+        replay_ring_push(&ring, msgs);
+        unref(msgs);
+    }
+
+    /* The newest are kept, oldest first, referenced by the ring alone. */
+    EXPECT_TRUE(ring.count == MAX_COUNT, "Expected %d messages\n", MAX_COUNT);
+    for (unsigned i = 0; i < MAX_COUNT; ++i) {
+        EXPECT_TRUE(holds(replay_ring_at(&ring, i), 2 * MAX_COUNT + i),
+                "Message %u is not the expected one\n", i);
+    }
+
+    replay_ring_deinit(&ring);
+}
+
+static void test_bytes(void)
+{
+    struct replay_ring ring;
+    struct net_message *msgs[CHAT_NUM_PROTOCOLS];
+    size_t bytes;
+
+    build(msgs, 0);
+    bytes = net_message_body_length(msgs[0]) + net_message_body_length(msgs[1]);
+    unref(msgs);
+
+    EXPECT_TRUE(replay_ring_init(&ring, MAX_COUNT, 3 * bytes) == 0,
+            "Initialisation should succeed\n");
+    for (unsigned i = 0; i < MAX_COUNT; ++i) {
+        build(msgs, i);
+        replay_ring_push(&ring, msgs);
+        unref(msgs);
+    }
+    EXPECT_TRUE(ring.count == 3 && ring.bytes == 3 * bytes &&
+            holds(replay_ring_at(&ring, 0), MAX_COUNT - 3),
+            "Expected the last 3 messages, got %u\n", ring.count);
+
+    /* A message larger than the ring is not kept. */
+    ring.max_bytes = bytes - 1;
+    build(msgs, MAX_COUNT);
+    replay_ring_push(&ring, msgs);
+    unref(msgs);
+    EXPECT_TRUE(ring.count == 3, "Oversized message should not be kept\n");
+
+    replay_ring_deinit(&ring);
+
+    EXPECT_TRUE(replay_ring_init(&ring, 0, 0) == 0, "Initialisation should succeed\n");
+    build(msgs, 0);
+    replay_ring_push(&ring, msgs);
+    unref(msgs);
+    EXPECT_TRUE(ring.count == 0, "An empty ring should keep nothing\n");
+    replay_ring_deinit(&ring);
+}
+
+int main(int argc, char *argv[])
+{
+    test_count();
+    test_bytes();
+    return 0;
+}
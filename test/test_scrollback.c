@@ -0,0 +1,109 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../scrollback.h"
+#include "test.h"
+
+#define MAX_ROWS                        100
+#define NUM_PUSHES                      1000000
+
+static void format(char *text, unsigned i)
+{
+    /* Rows of varying lengths, so that the byte ring wraps at any offset. */
+    sprintf(text, "row %u%.*s", i, (int)(i % 13), "-------------");
+}
+
+static bool holds(const struct scrollback *scrollback, unsigned i,
+        unsigned row)
+{
+    char text[32];
+    size_t len;
+    const unsigned char *data = scrollback_at(scrollback, i, &len);
+
+    format(text, row);
+    return len == strlen(text) && !memcmp(data, text, len);
+}
+
+static void test_rows(void)
+{
+    struct scrollback scrollback;
+    char text[32];
+
+    EXPECT_TRUE(scrollback_init(&scrollback, MAX_ROWS, 1 << 20) == 0,
+            "Initialisation should succeed\n");
+
+    for (unsigned i = 0; i < 3 * MAX_ROWS; ++i) {
+        format(text, i);
+        scrollback_push(&scrollback, text, strlen(text));
+    }
+
+    /* The newest are kept, oldest first. */
+    EXPECT_TRUE(scrollback.count == MAX_ROWS, "Expected %d rows, got %u\n",
+            MAX_ROWS, scrollback.count);
+    for (unsigned i = 0; i < MAX_ROWS; ++i) {
+        EXPECT_TRUE(holds(&scrollback, i, 2 * MAX_ROWS + i),
+                "Row %u is not the expected one\n", i);
+    }
+
+    /* Empty rows are kept too. */
+    scrollback_push(&scrollback, "", 0);
+    EXPECT_TRUE(scrollback.count == MAX_ROWS &&
+            holds(&scrollback, 0, 2 * MAX_ROWS + 1) &&
+            holds(&scrollback, MAX_ROWS - 2, 3 * MAX_ROWS - 1),
+            "Empty row should drop the oldest\n");
+
+    scrollback_deinit(&scrollback);
+}
+
+static void test_bytes(void)
+{
+    struct scrollback scrollback;
+    char text[32];
+    size_t bytes = 0;
+    unsigned count = 0;
+
+    EXPECT_TRUE(scrollback_init(&scrollback, MAX_ROWS, 250) == 0,
+            "Initialisation should succeed\n");
+
+    /* The memory taken is that of init, however many rows go through. */
+    for (unsigned i = 0; i < NUM_PUSHES; ++i) {
+        format(text, i);
+        scrollback_push(&scrollback, text, strlen(text));
+        EXPECT_TRUE(scrollback.bytes <= scrollback.max_bytes &&
+                holds(&scrollback, scrollback.count - 1, i),
+                "Row %u was not kept within the byte cap\n", i);
+    }
+
+    /* The rows kept are the newest, and as many as fit after the tail. */
+    for (unsigned i = 0; i < scrollback.count; ++i) {
+        EXPECT_TRUE(holds(&scrollback, i, NUM_PUSHES - scrollback.count + i),
+                "Row %u is not the expected one\n", i);
+    }
+    for (unsigned i = NUM_PUSHES; i-- > 0; ) {
+        format(text, i);
+        if (bytes + strlen(text) > 250 / 2) {
+            break;
+        }
+        bytes += strlen(text);
+        count++;
+    }
+    EXPECT_TRUE(scrollback.count >= count && scrollback.count < MAX_ROWS,
+            "Expected at least %u rows, got %u\n", count, scrollback.count);
+
+    /* A row larger than the ring is cut to its size. */
+    char big[300];
+    memset(big, 'x', sizeof(big));
+    scrollback_push(&scrollback, big, sizeof(big));
+    EXPECT_TRUE(scrollback.count == 1 && scrollback.bytes == 250,
+            "Oversized row should be cut, got %u rows\n", scrollback.count);
+
+    scrollback_deinit(&scrollback);
+}
+
+int main(int argc, char *argv[])
+{
+    test_rows();
+    test_bytes();
+    return 0;
+}
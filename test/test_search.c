@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+
+#include "../search.h"
+#include "test.h"
+
+#define NUM_MESSAGES                    1000
+
+static void test_terms(void)
+{
+    const char *text = "Hello, WORLD! naïve café x2 " "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa";
+    size_t len = strlen(text);
+    const char *expected[] = {
+        "hello", "world", "naïve", "café", "x2", "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+    };
+    char term[SEARCH_TERM_MAX_LEN];
+    unsigned n, i = 0;
+
+    while ((n = search_next_term(&text, &len, term))) {
+        EXPECT_TRUE(i < sizeof(expected) / sizeof(expected[0]) &&
+                n == strlen(expected[i]) && !memcmp(term, expected[i], n),
+                "Term %u is %.*s\n", i, (int)n, term);
+        i++;
+    }
+    EXPECT_TRUE(i == sizeof(expected) / sizeof(expected[0]) && len == 0,
+            "Expected %zu terms, got %u\n",
+            sizeof(expected) / sizeof(expected[0]), i);
+}
+
+static void test_query(void)
+{
+    struct search_index index;
+    uint64_t ids[NUM_MESSAGES];
+    char text[64];
+    unsigned n;
+    bool sorted = true;
+
+    EXPECT_TRUE(search_index_init(&index) == 0, "Initialisation should succeed\n");
+
+    /* Message i holds "fizz" if i is a multiple of 3, "buzz" of 5. */
+    for (unsigned i = 1; i <= NUM_MESSAGES; ++i) {
+        snprintf(text, sizeof(text), "%s %s message%u all all", i % 3 ? "" : "fizz",
+                i % 5 ? "" : "Buzz", i);
+        EXPECT_TRUE(search_index_add(&index, i, text, strlen(text)) == 0,
+                "Adding message %u failed\n", i);
+    }
+
+    EXPECT_TRUE(search_index_add(&index, NUM_MESSAGES, "late", 4) == -1 &&
+            errno == EINVAL, "Ids out of order should be refused\n");
+
+    n = search_index_query(&index, "all", 3, UINT64_MAX, ids, NUM_MESSAGES);
+    EXPECT_TRUE(n == NUM_MESSAGES && ids[0] == NUM_MESSAGES && ids[n - 1] == 1,
+            "Expected every message, newest first, got %u\n", n);
+
+    n = search_index_query(&index, "FIZZ, buzz", 10, UINT64_MAX, ids, NUM_MESSAGES);
+    for (unsigned i = 0; i < n; ++i) {
+        sorted &= ids[i] % 15 == 0 && (i == 0 || ids[i] < ids[i - 1]);
+    }
+    EXPECT_TRUE(n == NUM_MESSAGES / 15 && sorted && ids[0] == 990,
+            "Expected the multiples of 15, got %u\n", n);
+
+    /* Going on from where a query stopped. */
+    n = search_index_query(&index, "fizz buzz", 9, 990, ids, 2);
+    EXPECT_TRUE(n == 2 && ids[0] == 975 && ids[1] == 960,
+            "Expected 975 and 960, got %u\n", n);
+
+    n = search_index_query(&index, "message777", 10, UINT64_MAX, ids, 10);
+    EXPECT_TRUE(n == 1 && ids[0] == 777, "Expected message 777\n");
+
+    EXPECT_TRUE(search_index_query(&index, "fizz nothing", 12, UINT64_MAX, ids, 10) == 0 &&
+            search_index_query(&index, " ,.", 3, UINT64_MAX, ids, 10) == 0,
+            "Expected no matches\n");
+
+    search_index_deinit(&index);
+}
+
+static void test_compact(void)
+{
+    struct search_index index;
+
+    EXPECT_TRUE(search_index_init(&index) == 0, "Initialisation should succeed\n");
+
+    /* A term twice in a message is one posting, of about a byte. */
+    for (unsigned i = 1; i <= NUM_MESSAGES; ++i) {
+        search_index_add(&index, 3 * i, "echo echo", 9);
+    }
+    EXPECT_TRUE(index.count == 1 && index.bytes < 2 * NUM_MESSAGES,
+            "Index takes %zu bytes\n", index.bytes);
+
+    search_index_deinit(&index);
+}
+
+int main(int argc, char *argv[])
+{
+    test_terms();
+    test_query();
+    test_compact();
+    return 0;
+}
@@ -0,0 +1,110 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "../network.h"
+#include "test.h"
+
+static struct net_message *new_message(unsigned char tag, unsigned len)
+{
+    unsigned char body[NET_MSG_DATA_SIZE];
+    struct net_message *msg = net_message_new();
+
+    EXPECT_TRUE(msg != NULL, "Out of memory\n");
+    memset(body, tag, len);
+    EXPECT_TRUE(net_message_set_body(msg, body, len) == 0, "Body too long\n");
+    return msg;
+}
+
+/**
+ * @brief Read one message from fd and return the tag of its body.
+ */
+static int read_tag(int fd)
+{
+    unsigned char data[NET_MSG_DATA_SIZE];
+    unsigned len;
+
+    if (read(fd, data, NET_MSG_HEADER_LEN) != NET_MSG_HEADER_LEN) {
+        return -1;
+    }
+
+    len = data[0] << 8 | data[1];
+    if (read(fd, data, len - NET_MSG_HEADER_LEN) != len - NET_MSG_HEADER_LEN) {
+        return -1;
+    }
+
+    return data[0];
+}
+
+static void test_growth_and_order(int fds[2])
+{
+    struct net_endpoint *endp = net_endpoint_new(fds[0]);
+    struct net_message *msg;
+
+    /* More messages than the initial capacity, all in order. */
+    for (int i = 0; i < 100; ++i) {
+        msg = new_message(i, 10);
+        EXPECT_TRUE(net_enqueue_message(endp, msg) == i + 1, "Enqueue failed\n");
+        net_message_unref(msg);
+    }
+
+    EXPECT_TRUE(endp->send_queue_bytes == 100 * 12, "Wrong queued byte count\n");
+    EXPECT_TRUE(net_process_send(endp) == 0, "Queue should be flushed\n");
+    EXPECT_TRUE(endp->send_queue_bytes == 0, "Queued byte count should be 0\n");
+
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_TRUE(read_tag(fds[1]) == i, "Message %d out of order\n", i);
+    }
+
+    net_endpoint_destroy(endp);
+}
+
+static void test_budget_and_drop_oldest(int fds[2])
+{
+    struct net_endpoint *endp = net_endpoint_new(fds[0]);
+    struct net_message *msg;
+
+    /* Room for 3 messages of 100 bytes. */
+    net_endpoint_set_send_limit(endp, 300);
+
+    for (int i = 0; i < 3; ++i) {
+        msg = new_message(i, 98);
+        EXPECT_TRUE(net_enqueue_message(endp, msg) > 0, "Enqueue failed\n");
+        net_message_unref(msg);
+    }
+
+    msg = new_message(3, 98);
+    EXPECT_TRUE(net_enqueue_message(endp, msg) == -1 && errno == ENOBUFS,
+            "Message over the budget should be rejected\n");
+
+    EXPECT_TRUE(net_drop_queued(endp, 100) == 1, "Should drop one message\n");
+    EXPECT_TRUE(net_enqueue_message(endp, msg) == 3, "Enqueue failed\n");
+    net_message_unref(msg);
+
+    EXPECT_TRUE(net_process_send(endp) == 0, "Queue should be flushed\n");
+    EXPECT_TRUE(read_tag(fds[1]) == 1, "Oldest message should be dropped\n");
+    EXPECT_TRUE(read_tag(fds[1]) == 2, "Wrong message\n");
+    EXPECT_TRUE(read_tag(fds[1]) == 3, "Wrong message\n");
+
+    /* An empty queue takes a message larger than the budget. */
+    msg = new_message(4, 500);
+    EXPECT_TRUE(net_enqueue_message(endp, msg) == 1, "Enqueue failed\n");
+    net_message_unref(msg);
+
+    net_endpoint_destroy(endp);
+}
+
+int main(int argc, char *argv[])
+{
+    int fds[2];
+
+    EXPECT_TRUE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0, "socketpair failed\n");
+
+    test_growth_and_order(fds);
+    test_budget_and_drop_oldest(fds);
+
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+}
@@ -22,5 +22,68 @@ int main(int argc, char *argv[])
     EXPECT_TRUE(pargs.port == 14000,
             "Port should match the one that was given\n");
 
+    EXPECT_TRUE(
+            0 == scan_arguments(&pargs, 3, (char*[]){ "server", "--max-connections=5000", "14000" }),
+            "Valid arguments should be scanned successfully\n");
+    EXPECT_TRUE(pargs.max_connections == 5000,
+            "Connection limit should match the one that was given\n");
+    EXPECT_TRUE(
+            0 != scan_arguments(&pargs, 3, (char*[]){ "server", "--max-connections=0", "14000" }),
+            "Should reject a zero connection limit\n");
+
+    EXPECT_TRUE(pargs.backlog == DEFAULT_LISTEN_BACKLOG,
+            "Listen backlog should default to DEFAULT_LISTEN_BACKLOG\n");
+    EXPECT_TRUE(
+            0 == scan_arguments(&pargs, 3, (char*[]){ "server", "--backlog=8192", "14000" }),
+            "Valid arguments should be scanned successfully\n");
+    EXPECT_TRUE(pargs.backlog == 8192,
+            "Listen backlog should match the one that was given\n");
+    EXPECT_TRUE(
+            0 != scan_arguments(&pargs, 3, (char*[]){ "server", "--backlog=0", "14000" }),
+            "Should reject a zero listen backlog\n");
+
+    EXPECT_TRUE(
+            0 == scan_arguments(&pargs, 3, (char*[]){ "server", "--stall-timeout=0", "14000" }),
+            "A zero stall timeout should be accepted\n");
+    EXPECT_TRUE(pargs.stall_timeout_ms == 0,
+            "Stall timeout should match the one that was given\n");
+    EXPECT_TRUE(
+            0 != scan_arguments(&pargs, 3, (char*[]){ "server", "--stall-timeout=-1", "14000" }),
+            "Should reject a negative stall timeout\n");
+
+    EXPECT_TRUE(pargs.overflow == OVERFLOW_MARKER,
+            "Overflow policy should default to marker\n");
+    EXPECT_TRUE(
+            0 == scan_arguments(&pargs, 4, (char*[]){ "server", "--overflow=drop-oldest", "--send-queue-bytes=4096", "14000" }),
+            "Valid arguments should be scanned successfully\n");
+    EXPECT_TRUE(pargs.overflow == OVERFLOW_DROP_OLDEST && pargs.send_queue_bytes == 4096,
+            "Overflow policy and send queue size should match the ones given\n");
+    EXPECT_TRUE(
+            0 != scan_arguments(&pargs, 3, (char*[]){ "server", "--overflow=ignore", "14000" }),
+            "Should reject an unknown overflow policy\n");
+
+    EXPECT_TRUE(
+            0 == scan_arguments(&pargs, 4, (char*[]){ "server", "--message-cache=0", "--hugepages", "14000" }),
+            "Valid arguments should be scanned successfully\n");
+    EXPECT_TRUE(pargs.message_cache == 0 && pargs.hugepages,
+            "Message pool options should match the ones given\n");
+
+    EXPECT_TRUE(
+            0 == scan_arguments(&pargs, 2, (char*[]){ "server", "14000" }),
+            "Valid arguments should be scanned successfully\n");
+    EXPECT_TRUE(pargs.history_dir == NULL &&
+            pargs.history_sync_ms == DEFAULT_HISTORY_SYNC_MS,
+            "No history should be kept by default\n");
+    EXPECT_TRUE(
+            0 == scan_arguments(&pargs, 4, (char*[]){ "server", "--history=/var/chat",
+                "--history-sync=0", "14000" }),
+            "Valid arguments should be scanned successfully\n");
+    EXPECT_TRUE(pargs.history_dir && strcmp(pargs.history_dir, "/var/chat") == 0 &&
+            pargs.history_sync_ms == 0,
+            "History options should match the ones given\n");
+    EXPECT_TRUE(
+            0 != scan_arguments(&pargs, 3, (char*[]){ "server", "--history-sync=-1", "14000" }),
+            "Should reject a negative sync interval\n");
+
     return 0;
 }
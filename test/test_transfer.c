@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "../transfer.h"
+#include "../network.h"
+#include "test.h"
+
+#define SENDER                          "Billy"
+
+static char dir[] = "/tmp/test_transfer.XXXXXX";
+
+static void write_file(const char *path, const unsigned char *data, size_t len)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    EXPECT_TRUE(fd != -1 && write(fd, data, len) == (ssize_t)len,
+            "Unable to write %s\n", path);
+    close(fd);
+}
+
+static bool file_equals(const char *path, const unsigned char *data, size_t len)
+{
+    unsigned char buf[8192];
+    int fd = open(path, O_RDONLY);
+    ssize_t n;
+
+    if (fd == -1) {
+        return false;
+    }
+    n = read(fd, buf, sizeof(buf));
+    close(fd);
+
+    return n == (ssize_t)len && !memcmp(buf, data, len);
+}
+
+/**
+ * @brief Send a file through chunks in network format and receive it.
+ *
+ * @param skip Index of a chunk to leave out, or -1.
+ */
+static enum download_status transfer(struct downloads *dls, const char *path,
+        uint32_t id, int skip, const struct download **dl)
+{
+    enum download_status status = DOWNLOAD_FAILED;
+    struct upload up;
+    int i = 0;
+
+    EXPECT_TRUE(upload_open(&up, path, id) == 0, "Unable to open %s\n", path);
+
+    while (!upload_done(&up)) {
+        struct net_message *msg = upload_next_chunk(&up, CHAT_PROTOCOL_V2, SENDER);
+        struct chat_view view;
+
+        EXPECT_TRUE(msg != NULL, "Expected successful build\n");
+        EXPECT_TRUE(chat_view_decode(&view, CHAT_PROTOCOL_V2, net_message_body(msg),
+                    net_message_body_length(msg)) == CHAT_CHUNK,
+                "Expected successful decode\n");
+
+        if (i++ != skip) {
+            status = downloads_receive(dls, &view, dl);
+        }
+        net_message_unref(msg);
+    }
+
+    upload_close(&up);
+    return status;
+}
+
+static void test_round_trip(void)
+{
+    unsigned char data[5000];
+    struct downloads dls;
+    const struct download *dl;
+    char path[256], expected[256];
+
+    for (size_t i = 0; i < sizeof(data); ++i) {
+        data[i] = rand();
+    }
+
+    snprintf(path, sizeof(path), "%s/notes.bin", dir);
+    write_file(path, data, sizeof(data));
+    downloads_init(&dls, dir);
+
+    EXPECT_TRUE(transfer(&dls, path, 1, -1, &dl) == DOWNLOAD_DONE,
+            "Expected finished download\n");
+    snprintf(expected, sizeof(expected), "%s/" SENDER "-notes.bin", dir);
+    EXPECT_TRUE(strcmp(dl->path, expected) == 0, "Unexpected path %s\n", dl->path);
+    EXPECT_TRUE(file_equals(dl->path, data, sizeof(data)), "Received data differs\n");
+
+    // The same again does not overwrite it.
+    EXPECT_TRUE(transfer(&dls, path, 2, -1, &dl) == DOWNLOAD_DONE,
+            "Expected finished download\n");
+    EXPECT_TRUE(strcmp(dl->path, expected) != 0, "Existing file overwritten\n");
+    unlink(dl->path);
+    unlink(expected);
+
+    // A missing chunk fails the transfer and removes the file.
+    EXPECT_TRUE(transfer(&dls, path, 3, 2, &dl) == DOWNLOAD_FAILED,
+            "Expected failed download\n");
+    EXPECT_TRUE(access(expected, F_OK) == -1, "Failed download should be removed\n");
+
+    // An empty file takes one chunk.
+    write_file(path, data, 0);
+    EXPECT_TRUE(transfer(&dls, path, 4, -1, &dl) == DOWNLOAD_DONE,
+            "Expected finished empty download\n");
+    EXPECT_TRUE(file_equals(expected, data, 0), "Expected empty file\n");
+    unlink(expected);
+
+    unlink(path);
+    downloads_deinit(&dls);
+}
+
+static void test_names(void)
+{
+    struct chat_view view = { .type = CHAT_CHUNK };
+    struct downloads dls;
+    const struct download *dl;
+    char expected[256];
+
+    downloads_init(&dls, dir);
+
+    view.sender = (struct chat_field){ "../x", 4 };
+    view.chunk.size = 1;
+    view.chunk.name = (struct chat_field){ ".hidden/../../etc", 17 };
+    view.chunk.data = (struct chat_field){ "!", 1 };
+
+    EXPECT_TRUE(downloads_receive(&dls, &view, &dl) == DOWNLOAD_DONE,
+            "Expected finished download\n");
+    snprintf(expected, sizeof(expected), "%s/_._x-_hidden_.._.._etc", dir);
+    EXPECT_TRUE(strcmp(dl->path, expected) == 0, "Unexpected path %s\n", dl->path);
+    unlink(expected);
+
+    // A transfer joined halfway fails.
+    view.chunk.transfer = 1;
+    view.chunk.offset = 1;
+    view.chunk.size = 2;
+    EXPECT_TRUE(downloads_receive(&dls, &view, &dl) == DOWNLOAD_FAILED,
+            "Expected failed download\n");
+
+    // A sender who leaves aborts the transfer.
+    view.chunk.offset = 0;
+    EXPECT_TRUE(downloads_receive(&dls, &view, &dl) == DOWNLOAD_STARTED,
+            "Expected started download\n");
+    EXPECT_TRUE(downloads_abort_sender(&dls, &view.sender) == 1,
+            "Expected aborted download\n");
+    EXPECT_TRUE(access(dl->path, F_OK) == -1, "Aborted download should be removed\n");
+
+    downloads_deinit(&dls);
+}
+
+int main(int argc, char *argv[])
+{
+    EXPECT_TRUE(mkdtemp(dir) != NULL, "mkdtemp failed\n");
+
+    test_round_trip();
+    test_names();
+
+    rmdir(dir);
+    return 0;
+}
@@ -0,0 +1,170 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "../utf8.h"
+#include "test.h"
+
+struct sample {
+    const char *data;
+    size_t len;
+    int expected;                       /* Null bytes or -1 if invalid. */
+};
+
+#define SAMPLE(str, expected)           { str, sizeof(str) - 1, expected }
+
+static const struct sample samples[] = {
+    SAMPLE("", 0),
+    SAMPLE("hello", 0),
+    SAMPLE("Billy\0Hello\0", 2),
+    SAMPLE("\xc3\xa9t\xc3\xa9", 0),                 /* été */
+    SAMPLE("\xe2\x82\xac", 0),                      /* € */
+    SAMPLE("\xf0\x9f\x98\x80", 0),                  /* U+1F600 */
+    SAMPLE("\xf4\x8f\xbf\xbf", 0),                  /* U+10FFFF */
+    SAMPLE("\xed\x9f\xbf", 0),                      /* U+D7FF */
+    SAMPLE("\x80", -1),                             /* Lone continuation */
+    SAMPLE("a\xc3", -1),                            /* Cut by the end */
+    SAMPLE("\xc3\0", -1),                           /* Cut by a null byte */
+    SAMPLE("\xc0\xaf", -1),                         /* Overlong 2 */
+    SAMPLE("\xe0\x80\xaf", -1),                     /* Overlong 3 */
+    SAMPLE("\xf0\x80\x80\xaf", -1),                 /* Overlong 4 */
+    SAMPLE("\xed\xa0\x80", -1),                     /* Surrogate */
+    SAMPLE("\xf4\x90\x80\x80", -1),                 /* Above U+10FFFF */
+    SAMPLE("\xf8\x88\x80\x80\x80", -1),             /* Five bytes */
+    SAMPLE("\xe2\x82\xac\xac", -1),                 /* Extra continuation */
+    SAMPLE("\xff", -1),
+};
+
+static void test_samples(enum utf8_impl impl)
+{
+    char buf[200];
+    size_t nuls[4];
+
+    for (size_t i = 0; i < sizeof(samples) / sizeof(*samples); ++i) {
+        const struct sample *s = &samples[i];
+
+        EXPECT_TRUE(utf8_scan_impl(impl, (const unsigned char *)s->data, s->len,
+                    nuls, 4) == s->expected, "%s: wrong result for sample %zu\n",
+                utf8_impl_name(impl), i);
+
+        /* Same at every offset within and across blocks. */
+        for (size_t pad = 1; pad < 70; pad += 7) {
+            memset(buf, 'x', pad);
+            memcpy(buf + pad, s->data, s->len);
+            EXPECT_TRUE(utf8_scan_impl(impl, (const unsigned char *)buf,
+                        pad + s->len, nuls, 4) == s->expected,
+                    "%s: wrong result for sample %zu at offset %zu\n",
+                    utf8_impl_name(impl), i, pad);
+        }
+    }
+}
+
+static void test_stop_at_null(enum utf8_impl impl)
+{
+    const char data[] = "sender\0" "\xe2\x82\xac message\0" "\xff junk";
+    size_t nuls[2];
+
+    EXPECT_TRUE(utf8_scan_impl(impl, (const unsigned char *)data, sizeof(data) - 1,
+                nuls, 2) == 2 && nuls[0] == 6 && nuls[1] == 18,
+            "%s: bytes after the last null byte wanted should be ignored\n",
+            utf8_impl_name(impl));
+    EXPECT_TRUE(utf8_scan_impl(impl, (const unsigned char *)data, sizeof(data) - 1,
+                nuls, 1) == 1 && nuls[0] == 6,
+            "%s: should stop at the first null byte\n", utf8_impl_name(impl));
+    EXPECT_TRUE(utf8_scan_impl(impl, (const unsigned char *)data, 18, nuls, 2) == 1,
+            "%s: should find one null byte\n", utf8_impl_name(impl));
+}
+
+/**
+ * @brief Compare an implementation with the scalar one on random text.
+ */
+static void test_random(enum utf8_impl impl)
+{
+    static const char *const pieces[] = {
+        "a", "\0", "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80", "\x80",
+        "\xc3", "\xe2\x82", "\xed\xa0\x80", "\xf4\x90\x80\x80"
+    };
+    unsigned char buf[300];
+    size_t nuls[8], scalar_nuls[8];
+    int rc, scalar_rc;
+
+    srand(1);
+
+    for (int round = 0; round < 20000; ++round) {
+        size_t len = 0;
+        unsigned max_nuls = 1 + rand() % 8;
+
+        while (len < sizeof(buf) - 8 && rand() % 64 != 0) {
+            /* Mostly valid pieces. */
+            unsigned piece = rand() % 40 == 0 ? rand() % 10 : rand() % 5;
+            size_t piece_len = piece == 1 ? 1 : strlen(pieces[piece]);
+
+            memcpy(buf + len, pieces[piece], piece_len);
+            len += piece_len;
+        }
+
+        scalar_rc = utf8_scan_impl(UTF8_IMPL_SCALAR, buf, len, scalar_nuls, max_nuls);
+        rc = utf8_scan_impl(impl, buf, len, nuls, max_nuls);
+
+        EXPECT_TRUE(rc == scalar_rc, "%s: got %d, scalar got %d in round %d\n",
+                utf8_impl_name(impl), rc, scalar_rc, round);
+        EXPECT_TRUE(rc <= 0 || !memcmp(nuls, scalar_nuls, rc * sizeof(*nuls)),
+                "%s: null bytes differ in round %d\n", utf8_impl_name(impl), round);
+    }
+}
+
+/**
+ * @brief Scan text that ends right before an unmapped page, where a block
+ *        must not be read past the end of the data.
+ */
+static void test_page_end(enum utf8_impl impl)
+{
+    unsigned char *pages = mmap(NULL, 8192, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    size_t nuls[2];
+
+    EXPECT_TRUE(pages != MAP_FAILED, "mmap failed\n");
+    EXPECT_TRUE(mprotect(pages + 4096, 4096, PROT_NONE) == 0, "mprotect failed\n");
+
+    for (size_t len = 1; len < 40; ++len) {
+        unsigned char *data = pages + 4096 - len;
+
+        memset(data, 'a', len);
+        EXPECT_TRUE(utf8_scan_impl(impl, data, len, nuls, 2) == 0,
+                "%s: wrong result for %zu bytes at the end of a page\n",
+                utf8_impl_name(impl), len);
+
+        data[len - 1] = 0xc3;
+        EXPECT_TRUE(utf8_scan_impl(impl, data, len, nuls, 2) == -1,
+                "%s: cut sequence at the end of a page should be invalid\n",
+                utf8_impl_name(impl));
+    }
+
+    munmap(pages, 8192);
+}
+
+static void test_truncate(void)
+{
+    EXPECT_TRUE(utf8_truncate("abc", 5) == 3, "Short string should be kept\n");
+    EXPECT_TRUE(utf8_truncate("abcdef", 4) == 4, "Expected ASCII cut\n");
+    EXPECT_TRUE(utf8_truncate("ab\xe2\x82\xac", 4) == 2,
+            "Cut should not split a sequence\n");
+    EXPECT_TRUE(utf8_truncate("ab\xe2\x82\xac", 5) == 5, "Expected whole string\n");
+}
+
+int main(int argc, char *argv[])
+{
+    for (unsigned impl = 0; impl < UTF8_NUM_IMPLS; ++impl) {
+        if (!utf8_impl_supported(impl)) {
+            continue;
+        }
+
+        test_samples(impl);
+        test_stop_at_null(impl);
+        test_random(impl);
+        test_page_end(impl);
+    }
+
+    test_truncate();
+    return 0;
+}
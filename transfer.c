@@ -0,0 +1,276 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "transfer.h"
+#include "network.h"
+#include "log.h"
+#include "utf8.h"
+
+/* Tries at a free file name before giving up. */
+#define MAX_NAME_SUFFIX                 100
+
+int upload_open(struct upload *up, const char *path, uint32_t transfer)
+{
+    const char *base = strrchr(path, '/');
+    struct stat st;
+    size_t nul;
+
+    up->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (up->fd == -1) {
+        return -1;
+    }
+
+    if (fstat(up->fd, &st) == -1) {
+        goto error;
+    }
+
+    if (!S_ISREG(st.st_mode)) {
+        errno = EINVAL;
+        goto error;
+    }
+
+    if (st.st_size > CHAT_TRANSFER_MAX_LEN) {
+        errno = EFBIG;
+        goto error;
+    }
+
+    up->transfer = transfer;
+    up->offset = 0;
+    up->size = st.st_size;
+    up->started = false;
+
+    /* The name goes out as text. */
+    base = base ? base + 1 : path;
+    snprintf(up->name, sizeof(up->name), "%s", base);
+    if (utf8_scan((const unsigned char *)up->name, strlen(up->name), &nul, 1) != 0) {
+        strcpy(up->name, "file");
+    }
+    up->name[utf8_truncate(up->name, CHAT_FILE_NAME_MAX_LEN)] = '\0';
+
+    return 0;
+
+error:
+    close(up->fd);
+    up->fd = -1;
+    return -1;
+}
+
+struct net_message *upload_next_chunk(struct upload *up, unsigned version,
+        const char *sender)
+{
+    char data[CHAT_CHUNK_MAX_LEN];
+    struct chat_chunk chunk;
+    size_t len = up->size - up->offset;
+    ssize_t n;
+
+    if (len > sizeof(data)) {
+        len = sizeof(data);
+    }
+
+    n = read(up->fd, data, len);
+    if (n == -1) {
+        return NULL;
+    }
+    if ((size_t)n != len) {
+        /* The file shrank. */
+        errno = EIO;
+        return NULL;
+    }
+
+    chunk.transfer = up->transfer;
+    chunk.offset = up->offset;
+    chunk.size = up->size;
+    chunk.name.data = up->name;
+    chunk.name.len = strlen(up->name);
+    chunk.data.data = data;
+    chunk.data.len = len;
+
+    up->offset += len;
+    up->started = true;
+    return chat_chunk_build(version, sender, &chunk);
+}
+
+bool upload_done(const struct upload *up)
+{
+    /* An empty file still takes one chunk. */
+    return up->started && up->offset == up->size;
+}
+
+void upload_close(struct upload *up)
+{
+    if (up->fd != -1) {
+        close(up->fd);
+        up->fd = -1;
+    }
+}
+
+void downloads_init(struct downloads *dls, const char *dir)
+{
+    dls->dir = dir;
+    for (unsigned i = 0; i < TRANSFER_MAX_DOWNLOADS; ++i) {
+        dls->slots[i].fd = -1;
+    }
+}
+
+static bool field_is(const struct chat_field *field, const char *str)
+{
+    return strlen(str) == field->len && memcmp(field->data, str, field->len) == 0;
+}
+
+/**
+ * @brief Copy text into a file name, replacing what could leave the
+ *        directory or hide the file.
+ */
+static void sanitize_name(char *dst, const char *src, size_t len)
+{
+    for (size_t i = 0; i < len; ++i) {
+        unsigned char c = src[i];
+
+        dst[i] = c == '/' || c < 0x20 || (i == 0 && c == '.') ? '_' : c;
+    }
+    dst[len] = '\0';
+}
+
+/**
+ * @brief Create the file of a new download, named after the sender and the
+ *        transfer, with a number appended if the name is taken.
+ */
+static int create_file(struct downloads *dls, struct download *dl)
+{
+    char name[CHAT_MEMBER_NAME_MAX_LEN + 1 + CHAT_FILE_NAME_MAX_LEN + 1];
+    char sender[CHAT_MEMBER_NAME_MAX_LEN + 1];
+    char file[CHAT_FILE_NAME_MAX_LEN + 1];
+
+    sanitize_name(sender, dl->sender, strlen(dl->sender));
+    if (dl->name[0]) {
+        sanitize_name(file, dl->name, strlen(dl->name));
+    }
+    else {
+        snprintf(file, sizeof(file), "transfer-%u", (unsigned)dl->transfer);
+    }
+    snprintf(name, sizeof(name), "%s-%s", sender, file);
+
+    for (unsigned i = 0; i < MAX_NAME_SUFFIX; ++i) {
+        if (i == 0) {
+            snprintf(dl->path, sizeof(dl->path), "%s/%s", dls->dir, name);
+        }
+        else {
+            snprintf(dl->path, sizeof(dl->path), "%s/%s.%u", dls->dir, name, i);
+        }
+
+        dl->fd = open(dl->path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (dl->fd != -1 || errno != EEXIST) {
+            break;
+        }
+    }
+
+    return dl->fd == -1 ? -1 : 0;
+}
+
+static void fail_download(struct download *dl)
+{
+    close(dl->fd);
+    unlink(dl->path);
+    dl->fd = -1;
+}
+
+enum download_status downloads_receive(struct downloads *dls,
+        const struct chat_view *view, const struct download **pdl)
+{
+    static struct download failed;
+    const struct chat_chunk *chunk = &view->chunk;
+    enum download_status status = DOWNLOAD_RECEIVING;
+    struct download *dl = NULL, *free_slot = NULL;
+
+    for (unsigned i = 0; i < TRANSFER_MAX_DOWNLOADS; ++i) {
+        struct download *slot = &dls->slots[i];
+
+        if (slot->fd == -1) {
+            free_slot = free_slot ? free_slot : slot;
+        }
+        else if (slot->transfer == chunk->transfer &&
+                field_is(&view->sender, slot->sender)) {
+            dl = slot;
+            break;
+        }
+    }
+
+    if (!dl) {
+        /* Either a new transfer, or one whose start was missed. */
+        dl = free_slot ? free_slot : &failed;
+        dl->fd = -1;
+        dl->transfer = chunk->transfer;
+        dl->offset = 0;
+        dl->size = chunk->size;
+        snprintf(dl->sender, sizeof(dl->sender), "%.*s",
+                (int)view->sender.len, view->sender.data);
+        snprintf(dl->name, sizeof(dl->name), "%.*s",
+                (int)chunk->name.len, chunk->name.data);
+        dl->path[0] = '\0';
+        *pdl = dl;
+
+        if (!free_slot || chunk->offset != 0) {
+            return DOWNLOAD_FAILED;
+        }
+
+        if (create_file(dls, dl) == -1) {
+            log_error("Unable to save %s: %s\n", dl->path, strerror(errno));
+            dl->fd = -1;
+            return DOWNLOAD_FAILED;
+        }
+        status = DOWNLOAD_STARTED;
+    }
+
+    *pdl = dl;
+
+    if (chunk->offset != dl->offset || chunk->size != dl->size) {
+        log_debug("Missed data of transfer %u\n", (unsigned)dl->transfer);
+        fail_download(dl);
+        return DOWNLOAD_FAILED;
+    }
+
+    if (write(dl->fd, chunk->data.data, chunk->data.len) != (ssize_t)chunk->data.len) {
+        log_error("Unable to write %s: %s\n", dl->path, strerror(errno));
+        fail_download(dl);
+        return DOWNLOAD_FAILED;
+    }
+
+    dl->offset += chunk->data.len;
+    if (dl->offset == dl->size) {
+        close(dl->fd);
+        dl->fd = -1;
+        return DOWNLOAD_DONE;
+    }
+
+    return status;
+}
+
+unsigned downloads_abort_sender(struct downloads *dls,
+        const struct chat_field *sender)
+{
+    unsigned n = 0;
+
+    for (unsigned i = 0; i < TRANSFER_MAX_DOWNLOADS; ++i) {
+        struct download *dl = &dls->slots[i];
+
+        if (dl->fd != -1 && field_is(sender, dl->sender)) {
+            fail_download(dl);
+            n++;
+        }
+    }
+
+    return n;
+}
+
+void downloads_deinit(struct downloads *dls)
+{
+    for (unsigned i = 0; i < TRANSFER_MAX_DOWNLOADS; ++i) {
+        if (dls->slots[i].fd != -1) {
+            fail_download(&dls->slots[i]);
+        }
+    }
+}
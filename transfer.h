@@ -0,0 +1,110 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include "chat.h"
+
+struct net_message;
+
+/*
+ * Files sent and received as transfers of CHAT_CHUNKs, see chat.h. Chunks
+ * are read from and written to the files one at a time, so a transfer
+ * takes no more memory than a chunk whatever its size.
+ */
+
+#define TRANSFER_MAX_DOWNLOADS          8
+
+/* A file being sent. */
+struct upload {
+    int fd;                             /* -1 if no file is being sent. */
+    uint32_t transfer;
+    uint32_t offset;                    /* Of the next chunk. */
+    uint32_t size;
+    bool started;                       /* The first chunk was built. */
+    char name[CHAT_FILE_NAME_MAX_LEN + 1];
+};
+
+/* A file being received. */
+struct download {
+    int fd;                             /* -1 if the slot is free. */
+    char sender[CHAT_MEMBER_NAME_MAX_LEN + 1];
+    uint32_t transfer;
+    uint32_t offset;                    /* Of the next chunk expected. */
+    uint32_t size;
+    char name[CHAT_FILE_NAME_MAX_LEN + 1];
+    char path[PATH_MAX];
+};
+
+struct downloads {
+    const char *dir;                    /* Where files are saved. */
+    struct download slots[TRANSFER_MAX_DOWNLOADS];
+};
+
+enum download_status {
+    DOWNLOAD_STARTED,                   /* First chunk of a new transfer. */
+    DOWNLOAD_RECEIVING,
+    DOWNLOAD_DONE,
+    DOWNLOAD_FAILED                     /* Gap, full table or I/O error. */
+};
+
+/**
+ * @brief Open a file to send.
+ *
+ * @param transfer Id of the transfer, unique among the sender's.
+ *
+ * @return 0 on success, -1 on error (check errno, EFBIG if the file is
+ *         larger than CHAT_TRANSFER_MAX_LEN).
+ */
+int upload_open(struct upload *up, const char *path, uint32_t transfer);
+
+/**
+ * @brief Read and build the next chunk of a file.
+ *
+ * @return Network message of ref count 1 or NULL on error (check errno).
+ */
+struct net_message *upload_next_chunk(struct upload *up, unsigned version,
+        const char *sender);
+
+/**
+ * @brief Check whether every chunk of a file has been built.
+ */
+bool upload_done(const struct upload *up);
+
+void upload_close(struct upload *up);
+
+void downloads_init(struct downloads *dls, const char *dir);
+
+/**
+ * @brief Write a received chunk to its file, creating the file for the
+ *        first chunk of a transfer.
+ *
+ * @description Files are named after the sender and the name of the
+ *              transfer, and never overwrite an existing file. A transfer
+ *              fails if a chunk is missing, since the chunks of a transfer
+ *              arrive in order.
+ *
+ * @param view Decoded CHAT_CHUNK.
+ * @param dl Set to the download; a finished or failed one stays valid
+ *        until the next call.
+ */
+enum download_status downloads_receive(struct downloads *dls,
+        const struct chat_view *view, const struct download **dl);
+
+/**
+ * @brief Abort the transfers of a sender, who left, and delete what was
+ *        received of them.
+ *
+ * @return Number of transfers aborted.
+ */
+unsigned downloads_abort_sender(struct downloads *dls,
+        const struct chat_field *sender);
+
+/**
+ * @brief Abort all transfers.
+ */
+void downloads_deinit(struct downloads *dls);
+
+#endif /* TRANSFER_H */
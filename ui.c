@@ -1,10 +1,15 @@
+#define _GNU_SOURCE
 #define NCURSES_WIDECHAR 1
 #include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <wchar.h>
 #include <ncurses.h>
 #include <stdarg.h>
 #include "ui.h"
+#include "scrollback.h"
 
 #define UI_BG_DEFAULT_COLOR             COLOR_BLACK
 
@@ -22,9 +27,30 @@
 #define TEXT_INPUT_B_NCOLS(term_x)      (term_x)
 #define TEXT_INPUT_NCOLS(term_x)        (TEXT_INPUT_B_NCOLS(term_x) - PADDING * 2)
 
+/* Rows of the message window kept to page back to. */
+#define SCROLLBACK_MAX_ROWS             (1u << 16)
+#define SCROLLBACK_MAX_BYTES            (4u << 20)
+
+/* A row is kept as spans of color (1) | length (2) | text (length). */
+#define SPAN_HEADER_LEN                 3u
+#define ROW_MAX_BYTES                   4096u
+
+#define PRINTF_BUF_SIZE                 1024
+
 static WINDOW *message_window, *message_window_b;
 static WINDOW *text_input_window, *text_input_window_b;
 
+static struct scrollback scrollback;
+
+/* Row being written, shown below those in the scrollback. */
+static unsigned char row[ROW_MAX_BYTES];
+static size_t row_len;
+static size_t span_offset;              /* Of the header of the last span. */
+static int row_cols;
+static int message_fg = UI_FG_DEFAULT;
+
+static unsigned scrolled;               /* Rows the view is above the last. */
+
 static void ui_init_colors(void)
 {
     if (has_colors() == FALSE) {
@@ -68,7 +94,13 @@ int ui_init(void)
             MESSAGE_NLINES(term_y),
             MESSAGE_NCOLS(term_x), PADDING, PADDING);
     assert(message_window);
-    scrollok(message_window, TRUE);
+    /* Rows are wrapped and scrolled here, see ui_message_vprintf. */
+    scrollok(message_window, FALSE);
+
+    if (scrollback_init(&scrollback, SCROLLBACK_MAX_ROWS,
+                SCROLLBACK_MAX_BYTES) == -1) {
+        return -1;
+    }
 
     /* Initialise text input window. */
     text_input_window_b = newwin(
@@ -84,6 +116,7 @@ int ui_init(void)
 
     scrollok(text_input_window, TRUE);
     nodelay(text_input_window, 1);
+    keypad(text_input_window, TRUE);
 
     wnoutrefresh(message_window_b);
     wnoutrefresh(text_input_window_b);
@@ -106,15 +139,185 @@ void ui_deinit(void)
     delwin(message_window_b);
     delwin(text_input_window_b);
     endwin();
+    scrollback_deinit(&scrollback);
 }
 
 void ui_message_fg(int fgcolor)
 {
-    wattron(message_window, COLOR_PAIR(fgcolor));
+    message_fg = fgcolor;
 }
 
 /* Output functions */
 
+/**
+ * @brief Get a row of the view, the row being written coming after those in
+ *        the scrollback.
+ */
+static const unsigned char *view_row(unsigned i, size_t *len)
+{
+    if (i == scrollback.count) {
+        *len = row_len;
+        return row;
+    }
+
+    return scrollback_at(&scrollback, i, len);
+}
+
+static unsigned max_scrolled(void)
+{
+    int height = getmaxy(message_window);
+
+    return scrollback.count + 1 > (unsigned)height ?
+        scrollback.count + 1 - height : 0;
+}
+
+/**
+ * @brief Draw a row of the view at a line of the message window.
+ */
+static void draw_row(int y, unsigned i)
+{
+    size_t len;
+    const unsigned char *data = view_row(i, &len);
+
+    /* Cleared first, as a full row leaves the cursor on the next line. */
+    wmove(message_window, y, 0);
+    wclrtoeol(message_window);
+
+    while (len >= SPAN_HEADER_LEN) {
+        size_t span_len = data[1] | data[2] << 8;
+
+        wattrset(message_window, COLOR_PAIR(data[0]));
+        waddnstr(message_window, (const char *)data + SPAN_HEADER_LEN,
+                span_len);
+        data += SPAN_HEADER_LEN + span_len;
+        len -= SPAN_HEADER_LEN + span_len;
+    }
+}
+
+/**
+ * @brief Draw the lines of the message window from some line on.
+ */
+static void draw_view(int from_y)
+{
+    int height = getmaxy(message_window);
+    long top = (long)scrollback.count + 1 - scrolled - height;
+
+    for (int y = from_y; y < height; ++y) {
+        if (top + y < 0) {
+            wmove(message_window, y, 0);
+            wclrtoeol(message_window);
+        }
+        else {
+            draw_row(y, top + y);
+        }
+    }
+
+    wnoutrefresh(message_window);
+}
+
+/**
+ * @brief Draw the border of the message window, which tells how many rows
+ *        are below the view.
+ */
+static void draw_border(void)
+{
+    box(message_window_b, 0, 0);
+    if (scrolled > 0) {
+        mvwprintw(message_window_b, getmaxy(message_window_b) - 1, 2,
+                " %u more ", scrolled);
+    }
+    wnoutrefresh(message_window_b);
+}
+
+/**
+ * @brief Move the row being written to the scrollback.
+ */
+static void end_row(void)
+{
+    scrollback_push(&scrollback, row, row_len);
+    row_len = 0;
+    row_cols = 0;
+}
+
+/**
+ * @brief Add a character to the row being written, in the current color.
+ *
+ * @return Whether the row was full, and ended first.
+ */
+static bool add_char(const char *mb, size_t len, int cols)
+{
+    bool new_span = row_len == 0 || row[span_offset] != message_fg;
+    size_t needed = len + (new_span ? SPAN_HEADER_LEN : 0);
+    size_t span_len;
+    bool ended = false;
+
+    if (row_cols + cols > getmaxx(message_window) ||
+            row_len + needed + SPAN_HEADER_LEN > ROW_MAX_BYTES) {
+        end_row();
+        new_span = true;
+        ended = true;
+    }
+
+    if (new_span) {
+        span_offset = row_len;
+        row[row_len++] = message_fg;
+        row[row_len++] = 0;
+        row[row_len++] = 0;
+    }
+
+    memcpy(row + row_len, mb, len);
+    row_len += len;
+    row_cols += cols;
+
+    span_len = row_len - span_offset - SPAN_HEADER_LEN;
+    row[span_offset + 1] = span_len & 0xff;
+    row[span_offset + 2] = span_len >> 8;
+    return ended;
+}
+
+/**
+ * @brief Format text into rows as wide as the message window.
+ *
+ * @return Number of rows ended.
+ */
+static unsigned add_text(const char *text, size_t len)
+{
+    mbstate_t state = { 0 };
+    unsigned rows = 0;
+
+    while (len > 0) {
+        wchar_t wc;
+        size_t n = mbrtowc(&wc, text, len, &state);
+        int cols;
+
+        if (n == (size_t)-1 || n == (size_t)-2) {
+            /* Invalid byte, shown as one. */
+            memset(&state, 0, sizeof(state));
+            rows += add_char("?", 1, 1);
+            text++;
+            len--;
+            continue;
+        }
+        n = n ? n : 1;
+
+        if (wc == L'\n') {
+            end_row();
+            rows++;
+        }
+        else if ((cols = wcwidth(wc)) >= 0) {
+            rows += add_char(text, n, cols);
+        }
+        else {
+            rows += add_char("?", 1, 1);
+        }
+
+        text += n;
+        len -= n;
+    }
+
+    return rows;
+}
+
 int ui_message_printf(const char *fmt, ...)
 {
     va_list va;
@@ -129,15 +332,79 @@ int ui_message_printf(const char *fmt, ...)
 
 int ui_message_vprintf(const char *fmt, va_list va)
 {
-    int ret;
+    char buf[PRINTF_BUF_SIZE];
+    char *text = buf;
+    va_list copy;
+    int len;
+    unsigned rows;
+    int height;
 
     assert(message_window != NULL);
-    
-    ret = vw_printw(message_window, fmt, va);
-    touchwin(message_window_b);
-    wrefresh(message_window);
-    
-    return ret == OK ? 0 : -1;
+
+    va_copy(copy, va);
+    len = vsnprintf(buf, sizeof(buf), fmt, copy);
+    va_end(copy);
+    if (len < 0) {
+        return -1;
+    }
+    if ((size_t)len >= sizeof(buf)) {
+        text = malloc(len + 1);
+        if (!text) {
+            return -1;
+        }
+        vsnprintf(text, len + 1, fmt, va);
+    }
+
+    rows = add_text(text, len);
+    if (text != buf) {
+        free(text);
+    }
+
+    /* Only the lines that changed are drawn: the rows written if the view
+     * follows them, none if it is scrolled back, above them. */
+    height = getmaxy(message_window);
+    if (scrolled == 0) {
+        if (rows >= (unsigned)height) {
+            draw_view(0);
+        }
+        else {
+            scrollok(message_window, TRUE);
+            wscrl(message_window, rows);
+            scrollok(message_window, FALSE);
+            draw_view(height - 1 - rows);
+        }
+    }
+    else {
+        unsigned max = max_scrolled();
+
+        /* The view stays on the same rows, unless they were dropped. */
+        scrolled += rows;
+        if (scrolled > max) {
+            scrolled = max;
+            draw_view(0);
+        }
+        if (rows > 0) {
+            draw_border();
+        }
+    }
+    doupdate();
+
+    return 0;
+}
+
+/**
+ * @brief Scroll the view back by some rows, or forward if negative, and
+ *        draw it.
+ */
+static void ui_scroll(long rows)
+{
+    long to = (long)scrolled + rows;
+    long max = max_scrolled();
+
+    scrolled = to < 0 ? 0 : to > max ? max : to;
+    draw_view(0);
+    draw_border();
+    doupdate();
 }
 
 /* Input functions */
@@ -193,7 +460,24 @@ char *ui_get_line(void)
                 input_len--;
             }
         }
-        else if (status == KEY_CODE_YES) {}
+        else if (status == KEY_CODE_YES) {
+            int page = getmaxy(message_window) - 1;
+
+            switch (c) {
+            case KEY_PPAGE:
+                ui_scroll(page > 0 ? page : 1);
+                break;
+            case KEY_NPAGE:
+                ui_scroll(page > 0 ? -page : -1);
+                break;
+            case KEY_HOME:
+                ui_scroll(max_scrolled());
+                break;
+            case KEY_END:
+                ui_scroll(-(long)scrolled);
+                break;
+            }
+        }
         else if (c == L'\n') {
             /* Enter received; line is complete. */
             input_buf[input_len] = L'\0'; 
@@ -0,0 +1,332 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "log.h"
+#include "uring.h"
+
+#define URING_DESTROY_WAIT_MS           10
+#define URING_DESTROY_MAX_WAITS         100
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+        unsigned flags, void *arg, size_t argsz)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+            arg, argsz);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+        unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int uring_map_rings(struct uring *ring, const struct io_uring_params *p)
+{
+    unsigned char *sq, *cq;
+
+    ring->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+
+    if (ring->features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        return -1;
+    }
+
+    if (ring->features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    }
+    else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            return -1;
+        }
+    }
+
+    ring->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        return -1;
+    }
+
+    sq = ring->sq_ring;
+    ring->sq_head = (unsigned *)(sq + p->sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p->sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + p->sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p->sq_off.array);
+    ring->sq_local_tail = *ring->sq_tail;
+
+    cq = ring->cq_ring;
+    ring->cq_head = (unsigned *)(cq + p->cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p->cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + p->cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+
+    return 0;
+}
+
+static int uring_setup_buffers(struct uring *ring, unsigned count, unsigned size)
+{
+    struct io_uring_buf_reg reg = {0};
+
+    ring->buf_count = count;
+    ring->buf_size = size;
+    ring->buf_ring_size = count * sizeof(struct io_uring_buf);
+
+    ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED) {
+        ring->buf_ring = NULL;
+        return -1;
+    }
+
+    ring->buf_base = malloc((size_t)count * size);
+    ring->buf_len = calloc(count, sizeof(*ring->buf_len));
+    ring->buf_next = calloc(count, sizeof(*ring->buf_next));
+    if (!ring->buf_base || !ring->buf_len || !ring->buf_next) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    reg.ring_addr = (unsigned long)ring->buf_ring;
+    reg.ring_entries = count;
+    reg.bgid = URING_BUFFER_GROUP;
+
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        return -1;
+    }
+
+    for (unsigned bid = 0; bid < count; ++bid) {
+        uring_buffer_recycle(ring, bid);
+    }
+
+    return 0;
+}
+
+static void uring_free(struct uring *ring)
+{
+    if (ring->buf_ring)
+        munmap(ring->buf_ring, ring->buf_ring_size);
+    free(ring->buf_base);
+    free(ring->buf_len);
+    free(ring->buf_next);
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd != -1)
+        close(ring->fd);
+    free(ring);
+}
+
+struct uring *uring_new(unsigned entries, unsigned buf_count, unsigned buf_size)
+{
+    struct io_uring_params params = {0};
+    struct uring *ring;
+    int save_errno;
+
+    ring = calloc(1, sizeof(*ring));
+    if (!ring) {
+        return NULL;
+    }
+
+    params.flags = IORING_SETUP_SUBMIT_ALL;
+
+    ring->fd = sys_io_uring_setup(entries, &params);
+    if (ring->fd == -1) {
+        goto err;
+    }
+
+    ring->features = params.features;
+
+    if (!(ring->features & IORING_FEAT_NODROP) ||
+            !(ring->features & IORING_FEAT_EXT_ARG)) {
+        errno = ENOTSUP;
+        goto err;
+    }
+
+    if (uring_map_rings(ring, &params) == -1 ||
+            uring_setup_buffers(ring, buf_count, buf_size) == -1) {
+        goto err;
+    }
+
+    return ring;
+
+err:
+    save_errno = errno;
+    uring_free(ring);
+    errno = save_errno;
+    return NULL;
+}
+
+void uring_destroy(struct uring *ring)
+{
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+
+    /* Let outstanding operations finish so that their owners are freed. */
+    for (int i = 0; ring->num_ops > 0 && i < URING_DESTROY_MAX_WAITS; ++i) {
+        sqe = uring_get_sqe(ring);
+        if (sqe) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+        }
+
+        if (uring_submit(ring, 1, URING_DESTROY_WAIT_MS) == -1 && errno != EINTR) {
+            break;
+        }
+
+        while ((cqe = uring_peek_cqe(ring))) {
+            struct uring_op *op = (struct uring_op *)(unsigned long)cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+
+            uring_cqe_seen(ring);
+            if (op) {
+                op->complete(op, res, flags);
+            }
+        }
+    }
+
+    if (ring->num_ops > 0) {
+        log_error("io_uring destroyed with %u operations outstanding\n",
+                ring->num_ops);
+    }
+
+    uring_free(ring);
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+    struct io_uring_sqe *sqe;
+    unsigned head;
+
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head > ring->sq_mask) {
+        /* Full: submit what is pending without waiting. */
+        if (uring_submit(ring, 0, 0) == -1) {
+            return NULL;
+        }
+
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->sq_local_tail - head > ring->sq_mask) {
+            errno = EBUSY;
+            return NULL;
+        }
+    }
+
+    sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+    ring->sq_array[ring->sq_local_tail & ring->sq_mask] =
+        ring->sq_local_tail & ring->sq_mask;
+    ring->sq_local_tail++;
+
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int uring_submit(struct uring *ring, int wait, int timeout_ms)
+{
+    struct io_uring_getevents_arg arg = {0};
+    struct __kernel_timespec ts;
+    unsigned to_submit, flags = 0;
+    int ret;
+
+    to_submit = ring->sq_local_tail - *ring->sq_tail;
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+    if (wait) {
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+
+        if (timeout_ms >= 0) {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+            arg.ts = (unsigned long)&ts;
+        }
+    }
+    else if (to_submit == 0) {
+        return 0;
+    }
+
+    ring->num_enters++;
+    ret = sys_io_uring_enter(ring->fd, to_submit, wait ? 1 : 0, flags,
+            wait ? &arg : NULL, wait ? sizeof(arg) : 0);
+    if (ret == -1 && errno == ETIME) {
+        return 0;
+    }
+
+    return ret == -1 ? -1 : 0;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+    unsigned head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+unsigned char *uring_buffer(struct uring *ring, unsigned bid)
+{
+    return ring->buf_base + (size_t)bid * ring->buf_size;
+}
+
+void uring_buffer_recycle(struct uring *ring, unsigned bid)
+{
+    struct io_uring_buf *buf;
+
+    buf = &ring->buf_ring->bufs[ring->buf_tail & (ring->buf_count - 1)];
+    buf->addr = (unsigned long)uring_buffer(ring, bid);
+    buf->len = ring->buf_size;
+    buf->bid = bid;
+
+    ring->buf_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+int uring_cancel(struct uring *ring, struct uring_op *op)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+
+    if (!sqe) {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long)op;
+    return 0;
+}
@@ -0,0 +1,124 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+
+/*
+ * Minimal io_uring wrapper on top of the raw system calls with a single
+ * group of provided receive buffers.
+ *
+ * Every submission carries a pointer to a struct uring_op as its user data.
+ * Completions are dispatched to the op's complete function, which returns
+ * the reactor events (REACTOR_IN etc.) to report for op->data.
+ * Submissions whose user data is 0 complete silently.
+ */
+
+#define URING_BUFFER_GROUP              0
+
+struct uring_op {
+    unsigned (*complete)(struct uring_op *op, int res, unsigned flags);
+    void *data;
+};
+
+struct uring {
+    int fd;
+    unsigned features;
+
+    /* Submission queue. */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_local_tail;     /* Tail including unsubmitted entries. */
+
+    /* Completion queue. */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    /* Provided buffer ring. */
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    unsigned char *buf_base;
+    unsigned *buf_len;          /* Bytes received into each buffer. */
+    int *buf_next;              /* Per-buffer link for consumers' chains. */
+    unsigned buf_count;
+    unsigned buf_size;
+    unsigned short buf_tail;
+
+    unsigned num_ops;           /* Ops that may still complete. */
+    unsigned long long num_enters;
+};
+
+/**
+ * @brief Create an io_uring instance with a provided buffer ring.
+ *
+ * @param entries Submission queue size.
+ * @param buf_count Number of receive buffers (power of two).
+ * @param buf_size Size of each receive buffer.
+ *
+ * @return Ring or NULL if io_uring is unavailable (check errno).
+ */
+struct uring *uring_new(unsigned entries, unsigned buf_count, unsigned buf_size);
+
+/**
+ * @brief Cancel all outstanding operations, wait for them to complete and
+ *        destroy the ring.
+ */
+void uring_destroy(struct uring *ring);
+
+/**
+ * @brief Get a zeroed submission queue entry. If the submission queue is
+ *        full, the pending entries are submitted first.
+ *
+ * @return Entry or NULL on error.
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+
+/**
+ * @brief Submit pending entries and optionally wait for a completion.
+ *
+ * @param ring Ring.
+ * @param wait Non-zero to wait for at least one completion.
+ * @param timeout_ms Wait timeout in milliseconds or -1.
+ *
+ * @return 0 on success (including timeout), -1 on error (check errno).
+ */
+int uring_submit(struct uring *ring, int wait, int timeout_ms);
+
+/**
+ * @brief Get the next unprocessed completion.
+ *
+ * @return Completion or NULL if there is none. Call uring_cqe_seen() after
+ *         processing it.
+ */
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+
+void uring_cqe_seen(struct uring *ring);
+
+/**
+ * @brief Get a pointer to the data of a provided buffer.
+ */
+unsigned char *uring_buffer(struct uring *ring, unsigned bid);
+
+/**
+ * @brief Give a provided buffer back to the kernel.
+ */
+void uring_buffer_recycle(struct uring *ring, unsigned bid);
+
+/**
+ * @brief Cancel the operation whose user data is op.
+ *
+ * @return 0 on success, -1 if no submission entry is available.
+ */
+int uring_cancel(struct uring *ring, struct uring_op *op);
+
+#endif /* URING_H */
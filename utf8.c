@@ -0,0 +1,491 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <pthread.h>
+
+#include "utf8.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define UTF8_HAVE_X86                   1
+#include <immintrin.h>
+#endif
+
+#define ASCII_MASK                      0x8080808080808080ull
+#define ONES                            0x0101010101010101ull
+
+static pthread_once_t best_impl_once = PTHREAD_ONCE_INIT;
+static enum utf8_impl best_impl;
+
+static int utf8_scan_scalar(const unsigned char *data, size_t len,
+        size_t *nuls, unsigned max_nuls)
+{
+    unsigned found = 0;
+    size_t i = 0;
+
+    while (i < len) {
+        unsigned char c, lo = 0x80, hi = 0xbf;
+        unsigned num_conts;
+        uint64_t word;
+
+        /* Skip eight bytes at a time while they are ASCII and not null. */
+        while (i + 8 <= len) {
+            memcpy(&word, data + i, 8);
+            if ((word & ASCII_MASK) || ((word - ONES) & ~word & ASCII_MASK)) {
+                break;
+            }
+            i += 8;
+        }
+
+        if (i == len) {
+            break;
+        }
+
+        c = data[i];
+        if (c < 0x80) {
+            if (c == 0) {
+                nuls[found++] = i;
+                if (found == max_nuls) {
+                    return found;
+                }
+            }
+            i++;
+            continue;
+        }
+
+        /* The first continuation byte narrows the range of some leads. */
+        if (c >= 0xc2 && c <= 0xdf) {
+            num_conts = 1;
+        }
+        else if (c >= 0xe0 && c <= 0xef) {
+            num_conts = 2;
+            if (c == 0xe0) {
+                lo = 0xa0;      /* Overlong. */
+            }
+            else if (c == 0xed) {
+                hi = 0x9f;      /* Surrogates. */
+            }
+        }
+        else if (c >= 0xf0 && c <= 0xf4) {
+            num_conts = 3;
+            if (c == 0xf0) {
+                lo = 0x90;      /* Overlong. */
+            }
+            else if (c == 0xf4) {
+                hi = 0x8f;      /* Above U+10FFFF. */
+            }
+        }
+        else {
+            goto invalid;
+        }
+
+        if (len - i <= num_conts || data[i + 1] < lo || data[i + 1] > hi) {
+            goto invalid;
+        }
+
+        for (unsigned j = 2; j <= num_conts; ++j) {
+            if ((data[i + j] & 0xc0) != 0x80) {
+                goto invalid;
+            }
+        }
+
+        i += num_conts + 1;
+    }
+
+    return found;
+
+invalid:
+    errno = EILSEQ;
+    return -1;
+}
+
+#ifdef UTF8_HAVE_X86
+
+/*
+ * Errors of a pair of consecutive bytes, looked up by the high and low
+ * nibbles of the first byte and the high nibble of the second. A pair is
+ * invalid if all three lookups share a bit.
+ */
+#define TOO_SHORT                       (1 << 0)    /* Lead, then no continuation. */
+#define TOO_LONG                        (1 << 1)    /* ASCII, then continuation. */
+#define OVERLONG_3                      (1 << 2)
+#define TOO_LARGE                       (1 << 3)
+#define SURROGATE                       (1 << 4)
+#define OVERLONG_2                      (1 << 5)
+#define TOO_LARGE_1000                  (1 << 6)
+#define OVERLONG_4                      (1 << 6)
+#define TWO_CONTS                       (1 << 7)    /* Checked separately. */
+#define CARRY                           (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+static const uint8_t byte_1_high_table[16] = {
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+    TOO_SHORT | OVERLONG_2,
+    TOO_SHORT,
+    TOO_SHORT | OVERLONG_3 | SURROGATE,
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+};
+
+static const uint8_t byte_1_low_table[16] = {
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+    CARRY | OVERLONG_2,
+    CARRY,
+    CARRY,
+    CARRY | TOO_LARGE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000
+};
+
+static const uint8_t byte_2_high_table[16] = {
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+};
+
+/* A block is incomplete if one of its last three bytes needs more. */
+static const uint8_t incomplete_table[32] = {
+    [0 ... 28] = 0xff, 0xf0 - 1, 0xe0 - 1, 0xc0 - 1
+};
+
+/* Loaded at keep_table + 32 - n: n bytes of 0xff, then zeros. */
+static const uint8_t keep_table[64] = {
+    [0 ... 31] = 0xff
+};
+
+#define PAGE_SIZE                       4096u
+
+#define SSE4_TARGET                     __attribute__((target("sse4.1")))
+#define AVX2_TARGET                     __attribute__((target("avx2")))
+
+/* Bytes of prev and input shifted by n bytes: the n-th byte before each. */
+#define SSE4_PREV(input, prev, n)       _mm_alignr_epi8(input, prev, 16 - (n))
+#define AVX2_PREV(input, prev, n)       \
+    _mm256_alignr_epi8(input, _mm256_permute2x128_si256(prev, input, 0x21), 16 - (n))
+
+/**
+ * @brief Check whether width bytes can be read from p without crossing
+ *        into the next page, which might not be mapped.
+ */
+static inline bool can_read_block(const unsigned char *p, size_t width)
+{
+    return ((uintptr_t)p & (PAGE_SIZE - 1)) <= PAGE_SIZE - width;
+}
+
+/**
+ * @brief Load the first n bytes of a block, zeroing the rest. Zero padding
+ *        reads as ASCII, so a sequence cut short is an error.
+ */
+SSE4_TARGET
+static inline __m128i sse4_load_partial(const unsigned char *p, size_t n)
+{
+    unsigned char buf[16] = {0};
+
+    if (can_read_block(p, 16)) {
+        return _mm_and_si128(_mm_loadu_si128((const __m128i *)p),
+                _mm_loadu_si128((const __m128i *)(keep_table + 32 - n)));
+    }
+
+    memcpy(buf, p, n);
+    return _mm_loadu_si128((const __m128i *)buf);
+}
+
+/**
+ * @brief Get the errors of a block given the block before it.
+ */
+SSE4_TARGET
+static inline __m128i sse4_check_block(__m128i input, __m128i prev)
+{
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    __m128i prev1 = SSE4_PREV(input, prev, 1);
+    __m128i special, must_be_cont;
+
+    special = _mm_and_si128(_mm_and_si128(
+            _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)byte_1_high_table),
+                _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+            _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)byte_1_low_table),
+                _mm_and_si128(prev1, nibble))),
+            _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)byte_2_high_table),
+                _mm_and_si128(_mm_srli_epi16(input, 4), nibble)));
+
+    /* Third and fourth bytes of a sequence must be continuations. */
+    must_be_cont = _mm_or_si128(
+            _mm_subs_epu8(SSE4_PREV(input, prev, 2), _mm_set1_epi8(0xe0 - 0x80)),
+            _mm_subs_epu8(SSE4_PREV(input, prev, 3), _mm_set1_epi8(0xf0 - 0x80)));
+
+    return _mm_xor_si128(_mm_and_si128(must_be_cont, _mm_set1_epi8(0x80)), special);
+}
+
+SSE4_TARGET
+static int utf8_scan_sse4(const unsigned char *data, size_t len,
+        size_t *nuls, unsigned max_nuls)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i incomplete = _mm_loadu_si128(
+            (const __m128i *)(incomplete_table + 16));
+    __m128i prev = zero, prev_incomplete = zero, error = zero;
+    unsigned found = 0;
+
+    for (size_t pos = 0; pos < len; pos += 16) {
+        size_t n = len - pos < 16 ? len - pos : 16;
+        __m128i input, nul_bytes;
+        unsigned mask;
+
+        if (n == 16) {
+            input = _mm_loadu_si128((const __m128i *)(data + pos));
+        }
+        else {
+            input = sse4_load_partial(data + pos, n);
+        }
+
+        nul_bytes = _mm_cmpeq_epi8(input, zero);
+
+        /* Most blocks are ASCII text without null bytes. */
+        if (n == 16 && _mm_movemask_epi8(_mm_or_si128(input, nul_bytes)) == 0) {
+            error = _mm_or_si128(error, prev_incomplete);
+            prev_incomplete = zero;
+            prev = input;
+            continue;
+        }
+
+        mask = _mm_movemask_epi8(nul_bytes) & ((1u << n) - 1);
+        while (mask) {
+            unsigned off = __builtin_ctz(mask);
+
+            nuls[found++] = pos + off;
+            mask &= mask - 1;
+
+            if (found == max_nuls) {
+                /* Stop at this null byte. */
+                input = _mm_and_si128(input,
+                        _mm_loadu_si128((const __m128i *)(keep_table + 32 - off - 1)));
+                len = pos + off + 1;
+                break;
+            }
+        }
+
+        if (_mm_movemask_epi8(input) == 0) {
+            error = _mm_or_si128(error, prev_incomplete);
+            prev_incomplete = zero;
+        }
+        else {
+            error = _mm_or_si128(error, sse4_check_block(input, prev));
+            prev_incomplete = _mm_subs_epu8(input, incomplete);
+        }
+
+        prev = input;
+    }
+
+    error = _mm_or_si128(error, prev_incomplete);
+    if (!_mm_testz_si128(error, error)) {
+        errno = EILSEQ;
+        return -1;
+    }
+
+    return found;
+}
+
+AVX2_TARGET
+static inline __m256i avx2_load_partial(const unsigned char *p, size_t n)
+{
+    unsigned char buf[32] = {0};
+
+    if (can_read_block(p, 32)) {
+        return _mm256_and_si256(_mm256_loadu_si256((const __m256i *)p),
+                _mm256_loadu_si256((const __m256i *)(keep_table + 32 - n)));
+    }
+
+    memcpy(buf, p, n);
+    return _mm256_loadu_si256((const __m256i *)buf);
+}
+
+AVX2_TARGET
+static inline __m256i avx2_lookup(const uint8_t table[16], __m256i index)
+{
+    return _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(
+                _mm_loadu_si128((const __m128i *)table)), index);
+}
+
+AVX2_TARGET
+static inline __m256i avx2_check_block(__m256i input, __m256i prev)
+{
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i prev1 = AVX2_PREV(input, prev, 1);
+    __m256i special, must_be_cont;
+
+    special = _mm256_and_si256(_mm256_and_si256(
+            avx2_lookup(byte_1_high_table,
+                _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+            avx2_lookup(byte_1_low_table, _mm256_and_si256(prev1, nibble))),
+            avx2_lookup(byte_2_high_table,
+                _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble)));
+
+    must_be_cont = _mm256_or_si256(
+            _mm256_subs_epu8(AVX2_PREV(input, prev, 2), _mm256_set1_epi8(0xe0 - 0x80)),
+            _mm256_subs_epu8(AVX2_PREV(input, prev, 3), _mm256_set1_epi8(0xf0 - 0x80)));
+
+    return _mm256_xor_si256(_mm256_and_si256(must_be_cont,
+                _mm256_set1_epi8(0x80)), special);
+}
+
+AVX2_TARGET
+static int utf8_scan_avx2(const unsigned char *data, size_t len,
+        size_t *nuls, unsigned max_nuls)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i incomplete = _mm256_loadu_si256(
+            (const __m256i *)incomplete_table);
+    __m256i prev = zero, prev_incomplete = zero, error = zero;
+    unsigned found = 0;
+
+    for (size_t pos = 0; pos < len; pos += 32) {
+        size_t n = len - pos < 32 ? len - pos : 32;
+        __m256i input, nul_bytes;
+        unsigned mask;
+
+        if (n == 32) {
+            input = _mm256_loadu_si256((const __m256i *)(data + pos));
+        }
+        else {
+            input = avx2_load_partial(data + pos, n);
+        }
+
+        nul_bytes = _mm256_cmpeq_epi8(input, zero);
+
+        if (n == 32 && _mm256_movemask_epi8(_mm256_or_si256(input, nul_bytes)) == 0) {
+            error = _mm256_or_si256(error, prev_incomplete);
+            prev_incomplete = zero;
+            prev = input;
+            continue;
+        }
+
+        mask = _mm256_movemask_epi8(nul_bytes);
+        if (n < 32) {
+            mask &= (1u << n) - 1;
+        }
+
+        while (mask) {
+            unsigned off = __builtin_ctz(mask);
+
+            nuls[found++] = pos + off;
+            mask &= mask - 1;
+
+            if (found == max_nuls) {
+                input = _mm256_and_si256(input,
+                        _mm256_loadu_si256((const __m256i *)(keep_table + 32 - off - 1)));
+                len = pos + off + 1;
+                break;
+            }
+        }
+
+        if (_mm256_movemask_epi8(input) == 0) {
+            error = _mm256_or_si256(error, prev_incomplete);
+            prev_incomplete = zero;
+        }
+        else {
+            error = _mm256_or_si256(error, avx2_check_block(input, prev));
+            prev_incomplete = _mm256_subs_epu8(input, incomplete);
+        }
+
+        prev = input;
+    }
+
+    error = _mm256_or_si256(error, prev_incomplete);
+    if (!_mm256_testz_si256(error, error)) {
+        errno = EILSEQ;
+        return -1;
+    }
+
+    return found;
+}
+
+#endif /* UTF8_HAVE_X86 */
+
+bool utf8_impl_supported(enum utf8_impl impl)
+{
+    switch (impl) {
+    case UTF8_IMPL_SCALAR:
+        return true;
+#ifdef UTF8_HAVE_X86
+    case UTF8_IMPL_SSE4:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse4.1");
+    case UTF8_IMPL_AVX2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return false;
+    }
+}
+
+const char *utf8_impl_name(enum utf8_impl impl)
+{
+    static const char *const names[] = { "scalar", "sse4", "avx2" };
+
+    return impl < UTF8_NUM_IMPLS ? names[impl] : "unknown";
+}
+
+static void choose_best_impl(void)
+{
+    best_impl = UTF8_IMPL_SCALAR;
+
+    for (unsigned i = 0; i < UTF8_NUM_IMPLS; ++i) {
+        if (utf8_impl_supported(i)) {
+            best_impl = i;
+        }
+    }
+}
+
+int utf8_scan_impl(enum utf8_impl impl, const unsigned char *data, size_t len,
+        size_t *nuls, unsigned max_nuls)
+{
+    switch (impl) {
+#ifdef UTF8_HAVE_X86
+    case UTF8_IMPL_AVX2:
+        return utf8_scan_avx2(data, len, nuls, max_nuls);
+    case UTF8_IMPL_SSE4:
+        return utf8_scan_sse4(data, len, nuls, max_nuls);
+#endif
+    default:
+        return utf8_scan_scalar(data, len, nuls, max_nuls);
+    }
+}
+
+int utf8_scan(const unsigned char *data, size_t len, size_t *nuls,
+        unsigned max_nuls)
+{
+    pthread_once(&best_impl_once, choose_best_impl);
+    return utf8_scan_impl(best_impl, data, len, nuls, max_nuls);
+}
+
+size_t utf8_truncate(const char *str, size_t max_len)
+{
+    size_t len = strnlen(str, max_len + 1);
+
+    if (len <= max_len) {
+        return len;
+    }
+
+    /* Back off while the first byte left out continues a sequence. */
+    len = max_len;
+    while (len > 0 && ((unsigned char)str[len] & 0xc0) == 0x80) {
+        len--;
+    }
+
+    return len;
+}
@@ -0,0 +1,65 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * UTF-8 validation combined with a search for null bytes, so that the
+ * null-terminated fields of a chat object are found and validated in a
+ * single pass over the data.
+ *
+ * The vector implementations follow the lookup algorithm of Keiser and
+ * Lemire, "Validating UTF-8 In Less Than One Instruction Per Byte". The
+ * best one the CPU supports is picked at run time.
+ */
+
+enum utf8_impl {
+    UTF8_IMPL_SCALAR,
+    UTF8_IMPL_SSE4,
+    UTF8_IMPL_AVX2
+};
+
+#define UTF8_NUM_IMPLS                  3u
+
+/**
+ * @brief Validate UTF-8 up to the max_nuls-th null byte and record where
+ *        the null bytes are.
+ *
+ * @description Bytes after the last null byte wanted are not looked at, so
+ *              data may continue with something else. Without max_nuls
+ *              null bytes, all of data is validated. Overlong encodings,
+ *              surrogates and code points above U+10FFFF are invalid, as is
+ *              a sequence cut short by a null byte or the end of data.
+ *
+ * @param data Data.
+ * @param len Length of data.
+ * @param nuls Offsets of the null bytes found, at least max_nuls entries.
+ * @param max_nuls Number of null bytes to stop at, at least 1.
+ *
+ * @return Number of null bytes found, or -1 if the bytes before the last of
+ *         them (or all of data) are not valid UTF-8.
+ */
+int utf8_scan(const unsigned char *data, size_t len, size_t *nuls,
+        unsigned max_nuls);
+
+/**
+ * @brief Same as utf8_scan with a given implementation, for tests and
+ *        benchmarks.
+ *
+ * @note The implementation must be supported, see utf8_impl_supported.
+ */
+int utf8_scan_impl(enum utf8_impl impl, const unsigned char *data, size_t len,
+        size_t *nuls, unsigned max_nuls);
+
+bool utf8_impl_supported(enum utf8_impl impl);
+
+const char *utf8_impl_name(enum utf8_impl impl);
+
+/**
+ * @brief Get the length of the longest prefix of str of at most max_len
+ *        bytes that does not end inside a multibyte sequence.
+ */
+size_t utf8_truncate(const char *str, size_t max_len);
+
+#endif /* UTF8_H */